@@ -20,6 +20,8 @@
 
 #include <assert.h>
 
+#include <algorithm>
+
 class AudioBuffer
 {
   const int           n_channels = 0;
@@ -35,6 +37,11 @@ public:
   {
     buffer.insert (buffer.end(), samples.begin(), samples.end());
   }
+  void
+  write_frames (const float *samples, size_t frames)
+  {
+    buffer.insert (buffer.end(), samples, samples + frames * n_channels);
+  }
   std::vector<float>
   read_frames (size_t frames)
   {
@@ -45,6 +52,31 @@ public:
     buffer.erase (begin, end);
     return result;
   }
+  void
+  read_frames (size_t frames, std::vector<float>& out)
+  {
+    /* like read_frames (frames), but reuse the storage of out */
+    assert (frames * n_channels <= buffer.size());
+    const auto begin = buffer.begin();
+    const auto end   = begin + frames * n_channels;
+    out.assign (begin, end);
+    buffer.erase (begin, end);
+  }
+  void
+  read_frames (size_t frames, float *out)
+  {
+    assert (frames * n_channels <= buffer.size());
+    const auto begin = buffer.begin();
+    const auto end   = begin + frames * n_channels;
+    std::copy (begin, end, out);
+    buffer.erase (begin, end);
+  }
+  void
+  discard_frames (size_t frames)
+  {
+    assert (frames * n_channels <= buffer.size());
+    buffer.erase (buffer.begin(), buffer.begin() + frames * n_channels);
+  }
   size_t
   can_read_frames() const
   {
@@ -23,33 +23,154 @@
 #include "rawconverter.hh"
 #include "rawoutputstream.hh"
 #include "stdoutwavoutputstream.hh"
+#include "shminputstream.hh"
+#include "shmoutputstream.hh"
+
+#include "config.h"
+
+#if HAVE_FFMPEG
+#include "ffinputstream.hh"
+#include "ffoutputstream.hh"
+#endif
+
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
 
 using std::string;
+using std::vector;
 
 AudioStream::~AudioStream()
 {
 }
 
+Error
+AudioInputStream::read_frames (std::vector<float>& samples, size_t count)
+{
+  size_t frames_read = 0;
+
+  samples.resize (count * n_channels());
+  Error err = read_frames (samples.data(), count, frames_read);
+  samples.resize (frames_read * n_channels());
+  return err;
+}
+
+Error
+AudioOutputStream::write_frames (const std::vector<float>& samples)
+{
+  return write_frames (samples.data(), samples.size() / n_channels());
+}
+
+/* read the first bytes of stdin for format detection
+ *
+ * if stdin is seekable (redirected from a file), we seek back, so the bytes can be read again
+ */
+static Error
+read_stdin_prefix (vector<unsigned char>& prefix, bool& rewound)
+{
+  size_t n = 0;
+
+  prefix.resize (4);
+  while (n < prefix.size())
+    {
+      ssize_t count = read (STDIN_FILENO, &prefix[n], prefix.size() - n);
+      if (count == -1 && errno == EINTR)
+        continue;
+      if (count < 0)
+        return Error (string_printf ("error reading from stdin: %s", strerror (errno)));
+      if (count == 0)
+        break;
+      n += count;
+    }
+  prefix.resize (n);
+  rewound = lseek (STDIN_FILENO, -off_t (n), SEEK_CUR) != -1;
+  return Error::Code::NONE;
+}
+
+static std::unique_ptr<AudioInputStream>
+create_stdin (Error& err)
+{
+  vector<unsigned char> prefix;
+  bool rewound = false;
+
+  err = read_stdin_prefix (prefix, rewound);
+  if (err)
+    return nullptr;
+
+  const bool mp3 = MP3InputStream::is_mp3_prefix (prefix);
+  if (rewound)
+    prefix.clear();
+
+  if (mp3)
+    {
+      std::unique_ptr<MP3InputStream> mistream (new MP3InputStream());
+      err = mistream->open_stdin (prefix, /* read ahead */ true);
+      if (err)
+        return nullptr;
+      return std::move (mistream);
+    }
+  else
+    {
+      std::unique_ptr<SFInputStream> sistream (new SFInputStream());
+      err = sistream->open_stdin (prefix);
+      if (err)
+        return nullptr;
+      return std::move (sistream);
+    }
+}
+
 std::unique_ptr<AudioInputStream>
 AudioInputStream::create (const string& filename, Error& err)
 {
   std::unique_ptr<AudioInputStream> in_stream;
 
-  if (Params::input_format == Format::AUTO)
+  if (Params::input_format == Format::AUTO && filename == "-")
+    {
+      return create_stdin (err);
+    }
+  else if (Params::input_format == Format::AUTO)
     {
       SFInputStream *sistream = new SFInputStream();
       in_stream.reset (sistream);
       err = sistream->open (filename);
-      if (err && MP3InputStream::detect (filename))
+      if (err)
         {
           MP3InputStream *mistream = new MP3InputStream();
-          in_stream.reset (mistream);
+          std::unique_ptr<AudioInputStream> mp3_stream (mistream);
 
-          err = mistream->open (filename);
-          if (err)
-            return nullptr;
+          /* if the file is not an mp3 either, report the libsndfile error */
+          Error mp3_err = mistream->open (filename, /* read ahead */ true, Params::mp3_min_sample_rate);
+          if (!mp3_err)
+            {
+              in_stream = std::move (mp3_stream);
+              err = Error::Code::NONE;
+            }
         }
-      else if (err)
+#if HAVE_FFMPEG
+      if (err)
+        {
+          /* other containers/codecs (aac, opus, ...) are decoded using the ffmpeg libs */
+          FFInputStream *fistream = new FFInputStream();
+          std::unique_ptr<AudioInputStream> ff_stream (fistream);
+
+          Error ff_err = fistream->open (filename);
+          if (!ff_err)
+            {
+              in_stream = std::move (ff_stream);
+              err = Error::Code::NONE;
+            }
+        }
+#endif
+      if (err)
+        return nullptr;
+    }
+  else if (Params::input_format == Format::SHM)
+    {
+      ShmInputStream *shm_istream = new ShmInputStream();
+      in_stream.reset (shm_istream);
+
+      err = shm_istream->open (filename);
+      if (err)
         return nullptr;
     }
   else
@@ -77,11 +198,36 @@ AudioOutputStream::create (const string& filename, int n_channels, int sample_ra
       if (err)
         return nullptr;
     }
+  else if (Params::output_format == Format::SHM)
+    {
+      ShmOutputStream *shm_ostream = new ShmOutputStream();
+      out_stream.reset (shm_ostream);
+      err = shm_ostream->open (filename, n_channels, sample_rate);
+      if (err)
+        return nullptr;
+    }
+#if HAVE_FFMPEG
+  else if (Params::output_codec != "" || (filename != "-" && FFOutputStream::is_encoded_filename (filename)))
+    {
+      FFOutputStream *ffostream = new FFOutputStream (n_channels, sample_rate, bit_depth);
+      out_stream.reset (ffostream);
+      ffostream->set_bit_rate (Params::output_bit_rate);
+      err = ffostream->open (filename, Params::output_codec);
+      if (err)
+        return nullptr;
+    }
+#else
+  else if (Params::output_codec != "")
+    {
+      err = Error ("encoded output (--codec) is not available in this build (needs ffmpeg)");
+      return nullptr;
+    }
+#endif
   else if (filename == "-")
     {
       StdoutWavOutputStream *swstream = new StdoutWavOutputStream();
       out_stream.reset (swstream);
-      err = swstream->open (n_channels, sample_rate, bit_depth, n_frames);
+      err = swstream->open (n_channels, sample_rate, bit_depth, n_frames, Params::output_float);
       if (err)
         return nullptr;
     }
@@ -89,7 +235,7 @@ AudioOutputStream::create (const string& filename, int n_channels, int sample_ra
     {
       SFOutputStream *sfostream = new SFOutputStream();
       out_stream.reset (sfostream);
-      err = sfostream->open (filename, n_channels, sample_rate, bit_depth);
+      err = sfostream->open (filename, n_channels, sample_rate, bit_depth, SFOutputStream::OutFormat::WAV, Params::output_float);
       if (err)
         return nullptr;
     }
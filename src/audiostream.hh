@@ -41,7 +41,11 @@ public:
   static constexpr size_t N_FRAMES_UNKNOWN = ~size_t (0);
   virtual size_t n_frames() const = 0;
 
-  virtual Error read_frames (std::vector<float>& samples, size_t count) = 0;
+  /* read up to count frames into samples (which must have room for count * n_channels() values) */
+  virtual Error read_frames (float *samples, size_t count, size_t& frames_read) = 0;
+
+  /* convenience: resize samples to the number of frames read (reuses the storage of samples) */
+  Error read_frames (std::vector<float>& samples, size_t count);
 };
 
 class AudioOutputStream : public AudioStream
@@ -50,8 +54,10 @@ public:
   static std::unique_ptr<AudioOutputStream> create (const std::string& filename,
     int n_channels, int sample_rate, int bit_depth, size_t n_frames, Error& err);
 
-  virtual Error write_frames (const std::vector<float>& frames) = 0;
+  virtual Error write_frames (const float *samples, size_t count) = 0;
   virtual Error close() = 0;
+
+  Error write_frames (const std::vector<float>& samples);
 };
 
 #endif /* AUDIOWMARK_AUDIO_STREAM_HH */
@@ -28,6 +28,7 @@
 #include "wmcommon.hh"
 #include "shortcode.hh"
 #include "hls.hh"
+#include "video.hh"
 #include "resample.hh"
 
 #include <assert.h>
@@ -49,12 +50,22 @@ print_usage()
   printf ("  * create a watermarked wav file with a message\n");
   printf ("    audiowmark add <input_wav> <watermarked_wav> <message_hex>\n");
   printf ("\n");
+  printf ("  * watermark a (large) wav file in place, without creating a copy\n");
+  printf ("    audiowmark add --in-place <wav_file> <message_hex>\n");
+  printf ("\n");
   printf ("  * retrieve message\n");
   printf ("    audiowmark get <watermarked_wav>\n");
   printf ("\n");
   printf ("  * compare watermark message with expected message\n");
   printf ("    audiowmark cmp <watermarked_wav> <message_hex>\n");
   printf ("\n");
+  printf ("  * create a watermarked video file with a message (audio stream is re-encoded)\n");
+  printf ("    audiowmark video-add <input_video> <watermarked_video> <message_hex>\n");
+  printf ("\n");
+  printf ("  * retrieve/compare message from the audio stream of a video file\n");
+  printf ("    audiowmark video-get <watermarked_video>\n");
+  printf ("    audiowmark video-cmp <watermarked_video> <message_hex>\n");
+  printf ("\n");
   printf ("  * generate 128-bit watermarking key, to be used with --key option\n");
   printf ("    audiowmark gen-key <key_file>\n");
   printf ("\n");
@@ -66,18 +77,31 @@ print_usage()
   printf ("  --detect-speed          detect and correct replay speed difference\n");
   printf ("  --detect-speed-patient  slower, more accurate speed detection\n");
   printf ("  --json <file>           write JSON results into file\n");
+  printf ("  --mp3-reduced-rate      faster mp3 decoding at 1/2 or 1/4 sample rate\n");
+  printf ("\n");
+  printf ("Options for add:\n");
+  printf ("  --live                  low latency mode for live streams\n");
+  printf ("  --max-latency <ms>      live mode with latency budget\n");
+  printf ("  --resample-quality <q>  fast, normal or high                [normal]\n");
+  printf ("  --output-float          write 32 bit float wav output\n");
+  printf ("  --codec <name>          encode output using ffmpeg codec (like aac)\n");
+  printf ("  --bit-rate <bits>       bit rate for encoded output\n");
   printf ("\n");
   printf ("Options for add / get / cmp:\n");
   printf ("  --key <file>            load watermarking key from file\n");
   printf ("  --short <bits>          enable short payload mode\n");
   printf ("  --strength <s>          set watermark strength              [%.6g]\n", Params::water_delta * 1000);
+  printf ("  --channels <list>       only use channels (like 0,1) for the watermark\n");
+  printf ("  --mid                   use one watermark in the downmix of the channels\n");
   printf ("\n");
   printf ("  --input-format raw      use raw stream as input\n");
   printf ("  --output-format raw     use raw stream as output\n");
   printf ("  --format raw            use raw stream as input and output\n");
+  printf ("  --format shm            use shared memory ring buffers (names as filenames)\n");
   printf ("\n");
   printf ("The options to set the raw stream parameters (such as --raw-rate\n");
-  printf ("or --raw-channels) are documented in the README file.\n");
+  printf ("or --raw-channels) and the shared memory ring buffer layout are\n");
+  printf ("documented in the README file.\n");
   printf ("\n");
   printf ("HLS command help can be displayed using --help-hls\n");
 }
@@ -94,6 +118,24 @@ print_usage_hls()
   printf ("  * watermark one HLS segment:\n");
   printf ("    audiowmark hls-add <input_ts> <output_ts> <message_hex>\n");
   printf ("\n");
+  printf ("  * watermark one HLS segment with more than one message:\n");
+  printf ("    audiowmark hls-add <input_ts> <output_ts> <message_hex> [<output_ts> <message_hex>...]\n");
+  printf ("\n");
+  printf ("  * watermark consecutive HLS segments in one run (outputs are written to output_dir):\n");
+  printf ("    audiowmark hls-add-batch <output_dir> <message_hex> <input_ts>...\n");
+  printf ("\n");
+  printf ("  * write A/B variants (a/ and b/) of all prepared HLS segments:\n");
+  printf ("    audiowmark hls-prepare-ab <input_dir> <output_dir> <playlist_name>\n");
+  printf ("\n");
+  printf ("  * write playlist that selects A/B variant segments using a message:\n");
+  printf ("    audiowmark hls-ab-playlist <input_playlist> <output_playlist> <message_hex>\n");
+  printf ("\n");
+  printf ("  * retrieve message from the audio of an A/B variant stream:\n");
+  printf ("    audiowmark hls-ab-get <playlist> <watermarked_wav>\n");
+  printf ("\n");
+  printf ("  * compare message from the audio of an A/B variant stream:\n");
+  printf ("    audiowmark hls-ab-cmp <playlist> <watermarked_wav> <message_hex>\n");
+  printf ("\n");
   printf ("Global options:\n");
   printf ("  -q, --quiet           disable information messages\n");
   printf ("  --strict              treat (minor) problems as errors\n");
@@ -103,6 +145,8 @@ print_usage_hls()
   printf ("  --short <bits>        enable short payload mode\n");
   printf ("  --key <file>          load watermarking key from file\n");
   printf ("  --bit-rate            set AAC bitrate\n");
+  printf ("  --context-format <f>  hls-prepare context: flac, pcm16 or float [flac]\n");
+  printf ("  --incremental         hls-prepare: only prepare segments added since the last run\n");
 }
 
 Format
@@ -110,12 +154,66 @@ parse_format (const string& str)
 {
   if (str == "raw")
     return Format::RAW;
+  if (str == "shm")
+    return Format::SHM;
   if (str == "auto")
     return Format::AUTO;
   error ("audiowmark: unsupported format '%s'\n", str.c_str());
   exit (1);
 }
 
+ResampleQuality
+parse_resample_quality (const string& str)
+{
+  if (str == "fast")
+    return ResampleQuality::FAST;
+  if (str == "normal")
+    return ResampleQuality::NORMAL;
+  if (str == "high")
+    return ResampleQuality::HIGH;
+  error ("audiowmark: unsupported resample quality '%s'\n", str.c_str());
+  exit (1);
+}
+
+ContextFormat
+parse_context_format (const string& str)
+{
+  if (str == "flac")
+    return ContextFormat::FLAC;
+  if (str == "pcm16")
+    return ContextFormat::PCM16;
+  if (str == "float")
+    return ContextFormat::FLOAT;
+  error ("audiowmark: unsupported context format '%s'\n", str.c_str());
+  exit (1);
+}
+
+vector<int>
+parse_channels (const string& str)
+{
+  /* comma separated list of channel numbers, like "0,1" */
+  vector<int> channels;
+  const char *p = str.c_str();
+  while (*p)
+    {
+      char *end;
+      long ch = strtol (p, &end, 10);
+      if (end == p || ch < 0 || (*end && *end != ','))
+        {
+          error ("audiowmark: cannot parse channel list '%s'\n", str.c_str());
+          exit (1);
+        }
+      channels.push_back (ch);
+      p = *end ? end + 1 : end;
+    }
+  if (channels.empty())
+    {
+      error ("audiowmark: cannot parse channel list '%s'\n", str.c_str());
+      exit (1);
+    }
+  return channels;
+}
+
 RawFormat::Endian
 parse_endian (const string& str)
 {
@@ -134,6 +232,8 @@ parse_encoding (const string& str)
     return RawFormat::Encoding::SIGNED;
   if (str == "unsigned")
     return RawFormat::Encoding::UNSIGNED;
+  if (str == "float")
+    return RawFormat::Encoding::FLOAT;
   error ("audiowmark: unsupported encoding '%s'\n", str.c_str());
   exit (1);
 }
@@ -562,6 +662,14 @@ parse_shared_options (ArgParser& ap)
         }
       Params::payload_short = true;
     }
+  if (ap.parse_opt ("--channels", s))
+    {
+      Params::channels = parse_channels (s);
+    }
+  if (ap.parse_opt ("--mid"))
+    {
+      Params::mid = true;
+    }
   ap.parse_opt ("--frames-per-bit", Params::frames_per_bit);
   if (ap.parse_opt ("--linear"))
     {
@@ -657,6 +765,29 @@ parse_add_options (ArgParser& ap)
     {
       Params::test_no_limiter = true;
     }
+  ap.parse_opt ("--test-in-place-crash", Params::test_in_place_crash);
+  if (ap.parse_opt ("--resample-quality", s))
+    {
+      Params::resample_quality = parse_resample_quality (s);
+    }
+  if (ap.parse_opt ("--live"))
+    {
+      Params::live = true;
+    }
+  if (ap.parse_opt ("--max-latency", i))
+    {
+      Params::live = true;
+      Params::max_latency_ms = i;
+    }
+  if (ap.parse_opt ("--output-float"))
+    {
+      Params::output_float = true;
+    }
+  if (ap.parse_opt ("--codec", s))
+    {
+      Params::output_codec = s;
+    }
+  ap.parse_opt ("--bit-rate", Params::output_bit_rate);
 }
 
 void
@@ -705,6 +836,11 @@ parse_get_options (ArgParser& ap)
     {
       Params::json_output = s;
     }
+  if (ap.parse_opt ("--mp3-reduced-rate"))
+    {
+      /* the highest watermark band is below 5 kHz, so 11025 Hz is sufficient */
+      Params::mp3_min_sample_rate = 11025;
+    }
 }
 
 template <class ... Args>
@@ -770,21 +906,91 @@ main (int argc, char **argv)
 
       ap.parse_opt ("--bit-rate", Params::hls_bit_rate);
 
+      /* more than one <output_ts> <message_hex> pair: watermark the same segment with each message */
+      args = ap.remaining_args();
+      if (args.size() > 3 && args.size() % 2 == 1 && std::none_of (args.begin(), args.end(), is_option))
+        {
+          vector<string> outfiles, messages;
+          for (size_t i = 1; i < args.size(); i += 2)
+            {
+              outfiles.push_back (args[i]);
+              messages.push_back (args[i + 1]);
+            }
+          return hls_add (args[0], outfiles, messages);
+        }
       args = parse_positional (ap, "input_ts", "output_ts", "message_hex");
       return hls_add (args[0], args[1], args[2]);
     }
+  else if (ap.parse_cmd ("hls-add-batch"))
+    {
+      parse_shared_options (ap);
+
+      ap.parse_opt ("--bit-rate", Params::hls_bit_rate);
+
+      args = ap.remaining_args();
+      if (args.size() < 3 || std::any_of (args.begin(), args.end(), is_option))
+        args = parse_positional (ap, "output_dir", "message_hex", "input_ts"); // prints usage
+
+      return hls_add_batch (vector<string> (args.begin() + 2, args.end()), args[0], args[1]);
+    }
   else if (ap.parse_cmd ("hls-prepare"))
     {
       ap.parse_opt ("--bit-rate", Params::hls_bit_rate);
 
+      string s;
+      if (ap.parse_opt ("--context-format", s))
+        Params::hls_context_format = parse_context_format (s);
+
+      bool incremental = ap.parse_opt ("--incremental");
+
+      if (ap.parse_opt ("--test-sequential"))
+        Params::test_hls_sequential = true;
+
       args = parse_positional (ap, "input_dir", "output_dir", "playlist_name", "audio_master");
+      if (incremental)
+        return hls_prepare_incremental (args[0], args[1], args[2], args[3]);
       return hls_prepare (args[0], args[1], args[2], args[3]);
     }
+  else if (ap.parse_cmd ("hls-prepare-ab"))
+    {
+      parse_shared_options (ap);
+
+      ap.parse_opt ("--bit-rate", Params::hls_bit_rate);
+
+      args = parse_positional (ap, "input_dir", "output_dir", "playlist_name");
+      return hls_prepare_ab (args[0], args[1], args[2]);
+    }
+  else if (ap.parse_cmd ("hls-ab-playlist"))
+    {
+      parse_shared_options (ap);
+
+      args = parse_positional (ap, "input_playlist", "output_playlist", "message_hex");
+      return hls_ab_playlist (args[0], args[1], args[2]);
+    }
+  else if (ap.parse_cmd ("hls-ab-get"))
+    {
+      parse_shared_options (ap);
+
+      args = parse_positional (ap, "playlist", "watermarked_wav");
+      return hls_ab_get (args[0], args[1], /* no ber */ "");
+    }
+  else if (ap.parse_cmd ("hls-ab-cmp"))
+    {
+      parse_shared_options (ap);
+
+      args = parse_positional (ap, "playlist", "watermarked_wav", "message_hex");
+      return hls_ab_get (args[0], args[1], args[2]);
+    }
   else if (ap.parse_cmd ("add"))
     {
       parse_shared_options (ap);
       parse_add_options (ap);
 
+      if (ap.parse_opt ("--in-place"))
+        {
+          args = parse_positional (ap, "wav_file", "message_hex");
+          return add_watermark_in_place (args[0], args[1]);
+        }
       args = parse_positional (ap, "input_wav", "watermarked_wav", "message_hex");
       return add_watermark (args[0], args[1], args[2]);
     }
@@ -806,6 +1012,32 @@ main (int argc, char **argv)
       args = parse_positional (ap, "watermarked_wav", "message_hex");
       return get_watermark (args[0], args[1]);
     }
+  else if (ap.parse_cmd ("video-add"))
+    {
+      parse_shared_options (ap);
+      parse_add_options (ap);
+
+      args = parse_positional (ap, "input_video", "watermarked_video", "message_hex");
+      return video_add (args[0], args[1], args[2]);
+    }
+  else if (ap.parse_cmd ("video-get"))
+    {
+      parse_shared_options (ap);
+      parse_get_options (ap);
+
+      args = parse_positional (ap, "watermarked_video");
+      return video_get (args[0], /* no ber */ "");
+    }
+  else if (ap.parse_cmd ("video-cmp"))
+    {
+      parse_shared_options (ap);
+      parse_get_options (ap);
+
+      ap.parse_opt ("--expect-matches", Params::expect_matches);
+
+      args = parse_positional (ap, "watermarked_video", "message_hex");
+      return video_get (args[0], args[1]);
+    }
   else if (ap.parse_cmd ("gen-key"))
     {
       args = parse_positional (ap, "key_file");
@@ -0,0 +1,403 @@
+/*
+ * Copyright (C) 2018-2020 Stefan Westerfeld
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "ffinputstream.hh"
+
+#include <assert.h>
+
+#include <algorithm>
+
+extern "C" {
+#include <libavutil/opt.h>
+}
+
+#undef av_err2str
+#define av_err2str(errnum) av_make_error_string((char*)__builtin_alloca(AV_ERROR_MAX_STRING_SIZE), AV_ERROR_MAX_STRING_SIZE, errnum)
+
+using std::string;
+using std::min;
+
+FFInputStream::~FFInputStream()
+{
+  close();
+}
+
+void
+FFInputStream::set_other_packet_handler (std::function<Error (AVPacket *)> handler)
+{
+  assert (m_state == State::NEW);
+
+  m_other_packet_handler = handler;
+}
+
+Error
+FFInputStream::open (const string& filename, const string& format)
+{
+  assert (m_state == State::NEW);
+
+  av_log_set_level (AV_LOG_ERROR);
+
+  const AVInputFormat *in_format = nullptr;
+  if (format != "")
+    {
+      in_format = av_find_input_format (format.c_str());
+      if (!in_format)
+        return Error (string_printf ("unknown input format '%s'", format.c_str()));
+    }
+
+  /* from now on close() needs to free the contexts */
+  m_state = State::OPEN;
+
+  int ret = avformat_open_input (&m_fmt_ctx, filename == "-" ? "pipe:0" : filename.c_str(), in_format, nullptr);
+  if (ret < 0)
+    return Error (av_err2str (ret));
+
+  ret = avformat_find_stream_info (m_fmt_ctx, nullptr);
+  if (ret < 0)
+    return Error (string_printf ("could not find stream info: %s", av_err2str (ret)));
+
+  const AVCodec *codec = nullptr;
+  m_stream_index = av_find_best_stream (m_fmt_ctx, AVMEDIA_TYPE_AUDIO, -1, -1, &codec, 0);
+  if (m_stream_index < 0)
+    return Error ("no audio stream found");
+
+  AVStream *st = m_fmt_ctx->streams[m_stream_index];
+
+  /* we only decode one stream, so the demuxer can skip everything else (unless the packets are needed) */
+  if (!m_other_packet_handler)
+    {
+      for (unsigned int i = 0; i < m_fmt_ctx->nb_streams; i++)
+        if (int (i) != m_stream_index)
+          m_fmt_ctx->streams[i]->discard = AVDISCARD_ALL;
+    }
+
+  m_dec = avcodec_alloc_context3 (codec);
+  if (!m_dec)
+    return Error ("could not alloc a decoding context");
+
+  ret = avcodec_parameters_to_context (m_dec, st->codecpar);
+  if (ret < 0)
+    return Error ("could not copy the stream parameters");
+
+  m_dec->pkt_timebase = st->time_base;
+
+  ret = avcodec_open2 (m_dec, codec, nullptr);
+  if (ret < 0)
+    return Error (string_printf ("could not open audio codec: %s", av_err2str (ret)));
+
+  m_n_channels  = m_dec->channels;
+  m_sample_rate = m_dec->sample_rate;
+  if (m_n_channels < 1 || m_sample_rate < 1)
+    return Error ("unsupported audio stream parameters");
+
+  switch (m_dec->sample_fmt)
+    {
+      case AV_SAMPLE_FMT_U8:
+      case AV_SAMPLE_FMT_U8P:
+          m_bit_depth = 8;
+          break;
+
+      case AV_SAMPLE_FMT_S16:
+      case AV_SAMPLE_FMT_S16P:
+          m_bit_depth = 16;
+          break;
+
+      case AV_SAMPLE_FMT_S32:
+      case AV_SAMPLE_FMT_S32P:
+          m_bit_depth = 32;
+          break;
+
+      default:
+          m_bit_depth = 24; /* lossy codecs are decoded as floats */
+    }
+
+  m_pkt = av_packet_alloc();
+  m_frame = av_frame_alloc();
+  if (!m_pkt || !m_frame)
+    return Error ("could not allocate packet/frame");
+
+  /* convert (planar) decoder output to interleaved float samples */
+  m_swr_ctx = swr_alloc();
+  if (!m_swr_ctx)
+    return Error ("could not allocate resampler context");
+
+  av_opt_set_int        (m_swr_ctx, "in_channel_count",   m_n_channels,     0);
+  av_opt_set_int        (m_swr_ctx, "in_sample_rate",     m_sample_rate,    0);
+  av_opt_set_sample_fmt (m_swr_ctx, "in_sample_fmt",      m_dec->sample_fmt, 0);
+  av_opt_set_int        (m_swr_ctx, "out_channel_count",  m_n_channels,     0);
+  av_opt_set_int        (m_swr_ctx, "out_sample_rate",    m_sample_rate,    0);
+  av_opt_set_sample_fmt (m_swr_ctx, "out_sample_fmt",     AV_SAMPLE_FMT_FLT, 0);
+
+  ret = swr_init (m_swr_ctx);
+  if (ret < 0)
+    return Error ("failed to initialize the resampling context");
+
+  return Error::Code::NONE;
+}
+
+/* must be called after open(): feed the last n_packets audio packets of another file (for instance
+ * the previous hls segment) to the decoder and discard the decoded samples
+ *
+ * afterwards the decoder state (overlap of the previous frame) is the same as if both files were
+ * decoded as one stream; this assumes that the decoder has no delay (each packet produces its frame),
+ * which is true for AAC
+ */
+Error
+FFInputStream::preroll (const string& filename, const string& format, size_t n_packets)
+{
+  assert (m_state == State::OPEN);
+
+  FFInputStream prev_stream;
+  Error err = prev_stream.open (filename, format);
+  if (err)
+    return err;
+
+  if (prev_stream.m_dec->codec_id != m_dec->codec_id)
+    return Error (string_printf ("preroll file %s uses a different codec", filename.c_str()));
+
+  /* demux only, keep the last n_packets packets */
+  std::deque<AVPacket *> packets;
+  int ret;
+  while ((ret = av_read_frame (prev_stream.m_fmt_ctx, prev_stream.m_pkt)) >= 0)
+    {
+      if (prev_stream.m_pkt->stream_index == prev_stream.m_stream_index && n_packets)
+        {
+          if (packets.size() == n_packets)
+            {
+              av_packet_free (&packets.front());
+              packets.pop_front();
+            }
+          AVPacket *pkt = av_packet_alloc();
+          if (!pkt)
+            {
+              err = Error ("could not allocate packet");
+              break;
+            }
+          av_packet_move_ref (pkt, prev_stream.m_pkt);
+          packets.push_back (pkt);
+        }
+      av_packet_unref (prev_stream.m_pkt);
+    }
+  if (!err && ret != AVERROR_EOF)
+    err = Error (string_printf ("error reading preroll file %s: %s", filename.c_str(), av_err2str (ret)));
+
+  for (auto& pkt : packets)
+    {
+      if (!err)
+        {
+          ret = avcodec_send_packet (m_dec, pkt);
+          if (ret < 0)
+            err = Error (string_printf ("error decoding preroll packet: %s", av_err2str (ret)));
+
+          while (avcodec_receive_frame (m_dec, m_frame) == 0)
+            av_frame_unref (m_frame);
+        }
+      av_packet_free (&pkt);
+    }
+  return err;
+}
+
+/* decode the next frame (if any) and append it to m_read_buffer */
+Error
+FFInputStream::decode_more()
+{
+  int ret = avcodec_receive_frame (m_dec, m_frame);
+  if (ret == 0)
+    {
+      if (m_frame->channels != m_n_channels || m_frame->sample_rate != m_sample_rate || m_frame->format != m_dec->sample_fmt)
+        return Error ("audio stream parameters changed while decoding");
+
+      const size_t old_size = m_read_buffer.size();
+      m_read_buffer.resize (old_size + m_frame->nb_samples * m_n_channels);
+
+      uint8_t *out = reinterpret_cast<uint8_t *> (m_read_buffer.data() + old_size);
+      ret = swr_convert (m_swr_ctx, &out, m_frame->nb_samples, (const uint8_t **) m_frame->extended_data, m_frame->nb_samples);
+      av_frame_unref (m_frame);
+      if (ret < 0)
+        return Error ("error while converting");
+
+      m_read_buffer.resize (old_size + ret * m_n_channels);
+      return Error::Code::NONE;
+    }
+  if (ret == AVERROR_EOF)
+    {
+      m_eof = true;
+      return Error::Code::NONE;
+    }
+  if (ret != AVERROR (EAGAIN))
+    return Error (string_printf ("error decoding audio frame: %s", av_err2str (ret)));
+
+  /* decoder needs more input */
+  if (m_flushing)
+    {
+      m_eof = true;
+      return Error::Code::NONE;
+    }
+  ret = av_read_frame (m_fmt_ctx, m_pkt);
+  if (ret == AVERROR_EOF)
+    {
+      /* enter draining mode: get the remaining frames from the decoder */
+      m_flushing = true;
+      ret = avcodec_send_packet (m_dec, nullptr);
+      if (ret < 0)
+        return Error (string_printf ("error flushing decoder: %s", av_err2str (ret)));
+      return Error::Code::NONE;
+    }
+  if (ret < 0)
+    return Error (string_printf ("error reading input: %s", av_err2str (ret)));
+
+  if (m_pkt->stream_index == m_stream_index)
+    {
+      m_n_packets++;
+      m_packet_bytes += m_pkt->size;
+
+      ret = avcodec_send_packet (m_dec, m_pkt);
+    }
+  else if (m_other_packet_handler)
+    {
+      Error err = m_other_packet_handler (m_pkt);
+      av_packet_unref (m_pkt);
+      return err;
+    }
+  av_packet_unref (m_pkt);
+  if (ret < 0)
+    return Error (string_printf ("error decoding audio packet: %s", av_err2str (ret)));
+
+  return Error::Code::NONE;
+}
+
+Error
+FFInputStream::read_frames (float *samples, size_t count, size_t& frames_read)
+{
+  assert (m_state == State::OPEN);
+
+  frames_read = 0;
+  while (!m_eof && m_read_buffer.size() < count * m_n_channels)
+    {
+      Error err = decode_more();
+      if (err)
+        return err;
+    }
+
+  const auto begin = m_read_buffer.begin();
+  const auto end   = begin + min (count * m_n_channels, m_read_buffer.size());
+  std::copy (begin, end, samples);
+  frames_read = (end - begin) / m_n_channels;
+  m_read_buffer.erase (begin, end);
+  return Error::Code::NONE;
+}
+
+void
+FFInputStream::close()
+{
+  if (m_state == State::OPEN)
+    {
+      swr_free (&m_swr_ctx);
+      av_frame_free (&m_frame);
+      av_packet_free (&m_pkt);
+      avcodec_free_context (&m_dec);
+      if (m_fmt_ctx)
+        avformat_close_input (&m_fmt_ctx);
+
+      m_state = State::CLOSED;
+    }
+}
+
+int
+FFInputStream::bit_depth() const
+{
+  return m_bit_depth;
+}
+
+int
+FFInputStream::sample_rate() const
+{
+  return m_sample_rate;
+}
+
+int
+FFInputStream::n_channels() const
+{
+  return m_n_channels;
+}
+
+size_t
+FFInputStream::n_frames() const
+{
+  /* container durations are only estimates, so we don't promise a number of frames */
+  return N_FRAMES_UNKNOWN;
+}
+
+int
+FFInputStream::n_streams() const
+{
+  return m_fmt_ctx->nb_streams;
+}
+
+string
+FFInputStream::codec_name() const
+{
+  return avcodec_get_name (m_fmt_ctx->streams[m_stream_index]->codecpar->codec_id);
+}
+
+string
+FFInputStream::channel_layout() const
+{
+  uint64_t layout = m_dec->channel_layout;
+  if (!layout)
+    layout = av_get_default_channel_layout (m_n_channels);
+
+  char buffer[256];
+  av_get_channel_layout_string (buffer, sizeof (buffer), m_n_channels, layout);
+  return buffer;
+}
+
+/* returns false if the container has no start time for the audio stream */
+bool
+FFInputStream::start_time (double& seconds) const
+{
+  const AVStream *st = m_fmt_ctx->streams[m_stream_index];
+  if (st->start_time == AV_NOPTS_VALUE)
+    return false;
+
+  seconds = st->start_time * av_q2d (st->time_base);
+  return true;
+}
+
+size_t
+FFInputStream::n_packets() const
+{
+  return m_n_packets;
+}
+
+size_t
+FFInputStream::packet_bytes() const
+{
+  return m_packet_bytes;
+}
+
+const AVFormatContext *
+FFInputStream::format_context() const
+{
+  return m_fmt_ctx;
+}
+
+int
+FFInputStream::stream_index() const
+{
+  return m_stream_index;
+}
@@ -0,0 +1,96 @@
+/*
+ * Copyright (C) 2018-2020 Stefan Westerfeld
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef AUDIOWMARK_FF_INPUT_STREAM_HH
+#define AUDIOWMARK_FF_INPUT_STREAM_HH
+
+#include <string>
+#include <vector>
+#include <deque>
+#include <functional>
+
+#include "audiostream.hh"
+
+extern "C" {
+#include <libavformat/avformat.h>
+#include <libavcodec/avcodec.h>
+#include <libswresample/swresample.h>
+}
+
+/* decode the first audio stream of any container/codec supported by the ffmpeg libs */
+class FFInputStream : public AudioInputStream
+{
+  AVFormatContext  *m_fmt_ctx = nullptr;
+  AVCodecContext   *m_dec = nullptr;
+  AVPacket         *m_pkt = nullptr;
+  AVFrame          *m_frame = nullptr;
+  SwrContext       *m_swr_ctx = nullptr;
+  int               m_stream_index = -1;
+
+  int               m_n_channels = 0;
+  int               m_sample_rate = 0;
+  int               m_bit_depth = 0;
+  bool              m_flushing = false;
+  bool              m_eof = false;
+  size_t            m_n_packets = 0;
+  size_t            m_packet_bytes = 0;
+
+  std::function<Error (AVPacket *)> m_other_packet_handler;
+
+  std::vector<float> m_read_buffer;
+
+  enum class State {
+    NEW,
+    OPEN,
+    CLOSED
+  };
+  State             m_state = State::NEW;
+
+  Error decode_more();
+public:
+  ~FFInputStream();
+
+  /* must be called before open(): packets of the other streams are passed to the handler instead of being discarded */
+  void    set_other_packet_handler (std::function<Error (AVPacket *)> handler);
+
+  Error   open (const std::string& filename, const std::string& format = "");
+  Error   preroll (const std::string& filename, const std::string& format, size_t n_packets);
+  Error   read_frames (float *samples, size_t count, size_t& frames_read) override;
+  using AudioInputStream::read_frames;
+  void    close();
+
+  int     bit_depth() const override;
+  int     sample_rate() const override;
+  int     n_channels()  const override;
+  size_t  n_frames() const override;
+
+  /* stream properties (for validating/preparing hls segments) */
+  int           n_streams() const;
+  std::string   codec_name() const;
+  std::string   channel_layout() const;
+  bool          start_time (double& seconds) const;
+
+  /* number/size of the compressed audio packets read so far */
+  size_t        n_packets() const;
+  size_t        packet_bytes() const;
+
+  /* demuxer state (for copying the other streams) */
+  const AVFormatContext *format_context() const;
+  int           stream_index() const;
+};
+
+#endif /* AUDIOWMARK_FF_INPUT_STREAM_HH */
@@ -0,0 +1,116 @@
+/*
+ * Copyright (C) 2018-2020 Stefan Westerfeld
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef AUDIOWMARK_FF_OUTPUT_STREAM_HH
+#define AUDIOWMARK_FF_OUTPUT_STREAM_HH
+
+#include "audiostream.hh"
+#include "audiobuffer.hh"
+
+#include <assert.h>
+
+extern "C" {
+#include <libavformat/avformat.h>
+#include <libavutil/opt.h>
+#include <libswresample/swresample.h>
+#include <libavutil/avassert.h>
+#include <libavutil/timestamp.h>
+#include <libavcodec/avcodec.h>
+}
+
+/* encode audio using the ffmpeg libs (codec and container are chosen by the caller) */
+class FFOutputStream : public AudioOutputStream {
+protected:
+  AVStream         *m_st = nullptr;
+  AVCodecContext   *m_enc = nullptr;
+  AVFormatContext  *m_fmt_ctx = nullptr;
+
+  /* pts of the next frame that will be generated */
+  int64_t           m_next_pts = 0;
+  int               m_samples_count = 0;
+  int               m_start_pos = 0;
+
+  AVFrame          *m_frame = nullptr;
+  AVFrame          *m_tmp_frame = nullptr;
+  AVPacket         *m_tmp_pkt = nullptr;
+
+  /* zero padding of the last frame, which is trimmed from the last packet */
+  int               m_end_padding = 0;
+  AVPacket         *m_last_pkt = nullptr;
+  bool              m_have_last_pkt = false;
+
+  SwrContext       *m_swr_ctx = nullptr;
+
+  int               m_bit_depth = 0;
+  int               m_sample_rate = 0;
+  int               m_n_channels = 0;
+  AudioBuffer       m_audio_buffer;
+  int               m_bit_rate = 0;
+  std::string       m_channel_layout;
+
+  enum class State {
+    NEW,
+    OPEN,
+    CLOSED
+  };
+  State             m_state = State::NEW;
+
+  Error add_stream (const AVCodec *codec);
+  Error open_audio (const AVCodec *codec, AVDictionary *opt_arg);
+  Error open_format (const std::string& format, const std::string& filename);
+  Error open_file (const std::string& out_filename);
+  Error write_header();
+  Error open_output (const std::string& out_filename, const AVCodec *codec);
+  void  close_format();
+  void  free_format();
+  Error find_encoder (enum AVCodecID codec_id, const AVCodec **codec);
+  AVFrame *get_audio_frame();
+  enum class EncResult {
+    OK,
+    ERROR,
+    DONE
+  };
+  EncResult write_audio_frame (Error& err);
+  void close_stream();
+  AVFrame *alloc_audio_frame (AVSampleFormat sample_fmt, uint64_t channel_layout, int sample_rate, int nb_samples, Error& err);
+
+  int write_frame (const AVRational *time_base, AVStream *st, AVPacket *pkt);
+  Error write_last_packet();
+  Error encode_buffered_frames();
+  Error finish (bool pad_last_frame);
+
+  /* called for each encoded packet: return false to drop the packet */
+  virtual bool filter_packet (Error& err);
+public:
+  FFOutputStream (int n_channels, int sample_rate, int bit_depth);
+  ~FFOutputStream();
+
+  void set_bit_rate (int bit_rate);
+  void set_channel_layout (const std::string& channel_layout);
+
+  Error open (const std::string& output_filename, const std::string& codec_name = "");
+  int bit_depth() const override;
+  int sample_rate() const override;
+  int n_channels() const override;
+  Error write_frames (const float *samples, size_t count) override;
+  using AudioOutputStream::write_frames;
+  Error close() override;
+
+  static bool is_encoded_filename (const std::string& filename);
+};
+
+#endif /* AUDIOWMARK_FF_OUTPUT_STREAM_HH */
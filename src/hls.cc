@@ -17,18 +17,24 @@
 
 #include <string>
 #include <regex>
+#include <algorithm>
 
 #include <sys/types.h>
-#include <sys/wait.h>
 #include <sys/stat.h>
 #include <unistd.h>
+#include <dirent.h>
+#include <strings.h>
 
 #include "utils.hh"
 #include "mpegts.hh"
 #include "sfinputstream.hh"
 #include "sfoutputstream.hh"
+#include "rawinputstream.hh"
+#include "rawconverter.hh"
 #include "wmcommon.hh"
 #include "wavdata.hh"
+#include "threadpool.hh"
+#include "hls.hh"
 
 #include "config.h"
 
@@ -37,6 +43,229 @@ using std::vector;
 using std::regex;
 using std::map;
 using std::min;
+using std::max;
+
+/* read playlist, removing newline chars at the end of each line */
+static Error
+read_playlist (const string& filename, vector<string>& lines)
+{
+  FILE *file = fopen (filename.c_str(), "r");
+  ScopedFile file_s (file);
+
+  if (!file)
+    return Error (string_printf ("error opening playlist %s", filename.c_str()));
+
+  char buffer[1024];
+  while (fgets (buffer, 1024, file))
+    {
+      /* kill newline chars at end */
+      int last = strlen (buffer) - 1;
+      while (last > 0 && (buffer[last] == '\n' || buffer[last] == '\r'))
+        buffer[last--] = 0;
+
+      lines.push_back (buffer);
+    }
+  return Error::Code::NONE;
+}
+
+/* every playlist line that is not blank or a comment refers to a segment */
+static bool
+is_segment_line (const string& s)
+{
+  static const regex blank_re (R"(\s*(#.*)?)");
+
+  return !regex_match (s, blank_re);
+}
+
+/* per viewer playlist: segment i is taken from the variant (a/ or b/) for message bit i % payload_size */
+int
+hls_ab_playlist (const string& in_playlist, const string& out_playlist, const string& bits)
+{
+  vector<int> bitvec = parse_payload (bits);
+  if (bitvec.empty())
+    return 1;
+
+  vector<string> lines;
+  Error err = read_playlist (in_playlist, lines);
+  if (err)
+    {
+      error ("audiowmark: %s\n", err.message());
+      return 1;
+    }
+
+  FILE *out_file = out_playlist == "-" ? stdout : fopen (out_playlist.c_str(), "w");
+  ScopedFile out_file_s (out_file == stdout ? nullptr : out_file);
+  if (!out_file)
+    {
+      error ("audiowmark: error opening output playlist %s\n", out_playlist.c_str());
+      return 1;
+    }
+
+  size_t segment = 0;
+  for (auto& s : lines)
+    {
+      if (is_segment_line (s))
+        {
+          const char *variant = bitvec[segment++ % bitvec.size()] ? "b/" : "a/";
+          fprintf (out_file, "%s%s\n", variant, s.c_str());
+        }
+      else
+        {
+          fprintf (out_file, "%s\n", s.c_str());
+        }
+    }
+  if (fflush (out_file) != 0)
+    {
+      error ("audiowmark: error writing output playlist %s\n", out_playlist.c_str());
+      return 1;
+    }
+  return 0;
+}
+
+/* detect message in the audio of a stream that was delivered using an A/B variant playlist */
+int
+hls_ab_get (const string& playlist, const string& infile, const string& bits)
+{
+  vector<string> lines;
+  Error err = read_playlist (playlist, lines);
+  if (err)
+    {
+      error ("audiowmark: %s\n", err.message());
+      return 1;
+    }
+
+  /* the segment durations are needed to find the segment boundaries in the audio */
+  const regex extinf_re (R"(#EXTINF:\s*([0-9.]+).*)");
+  vector<double> segment_durations;
+  double duration = -1;
+  for (auto& s : lines)
+    {
+      std::smatch match;
+      if (regex_match (s, match, extinf_re))
+        {
+          duration = atof (match[1].str().c_str());
+        }
+      else if (is_segment_line (s))
+        {
+          if (duration < 0)
+            {
+              error ("audiowmark: playlist %s: missing #EXTINF duration for segment %s\n", playlist.c_str(), s.c_str());
+              return 1;
+            }
+          segment_durations.push_back (duration);
+          duration = -1;
+        }
+    }
+  return get_ab_watermark (infile, segment_durations, bits);
+}
+
+/* hls input for get/cmp: a playlist (.m3u8) or a directory that contains the .ts segments */
+bool
+hls_is_input (const string& filename)
+{
+  const string ext = ".m3u8";
+  if (filename.size() > ext.size() && strcasecmp (filename.c_str() + filename.size() - ext.size(), ext.c_str()) == 0)
+    return true;
+
+  struct stat st;
+  return stat (filename.c_str(), &st) == 0 && S_ISDIR (st.st_mode);
+}
+
+/* sort segment names like out2.ts before out10.ts: digit sequences are compared by their numeric value */
+static bool
+natural_less (const string& a, const string& b)
+{
+  size_t i = 0, j = 0;
+  while (i < a.size() && j < b.size())
+    {
+      if (isdigit (a[i]) && isdigit (b[j]))
+        {
+          size_t ei = i, ej = j;
+          while (ei < a.size() && isdigit (a[ei]))
+            ei++;
+          while (ej < b.size() && isdigit (b[ej]))
+            ej++;
+
+          /* ignore leading zeros, then the longer number is larger */
+          while (i + 1 < ei && a[i] == '0')
+            i++;
+          while (j + 1 < ej && b[j] == '0')
+            j++;
+          if (ei - i != ej - j)
+            return ei - i < ej - j;
+
+          int cmp = a.compare (i, ei - i, b, j, ej - j);
+          if (cmp != 0)
+            return cmp < 0;
+
+          i = ei;
+          j = ej;
+        }
+      else
+        {
+          if (a[i] != b[j])
+            return a[i] < b[j];
+          i++;
+          j++;
+        }
+    }
+  return a.size() - i < b.size() - j;
+}
+
+/* find the segment files of a playlist (in playlist order) or a directory (in natural sort order) */
+Error
+hls_input_segments (const string& filename, vector<string>& segments)
+{
+  struct stat st;
+  if (stat (filename.c_str(), &st) == 0 && S_ISDIR (st.st_mode))
+    {
+      DIR *dir = opendir (filename.c_str());
+      if (!dir)
+        return Error (string_printf ("error opening directory %s: %s", filename.c_str(), strerror (errno)));
+
+      vector<string> names;
+      while (struct dirent *entry = readdir (dir))
+        {
+          const string name = entry->d_name;
+          if (name.size() > 3 && strcasecmp (name.c_str() + name.size() - 3, ".ts") == 0)
+            names.push_back (name);
+        }
+      closedir (dir);
+
+      std::sort (names.begin(), names.end(), natural_less);
+      for (auto& name : names)
+        segments.push_back (filename + "/" + name);
+
+      if (segments.empty())
+        return Error (string_printf ("no .ts segments found in directory %s", filename.c_str()));
+      return Error::Code::NONE;
+    }
+
+  vector<string> lines;
+  Error err = read_playlist (filename, lines);
+  if (err)
+    return err;
+
+  /* segment names are relative to the directory of the playlist */
+  const size_t slash = filename.rfind ('/');
+  const string dir = slash == string::npos ? "" : filename.substr (0, slash + 1);
+  for (auto& s : lines)
+    {
+      if (!is_segment_line (s))
+        continue;
+
+      if (s.find ("://") != string::npos)
+        return Error (string_printf ("playlist %s: only local segments are supported (%s)", filename.c_str(), s.c_str()));
+
+      if (hls_is_input (s))
+        return Error (string_printf ("playlist %s is a master playlist, use one of its media playlists", filename.c_str()));
+
+      segments.push_back (s[0] == '/' ? s : dir + s);
+    }
+  if (segments.empty())
+    return Error (string_printf ("playlist %s contains no segments", filename.c_str()));
+  return Error::Code::NONE;
+}
 
 #if !HAVE_FFMPEG
 int
@@ -46,15 +275,51 @@ hls_prepare (const string& in_dir, const string& out_dir, const string& filename
   return 1;
 }
 
+int
+hls_prepare_incremental (const string& in_dir, const string& out_dir, const string& filename, const string& audio_master)
+{
+  error ("audiowmark: hls support is not available in this build of audiowmark\n");
+  return 1;
+}
+
+Error
+hls_load_input (const string& filename, WavData& wav_data)
+{
+  return Error ("hls support is not available in this build of audiowmark");
+}
+
 int
 hls_add (const string& infile, const string& outfile, const string& bits)
 {
   error ("audiowmark: hls support is not available in this build of audiowmark\n");
   return 1;
 }
+
+int
+hls_add (const string& infile, const vector<string>& outfiles, const vector<string>& bits)
+{
+  error ("audiowmark: hls support is not available in this build of audiowmark\n");
+  return 1;
+}
+
+int
+hls_prepare_ab (const string& in_dir, const string& out_dir, const string& filename)
+{
+  error ("audiowmark: hls support is not available in this build of audiowmark\n");
+  return 1;
+}
+
+int
+hls_add_batch (const vector<string>& infiles, const string& out_dir, const string& bits)
+{
+  error ("audiowmark: hls support is not available in this build of audiowmark\n");
+  return 1;
+}
 #else
 
 #include "hlsoutputstream.hh"
+#include "ffinputstream.hh"
+#include "mmapwavfile.hh"
 
 static bool
 file_exists (const string& filename)
@@ -68,321 +333,661 @@ file_exists (const string& filename)
   return false;
 }
 
-static string
-args2string (const vector<string>& args)
+static const char *
+context_format_name (ContextFormat format)
+{
+  switch (format)
+    {
+      case ContextFormat::FLAC:  return "flac";
+      case ContextFormat::PCM16: return "pcm16";
+      case ContextFormat::FLOAT: return "float";
+    }
+  return "";
+}
+
+/* raw formats used to store the context without compression */
+static Error
+context_raw_format (const string& format_name, int n_channels, int sample_rate, RawFormat& format)
 {
-  string result;
-  bool first = true;
+  format = RawFormat (n_channels, sample_rate, 16);
+  if (format_name == context_format_name (ContextFormat::PCM16))
+    return Error::Code::NONE;
 
-  for (auto a : args)
+  if (format_name == context_format_name (ContextFormat::FLOAT))
     {
-      if (!first)
-        result += " ";
-      first = false;
-      result += a;
+      format.set_bit_depth (32);
+      format.set_encoding (RawFormat::FLOAT);
+      return Error::Code::NONE;
     }
-  return result;
+  return Error (string_printf ("unsupported hls context format '%s'", format_name.c_str()));
+}
+
+Error
+ff_decode (const string& filename, WavData& out_wav_data)
+{
+  FFInputStream in_stream;
+
+  Error err = in_stream.open (filename, "mpegts");
+  if (err)
+    return err;
+
+  return out_wav_data.load (&in_stream);
 }
 
+/* number of aac packets of the previous segment that are decoded before each segment */
+static constexpr size_t hls_preroll_packets = 3;
+
+/* decode one segment of a hls stream; the decoder first decodes the last packets of the previous segment
+ * (and drops the samples), so the start of the segment is decoded like a player decodes the whole stream
+ */
 static Error
-run (const vector<string>& args, vector<string> *pipe_out = nullptr)
+decode_input_segment (const vector<string>& segment_files, size_t i, WavData& wav_data)
 {
-  auto report_error = [=] { error ("audiowmark: failed to execute %s\n", args2string (args).c_str()); };
+  FFInputStream in_stream;
 
-  char *argv[args.size() + 1];
-  for (size_t i = 0; i < args.size(); i++)
-    argv[i] = (char *) args[i].c_str();
-  argv[args.size()] = nullptr;
+  Error err = in_stream.open (segment_files[i], "mpegts");
+  if (err)
+    return err;
 
-  int pipe_fds[2];
-  if (pipe_out)
+  if (i > 0)
     {
-      if (pipe (pipe_fds) == -1)
-        {
-          report_error();
-          return Error ("pipe() failed");
-        }
+      err = in_stream.preroll (segment_files[i - 1], "mpegts", hls_preroll_packets);
+      if (err)
+        return err;
     }
-  pid_t pid = fork();
-  if (pid < 0)
+  return wav_data.load (&in_stream);
+}
+
+/* decode all segments of a hls stream (in parallel) and append the audio of the segments without gaps */
+Error
+hls_load_input (const string& filename, WavData& wav_data)
+{
+  vector<string> segment_files;
+  Error err = hls_input_segments (filename, segment_files);
+  if (err)
+    return err;
+
+  struct Segment
+  {
+    WavData wav_data;
+    Error   err;
+  };
+  vector<Segment> segments (segment_files.size());
+
+  ThreadPool thread_pool;
+  for (size_t i = 0; i < segments.size(); i++)
     {
-      if (pipe_out)
-        {
-          close (pipe_fds[0]);
-          close (pipe_fds[1]);
-        }
-      report_error();
-      return Error ("fork() failed");
+      thread_pool.add_job ([&segments, &segment_files, i] {
+        segments[i].err = decode_input_segment (segment_files, i, segments[i].wav_data);
+      });
     }
-  if (pid == 0) /* child process */
+  thread_pool.wait_all();
+
+  size_t n_values = 0;
+  for (size_t i = 0; i < segments.size(); i++)
     {
-      if (pipe_out)
-        {
-          // replace stdout with pipe
-          if (dup2 (pipe_fds[1], STDOUT_FILENO) == -1)
-            {
-              perror ("audiowmark: dup2() failed");
-              exit (127);
-            }
+      const WavData& segment = segments[i].wav_data;
 
-          // close remaining pipe fds
-          close (pipe_fds[0]);
-          close (pipe_fds[1]);
-        }
-      execvp (argv[0], argv);
-      perror ("audiowmark: execvp() failed");
+      if (segments[i].err)
+        return Error (string_printf ("decoding hls segment %s failed: %s", segment_files[i].c_str(), segments[i].err.message()));
+
+      if (segment.n_channels() != segments[0].wav_data.n_channels() || segment.sample_rate() != segments[0].wav_data.sample_rate())
+        return Error (string_printf ("hls segment %s: audio format differs from first segment", segment_files[i].c_str()));
 
-      // should not be reached in normal operation, so exec failed
-      exit (127);
+      n_values += segment.n_values();
     }
 
-  /* parent process */
-  if (pipe_out) /* capture child stdout */
-    {
-      close (pipe_fds[1]); // close pipe write fd
+  const int n_channels  = segments[0].wav_data.n_channels();
+  const int sample_rate = segments[0].wav_data.sample_rate();
+  const int bit_depth   = segments[0].wav_data.bit_depth();
 
-      FILE *f = fdopen (pipe_fds[0], "r");
-      if (!f)
-        {
-          close (pipe_fds[0]);
-          report_error();
-          return Error ("fdopen() pipe failed");
-        }
-      char buffer[1024];
-      while (fgets (buffer, 1024, f))
-        {
-          if (strlen (buffer) && buffer[strlen (buffer) - 1] == '\n')
-            buffer[strlen (buffer) - 1] = 0;
-          if (pipe_out)
-            pipe_out->push_back (buffer);
-        }
-      fclose (f);        // close pipe read fd
-    }
-  int status;
-  pid_t exited = waitpid (pid, &status, 0);
-  if (exited < 0)
-    {
-      report_error();
-      return Error ("waitpid() failed");
-    }
-  if (WIFEXITED (status))
-    {
-      int exit_status = WEXITSTATUS (status);
-      if (exit_status != 0)
-        {
-          report_error();
-          return Error (string_printf ("subprocess failed / exit status %d", exit_status));
-        }
-    }
-  else
+  vector<float> samples;
+  samples.reserve (n_values);
+  for (auto& segment : segments)
     {
-      report_error();
-      return Error ("child didn't exit normally");
+      samples.insert (samples.end(), segment.wav_data.samples().begin(), segment.wav_data.samples().end());
+      segment.wav_data = WavData(); // free memory early
     }
+  wav_data = WavData (samples, n_channels, sample_rate, bit_depth);
   return Error::Code::NONE;
 }
 
-Error
-ff_decode (const string& filename, WavData& out_wav_data)
+int
+hls_add (const string& infile, const string& outfile, const string& bits)
+{
+  return hls_add (infile, vector<string> { outfile }, vector<string> { bits });
+}
+
+/* prepared segment (written by hls-prepare): parameters and context audio */
+struct PreparedSegment
 {
-  FILE *tmp_file = tmpfile();
-  ScopedFile tmp_file_s (tmp_file);
-  string tmp_file_name = string_printf ("/dev/fd/%d", fileno (tmp_file));
+  TSReader      reader;
+  size_t        start_pos = 0;
+  size_t        prev_size = 0;
+  size_t        size      = 0;
+  double        pts_start = 0;
+  int           bit_rate  = 0;
+  std::string   channel_layout;
+
+  std::unique_ptr<AudioInputStream> in_stream;
 
-  if (!tmp_file)
-    return Error ("failed to create temp file");
+  Error load (const string& infile);
 
-  Error err = run ({"ffmpeg", "-v", "error", "-y", "-f",  "mpegts", "-i", filename, "-f", "wav", tmp_file_name});
+  /* number of aac frames before the segment start that are encoded (but not written) by hls-add */
+  size_t
+  cut_aac_frames() const
+  {
+    const size_t prev_ctx = min<size_t> (1024 * 3, prev_size);
+    return prev_ctx / 1024;
+  }
+};
+
+Error
+PreparedSegment::load (const string& infile)
+{
+  Error err = reader.load (infile);
   if (err)
     return err;
 
-  err = out_wav_data.load (tmp_file_name);
+  map<string, string> vars = reader.parse_vars ("vars");
+  string missing_var;
+
+  auto get_var = [&] (const std::string& var) {
+    auto it = vars.find (var);
+    if (it == vars.end())
+      {
+        if (missing_var.empty())
+          missing_var = var;
+        return "";
+      }
+    else
+      return it->second.c_str();
+  };
+  start_pos = atoi (get_var ("start_pos"));
+  prev_size = atoi (get_var ("prev_size"));
+  size      = atoi (get_var ("size"));
+  pts_start = atof (get_var ("pts_start"));
+  bit_rate  = atoi (get_var ("bit_rate"));
+
+  channel_layout = get_var ("channel_layout");
+
+  if (!missing_var.empty())
+    return Error (string_printf ("hls segment is missing value for required variable '%s'", missing_var.c_str()));
+
+  /* segments prepared by older versions have no context_format entry and always use flac */
+  string context_format = vars.count ("context_format") ? vars["context_format"] : context_format_name (ContextFormat::FLAC);
+  const bool flac_context = context_format == context_format_name (ContextFormat::FLAC);
+
+  RawFormat raw_format;
+  if (!flac_context)
+    {
+      int n_channels  = atoi (get_var ("context_channels"));
+      int sample_rate = atoi (get_var ("context_sample_rate"));
+      if (!missing_var.empty())
+        return Error (string_printf ("hls segment is missing value for required variable '%s'", missing_var.c_str()));
+
+      err = context_raw_format (context_format, n_channels, sample_rate, raw_format);
+      if (err)
+        return err;
+    }
+
+  const TSReader::Entry *full_ctx = reader.find (flac_context ? "full.flac" : "full.raw");
+  if (!full_ctx)
+    return Error (string_printf ("no embedded context found in %s", infile.c_str()));
+
+  /* both streams read the context directly from the TSReader entry (no copy) */
+  if (flac_context)
+    {
+      SFInputStream *sf_in_stream = new SFInputStream();
+      in_stream.reset (sf_in_stream);
+      err = sf_in_stream->open (&full_ctx->data);
+    }
+  else
+    {
+      RawInputStream *raw_in_stream = new RawInputStream();
+      in_stream.reset (raw_in_stream);
+      err = raw_in_stream->open (&full_ctx->data, raw_format);
+    }
   return err;
 }
 
-int
-hls_add (const string& infile, const string& outfile, const string& bits)
+/* watermark one loaded segment with different messages (outfiles[i] gets message bits[i]) */
+static int
+add_segment_watermark (const PreparedSegment& segment, const vector<string>& outfiles, const vector<string>& bits)
 {
-  TSReader reader;
+  AudioInputStream *in_stream = segment.in_stream.get();
+  Error err;
 
-  Error err = reader.load (infile);
-  if (err)
+  int bit_rate = segment.bit_rate;
+  if (Params::hls_bit_rate)  // command line option overrides vars bit-rate
+    bit_rate = Params::hls_bit_rate;
+
+  /* ffmpeg aac encode adds one frame of latency - it would be possible to compensate for this
+   * by setting shift = 1024, but it can also be done by adjusting the presentation timestamp
+   */
+  const size_t prev_ctx = min<size_t> (1024 * 3, segment.prev_size);
+  const size_t shift = 0;
+  const size_t cut_aac_frames = (prev_ctx + shift) / 1024;
+  const size_t delete_input_start = segment.prev_size - prev_ctx;
+  const size_t keep_aac_frames = segment.size / 1024;
+
+  /* one output stream (and aac encoder) per message; the context is only decoded and analyzed once */
+  vector<std::unique_ptr<HLSOutputStream>> out_streams;
+  vector<AudioOutputStream *> out_stream_ptrs;
+  for (auto& outfile : outfiles)
     {
-      error ("hls: %s\n", err.message());
-      return 1;
+      HLSOutputStream *out_stream = new HLSOutputStream (in_stream->n_channels(), in_stream->sample_rate(), in_stream->bit_depth());
+      out_streams.emplace_back (out_stream);
+      out_stream_ptrs.push_back (out_stream);
+
+      out_stream->set_bit_rate (bit_rate);
+      out_stream->set_channel_layout (segment.channel_layout);
+
+      err = out_stream->open (outfile, cut_aac_frames, keep_aac_frames, segment.pts_start, delete_input_start);
+      if (err)
+        {
+          error ("audiowmark: error opening HLS output stream %s: %s\n", outfile.c_str(), err.message());
+          return 1;
+        }
     }
 
-  const TSReader::Entry *full_flac = reader.find ("full.flac");
-  if (!full_flac)
+  int wm_rc = add_stream_watermark (in_stream, out_stream_ptrs, bits, segment.start_pos - segment.prev_size);
+  if (wm_rc != 0)
+    return wm_rc;
+
+  info ("AAC Bitrate:  %d\n", bit_rate);
+  return 0;
+}
+
+/* watermark one segment with different messages (outfiles[i] gets message bits[i]) */
+int
+hls_add (const string& infile, const vector<string>& outfiles, const vector<string>& bits)
+{
+  assert (outfiles.size() == bits.size());
+
+  if (std::count (outfiles.begin(), outfiles.end(), "-") > 1)
     {
-      error ("hls: no embedded context found in %s\n", infile.c_str());
+      error ("audiowmark: hls: only one output segment can be written to stdout\n");
       return 1;
     }
 
-  SFInputStream in_stream;
-  err = in_stream.open (&full_flac->data);
+  PreparedSegment segment;
+  Error err = segment.load (infile);
   if (err)
     {
-      error ("hls: %s\n", err.message());
+      error ("audiowmark: hls: %s\n", err.message());
       return 1;
     }
+  return add_segment_watermark (segment, outfiles, bits);
+}
 
-  map<string, string> vars = reader.parse_vars ("vars");
-  bool missing_vars = false;
-
-  auto get_var = [&] (const std::string& var) {
-    auto it = vars.find (var);
-    if (it == vars.end())
+/* reads the audio of consecutive prepared segments as one stream: the context before the first
+ * segment, the segments themselves and the context after the last segment
+ */
+class SegmentSequenceInputStream : public AudioInputStream
+{
+  struct Part
+  {
+    AudioInputStream *stream;
+    size_t            skip_frames;
+    size_t            n_frames; // N_FRAMES_UNKNOWN: read until end of stream
+  };
+  vector<Part>  m_parts;
+  size_t        m_part = 0;
+  vector<float> m_skip_buffer;
+public:
+  void
+  add_part (AudioInputStream *stream, size_t skip_frames, size_t n_frames)
+  {
+    m_parts.push_back ({ stream, skip_frames, n_frames });
+  }
+  int
+  bit_depth() const override
+  {
+    return m_parts[0].stream->bit_depth();
+  }
+  int
+  sample_rate() const override
+  {
+    return m_parts[0].stream->sample_rate();
+  }
+  int
+  n_channels() const override
+  {
+    return m_parts[0].stream->n_channels();
+  }
+  size_t
+  n_frames() const override
+  {
+    size_t frames = 0;
+    for (auto& part : m_parts)
       {
-        error ("audiowmark: hls segment is missing value for required variable '%s'\n", var.c_str());
-        missing_vars = true;
-        return "";
+        size_t part_frames = part.n_frames;
+        if (part_frames == N_FRAMES_UNKNOWN)
+          {
+            if (part.stream->n_frames() == N_FRAMES_UNKNOWN)
+              return N_FRAMES_UNKNOWN;
+            part_frames = part.stream->n_frames() - min (part.skip_frames, part.stream->n_frames());
+          }
+        frames += part_frames;
       }
-    else
-      return it->second.c_str();
-  };
-  size_t start_pos = atoi (get_var ("start_pos"));
-  size_t prev_size = atoi (get_var ("prev_size"));
-  size_t size      = atoi (get_var ("size"));
-  double pts_start = atof (get_var ("pts_start"));
-  int    bit_rate  = atoi (get_var ("bit_rate"));
-  size_t prev_ctx  = min<size_t> (1024 * 3, prev_size);
+    return frames;
+  }
+  Error
+  read_frames (float *samples, size_t count, size_t& frames_read) override
+  {
+    frames_read = 0;
+    while (frames_read < count && m_part < m_parts.size())
+      {
+        Part& part = m_parts[m_part];
+        size_t n_read = 0;
+        Error err;
+        if (part.skip_frames)
+          {
+            /* the context before a segment was already read from the previous segment */
+            const size_t n = min<size_t> (part.skip_frames, 1024);
+            m_skip_buffer.resize (n * n_channels());
+            err = part.stream->read_frames (m_skip_buffer.data(), n, n_read);
+            part.skip_frames -= n_read;
+          }
+        else
+          {
+            const size_t n = min (count - frames_read, part.n_frames);
+            err = part.stream->read_frames (samples + frames_read * n_channels(), n, n_read);
+            frames_read += n_read;
+            if (part.n_frames != N_FRAMES_UNKNOWN)
+              part.n_frames -= n_read;
+          }
+        if (err)
+          return err;
+        if (n_read == 0 || part.n_frames == 0)
+          m_part++;
+      }
+    return Error::Code::NONE;
+  }
+};
 
-  string channel_layout = get_var ("channel_layout");
+/* watermark consecutive segments in one run: the watermark generator, limiter and aac encoder
+ * state is kept across segment boundaries, so each sample is only processed once
+ */
+int
+hls_add_batch (const vector<string>& infiles, const string& out_dir, const string& bits)
+{
+  vector<std::unique_ptr<PreparedSegment>> segments;
+  for (auto& infile : infiles)
+    {
+      PreparedSegment *segment = new PreparedSegment();
+      segments.emplace_back (segment);
 
-  if (missing_vars)
-    return 1;
+      Error err = segment->load (infile);
+      if (err)
+        {
+          error ("audiowmark: hls: %s\n", err.message());
+          return 1;
+        }
+    }
+  const PreparedSegment& first = *segments.front();
+  for (size_t i = 1; i < segments.size(); i++)
+    {
+      const PreparedSegment& prev = *segments[i - 1];
+      const PreparedSegment& segment = *segments[i];
+      if (segment.start_pos != prev.start_pos + prev.size)
+        {
+          error ("audiowmark: hls: segment %s does not directly follow segment %s\n", infiles[i].c_str(), infiles[i - 1].c_str());
+          return 1;
+        }
+      if (segment.in_stream->n_channels() != first.in_stream->n_channels() ||
+          segment.in_stream->sample_rate() != first.in_stream->sample_rate())
+        {
+          error ("audiowmark: hls: segment %s has a different audio format than segment %s\n", infiles[i].c_str(), infiles[0].c_str());
+          return 1;
+        }
+    }
 
+  SegmentSequenceInputStream in_stream;
+  for (size_t i = 0; i < segments.size(); i++)
+    {
+      const PreparedSegment& segment = *segments[i];
+      const bool   last   = i + 1 == segments.size();
+      const size_t skip   = i == 0 ? 0 : segment.prev_size;
+      const size_t frames = last ? AudioInputStream::N_FRAMES_UNKNOWN : segment.size + (i == 0 ? segment.prev_size : 0);
+
+      in_stream.add_part (segment.in_stream.get(), skip, frames);
+    }
+
+  int bit_rate = first.bit_rate;
   if (Params::hls_bit_rate)  // command line option overrides vars bit-rate
     bit_rate = Params::hls_bit_rate;
 
   HLSOutputStream out_stream (in_stream.n_channels(), in_stream.sample_rate(), in_stream.bit_depth());
-
   out_stream.set_bit_rate (bit_rate);
-  out_stream.set_channel_layout (channel_layout);
+  out_stream.set_channel_layout (first.channel_layout);
 
-  /* ffmpeg aac encode adds one frame of latency - it would be possible to compensate for this
-   * by setting shift = 1024, but it can also be done by adjusting the presentation timestamp
-   */
-  const size_t shift = 0;
-  const size_t cut_aac_frames = (prev_ctx + shift) / 1024;
-  const size_t delete_input_start = prev_size - prev_ctx;
-  const size_t keep_aac_frames = size / 1024;
+  vector<string> outfiles;
+  for (auto& infile : infiles)
+    {
+      const size_t slash = infile.rfind ('/');
+      outfiles.push_back (out_dir + "/" + (slash == string::npos ? infile : infile.substr (slash + 1)));
+    }
 
-  err = out_stream.open (outfile, cut_aac_frames, keep_aac_frames, pts_start, delete_input_start);
+  /* same parameters as hls_add for the first segment */
+  const size_t prev_ctx = min<size_t> (1024 * 3, first.prev_size);
+  Error err = out_stream.open (outfiles[0], first.cut_aac_frames(), first.size / 1024, first.pts_start, first.prev_size - prev_ctx);
   if (err)
     {
-      error ("audiowmark: error opening HLS output stream %s: %s\n", outfile.c_str(), err.message());
+      error ("audiowmark: error opening HLS output stream %s: %s\n", outfiles[0].c_str(), err.message());
       return 1;
     }
+  for (size_t i = 1; i < segments.size(); i++)
+    out_stream.add_segment (outfiles[i], segments[i]->cut_aac_frames(), segments[i]->size / 1024, segments[i]->pts_start);
 
-  int wm_rc = add_stream_watermark (&in_stream, &out_stream, bits, start_pos - prev_size);
+  int wm_rc = add_stream_watermark (&in_stream, &out_stream, bits, first.start_pos - first.prev_size);
   if (wm_rc != 0)
     return wm_rc;
 
   info ("AAC Bitrate:  %d\n", bit_rate);
+  info ("Segments:     %zd\n", segments.size());
   return 0;
 }
 
 Error
-bit_rate_from_m3u8 (const string& m3u8, const WavData& wav_data, int& bit_rate)
+load_audio_master (const string& filename, WavData& audio_master_data)
 {
-  FILE *tmp_file = tmpfile();
-  ScopedFile tmp_file_s (tmp_file);
-  string tmp_file_name = string_printf ("/dev/fd/%d", fileno (tmp_file));
-
-  if (!tmp_file)
-    return Error ("failed to create temp file");
+  FFInputStream in_stream;
 
-  Error err = run ({"ffmpeg", "-v", "error", "-y", "-i", m3u8, "-c:a", "copy", "-f", "adts", tmp_file_name});
+  Error err = in_stream.open (filename);
   if (err)
     return err;
 
-  struct stat stat_buf;
-  if (stat (tmp_file_name.c_str(), &stat_buf) != 0)
-    {
-      return Error (string_printf ("failed to stat temporary aac file: %s", strerror (errno)));
-    }
-  double seconds = double (wav_data.n_frames()) / wav_data.sample_rate();
-  bit_rate = stat_buf.st_size / seconds * 8;
-  return Error::Code::NONE;
+  return audio_master_data.load (&in_stream);
 }
 
+/* validate input segment and decode it to find its size (in frames) and the size of the aac data */
 Error
-load_audio_master (const string& filename, WavData& audio_master_data)
+probe_input_segment (const string& filename, map<string, string>& vars, size_t& size, size_t& aac_bytes)
 {
-  FILE *tmp_file = tmpfile();
-  ScopedFile tmp_file_s (tmp_file);
-  string tmp_file_name = string_printf ("/dev/fd/%d", fileno (tmp_file));
+  TSReader reader;
+
+  Error err = reader.load (filename);
+  if (err)
+    return Error (string_printf ("failed to read mpegts input file: %s", filename.c_str()));
 
-  if (!tmp_file)
-    return Error ("failed to create temp file");
+  if (reader.entries().size())
+    return Error (string_printf ("file appears to be already prepared: %s", filename.c_str()));
 
-  /* extract wav */
-  Error err = run ({"ffmpeg", "-v", "error", "-y", "-i", filename, "-f", "wav", tmp_file_name});
+  FFInputStream in_stream;
+  err = in_stream.open (filename, "mpegts");
   if (err)
-    return err;
+    return Error (string_printf ("failed to validate input file: %s: %s", filename.c_str(), err.message()));
+
+  if (in_stream.n_streams() != 1)
+    return Error (string_printf ("hls segment '%s' contains more than one stream", filename.c_str()));
+
+  if (in_stream.codec_name() != "aac")
+    return Error (string_printf ("hls segment '%s' is not encoded using AAC", filename.c_str()));
+
+  /* get segment parameters */
+  vars["channel_layout"] = in_stream.channel_layout();
+
+  /* get start pts */
+  double start_time;
+  if (!in_stream.start_time (start_time))
+    return Error (string_printf ("hls segment '%s' has no start_time entry", filename.c_str()));
+
+  vars["pts_start"] = string_printf ("%f", start_time);
 
-  err = audio_master_data.load (tmp_file_name);
+  WavData out;
+  err = out.load (&in_stream);
   if (err)
-    return err;
+    return Error (string_printf ("decoding %s failed: %s", filename.c_str(), err.message()));
+
+  size = out.n_frames();
 
+  /* size of the aac data as adts stream (which has a 7 byte header for each packet) */
+  aac_bytes = in_stream.packet_bytes() + 7 * in_stream.n_packets();
   return Error::Code::NONE;
 }
 
-Error
-probe_input_segment (const string& filename, map<string, string>& params)
-{
-  TSReader reader;
+/* write context and vars into the output segment */
+Error
+write_output_segment (const string& in_segment, const string& out_segment, const WavData& audio_master_data,
+                      size_t start_point, size_t end_point, size_t segment_size_with_ctx, const map<string, string>& vars)
+{
+  vector<float> out_signal (audio_master_data.samples().begin() + start_point * audio_master_data.n_channels(),
+                            audio_master_data.samples().begin() + end_point * audio_master_data.n_channels());
+
+  // append zeros if audio master is too short to provide segment with context
+  out_signal.resize (segment_size_with_ctx * audio_master_data.n_channels());
+
+  /* store everything we need in a mpegts file */
+  TSWriter writer;
+
+  const string context_format = vars.at ("context_format");
+  if (context_format == context_format_name (ContextFormat::FLAC))
+    {
+      vector<unsigned char> full_flac_mem;
+      SFOutputStream out_stream;
+      Error err = out_stream.open (&full_flac_mem,
+                                   audio_master_data.n_channels(), audio_master_data.sample_rate(), audio_master_data.bit_depth(),
+                                   SFOutputStream::OutFormat::FLAC);
+      if (err)
+        return Error (string_printf ("open context flac failed: %s", err.message()));
+
+      err = out_stream.write_frames (out_signal);
+      if (err)
+        return Error (string_printf ("write context flac failed: %s", err.message()));
+
+      err = out_stream.close();
+      if (err)
+        return Error (string_printf ("close context flac failed: %s", err.message()));
+
+      writer.append_data ("full.flac", std::move (full_flac_mem));
+    }
+  else
+    {
+      RawFormat raw_format;
+      Error err = context_raw_format (context_format, audio_master_data.n_channels(), audio_master_data.sample_rate(), raw_format);
+      if (err)
+        return err;
+
+      std::unique_ptr<RawConverter> raw_converter (RawConverter::create (raw_format, err));
+      if (err)
+        return err;
+
+      vector<unsigned char> full_raw_mem (out_signal.size() * raw_format.bit_depth() / 8);
+      raw_converter->to_raw (out_signal.data(), out_signal.size(), full_raw_mem.data());
+
+      writer.append_data ("full.raw", std::move (full_raw_mem));
+    }
+  writer.append_vars ("vars", vars);
+
+  return writer.process (in_segment, out_segment);
+}
+
+struct InputSegment
+{
+  string              name;
+  size_t              size = 0;
+  size_t              aac_bytes = 0;
+  map<string, string> vars;
+  Error               err;
+};
+
+/* the output of hls-prepare must not depend on the number of threads (one thread for testing) */
+static unsigned int
+prepare_threads()
+{
+  return Params::test_hls_sequential ? 1 : std::thread::hardware_concurrency();
+}
+
+/* decode input segments in parallel (the thread pool may already run other jobs) */
+static void
+probe_input_segments (ThreadPool& thread_pool, const string& in_dir, vector<InputSegment>& segments)
+{
+  for (auto& segment : segments)
+    {
+      thread_pool.add_job ([&in_dir, &segment] {
+        segment.err = probe_input_segment (in_dir + "/" + segment.name, segment.vars, segment.size, segment.aac_bytes);
+      });
+    }
+}
+
+/* create context for each segment and write output segments in parallel
+ *
+ * audio_master_data contains the audio master starting at frame master_pos; start_pos is the
+ * position of the first segment in the audio master, and is updated to the end of the last segment
+ */
+static int
+write_output_segments (ThreadPool& thread_pool, const string& in_dir, const string& out_dir, vector<InputSegment>& segments,
+                       const WavData& audio_master_data, size_t master_pos, size_t& start_pos, int bit_rate)
+{
+  for (auto& segment : segments)
+    {
+      if ((segment.size % 1024) != 0)
+        {
+          error ("audiowmark: hls input segments need 1024-sample alignment (due to AAC)\n");
+          return 1;
+        }
+    }
+  for (auto& segment : segments)
+    {
+      /* store 3 seconds of the context before this segment and after this segment (if available) */
+      const size_t ctx_3sec = 3 * audio_master_data.sample_rate();
+      const size_t prev_size = min<size_t> (start_pos, ctx_3sec);
+      const size_t segment_size_with_ctx = prev_size + segment.size + ctx_3sec;
+
+      segment.vars["start_pos"] = string_printf ("%zd", start_pos);
+      segment.vars["size"] = string_printf ("%zd", segment.size);
+      segment.vars["prev_size"] = string_printf ("%zd", prev_size);
+      segment.vars["bit_rate"] = string_printf ("%d", bit_rate);
+      segment.vars["context_format"] = context_format_name (Params::hls_context_format);
+      segment.vars["context_channels"] = string_printf ("%d", audio_master_data.n_channels());
+      segment.vars["context_sample_rate"] = string_printf ("%d", audio_master_data.sample_rate());
+
+      /* write audio segment with context */
+      assert (start_pos - prev_size >= master_pos);
+      const size_t start_point = min (start_pos - prev_size - master_pos, audio_master_data.n_frames());
+      const size_t end_point = min (start_point + segment_size_with_ctx, audio_master_data.n_frames());
 
-  Error err = reader.load (filename);
-  if (err)
-    {
-      error ("audiowmark: hls: failed to read mpegts input file: %s\n", filename.c_str());
-      return err;
-    }
+      thread_pool.add_job ([&, start_point, end_point, segment_size_with_ctx] {
+        segment.err = write_output_segment (in_dir + "/" + segment.name, out_dir + "/" + segment.name, audio_master_data,
+                                            start_point, end_point, segment_size_with_ctx, segment.vars);
+      });
 
-  if (reader.entries().size())
-    {
-      error ("audiowmark: hls: file appears to be already prepared: %s\n", filename.c_str());
-      return Error ("input for hls-prepare must not contain context");
+      /* start position for the next segment */
+      start_pos += segment.size;
     }
+  thread_pool.wait_all();
 
-  vector<string> format_out;
-  err = run ({"ffprobe", "-v", "error", "-print_format", "compact", "-show_streams", filename}, &format_out);
-  if (err)
-    {
-      error ("audiowmark: hls: failed to validate input file: %s\n", filename.c_str());
-      return err;
-    }
-  for (auto o : format_out)
+  for (auto& segment : segments)
     {
-      /* parse assignments stream|index=0|codec_name=aac|... */
-      string key, value;
-      bool in_key = true;
-      for (char c : '|' + o + '|')
+      if (segment.err)
         {
-          if (c == '=')
-            {
-              in_key = false;
-            }
-          else if (c == '|')
-            {
-              params[key] = value;
-              in_key = true;
-              key = "";
-              value = "";
-            }
-          else
-            {
-              if (in_key)
-                key += c;
-              else
-                value += c;
-            }
+          error ("audiowmark: processing hls segment %s failed: %s\n", segment.name.c_str(), segment.err.message());
+          return 1;
         }
     }
-  return Error::Code::NONE;
+  return 0;
 }
 
 int
@@ -420,21 +1025,7 @@ hls_prepare (const string& in_dir, const string& out_dir, const string& filename
       return 1;
     }
 
-  WavData audio_master_data;
-  Error err = load_audio_master (audio_master, audio_master_data);
-  if (err)
-    {
-      error ("audiowmark: failed to load audio master: %s\n", audio_master.c_str());
-      return 1;
-    }
-
-  struct Segment
-  {
-    string              name;
-    size_t              size;
-    map<string, string> vars;
-  };
-  vector<Segment> segments;
+  vector<InputSegment> segments;
   char buffer[1024];
   int line = 1;
   const regex blank_re (R"(\s*(#.*)?)");
@@ -456,62 +1047,48 @@ hls_prepare (const string& in_dir, const string& out_dir, const string& filename
       else
         {
           fprintf (out_file, "%s\n", s.c_str());
-          Segment segment;
+          InputSegment segment;
           segment.name = s;
           segments.push_back (segment);
         }
       line++;
     }
-  for (auto& segment : segments)
-    {
-      map<string, string> params;
-      string segname = in_dir + "/" + segment.name;
 
-      Error err = probe_input_segment (segname, params);
-      if (err)
-        {
-          error ("audiowmark: hls: %s\n", err.message());
-          return 1;
-        }
-      /* validate input segment */
-      if (atoi (params["index"].c_str()) != 0)
-        {
-          error ("audiowmark: hls segment '%s' contains more than one stream\n", segname.c_str());
-          return 1;
-        }
-      if (params["codec_name"] != "aac")
-        {
-          error ("audiowmark: hls segment '%s' is not encoded using AAC\n", segname.c_str());
-          return 1;
-        }
+  /* decode audio master and input segments in parallel */
+  ThreadPool thread_pool (prepare_threads());
 
-      /* get segment parameters */
-      if (params["channel_layout"].empty())
-        {
-          error ("audiowmark: hls segment '%s' has no channel_layout entry\n", segname.c_str());
-          return 1;
-        }
-      segment.vars["channel_layout"] = params["channel_layout"];
+  WavData audio_master_data;
+  Error err;
+  thread_pool.add_job ([&] {
+    err = load_audio_master (audio_master, audio_master_data);
+  });
+  probe_input_segments (thread_pool, in_dir, segments);
+  thread_pool.wait_all();
 
-      /* get start pts */
-      if (params["start_time"].empty())
+  if (err)
+    {
+      error ("audiowmark: failed to load audio master: %s\n", audio_master.c_str());
+      return 1;
+    }
+  for (auto& segment : segments)
+    {
+      if (segment.err)
         {
-          error ("audiowmark: hls segment '%s' has no start_time entry\n", segname.c_str());
+          error ("audiowmark: hls: %s\n", segment.err.message());
           return 1;
         }
-      segment.vars["pts_start"] = params["start_time"];
     }
 
   /* find bitrate for AAC encoder */
   int bit_rate = 0;
   if (!Params::hls_bit_rate)
     {
-      err = bit_rate_from_m3u8 (in_dir + "/" + filename, audio_master_data, bit_rate);
-      if (err)
-        {
-          error ("audiowmark: bit-rate detection failed: %s\n", err.message());
-          return 1;
-         }
+      size_t aac_bytes = 0;
+      for (auto& segment : segments)
+        aac_bytes += segment.aac_bytes;
+
+      double seconds = double (audio_master_data.n_frames()) / audio_master_data.sample_rate();
+      bit_rate = aac_bytes / seconds * 8;
       info ("AAC Bitrate:  %d (detected)\n", bit_rate);
     }
   else
@@ -521,93 +1098,398 @@ hls_prepare (const string& in_dir, const string& out_dir, const string& filename
     }
 
   info ("Segments:     %zd\n", segments.size());
-  size_t start_pos = 0;
   for (auto& segment : segments)
     {
-      WavData out;
-      Error err = ff_decode (in_dir + "/" + segment.name, out);
-      if (err)
+      string out_segment = out_dir + "/" + segment.name;
+      if (file_exists (out_segment))
         {
-          error ("audiowmark: hls: ff_decode failed: %s\n", err.message());
+          error ("audiowmark: output file already exists: %s\n", out_segment.c_str());
           return 1;
         }
-      segment.size = out.n_values() / out.n_channels();
+    }
 
-      if ((segment.size % 1024) != 0)
+  size_t start_pos = 0;
+  int rc = write_output_segments (thread_pool, in_dir, out_dir, segments, audio_master_data, 0, start_pos, bit_rate);
+  if (rc != 0)
+    return rc;
+
+  int orig_seconds = start_pos / audio_master_data.sample_rate();
+  info ("Time:         %d:%02d\n", orig_seconds / 60, orig_seconds % 60);
+  return 0;
+}
+/* read the part of the audio master that is needed for the segments [start_pos, start_pos + size) with context
+ *
+ * wav files are memory mapped, so the time needed does not depend on the position of the segments;
+ * this also works for wav files that are still being written, other formats need to be seekable
+ *
+ * the audio master must contain the context after the last segment: otherwise the segments are
+ * not ready yet (the audio master is still growing), and an error is returned; if the stream is
+ * finished, the audio master is complete, and whatever is missing at the end is padded later
+ * (by write_output_segment), like hls_prepare does it
+ */
+static Error
+load_audio_master_window (const string& filename, size_t start_pos, size_t size, bool finished, size_t& master_pos,
+                          WavData& audio_master_data)
+{
+  /* 3 seconds of context before the first segment and after the last segment */
+  auto window = [&] (int sample_rate, size_t& end) {
+    const size_t ctx_3sec = 3 * sample_rate;
+    master_pos = start_pos - min (start_pos, ctx_3sec);
+    end = start_pos + size + ctx_3sec;
+  };
+  auto too_short = [&] (size_t n_frames, size_t end) {
+    return Error (string_printf ("audio master %s is too short: segments with context need %zd frames, audio master has %zd frames",
+                                 filename.c_str(), end, n_frames));
+  };
+  MMapWavFile wav_file;
+
+  Error err = wav_file.open (filename, false);
+  if (!err)
+    {
+      size_t end;
+      window (wav_file.sample_rate(), end);
+      if (wav_file.n_frames() < end)
         {
-          error ("audiowmark: hls input segments need 1024-sample alignment (due to AAC)\n");
-          return 1;
+          if (!finished)
+            return too_short (wav_file.n_frames(), end);
+
+          end = max (master_pos, wav_file.n_frames());
         }
 
-      /* store 3 seconds of the context before this segment and after this segment (if available) */
-      const size_t ctx_3sec = 3 * out.sample_rate();
-      const size_t prev_size = min<size_t> (start_pos, ctx_3sec);
-      const size_t segment_size_with_ctx = prev_size + segment.size + ctx_3sec;
+      vector<float> samples ((end - master_pos) * wav_file.n_channels());
+      wav_file.read_frames (master_pos, end - master_pos, samples.data());
 
-      segment.vars["start_pos"] = string_printf ("%zd", start_pos);
-      segment.vars["size"] = string_printf ("%zd", segment.size);
-      segment.vars["prev_size"] = string_printf ("%zd", prev_size);
-      segment.vars["bit_rate"] = string_printf ("%d", bit_rate);
+      audio_master_data = WavData (samples, wav_file.n_channels(), wav_file.sample_rate(), wav_file.bit_depth());
+      return Error::Code::NONE;
+    }
 
-      /* write audio segment with context */
-      const size_t start_point = min (start_pos - prev_size, audio_master_data.n_frames());
-      const size_t end_point = min (start_point + segment_size_with_ctx, audio_master_data.n_frames());
+  /* other formats: decoding from the start for each run would get slower and slower, so we need to seek */
+  SFInputStream in_stream;
+  err = in_stream.open (filename);
+  if (err)
+    return Error (string_printf ("audio master %s must be a wav file or another format that can be seeked (%s)",
+                                 filename.c_str(), err.message()));
+
+  size_t end;
+  window (in_stream.sample_rate(), end);
+  if (in_stream.n_frames() == AudioInputStream::N_FRAMES_UNKNOWN)
+    return too_short (0, end);
+  if (in_stream.n_frames() < end)
+    {
+      if (!finished)
+        return too_short (in_stream.n_frames(), end);
 
-      vector<float> out_signal (audio_master_data.samples().begin() + start_point * audio_master_data.n_channels(),
-                                audio_master_data.samples().begin() + end_point * audio_master_data.n_channels());
+      end = max (master_pos, in_stream.n_frames());
+    }
 
-      // append zeros if audio master is too short to provide segment with context
-      out_signal.resize (segment_size_with_ctx * audio_master_data.n_channels());
+  err = in_stream.seek (master_pos);
+  if (err)
+    return err;
 
-      vector<unsigned char> full_flac_mem;
-      SFOutputStream out_stream;
-      err = out_stream.open (&full_flac_mem,
-                             audio_master_data.n_channels(), audio_master_data.sample_rate(), audio_master_data.bit_depth(),
-                             SFOutputStream::OutFormat::FLAC);
+  const int n_channels = in_stream.n_channels();
+  vector<float> samples ((end - master_pos) * n_channels);
+  size_t frames_read = 0;
+  while (frames_read < end - master_pos)
+    {
+      size_t n;
+      err = in_stream.read_frames (&samples[frames_read * n_channels], end - master_pos - frames_read, n);
+      if (err)
+        return err;
+      if (!n)
+        return too_short (master_pos + frames_read, end);
+
+      frames_read += n;
+    }
+  audio_master_data = WavData (samples, n_channels, in_stream.sample_rate(), in_stream.bit_depth());
+  return Error::Code::NONE;
+}
+
+/* state of hls_prepare_incremental, stored as "key=value" lines */
+static Error
+load_prepare_state (const string& filename, map<string, string>& state)
+{
+  vector<string> lines;
+  Error err = read_playlist (filename, lines);
+  if (err)
+    return Error (string_printf ("error reading state file %s", filename.c_str()));
+
+  for (auto& s : lines)
+    {
+      size_t eq = s.find ('=');
+      if (eq != string::npos)
+        state[s.substr (0, eq)] = s.substr (eq + 1);
+    }
+  for (auto key : { "last_segment", "start_pos", "bit_rate", "sample_rate", "channels" })
+    {
+      if (!state.count (key))
+        return Error (string_printf ("state file %s: missing entry %s", filename.c_str(), key));
+    }
+  return Error::Code::NONE;
+}
+
+/* write file under a temporary name and rename it, so readers never see a partially written file */
+static Error
+write_file_atomic (const string& filename, const vector<string>& lines)
+{
+  const string tmp_name = filename + ".tmp";
+  FILE *file = fopen (tmp_name.c_str(), "w");
+  if (!file)
+    return Error (string_printf ("error opening output file %s", tmp_name.c_str()));
+
+  for (auto& s : lines)
+    fprintf (file, "%s\n", s.c_str());
+
+  bool write_error = ferror (file);
+  if (fclose (file) != 0 || write_error)
+    return Error (string_printf ("error writing output file %s", tmp_name.c_str()));
+
+  if (rename (tmp_name.c_str(), filename.c_str()) != 0)
+    return Error (string_printf ("error renaming %s to %s: %s", tmp_name.c_str(), filename.c_str(), strerror (errno)));
+
+  return Error::Code::NONE;
+}
+
+/* hls-prepare for live playlists
+ *
+ * each run only prepares the segments that were appended to the input playlist since the last run;
+ * the position in the audio master and the bit rate are kept in a state file in the output directory,
+ * and only the part of the audio master that is needed for the new segments is loaded
+ */
+int
+hls_prepare_incremental (const string& in_dir, const string& out_dir, const string& filename, const string& audio_master)
+{
+  vector<string> lines;
+  Error err = read_playlist (in_dir + "/" + filename, lines);
+  if (err)
+    {
+      error ("audiowmark: %s\n", err.message());
+      return 1;
+    }
+
+  int mkret = mkdir (out_dir.c_str(), 0755);
+  if (mkret == -1 && errno != EEXIST)
+    {
+      error ("audiowmark: unable to create directory %s: %s\n", out_dir.c_str(), strerror (errno));
+      return 1;
+    }
+
+  const string out_name = out_dir + "/" + filename;
+  const string state_name = out_name + ".state";
+
+  map<string, string> state;
+  if (file_exists (state_name))
+    {
+      err = load_prepare_state (state_name, state);
       if (err)
         {
-          error ("audiowmark: hls: open context flac failed: %s\n", err.message());
+          error ("audiowmark: %s\n", err.message());
           return 1;
         }
+    }
+  else if (file_exists (out_name))
+    {
+      error ("audiowmark: output file already exists: %s\n", out_name.c_str());
+      return 1;
+    }
 
-      err = out_stream.write_frames (out_signal);
-      if (err)
+  /* segments after the last prepared segment are new (older entries may have been removed from the playlist) */
+  vector<InputSegment> segments;
+  bool found_last = state.empty();
+  bool finished = false;
+  for (auto& s : lines)
+    {
+      if (s == "#EXT-X-ENDLIST")
+        finished = true;
+
+      if (!is_segment_line (s))
+        continue;
+
+      if (found_last)
+        {
+          InputSegment segment;
+          segment.name = s;
+          segments.push_back (segment);
+        }
+      else if (s == state["last_segment"])
+        {
+          found_last = true;
+        }
+    }
+  if (!found_last)
+    {
+      error ("audiowmark: last prepared segment %s is no longer in playlist %s\n", state["last_segment"].c_str(), filename.c_str());
+      return 1;
+    }
+
+  ThreadPool thread_pool (prepare_threads());
+  probe_input_segments (thread_pool, in_dir, segments);
+  thread_pool.wait_all();
+
+  for (auto& segment : segments)
+    {
+      if (segment.err)
         {
-          error ("audiowmark: hls: write context flac failed: %s\n", err.message());
+          error ("audiowmark: hls: %s\n", segment.err.message());
           return 1;
         }
+    }
 
-      err = out_stream.close();
+  if (segments.empty())
+    {
+      info ("Segments:     0\n");
+
+      /* nothing prepared yet: the output playlist is written once the first segment is available */
+      if (state.empty())
+        return 0;
+    }
+  else
+    {
+      size_t start_pos = state.empty() ? 0 : atoll (state["start_pos"].c_str());
+      int bit_rate = state.empty() ? Params::hls_bit_rate : atoi (state["bit_rate"].c_str());
+
+      size_t size = 0;
+      for (auto& segment : segments)
+        size += segment.size;
+
+      WavData audio_master_data;
+      size_t master_pos;
+      err = load_audio_master_window (audio_master, start_pos, size, finished, master_pos, audio_master_data);
       if (err)
         {
-          error ("audiowmark: hls: close context flac failed: %s\n", err.message());
+          error ("audiowmark: failed to load audio master: %s\n", err.message());
+          return 1;
+        }
+      if (!state.empty() && (atoi (state["sample_rate"].c_str()) != audio_master_data.sample_rate() ||
+                             atoi (state["channels"].c_str()) != audio_master_data.n_channels()))
+        {
+          error ("audiowmark: audio master format does not match the format used for previous segments\n");
           return 1;
         }
 
-      /* store everything we need in a mpegts file */
-      TSWriter writer;
+      /* find bitrate for AAC encoder (only on the first run, all segments use the same bit rate) */
+      if (!bit_rate)
+        {
+          size_t aac_bytes = 0;
+          for (auto& segment : segments)
+            aac_bytes += segment.aac_bytes;
+
+          double seconds = double (size) / audio_master_data.sample_rate();
+          bit_rate = aac_bytes / seconds * 8;
+          info ("AAC Bitrate:  %d (detected)\n", bit_rate);
+        }
+      else
+        {
+          info ("AAC Bitrate:  %d\n", bit_rate);
+        }
+
+      info ("Segments:     %zd\n", segments.size());
+      int rc = write_output_segments (thread_pool, in_dir, out_dir, segments, audio_master_data, master_pos, start_pos, bit_rate);
+      if (rc != 0)
+        return rc;
 
-      writer.append_data ("full.flac", full_flac_mem);
-      writer.append_vars ("vars", segment.vars);
+      state["last_segment"] = segments.back().name;
+      state["start_pos"] = string_printf ("%zd", start_pos);
+      state["bit_rate"] = string_printf ("%d", bit_rate);
+      state["sample_rate"] = string_printf ("%d", audio_master_data.sample_rate());
+      state["channels"] = string_printf ("%d", audio_master_data.n_channels());
 
-      string out_segment = out_dir + "/" + segment.name;
-      if (file_exists (out_segment))
+      vector<string> state_lines;
+      for (auto& kv : state)
+        state_lines.push_back (kv.first + "=" + kv.second);
+
+      /* the state is written before the playlist, so the playlist never refers to segments that would be prepared again */
+      err = write_file_atomic (state_name, state_lines);
+      if (err)
         {
-          error ("audiowmark: output file already exists: %s\n", out_segment.c_str());
+          error ("audiowmark: %s\n", err.message());
           return 1;
         }
-      err = writer.process (in_dir + "/" + segment.name, out_segment);
-      if (err)
+    }
+
+  /* playlist with all prepared segments */
+  err = write_file_atomic (out_name, lines);
+  if (err)
+    {
+      error ("audiowmark: %s\n", err.message());
+      return 1;
+    }
+  return 0;
+}
+
+/* write two variants of each prepared segment: a/ with all message bits 0 and b/ with all message bits 1 */
+int
+hls_prepare_ab (const string& in_dir, const string& out_dir, const string& filename)
+{
+  vector<string> lines;
+  Error err = read_playlist (in_dir + "/" + filename, lines);
+  if (err)
+    {
+      error ("audiowmark: %s\n", err.message());
+      return 1;
+    }
+
+  const string a_dir = out_dir + "/a";
+  const string b_dir = out_dir + "/b";
+  for (auto dir : { out_dir, a_dir, b_dir })
+    {
+      int mkret = mkdir (dir.c_str(), 0755);
+      if (mkret == -1 && errno != EEXIST)
         {
-          error ("audiowmark: processing hls segment %s failed: %s\n", segment.name.c_str(), err.message());
+          error ("audiowmark: unable to create directory %s: %s\n", dir.c_str(), strerror (errno));
           return 1;
         }
+    }
 
-      /* start position for the next segment */
-      start_pos += segment.size;
+  vector<string> segments;
+  for (auto& s : lines)
+    {
+      if (is_segment_line (s))
+        segments.push_back (s);
     }
-  int orig_seconds = start_pos / audio_master_data.sample_rate();
-  info ("Time:         %d:%02d\n", orig_seconds / 60, orig_seconds % 60);
+  for (auto& segment : segments)
+    {
+      for (auto dir : { a_dir, b_dir })
+        {
+          if (file_exists (dir + "/" + segment))
+            {
+              error ("audiowmark: output file already exists: %s\n", (dir + "/" + segment).c_str());
+              return 1;
+            }
+        }
+    }
+
+  /* the playlist is used as template for the per viewer playlists (hls-ab-playlist) */
+  string out_name = out_dir + "/" + filename;
+  if (file_exists (out_name))
+    {
+      error ("audiowmark: output file already exists: %s\n", out_name.c_str());
+      return 1;
+    }
+  FILE *out_file = fopen (out_name.c_str(), "w");
+  ScopedFile out_file_s (out_file);
+
+  if (!out_file)
+    {
+      error ("audiowmark: error opening output playlist %s\n", out_name.c_str());
+      return 1;
+    }
+  for (auto& s : lines)
+    fprintf (out_file, "%s\n", s.c_str());
+
+  const string a_bits = bit_vec_to_str (vector<int> (Params::payload_size, 0));
+  const string b_bits = bit_vec_to_str (vector<int> (Params::payload_size, 1));
+
+  /* hls_add decodes and analyzes each segment once, and encodes both variants in parallel */
+  for (auto& segment : segments)
+    {
+      int rc = hls_add (in_dir + "/" + segment, { a_dir + "/" + segment, b_dir + "/" + segment }, { a_bits, b_bits });
+      if (rc != 0)
+        {
+          error ("audiowmark: processing hls segment %s failed\n", segment.c_str());
+          return rc;
+        }
+    }
+  info ("Segments:     %zd\n", segments.size());
   return 0;
 }
 #endif
@@ -19,10 +19,21 @@
 #define AUDIOWMARK_HLS_HH
 
 #include <string>
+#include <vector>
 
 int hls_add (const std::string& infile, const std::string& outfile, const std::string& bits);
+int hls_add (const std::string& infile, const std::vector<std::string>& outfiles, const std::vector<std::string>& bits);
+int hls_add_batch (const std::vector<std::string>& infiles, const std::string& out_dir, const std::string& bits);
 int hls_prepare (const std::string& in_dir, const std::string& out_dir, const std::string& filename, const std::string& audio_master);
+int hls_prepare_incremental (const std::string& in_dir, const std::string& out_dir, const std::string& filename, const std::string& audio_master);
+int hls_prepare_ab (const std::string& in_dir, const std::string& out_dir, const std::string& filename);
+int hls_ab_playlist (const std::string& in_playlist, const std::string& out_playlist, const std::string& bits);
+int hls_ab_get (const std::string& playlist, const std::string& infile, const std::string& bits);
 
 Error ff_decode (const std::string& filename, WavData& out_wav_data);
 
+bool  hls_is_input (const std::string& filename);
+Error hls_input_segments (const std::string& filename, std::vector<std::string>& segments);
+Error hls_load_input (const std::string& filename, WavData& wav_data);
+
 #endif /* AUDIOWMARK_MPEGTS_HH */
@@ -0,0 +1,648 @@
+/*
+ * Copyright (C) 2018-2020 Stefan Westerfeld
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "inplacestream.hh"
+#include "wmcommon.hh"
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <assert.h>
+
+using std::string;
+using std::vector;
+using std::min;
+
+static const char journal_magic[] = "AWMJRNL1";
+static const char record_magic[]  = "PAGE";
+
+namespace {
+
+/* FNV-1a hash, used to detect incomplete (torn) journal records */
+class Checksum
+{
+  uint64_t m_hash = 0xcbf29ce484222325ULL;
+public:
+  void
+  add (const unsigned char *data, size_t len)
+  {
+    for (size_t i = 0; i < len; i++)
+      {
+        m_hash ^= data[i];
+        m_hash *= 0x100000001b3ULL;
+      }
+  }
+  uint64_t
+  hash() const
+  {
+    return m_hash;
+  }
+};
+
+class JournalWriter
+{
+  vector<unsigned char> m_bytes;
+public:
+  void
+  append (const unsigned char *data, size_t len)
+  {
+    m_bytes.insert (m_bytes.end(), data, data + len);
+  }
+  void
+  append_str (const string& str)
+  {
+    append_u64 (str.size());
+    append ((const unsigned char *) str.data(), str.size());
+  }
+  void
+  append_u64 (uint64_t u)
+  {
+    for (int i = 0; i < 8; i++)
+      m_bytes.push_back (u >> (i * 8));
+  }
+  const vector<unsigned char>&
+  bytes() const
+  {
+    return m_bytes;
+  }
+};
+
+class JournalReader
+{
+  const vector<unsigned char>& m_bytes;
+  size_t                       m_pos = 0;
+public:
+  JournalReader (const vector<unsigned char>& bytes) :
+    m_bytes (bytes)
+  {
+  }
+  bool
+  read (unsigned char *data, size_t len)
+  {
+    if (len > m_bytes.size() - m_pos)
+      return false;
+    memcpy (data, &m_bytes[m_pos], len);
+    m_pos += len;
+    return true;
+  }
+  bool
+  read_u64 (uint64_t& u)
+  {
+    unsigned char b[8];
+    if (!read (b, 8))
+      return false;
+    u = 0;
+    for (int i = 0; i < 8; i++)
+      u |= uint64_t (b[i]) << (i * 8);
+    return true;
+  }
+  bool
+  read_bytes (vector<unsigned char>& data)
+  {
+    uint64_t len;
+    if (!read_u64 (len) || len > m_bytes.size() - m_pos)
+      return false;
+    data.assign (m_bytes.begin() + m_pos, m_bytes.begin() + m_pos + len);
+    m_pos += len;
+    return true;
+  }
+  size_t
+  pos() const
+  {
+    return m_pos;
+  }
+  bool
+  at_end() const
+  {
+    return m_pos == m_bytes.size();
+  }
+};
+
+}
+
+static void
+encode_u64 (unsigned char *bytes, uint64_t u)
+{
+  for (int i = 0; i < 8; i++)
+    bytes[i] = u >> (i * 8);
+}
+
+/* make sure that a rename/unlink in the directory of filename is on disk */
+static Error
+sync_dir (const string& filename)
+{
+  string dirname = ".";
+  size_t slash = filename.rfind ('/');
+  if (slash != string::npos)
+    dirname = slash ? filename.substr (0, slash) : "/";
+
+  int fd = open (dirname.c_str(), O_RDONLY | O_DIRECTORY);
+  if (fd < 0)
+    return Error (string_printf ("open directory '%s' failed: %s", dirname.c_str(), strerror (errno)));
+
+  int rc = fsync (fd);
+  close (fd);
+  if (rc < 0)
+    return Error (string_printf ("sync directory '%s' failed: %s", dirname.c_str(), strerror (errno)));
+
+  return Error::Code::NONE;
+}
+
+static Error
+read_file (const string& filename, vector<unsigned char>& bytes)
+{
+  FILE *file = fopen (filename.c_str(), "rb");
+  if (!file)
+    return Error (strerror (errno));
+
+  unsigned char buffer[64 * 1024];
+  size_t        n;
+
+  bytes.clear();
+  while ((n = fread (buffer, 1, sizeof (buffer), file)) > 0)
+    bytes.insert (bytes.end(), buffer, buffer + n);
+
+  bool read_error = ferror (file);
+  fclose (file);
+  if (read_error)
+    return Error ("read failed");
+
+  return Error::Code::NONE;
+}
+
+InPlaceJournal::InPlaceJournal (MMapWavFile *wav_file, const string& wav_filename, const string& settings) :
+  m_wav_file (wav_file),
+  m_filename (wav_filename + ".journal"),
+  m_settings (settings)
+{
+}
+
+InPlaceJournal::~InPlaceJournal()
+{
+  if (m_file)
+    fclose (m_file);
+}
+
+bool
+InPlaceJournal::exists() const
+{
+  return access (m_filename.c_str(), F_OK) == 0;
+}
+
+/* header with the file layout (so we don't apply the journal to a different file) and settings */
+static vector<unsigned char>
+journal_header (const MMapWavFile *wav_file, const string& settings)
+{
+  JournalWriter writer;
+  writer.append ((const unsigned char *) journal_magic, 8);
+  writer.append_u64 (wav_file->data_offset());
+  writer.append_u64 (wav_file->data_size());
+  writer.append_u64 (wav_file->n_channels());
+  writer.append_u64 (wav_file->sample_rate());
+  writer.append_u64 (wav_file->bit_depth());
+  writer.append_str (settings);
+  return writer.bytes();
+}
+
+Error
+InPlaceJournal::write_file (const string& filename, size_t checkpoint, const vector<unsigned char>& preroll)
+{
+  JournalWriter writer;
+  auto header = journal_header (m_wav_file, m_settings);
+  writer.append (header.data(), header.size());
+  writer.append_u64 (checkpoint);
+  writer.append_u64 (preroll.size());
+  writer.append (preroll.data(), preroll.size());
+
+  Checksum checksum;
+  checksum.add (writer.bytes().data(), writer.bytes().size());
+  writer.append_u64 (checksum.hash());
+
+  FILE *file = fopen (filename.c_str(), "wb");
+  if (!file)
+    return Error (string_printf ("open journal '%s' failed: %s", filename.c_str(), strerror (errno)));
+
+  const auto& bytes = writer.bytes();
+  bool ok = fwrite (bytes.data(), 1, bytes.size(), file) == bytes.size();
+  ok = ok && fflush (file) == 0;
+  ok = ok && fsync (fileno (file)) == 0;
+  ok = (fclose (file) == 0) && ok;
+  if (!ok)
+    return Error (string_printf ("write journal '%s' failed: %s", filename.c_str(), strerror (errno)));
+
+  return Error::Code::NONE;
+}
+
+/* start a new journal (atomically replaces the old journal, if any) */
+Error
+InPlaceJournal::start (size_t checkpoint, const vector<unsigned char>& preroll)
+{
+  if (m_file)
+    {
+      fclose (m_file);
+      m_file = nullptr;
+    }
+  const string tmp_filename = m_filename + ".tmp";
+  Error err = write_file (tmp_filename, checkpoint, preroll);
+  if (err)
+    return err;
+
+  if (rename (tmp_filename.c_str(), m_filename.c_str()) < 0)
+    return Error (string_printf ("rename journal '%s' failed: %s", tmp_filename.c_str(), strerror (errno)));
+
+  err = sync_dir (m_filename);
+  if (err)
+    return err;
+
+  m_file = fopen (m_filename.c_str(), "ab");
+  if (!m_file)
+    return Error (string_printf ("open journal '%s' failed: %s", m_filename.c_str(), strerror (errno)));
+
+  return Error::Code::NONE;
+}
+
+/* save original data before it is modified; the caller must sync() before modifying the data */
+Error
+InPlaceJournal::append (size_t data_pos, const unsigned char *orig, size_t len)
+{
+  assert (m_file);
+
+  unsigned char record_header[4 + 8 + 8];
+  memcpy (record_header, record_magic, 4);
+  encode_u64 (record_header + 4, data_pos);
+  encode_u64 (record_header + 12, len);
+
+  Checksum checksum;
+  checksum.add (record_header, sizeof (record_header));
+  checksum.add (orig, len);
+
+  unsigned char record_checksum[8];
+  encode_u64 (record_checksum, checksum.hash());
+
+  fwrite (record_header, 1, sizeof (record_header), m_file);
+  fwrite (orig, 1, len, m_file);
+  fwrite (record_checksum, 1, sizeof (record_checksum), m_file);
+  if (ferror (m_file))
+    return Error (string_printf ("write journal '%s' failed", m_filename.c_str()));
+
+  return Error::Code::NONE;
+}
+
+Error
+InPlaceJournal::sync()
+{
+  assert (m_file);
+
+  if (fflush (m_file) != 0 || fdatasync (fileno (m_file)) < 0)
+    return Error (string_printf ("sync journal '%s' failed: %s", m_filename.c_str(), strerror (errno)));
+
+  return Error::Code::NONE;
+}
+
+/* restore the original data of all pages modified after the checkpoint
+ *
+ * the last record may be incomplete if the process was killed while writing the journal;
+ * since the data is only modified after the records have been synced, such a record
+ * can be ignored
+ */
+Error
+InPlaceJournal::recover (size_t& checkpoint, vector<unsigned char>& preroll)
+{
+  vector<unsigned char> bytes;
+  Error err = read_file (m_filename, bytes);
+  if (err)
+    return Error (string_printf ("read journal '%s' failed: %s", m_filename.c_str(), err.message()));
+
+  const auto header = journal_header (m_wav_file, m_settings);
+  if (bytes.size() < header.size() || memcmp (bytes.data(), header.data(), 8) != 0)
+    return Error (string_printf ("'%s' is not a journal file", m_filename.c_str()));
+  if (memcmp (bytes.data(), header.data(), header.size()) != 0)
+    return Error (string_printf ("journal '%s' was created for a different file or with different settings "
+                                 "(use the same message and options to resume)", m_filename.c_str()));
+
+  JournalReader reader (bytes);
+  vector<unsigned char> header_bytes (header.size());
+  uint64_t checkpoint64, hash;
+
+  reader.read (header_bytes.data(), header_bytes.size());
+  if (!reader.read_u64 (checkpoint64) || !reader.read_bytes (preroll))
+    return Error (string_printf ("journal '%s' is truncated", m_filename.c_str()));
+
+  Checksum checksum;
+  checksum.add (bytes.data(), reader.pos());
+  if (!reader.read_u64 (hash) || hash != checksum.hash() || checkpoint64 > m_wav_file->n_frames())
+    return Error (string_printf ("journal '%s' is corrupt", m_filename.c_str()));
+
+  checkpoint = checkpoint64;
+
+  unsigned char *data = m_wav_file->data();
+  size_t restore_start = m_wav_file->data_size();
+  size_t restore_end = 0;
+  while (!reader.at_end())
+    {
+      unsigned char record_header[4 + 8 + 8];
+      vector<unsigned char> orig;
+
+      if (!reader.read (record_header, sizeof (record_header)) || memcmp (record_header, record_magic, 4) != 0)
+        break;
+
+      uint64_t data_pos = 0, len = 0;
+      for (int i = 7; i >= 0; i--)
+        {
+          data_pos = (data_pos << 8) | record_header[4 + i];
+          len      = (len << 8) | record_header[12 + i];
+        }
+      if (len > bytes.size())
+        break;
+
+      orig.resize (len);
+      if (!reader.read (orig.data(), len) || !reader.read_u64 (hash))
+        break;
+
+      Checksum record_checksum;
+      record_checksum.add (record_header, sizeof (record_header));
+      record_checksum.add (orig.data(), len);
+      if (hash != record_checksum.hash())
+        break;
+
+      if (data_pos > m_wav_file->data_size() || len > m_wav_file->data_size() - data_pos)
+        return Error (string_printf ("journal '%s' is corrupt", m_filename.c_str()));
+
+      memcpy (data + data_pos, orig.data(), len);
+      restore_start = min<size_t> (restore_start, data_pos);
+      restore_end = std::max<size_t> (restore_end, data_pos + len);
+    }
+  if (restore_start < restore_end)
+    {
+      /* the restored data must be on disk before the journal is replaced */
+      err = m_wav_file->sync (restore_start, restore_end - restore_start);
+      if (err)
+        return err;
+    }
+  return Error::Code::NONE;
+}
+
+Error
+InPlaceJournal::remove()
+{
+  if (m_file)
+    {
+      fclose (m_file);
+      m_file = nullptr;
+    }
+  if (unlink (m_filename.c_str()) < 0)
+    return Error (string_printf ("remove journal '%s' failed: %s", m_filename.c_str(), strerror (errno)));
+
+  return sync_dir (m_filename);
+}
+
+Error
+InPlaceInputStream::open (MMapWavFile *wav_file, size_t start_frame, const vector<unsigned char>& preroll)
+{
+  m_wav_file    = wav_file;
+  m_preroll     = preroll;
+  m_start_frame = start_frame;
+  m_pos         = start_frame * wav_file->frame_bytes();
+
+  Error err;
+  m_raw_converter.reset (RawConverter::create (wav_file->raw_format(), err));
+  return err;
+}
+
+Error
+InPlaceInputStream::read_frames (float *samples, size_t count, size_t& frames_read)
+{
+  const size_t frame_bytes = m_wav_file->frame_bytes();
+  const int    n_channels  = m_wav_file->n_channels();
+
+  frames_read = 0;
+  if (m_preroll_pos < m_preroll.size())
+    {
+      size_t frames = min (count, (m_preroll.size() - m_preroll_pos) / frame_bytes);
+
+      m_raw_converter->from_raw (m_preroll.data() + m_preroll_pos, frames * n_channels, samples);
+      m_preroll_pos += frames * frame_bytes;
+      frames_read += frames;
+    }
+  /* convert directly from the mapped file */
+  size_t frames = min (count - frames_read, m_wav_file->n_frames() - m_pos / frame_bytes);
+
+  m_wav_file->read_frames (m_pos / frame_bytes, frames, samples + frames_read * n_channels);
+  m_pos += frames * frame_bytes;
+  frames_read += frames;
+
+  return Error::Code::NONE;
+}
+
+int
+InPlaceInputStream::bit_depth() const
+{
+  return m_wav_file->bit_depth();
+}
+
+int
+InPlaceInputStream::sample_rate() const
+{
+  return m_wav_file->sample_rate();
+}
+
+int
+InPlaceInputStream::n_channels() const
+{
+  return m_wav_file->n_channels();
+}
+
+size_t
+InPlaceInputStream::n_frames() const
+{
+  return m_preroll.size() / m_wav_file->frame_bytes() + m_wav_file->n_frames() - m_start_frame;
+}
+
+InPlaceOutputStream::~InPlaceOutputStream()
+{
+  /* no close() here: if watermarking was not completed, the journal is needed to resume */
+}
+
+Error
+InPlaceOutputStream::open (MMapWavFile *wav_file, InPlaceJournal *journal, size_t start_frame, size_t skip_frames)
+{
+  assert (m_state == State::NEW);
+
+  m_wav_file       = wav_file;
+  m_journal        = journal;
+  m_skip_frames    = skip_frames;
+  m_pos            = start_frame * wav_file->frame_bytes();
+  m_checkpoint_pos = m_pos;
+  m_block_bytes    = block_seconds * wav_file->sample_rate() * wav_file->frame_bytes();
+
+  Error err;
+  m_raw_converter.reset (RawConverter::create (wav_file->raw_format(), err));
+  if (err)
+    return err;
+
+  m_state = State::OPEN;
+  return Error::Code::NONE;
+}
+
+Error
+InPlaceOutputStream::write_block (size_t len)
+{
+  assert (len <= m_pending.size() && len <= m_wav_file->data_size() - m_pos);
+
+  const size_t page_size = sysconf (_SC_PAGESIZE);
+  const unsigned char *block = m_pending.data();
+  unsigned char *data = m_wav_file->data() + m_pos;
+
+  /* original data of the last block before a checkpoint is the preroll for resuming */
+  m_preroll.assign (data, data + len);
+
+  /* find modified pages */
+  auto& runs = m_runs;
+  runs.clear();
+  size_t i = 0;
+  while (i < len)
+    {
+      const size_t n = min (page_size - (m_wav_file->data_offset() + m_pos + i) % page_size, len - i);
+      if (memcmp (data + i, block + i, n) != 0)
+        {
+          if (!runs.empty() && runs.back().first + runs.back().second == i)
+            runs.back().second += n;
+          else
+            runs.emplace_back (i, n);
+        }
+      i += n;
+    }
+  if (!runs.empty())
+    {
+      for (auto run : runs)
+        {
+          Error err = m_journal->append (m_pos + run.first, data + run.first, run.second);
+          if (err)
+            return err;
+        }
+      Error err = m_journal->sync();
+      if (err)
+        return err;
+
+      for (size_t r = 0; r < runs.size(); r++)
+        {
+          /* simulate a crash while the block is only partially modified */
+          if (Params::test_in_place_crash && m_n_blocks_written + 1 == Params::test_in_place_crash && r == runs.size() / 2)
+            _exit (1);
+
+          memcpy (data + runs[r].first, block + runs[r].first, runs[r].second);
+        }
+    }
+  m_n_blocks_written++;
+  m_pos += len;
+
+  if (len == m_block_bytes && ++m_n_blocks == checkpoint_blocks)
+    {
+      /* checkpoint: make watermarked data persistent, then start a new (empty) journal */
+      Error err = m_wav_file->sync (m_checkpoint_pos, m_pos - m_checkpoint_pos);
+      if (err)
+        return err;
+
+      err = m_journal->start (m_pos / m_wav_file->frame_bytes(), m_preroll);
+      if (err)
+        return err;
+
+      m_checkpoint_pos = m_pos;
+      m_n_blocks = 0;
+    }
+  return Error::Code::NONE;
+}
+
+Error
+InPlaceOutputStream::write_frames (const float *samples, size_t count)
+{
+  assert (m_state == State::OPEN);
+
+  /* output for the preroll is not written (the file already contains watermarked data here) */
+  if (m_skip_frames)
+    {
+      const size_t skip = min (m_skip_frames, count);
+
+      samples += skip * m_wav_file->n_channels();
+      count -= skip;
+      m_skip_frames -= skip;
+    }
+  const size_t len = count * m_wav_file->frame_bytes();
+  if (m_pos + m_pending.size() + len > m_wav_file->data_size())
+    return Error ("in-place output is longer than input");
+
+  /* convert to the end of the pending data */
+  const size_t old_size = m_pending.size();
+  m_pending.resize (old_size + len);
+  m_raw_converter->to_raw (samples, count * m_wav_file->n_channels(), m_pending.data() + old_size);
+
+  while (m_pending.size() >= m_block_bytes)
+    {
+      Error err = write_block (m_block_bytes);
+      if (err)
+        return err;
+
+      m_pending.erase (m_pending.begin(), m_pending.begin() + m_block_bytes);
+    }
+  return Error::Code::NONE;
+}
+
+Error
+InPlaceOutputStream::close()
+{
+  if (m_state == State::OPEN)
+    {
+      Error err = write_block (m_pending.size());
+      if (err)
+        return err;
+      m_pending.clear();
+
+      if (m_pos != m_wav_file->data_size())
+        return Error ("in-place output is shorter than input");
+
+      err = m_wav_file->sync (m_checkpoint_pos, m_pos - m_checkpoint_pos);
+      if (err)
+        return err;
+
+      /* all data is watermarked and on disk: journal is no longer needed */
+      err = m_journal->remove();
+      if (err)
+        return err;
+
+      m_state = State::CLOSED;
+    }
+  return Error::Code::NONE;
+}
+
+int
+InPlaceOutputStream::bit_depth() const
+{
+  return m_wav_file->bit_depth();
+}
+
+int
+InPlaceOutputStream::sample_rate() const
+{
+  return m_wav_file->sample_rate();
+}
+
+int
+InPlaceOutputStream::n_channels() const
+{
+  return m_wav_file->n_channels();
+}
@@ -0,0 +1,125 @@
+/*
+ * Copyright (C) 2018-2020 Stefan Westerfeld
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef AUDIOWMARK_IN_PLACE_STREAM_HH
+#define AUDIOWMARK_IN_PLACE_STREAM_HH
+
+#include "audiostream.hh"
+#include "rawconverter.hh"
+#include "mmapwavfile.hh"
+
+/* journal for crash safe in-place watermarking
+ *
+ * the journal stores a checkpoint (all sample data before it is watermarked), the
+ * original sample data of the block before the checkpoint (to initialize the watermark
+ * generator when resuming) and the original contents of all pages that have been modified
+ * after the checkpoint; so after a crash, the file can be restored to the state at the
+ * checkpoint, and watermarking can continue from there
+ */
+class InPlaceJournal
+{
+  MMapWavFile *m_wav_file = nullptr;
+  std::string  m_filename;
+  std::string  m_settings;
+  FILE        *m_file = nullptr;
+
+  Error write_file (const std::string& filename, size_t checkpoint, const std::vector<unsigned char>& preroll);
+public:
+  InPlaceJournal (MMapWavFile *wav_file, const std::string& wav_filename, const std::string& settings);
+  ~InPlaceJournal();
+
+  const std::string& filename() const { return m_filename; }
+
+  bool  exists() const;
+  Error recover (size_t& checkpoint, std::vector<unsigned char>& preroll);
+  Error start (size_t checkpoint, const std::vector<unsigned char>& preroll);
+  Error append (size_t data_pos, const unsigned char *orig, size_t len);
+  Error sync();
+  Error remove();
+};
+
+/* reads the original sample data of a memory mapped wav file, starting at some frame
+ *
+ * when resuming, the original data before the start frame (preroll) is read first
+ */
+class InPlaceInputStream : public AudioInputStream
+{
+  MMapWavFile               *m_wav_file = nullptr;
+  std::vector<unsigned char> m_preroll;
+  size_t                     m_preroll_pos = 0;
+  size_t                     m_start_frame = 0;
+  size_t                     m_pos = 0;
+
+  std::unique_ptr<RawConverter> m_raw_converter;
+public:
+  Error   open (MMapWavFile *wav_file, size_t start_frame, const std::vector<unsigned char>& preroll);
+  Error   read_frames (float *samples, size_t count, size_t& frames_read) override;
+  using AudioInputStream::read_frames;
+
+  int     bit_depth() const override;
+  int     sample_rate() const override;
+  size_t  n_frames() const override;
+  int     n_channels() const override;
+};
+
+/* writes the watermarked sample data back into the memory mapped wav file
+ *
+ * data is written in blocks; the original contents of the pages that will be modified
+ * are appended to the journal and synced before a block is changed, pages that don't
+ * change (for instance digital silence) are not written at all
+ */
+class InPlaceOutputStream : public AudioOutputStream
+{
+  MMapWavFile               *m_wav_file = nullptr;
+  InPlaceJournal            *m_journal = nullptr;
+  size_t                     m_skip_frames = 0;
+  size_t                     m_pos = 0;
+  size_t                     m_checkpoint_pos = 0;
+  size_t                     m_block_bytes = 0;
+  int                        m_n_blocks = 0;
+  int                        m_n_blocks_written = 0;
+  std::vector<unsigned char> m_pending;
+  std::vector<unsigned char> m_preroll;
+  std::vector<std::pair<size_t, size_t>> m_runs;
+
+  std::unique_ptr<RawConverter> m_raw_converter;
+
+  enum class State {
+    NEW,
+    OPEN,
+    CLOSED
+  };
+  State                      m_state = State::NEW;
+
+  Error write_block (size_t len);
+public:
+  /* the block size is aligned to the watermark frames and limiter blocks for all sample rates */
+  static constexpr int block_seconds     = 8;
+  static constexpr int checkpoint_blocks = 4;
+
+  ~InPlaceOutputStream();
+
+  Error open (MMapWavFile *wav_file, InPlaceJournal *journal, size_t start_frame, size_t skip_frames);
+  Error write_frames (const float *samples, size_t count) override;
+  using AudioOutputStream::write_frames;
+  Error close() override;
+  int   sample_rate() const override;
+  int   bit_depth() const override;
+  int   n_channels() const override;
+};
+
+#endif /* AUDIOWMARK_IN_PLACE_STREAM_HH */
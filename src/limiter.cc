@@ -21,8 +21,11 @@
 #include <math.h>
 #include <stdio.h>
 
+#include <algorithm>
+
 using std::vector;
 using std::max;
+using std::min;
 
 Limiter::Limiter (int n_channels, int sample_rate) :
   n_channels (n_channels),
@@ -44,6 +47,15 @@ Limiter::set_ceiling (float new_ceiling)
 
 vector<float>
 Limiter::process (const vector<float>& samples)
+{
+  vector<float> out;
+  process (samples, out);
+  return out;
+}
+
+/* same as above, but reuses the storage of out (and of the internal buffer) */
+void
+Limiter::process (const vector<float>& samples, vector<float>& out)
 {
   assert (block_size >= 1);
   assert (samples.size() % n_channels == 0);    // process should be called with whole frames
@@ -53,17 +65,18 @@ Limiter::process (const vector<float>& samples)
   /* need at least two complete blocks in buffer to produce output */
   const uint buffered_blocks = buffer.size() / n_channels / block_size;
   if (buffered_blocks < 2)
-    return {};
+    {
+      out.clear();
+      return;
+    }
 
   const uint blocks_todo = buffered_blocks - 1;
 
-  vector<float> out (blocks_todo * block_size * n_channels);
+  out.resize (blocks_todo * block_size * n_channels);
   for (uint b = 0; b < blocks_todo; b++)
     process_block (&buffer[b * block_size * n_channels], &out[b * block_size * n_channels]);
 
   buffer.erase (buffer.begin(), buffer.begin() + blocks_todo * block_size * n_channels);
-
-  return out;
 }
 
 size_t
@@ -151,3 +164,162 @@ Limiter::flush()
     }
   return out;
 }
+
+LookaheadLimiter::LookaheadLimiter (int n_channels, int sample_rate) :
+  n_channels (n_channels),
+  sample_rate (sample_rate)
+{
+  reset();
+}
+
+void
+LookaheadLimiter::set_lookahead_ms (double ms)
+{
+  window = uint (sample_rate * ms / 1000) + 1;
+  reset();
+}
+
+void
+LookaheadLimiter::set_release_ms (double ms)
+{
+  const double release_frames = sample_rate * ms / 1000;
+
+  release_factor = release_frames > 1 ? 1 - exp (-1 / release_frames) : 1;
+}
+
+void
+LookaheadLimiter::set_ceiling (float new_ceiling)
+{
+  ceiling = new_ceiling;
+}
+
+size_t
+LookaheadLimiter::lookahead_frames() const
+{
+  return window - 1;
+}
+
+void
+LookaheadLimiter::reset()
+{
+  frame_pos = 0;
+  delay_buffer.assign (window * n_channels, 0);
+  gain_buffer.assign (window, 1);
+  gain_sum = window;
+  release_gain = 1;
+
+  max_value.resize (window);
+  max_pos.resize (window);
+  max_head = 0;
+  max_size = 0;
+}
+
+/* returns the maximum peak of the last window frames (including the current frame) */
+float
+LookaheadLimiter::window_max (float peak)
+{
+  /* remove oldest entry if it is no longer part of the window */
+  if (max_size && max_pos[max_head] + window <= frame_pos)
+    {
+      max_head = (max_head + 1) % window;
+      max_size--;
+    }
+  /* remove entries which can no longer become the maximum */
+  while (max_size && max_value[(max_head + max_size - 1) % window] <= peak)
+    max_size--;
+
+  const size_t tail = (max_head + max_size) % window;
+  max_value[tail] = peak;
+  max_pos[tail]   = frame_pos;
+  max_size++;
+
+  return max_value[max_head];
+}
+
+vector<float>
+LookaheadLimiter::process (const vector<float>& samples)
+{
+  vector<float> out;
+  process (samples, out);
+  return out;
+}
+
+void
+LookaheadLimiter::process (const vector<float>& samples, vector<float>& out)
+{
+  assert (samples.size() % n_channels == 0);    // process should be called with whole frames
+
+  const size_t n_frames = samples.size() / n_channels;
+
+  /* peak level of each frame, never below ceiling (branch free, can be vectorized) */
+  peaks.assign (n_frames, ceiling);
+  for (size_t i = 0; i < n_frames; i++)
+    for (uint c = 0; c < n_channels; c++)
+      peaks[i] = max (peaks[i], fabsf (samples[i * n_channels + c]));
+
+  /* the first lookahead_frames() input frames produce no output */
+  const size_t delay = window - 1;
+  const size_t no_output_frames = frame_pos < delay ? min (delay - frame_pos, n_frames) : 0;
+  out.resize ((n_frames - no_output_frames) * n_channels);
+
+  float *out_ptr = out.data();
+  for (size_t i = 0; i < n_frames; i++)
+    {
+      const size_t pos = frame_pos % window;
+
+      /* the gain required to keep all frames in the window below the ceiling,
+       * recovering with the release time constant after the peak has passed
+       */
+      const float gain = ceiling / window_max (peaks[i]);
+      release_gain = min (gain, release_gain + (1 - release_gain) * release_factor);
+
+      gain_sum += release_gain - gain_buffer[pos];
+      gain_buffer[pos] = release_gain;
+      if (pos == window - 1) /* avoid accumulating rounding errors */
+        {
+          gain_sum = 0;
+          for (auto g : gain_buffer)
+            gain_sum += g;
+        }
+
+      std::copy_n (&samples[i * n_channels], n_channels, &delay_buffer[pos * n_channels]);
+
+      /* output oldest frame from delay buffer: the average of the gains is at most the
+       * smallest required gain of any window that contains this frame
+       */
+      if (frame_pos >= delay)
+        {
+          const float  scale = gain_sum / window;
+          const float *delay_frame = &delay_buffer[((frame_pos + 1) % window) * n_channels];
+
+          for (uint c = 0; c < n_channels; c++)
+            *out_ptr++ = delay_frame[c] * scale;
+        }
+      frame_pos++;
+    }
+}
+
+size_t
+LookaheadLimiter::skip (size_t zeros)
+{
+  size_t out_frames = 0;
+  while (zeros > 0)
+    {
+      const size_t todo = min<size_t> (zeros, 1024);
+
+      silence.resize (todo * n_channels);
+      process (silence, skip_out);
+
+      out_frames += skip_out.size() / n_channels;
+      zeros -= todo;
+    }
+  return out_frames;
+}
+
+vector<float>
+LookaheadLimiter::flush()
+{
+  /* feeding lookahead_frames() zeros outputs everything that is still buffered */
+  silence.resize (lookahead_frames() * n_channels);
+  return process (silence);
+}
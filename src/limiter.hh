@@ -42,6 +42,58 @@ public:
   void set_ceiling (float ceiling);
 
   std::vector<float> process (const std::vector<float>& samples);
+  void               process (const std::vector<float>& samples, std::vector<float>& out);
+  size_t             skip (size_t zeros);
+  std::vector<float> flush();
+};
+
+/* sample accurate peak limiter with a short lookahead (for live streams)
+ *
+ * the required gain for each frame is tracked using a sliding window maximum
+ * of the peak level, and then smoothed by a moving average of the same length;
+ * this guarantees that the output never exceeds the ceiling, while the gain
+ * changes are spread over the lookahead time
+ *
+ * unlike Limiter, output is produced for every input frame, delayed by
+ * lookahead_frames()
+ */
+class LookaheadLimiter
+{
+  float  ceiling        = 1;
+  float  release_factor = 1;
+  uint   n_channels     = 0;
+  uint   sample_rate    = 0;
+  uint   window         = 1;   // lookahead + 1 frames
+  size_t frame_pos      = 0;   // number of input frames processed so far
+  double gain_sum       = 0;
+
+  std::vector<float>  delay_buffer;   // last window input frames (circular)
+  std::vector<float>  gain_buffer;    // last window gains (circular)
+  float               release_gain = 1;
+
+  /* monotonic queue for sliding window maximum (circular) */
+  std::vector<float>  max_value;
+  std::vector<size_t> max_pos;
+  size_t              max_head = 0;
+  size_t              max_size = 0;
+
+  std::vector<float>  peaks;          // scratch buffer: per frame peak
+  std::vector<float>  silence;        // scratch buffer: zeros for skip/flush
+  std::vector<float>  skip_out;       // scratch buffer: discarded output
+
+  void reset();
+  float window_max (float peak);
+public:
+  LookaheadLimiter (int n_channels, int sample_rate);
+
+  void set_lookahead_ms (double value_ms);
+  void set_release_ms (double value_ms);
+  void set_ceiling (float ceiling);
+
+  size_t             lookahead_frames() const;
+
+  std::vector<float> process (const std::vector<float>& samples);
+  void               process (const std::vector<float>& samples, std::vector<float>& out);
   size_t             skip (size_t zeros);
   std::vector<float> flush();
 };
@@ -0,0 +1,241 @@
+/*
+ * Copyright (C) 2018-2020 Stefan Westerfeld
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "mmapwavfile.hh"
+#include "sampleconv.hh"
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <assert.h>
+
+#include <algorithm>
+
+using std::string;
+
+MMapWavFile::~MMapWavFile()
+{
+  close();
+}
+
+Error
+MMapWavFile::open (const string& filename, bool writable)
+{
+  assert (m_fd == -1);
+
+  m_fd = ::open (filename.c_str(), writable ? O_RDWR : O_RDONLY);
+  if (m_fd < 0)
+    return Error (strerror (errno));
+
+  struct stat st;
+  if (fstat (m_fd, &st) < 0)
+    {
+      Error err (strerror (errno));
+      close();
+      return err;
+    }
+  if (!S_ISREG (st.st_mode) || st.st_size == 0)
+    {
+      close();
+      return Error ("not a regular (non-empty) file");
+    }
+  m_map_size = st.st_size;
+
+  const int prot = writable ? (PROT_READ | PROT_WRITE) : PROT_READ;
+  void *map = mmap (nullptr, m_map_size, prot, MAP_SHARED, m_fd, 0);
+  if (map == MAP_FAILED)
+    {
+      Error err (strerror (errno));
+      close();
+      return err;
+    }
+  m_map = static_cast<unsigned char *> (map);
+
+  Error err = parse_header();
+  if (err)
+    {
+      close();
+      return err;
+    }
+  /* we process the sample data from the start to the end */
+  madvise (m_map, m_map_size, MADV_SEQUENTIAL);
+  return Error::Code::NONE;
+}
+
+static uint32_t
+read_u32 (const unsigned char *p)
+{
+  return p[0] | (p[1] << 8) | (p[2] << 16) | (uint32_t (p[3]) << 24);
+}
+
+static uint16_t
+read_u16 (const unsigned char *p)
+{
+  return p[0] | (p[1] << 8);
+}
+
+Error
+MMapWavFile::parse_header()
+{
+  if (m_map_size < 12 || memcmp (m_map, "RIFF", 4) != 0 || memcmp (m_map + 8, "WAVE", 4) != 0)
+    return Error ("not a RIFF/WAVE file");
+
+  bool   have_fmt = false;
+  size_t pos = 12;
+  while (pos + 8 <= m_map_size)
+    {
+      const unsigned char *chunk = m_map + pos;
+      const size_t chunk_size = read_u32 (chunk + 4);
+
+      if (memcmp (chunk, "fmt ", 4) == 0)
+        {
+          if (chunk_size < 16 || pos + 8 + chunk_size > m_map_size)
+            return Error ("bad fmt chunk");
+
+          int format = read_u16 (chunk + 8);
+          if (format == 0xFFFE && chunk_size >= 40) /* WAVE_FORMAT_EXTENSIBLE: format is stored in sub format */
+            format = read_u16 (chunk + 32);
+
+          m_n_channels  = read_u16 (chunk + 10);
+          m_sample_rate = read_u32 (chunk + 12);
+
+          const int block_align = read_u16 (chunk + 20);
+          if (m_n_channels == 0 || block_align % m_n_channels)
+            return Error ("bad fmt chunk");
+
+          /* container size: 24 bit samples with 20 valid bits still use 3 bytes */
+          m_bit_depth = block_align / m_n_channels * 8;
+          if (format == 1) /* PCM */
+            {
+              if (m_bit_depth != 8 && m_bit_depth != 16 && m_bit_depth != 24 && m_bit_depth != 32)
+                return Error (string_printf ("unsupported bit depth %d", m_bit_depth));
+            }
+          else if (format == 3) /* IEEE float */
+            {
+              if (m_bit_depth != 32)
+                return Error (string_printf ("unsupported float bit depth %d", m_bit_depth));
+              m_float = true;
+            }
+          else
+            {
+              return Error ("only uncompressed PCM or float wav files are supported");
+            }
+          have_fmt = true;
+        }
+      else if (memcmp (chunk, "data", 4) == 0)
+        {
+          if (!have_fmt)
+            return Error ("data chunk before fmt chunk");
+
+          m_data_offset = pos + 8;
+          /* files that have not been closed properly (or are still being written) may have a wrong
+           * data size: 0 or 0xFFFFFFFF mean that the data continues until the end of the file
+           */
+          if (chunk_size == 0 || chunk_size == 0xFFFFFFFF)
+            m_data_size = m_map_size - m_data_offset;
+          else
+            m_data_size = std::min (chunk_size, m_map_size - m_data_offset);
+          m_data_size -= m_data_size % frame_bytes();
+          return Error::Code::NONE;
+        }
+      pos += 8 + chunk_size + (chunk_size & 1);
+    }
+  return Error ("no data chunk found");
+}
+
+RawFormat
+MMapWavFile::raw_format() const
+{
+  RawFormat format (m_n_channels, m_sample_rate, m_bit_depth);
+  format.set_endian (RawFormat::LITTLE);
+  if (m_float)
+    format.set_encoding (RawFormat::FLOAT);
+  else if (m_bit_depth == 8)
+    format.set_encoding (RawFormat::UNSIGNED); // 8 bit wav files are unsigned
+  else
+    format.set_encoding (RawFormat::SIGNED);
+  return format;
+}
+
+/* convert sample data to float, without any intermediate buffers */
+void
+MMapWavFile::read_frames (size_t start_frame, size_t n_frames, float *samples) const
+{
+  assert (start_frame + n_frames <= this->n_frames());
+
+  const unsigned char *ptr = data() + start_frame * frame_bytes();
+  const size_t n_values = n_frames * m_n_channels;
+
+  if (m_float) /* little endian float data can be used as it is */
+    {
+      memcpy (samples, ptr, n_values * sizeof (float));
+      return;
+    }
+  /* same normalization as SFInputStream (which reads 32 bit int values) */
+  const RawFormat format = raw_format();
+  SampleConv::pcm_to_float (ptr, n_values, samples, format.bit_depth(), format.endian(), format.encoding());
+}
+
+/* frames that have been read and will not be needed again don't need to stay in memory */
+void
+MMapWavFile::release_frames (size_t start_frame, size_t n_frames) const
+{
+  const size_t page_size = sysconf (_SC_PAGESIZE);
+  size_t start = m_data_offset + start_frame * frame_bytes();
+  size_t end   = start + n_frames * frame_bytes();
+
+  /* only release whole pages */
+  start = (start + page_size - 1) / page_size * page_size;
+  end  -= end % page_size;
+  if (start < end)
+    madvise (m_map + start, end - start, MADV_DONTNEED);
+}
+
+/* write back the changes of a part of the sample data and wait until they are on disk */
+Error
+MMapWavFile::sync (size_t data_pos, size_t len)
+{
+  assert (data_pos + len <= m_data_size);
+
+  const size_t page_size = sysconf (_SC_PAGESIZE);
+  size_t start = m_data_offset + data_pos;
+  size_t end   = start + len;
+
+  start -= start % page_size;
+  if (msync (m_map + start, end - start, MS_SYNC) < 0)
+    return Error (strerror (errno));
+
+  return Error::Code::NONE;
+}
+
+void
+MMapWavFile::close()
+{
+  if (m_map)
+    {
+      munmap (m_map, m_map_size);
+      m_map = nullptr;
+    }
+  if (m_fd >= 0)
+    {
+      ::close (m_fd);
+      m_fd = -1;
+    }
+}
@@ -0,0 +1,73 @@
+/*
+ * Copyright (C) 2018-2020 Stefan Westerfeld
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef AUDIOWMARK_MMAP_WAV_FILE_HH
+#define AUDIOWMARK_MMAP_WAV_FILE_HH
+
+#include <string>
+
+#include "utils.hh"
+#include "rawinputstream.hh"
+
+/* memory mapped access to the sample data of an uncompressed wav file
+ *
+ * the whole file is mapped, so for large files only the pages that are actually
+ * accessed will be read; if the file is opened for writing, changes to data()
+ * are written back to the file (sync() can be used to wait until this is done)
+ *
+ * supported formats: 8/16/24/32 bit integer PCM and 32 bit float (little endian)
+ */
+class MMapWavFile
+{
+  int            m_fd = -1;
+  unsigned char *m_map = nullptr;
+  size_t         m_map_size = 0;
+  size_t         m_data_offset = 0;
+  size_t         m_data_size = 0;
+  int            m_n_channels = 0;
+  int            m_sample_rate = 0;
+  int            m_bit_depth = 0;
+  bool           m_float = false;
+
+  Error parse_header();
+public:
+  ~MMapWavFile();
+
+  Error open (const std::string& filename, bool writable);
+  Error sync (size_t data_pos, size_t len);
+  void  close();
+
+  int    n_channels() const  { return m_n_channels; }
+  int    sample_rate() const { return m_sample_rate; }
+  int    bit_depth() const   { return m_bit_depth; }
+  bool   is_float() const    { return m_float; }
+  size_t frame_bytes() const { return m_n_channels * m_bit_depth / 8; }
+  size_t n_frames() const    { return m_data_size / frame_bytes(); }
+
+  /* file offset and size of the sample data */
+  size_t data_offset() const { return m_data_offset; }
+  size_t data_size() const   { return m_data_size; }
+
+  unsigned char *data() const { return m_map + m_data_offset; }
+
+  RawFormat raw_format() const;
+
+  void  read_frames (size_t start_frame, size_t n_frames, float *samples) const;
+  void  release_frames (size_t start_frame, size_t n_frames) const;
+};
+
+#endif /* AUDIOWMARK_MMAP_WAV_FILE_HH */
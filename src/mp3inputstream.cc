@@ -19,23 +19,25 @@
 
 #include <mpg123.h>
 #include <assert.h>
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <algorithm>
 
 using std::min;
 using std::string;
+using std::vector;
 
 static void
 mp3_init()
 {
-  static bool mpg123_init_ok = false;
-  if (!mpg123_init_ok)
+  /* streams can be opened from worker threads: static initialization is thread safe */
+  static int init_err = mpg123_init();
+  if (init_err != MPG123_OK)
     {
-      int err = mpg123_init();
-      if (err != MPG123_OK)
-        {
-          error ("audiowmark: init mpg123 lib failed\n");
-          exit (1);
-        }
-      mpg123_init_ok = true;
+      error ("audiowmark: init mpg123 lib failed\n");
+      exit (1);
     }
 }
 
@@ -45,7 +47,7 @@ MP3InputStream::~MP3InputStream()
 }
 
 Error
-MP3InputStream::open (const string& filename)
+MP3InputStream::open_handle()
 {
   int err = 0;
 
@@ -55,15 +57,13 @@ MP3InputStream::open (const string& filename)
   if (err != MPG123_OK)
     return Error ("mpg123_new failed");
 
+  /* from now on close() needs to free the handle */
+  m_state = State::OPEN;
+
   err = mpg123_param (m_handle, MPG123_ADD_FLAGS, MPG123_QUIET, 0);
   if (err != MPG123_OK)
     return Error ("setting quiet mode failed");
 
-  // allow arbitary amount of data for resync */
-  err = mpg123_param (m_handle, MPG123_RESYNC_LIMIT, -1, 0);
-  if (err != MPG123_OK)
-    return Error ("setting resync limit parameter failed");
-
   // force floating point output
   {
     const long *rates;
@@ -79,88 +79,449 @@ MP3InputStream::open (const string& filename)
           return Error (mpg123_strerror (m_handle));
       }
   }
+  return Error::Code::NONE;
+}
 
-  err = mpg123_open (m_handle, filename.c_str());
-  if (err != MPG123_OK)
+/* if min_sample_rate is set, the file is decoded at 1/2 or 1/4 of its sample rate
+ * (but not below min_sample_rate), which is a lot faster, as mpg123 can skip the
+ * synthesis of the higher subbands
+ */
+Error
+MP3InputStream::open (const string& filename, bool read_ahead, int min_sample_rate)
+{
+  Error err = open_file (filename, min_sample_rate);
+  if (err)
+    return err;
+
+  return open_decoder (read_ahead);
+}
+
+/* open a file using the index of another stream that has opened the same file before,
+ * which avoids scanning the file and probing (for decoding parts of the file in parallel)
+ */
+Error
+MP3InputStream::open (const string& filename, const Index& index, int min_sample_rate)
+{
+  if (index.offsets.empty())
+    return open (filename, /* read ahead */ false, min_sample_rate);
+
+  Error err = open_file (filename, min_sample_rate);
+  if (err)
+    return err;
+
+  return open_decoder (/* read ahead */ false, &index);
+}
+
+Error
+MP3InputStream::open_file (const string& filename, int min_sample_rate)
+{
+  Error err = open_handle();
+  if (err)
+    return err;
+
+  if (mpg123_open (m_handle, filename.c_str()) != MPG123_OK)
     return Error (mpg123_strerror (m_handle));
 
   m_need_close = true;
 
-  /* scan headers to get best possible length estimate */
-  err = mpg123_scan (m_handle);
-  if (err != MPG123_OK)
+  if (min_sample_rate > 0)
+    {
+      err = reduce_rate (filename, min_sample_rate);
+      if (err)
+        return err;
+    }
+  return Error::Code::NONE;
+}
+
+Error
+MP3InputStream::reduce_rate (const string& filename, int min_sample_rate)
+{
+  long rate;
+  int channels;
+  int encoding;
+
+  /* the native rate is only known after parsing the first frame header */
+  if (mpg123_getformat (m_handle, &rate, &channels, &encoding) != MPG123_OK)
+    return Error (mpg123_strerror (m_handle));
+
+  int down_sample = 2; /* 0: full rate, 1: half rate, 2: quarter rate */
+  while (down_sample > 0 && (rate >> down_sample) < min_sample_rate)
+    down_sample--;
+
+  if (down_sample == 0)
+    return Error::Code::NONE;
+
+  /* the decoder is set up for the output rate when opening the file, so reopen it */
+  mpg123_close (m_handle);
+  m_need_close = false;
+
+  if (mpg123_param (m_handle, MPG123_DOWN_SAMPLE, down_sample, 0) != MPG123_OK)
+    return Error ("setting down sample parameter failed");
+
+  if (mpg123_open (m_handle, filename.c_str()) != MPG123_OK)
     return Error (mpg123_strerror (m_handle));
 
+  m_need_close = true;
+  return Error::Code::NONE;
+}
+
+/* if prefix is empty, stdin is read directly (it must be seekable); otherwise the
+ * prefix bytes (which have already been read from stdin) are decoded first, followed
+ * by the rest of stdin (which is read in feed mode, so pipes work)
+ */
+Error
+MP3InputStream::open_stdin (const vector<unsigned char>& prefix, bool read_ahead)
+{
+  Error err = open_handle();
+  if (err)
+    return err;
+
+  if (prefix.empty())
+    {
+      if (mpg123_open_fd (m_handle, STDIN_FILENO) != MPG123_OK)
+        return Error (mpg123_strerror (m_handle));
+
+      m_need_close = true;
+    }
+  else
+    {
+      if (mpg123_open_feed (m_handle) != MPG123_OK)
+        return Error (mpg123_strerror (m_handle));
+
+      m_need_close = true;
+      m_feed_fd = STDIN_FILENO;
+
+      if (mpg123_feed (m_handle, prefix.data(), prefix.size()) != MPG123_OK)
+        return Error (mpg123_strerror (m_handle));
+    }
+  return open_decoder (read_ahead);
+}
+
+/* there is no really simple way of detecting if something is an mp3
+ *
+ * so we try to decode a few frames; if that works without error the
+ * data is probably a valid mp3 - the decoded frames are kept in the
+ * read buffer, so probing doesn't cost any extra decoding
+ */
+Error
+MP3InputStream::open_decoder (bool read_ahead, const Index *index)
+{
   long rate;
   int channels;
   int encoding;
+  int err;
 
-  err = mpg123_getformat (m_handle, &rate, &channels, &encoding);
+  /* parse the first frame header with the default resync limit, so that non-mp3 data fails quickly */
+  while ((err = mpg123_getformat (m_handle, &rate, &channels, &encoding)) == MPG123_NEED_MORE && m_feed_fd >= 0)
+    {
+      bool feed_eof = false;
+
+      Error ferr = feed_more (feed_eof);
+      if (ferr)
+        return ferr;
+      if (feed_eof)
+        break;
+    }
   if (err != MPG123_OK)
     return Error (mpg123_strerror (m_handle));
 
+  long default_resync_limit;
+  err = mpg123_getparam (m_handle, MPG123_RESYNC_LIMIT, &default_resync_limit, nullptr);
+  if (err != MPG123_OK)
+    return Error ("getting resync limit parameter failed");
+
+  if (m_feed_fd >= 0)
+    {
+      /* in feed mode we cannot scan ahead, so the length is unknown */
+      m_n_frames = N_FRAMES_UNKNOWN;
+    }
+  else if (index)
+    {
+      /* the file has been scanned before, so we can reuse its index (mpg123 copies it) */
+      if (mpg123_set_index (m_handle, const_cast<off_t *> (index->offsets.data()), index->step, index->offsets.size()) != MPG123_OK)
+        return Error (mpg123_strerror (m_handle));
+
+      m_n_frames = index->n_frames;
+    }
+  else
+    {
+      /* scan headers to get best possible length estimate (allowing arbitrary amount of data for resync) */
+      err = mpg123_param (m_handle, MPG123_RESYNC_LIMIT, -1, 0);
+      if (err != MPG123_OK)
+        return Error ("setting resync limit parameter failed");
+
+      err = mpg123_scan (m_handle);
+      if (err != MPG123_OK)
+        return Error (mpg123_strerror (m_handle));
+
+      m_n_frames = mpg123_length (m_handle);
+
+      /* keep the index for opening the file again (the read ahead thread is not running yet) */
+      off_t *offsets = nullptr;
+      off_t  step = 0;
+      size_t fill = 0;
+      if (mpg123_index (m_handle, &offsets, &step, &fill) == MPG123_OK && offsets && fill)
+        {
+          m_index.offsets.assign (offsets, offsets + fill);
+          m_index.step = step;
+          m_index.n_frames = m_n_frames;
+        }
+
+      /* probing (below) should fail for data that is not an mp3, so restore the default resync limit */
+      err = mpg123_param (m_handle, MPG123_RESYNC_LIMIT, default_resync_limit, 0);
+      if (err != MPG123_OK)
+        return Error ("setting resync limit parameter failed");
+    }
+  m_frames_left = m_n_frames;
+
   /* ensure that the format will not change */
   mpg123_format_none (m_handle);
   mpg123_format (m_handle, rate, channels, encoding);
 
-  m_n_values = mpg123_length (m_handle) * channels;
   m_n_channels = channels;
   m_sample_rate = rate;
-  m_frames_left = m_n_values / m_n_channels;
+
+  /* a file with an index has already been probed when the index was created */
+  if (!index)
+    {
+      m_probe = true;
+      for (size_t i = 0; i < 30 && !m_eof; i++)
+        {
+          Error derr = decode_block (m_read_buffer, m_eof);
+          if (derr)
+            return derr;
+        }
+      m_probe = false;
+    }
+
+  // allow arbitary amount of data for resync */
+  err = mpg123_param (m_handle, MPG123_RESYNC_LIMIT, -1, 0);
+  if (err != MPG123_OK)
+    return Error ("setting resync limit parameter failed");
+
+  if (read_ahead && !m_eof)
+    m_read_ahead_thread = std::thread (&MP3InputStream::read_ahead_loop, this);
 
   return Error::Code::NONE;
 }
 
 Error
-MP3InputStream::read_frames (std::vector<float>& samples, size_t count)
+MP3InputStream::feed_more (bool& feed_eof)
 {
-  while (!m_eof && m_read_buffer.size() < count * m_n_channels)
+  m_feed_buffer.resize (64 * 1024);
+
+  ssize_t count;
+  do
+    count = read (m_feed_fd, m_feed_buffer.data(), m_feed_buffer.size());
+  while (count == -1 && errno == EINTR);
+
+  if (count < 0)
+    return Error (string_printf ("error reading mp3 input: %s", strerror (errno)));
+
+  if (count == 0)
     {
-      size_t buffer_bytes = mpg123_outblock (m_handle);
-      assert (buffer_bytes % sizeof (float) == 0);
+      feed_eof = true;
+      return Error::Code::NONE;
+    }
+  if (mpg123_feed (m_handle, m_feed_buffer.data(), count) != MPG123_OK)
+    return Error (mpg123_strerror (m_handle));
+
+  return Error::Code::NONE;
+}
 
-      std::vector<float> buffer (buffer_bytes / sizeof (float));
+/* decode one block and append it to buffer */
+Error
+MP3InputStream::decode_block (vector<float>& buffer, bool& eof)
+{
+  const size_t buffer_bytes = mpg123_outblock (m_handle);
+  assert (buffer_bytes % sizeof (float) == 0);
 
-      size_t done;
-      int err = mpg123_read (m_handle, reinterpret_cast<unsigned char *> (&buffer[0]), buffer_bytes, &done);
+  for (;;)
+    {
+      /* decode directly into the buffer (its capacity is reused between calls) */
+      const size_t old_size = buffer.size();
+      buffer.resize (old_size + buffer_bytes / sizeof (float));
+
+      size_t done = 0;
+      int err = mpg123_read (m_handle, reinterpret_cast<unsigned char *> (buffer.data() + old_size), buffer_bytes, &done);
+      const bool feed_more_data = (err == MPG123_NEED_MORE && m_feed_fd >= 0);
+      buffer.resize (old_size + ((err == MPG123_OK || feed_more_data) ? done / sizeof (float) : 0));
       if (err == MPG123_OK)
         {
-          const size_t n_values = done / sizeof (float);
-          m_read_buffer.insert (m_read_buffer.end(), buffer.begin(), buffer.begin() + n_values);
+          return Error::Code::NONE;
+        }
+      else if (feed_more_data)
+        {
+          if (done)
+            return Error::Code::NONE;
+
+          bool feed_eof = false;
+          Error ferr = feed_more (feed_eof);
+          if (ferr)
+            return ferr;
+          if (feed_eof)
+            {
+              eof = true;
+              return Error::Code::NONE;
+            }
+        }
+      else if (err == MPG123_NEW_FORMAT)
+        {
+          // format is fixed after open, nothing to do
         }
       else if (err == MPG123_DONE)
         {
-          m_eof = true;
+          eof = true;
+          return Error::Code::NONE;
         }
-      else if (err == MPG123_NEED_MORE)
+      else if (err == MPG123_NEED_MORE && !m_probe)
         {
           // some mp3s have this error before reaching eof -> harmless
-          m_eof = true;
+          eof = true;
+          return Error::Code::NONE;
         }
       else
         {
           return Error (mpg123_strerror (m_handle));
         }
     }
-  /* pad zero samples at end if necessary to match the number of frames we promised to deliver */
-  if (m_eof && m_read_buffer.size() < m_frames_left * m_n_channels)
-    m_read_buffer.resize (m_frames_left * m_n_channels);
+}
+
+/* append the next decoded block to m_read_buffer (from the read ahead thread, if any) */
+Error
+MP3InputStream::next_block (bool& eof)
+{
+  if (!m_read_ahead_thread.joinable())
+    return decode_block (m_read_buffer, eof);
+
+  std::unique_lock<std::mutex> lock (m_read_ahead_mutex);
+  m_read_ahead_cond.wait (lock, [this] { return !m_read_ahead_queue.empty() || m_read_ahead_eof; });
+  if (m_read_ahead_queue.empty())
+    {
+      eof = true;
+      return m_read_ahead_error;
+    }
+  vector<float>& block = m_read_ahead_queue.front();
+  m_read_buffer.insert (m_read_buffer.end(), block.begin(), block.end());
+
+  m_free_blocks.push_back (std::move (block));
+  m_read_ahead_queue.pop_front();
+  m_read_ahead_cond.notify_all();
+  return Error::Code::NONE;
+}
+
+void
+MP3InputStream::read_ahead_loop()
+{
+  vector<float> block;
+  bool eof = false;
+
+  while (!eof)
+    {
+      {
+        std::unique_lock<std::mutex> lock (m_read_ahead_mutex);
+        m_read_ahead_cond.wait (lock, [this] { return m_read_ahead_queue.size() < read_ahead_blocks || m_read_ahead_stop; });
+        if (m_read_ahead_stop)
+          return;
+
+        /* reuse storage of blocks that have been consumed */
+        if (!m_free_blocks.empty())
+          {
+            block = std::move (m_free_blocks.back());
+            m_free_blocks.pop_back();
+          }
+      }
+      block.clear();
+
+      /* decoding is done without holding the lock */
+      Error err = decode_block (block, eof);
+
+      std::lock_guard<std::mutex> lock (m_read_ahead_mutex);
+      if (err)
+        {
+          m_read_ahead_error = err;
+          eof = true;
+        }
+      else if (!block.empty())
+        {
+          m_read_ahead_queue.push_back (std::move (block));
+        }
+      if (eof)
+        m_read_ahead_eof = true;
+      m_read_ahead_cond.notify_all();
+    }
+}
+
+Error
+MP3InputStream::read_frames (float *samples, size_t count, size_t& frames_read)
+{
+  frames_read = 0;
+  while (!m_eof && m_read_buffer.size() < count * m_n_channels)
+    {
+      Error err = next_block (m_eof);
+      if (err)
+        return err;
+    }
+  const bool known_length = (m_n_frames != N_FRAMES_UNKNOWN);
+  if (known_length)
+    {
+      /* pad zero samples at end if necessary to match the number of frames we promised to deliver */
+      if (m_eof && m_read_buffer.size() < m_frames_left * m_n_channels)
+        m_read_buffer.resize (m_frames_left * m_n_channels);
 
-  /* never read past the promised number of frames */
-  if (count > m_frames_left)
-    count = m_frames_left;
+      /* never read past the promised number of frames */
+      if (count > m_frames_left)
+        count = m_frames_left;
+    }
 
   const auto begin = m_read_buffer.begin();
   const auto end   = begin + min (count * m_n_channels, m_read_buffer.size());
-  samples.assign (begin, end);
+  std::copy (begin, end, samples);
+  frames_read = (end - begin) / m_n_channels;
   m_read_buffer.erase (begin, end);
-  m_frames_left -= count;
+  if (known_length)
+    m_frames_left -= count;
+  return Error::Code::NONE;
+}
+
+/* seek to a frame position (only for files opened without read ahead)
+ *
+ * sample positions don't include the encoder delay (gapless decoding), so they match
+ * the samples returned by read_frames() when decoding from the start
+ */
+Error
+MP3InputStream::seek (size_t frame)
+{
+  assert (m_feed_fd < 0 && !m_read_ahead_thread.joinable());
+
+  /* decode frames before the seek position to fill the bit reservoir and the filter
+   * states, so that the samples are identical to those of serial decoding
+   */
+  int err = mpg123_param (m_handle, MPG123_PREFRAMES, 16, 0);
+  if (err != MPG123_OK)
+    return Error ("setting preframes parameter failed");
+
+  if (mpg123_seek (m_handle, frame, SEEK_SET) < 0)
+    return Error (mpg123_strerror (m_handle));
+
+  m_read_buffer.clear();
+  m_eof = false;
+  m_frames_left = frame < m_n_frames ? m_n_frames - frame : 0;
   return Error::Code::NONE;
 }
 
 void
 MP3InputStream::close()
 {
+  if (m_read_ahead_thread.joinable())
+    {
+      {
+        std::lock_guard<std::mutex> lock (m_read_ahead_mutex);
+        m_read_ahead_stop = true;
+      }
+      m_read_ahead_cond.notify_all();
+      m_read_ahead_thread.join();
+    }
   if (m_state == State::OPEN)
     {
       if (m_handle && m_need_close)
@@ -172,6 +533,7 @@ MP3InputStream::close()
           m_handle = nullptr;
         }
       m_state = State::CLOSED;
+      m_feed_fd = -1;
     }
 }
 
@@ -196,74 +558,33 @@ MP3InputStream::n_channels() const
 size_t
 MP3InputStream::n_frames() const
 {
-  return m_n_values / m_n_channels;
+  return m_n_frames;
 }
 
-/* there is no really simple way of detecting if something is an mp3
- *
- * so we try to decode a few frames; if that works without error the
- * file is probably a valid mp3
- */
+/* empty if the stream has not scanned a file (i.e. for stdin) */
+const MP3InputStream::Index&
+MP3InputStream::index() const
+{
+  return m_index;
+}
+
+/* quick check on the first bytes of a stream: ID3 tag or mpeg audio frame sync */
 bool
-MP3InputStream::detect (const string& filename)
+MP3InputStream::is_mp3_prefix (const vector<unsigned char>& prefix)
 {
-  struct ScopedMHandle
-  {
-    mpg123_handle *mh         = nullptr;
-    bool           need_close = false;
+  if (prefix.size() >= 3 && prefix[0] == 'I' && prefix[1] == 'D' && prefix[2] == '3')
+    return true;
 
-    ~ScopedMHandle()
+  /* frame sync; ADTS (aac) uses the same sync, but layer 0 */
+  if (prefix.size() >= 3 && prefix[0] == 0xff && (prefix[1] & 0xe0) == 0xe0)
     {
-      if (mh && need_close)
-        mpg123_close (mh);
+      const int version           = (prefix[1] >> 3) & 3;
+      const int layer             = (prefix[1] >> 1) & 3;
+      const int bit_rate_index    = prefix[2] >> 4;
+      const int sample_rate_index = (prefix[2] >> 2) & 3;
 
-      if (mh)
-        mpg123_delete (mh);
-    }
-  };
-
-  int err = 0;
-
-  mp3_init();
-
-  mpg123_handle *mh = mpg123_new (NULL, &err);
-  if (err != MPG123_OK)
-    return false;
-
-  auto smh = ScopedMHandle { mh }; // cleanup on return
-
-  err = mpg123_param (mh, MPG123_ADD_FLAGS, MPG123_QUIET, 0);
-  if (err != MPG123_OK)
-    return false;
-
-  err = mpg123_open (mh, filename.c_str());
-  if (err != MPG123_OK)
-    return false;
-
-  smh.need_close = true;
-
-  long rate;
-  int channels;
-  int encoding;
-  err = mpg123_getformat (mh, &rate, &channels, &encoding);
-  if (err != MPG123_OK)
-    return false;
-
-  size_t buffer_bytes = mpg123_outblock (mh);
-  unsigned char buffer[buffer_bytes];
-
-  for (size_t i = 0; i < 30; i++)
-    {
-      size_t done;
-      err = mpg123_read (mh, buffer, buffer_bytes, &done);
-      if (err == MPG123_DONE)
-        {
-          return true;
-        }
-      else if (err != MPG123_OK)
-        {
-          return false;
-        }
+      /* reject reserved values */
+      return version != 1 && layer != 0 && bit_rate_index != 15 && sample_rate_index != 3;
     }
-  return true;
+  return false;
 }
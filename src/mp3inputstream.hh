@@ -19,32 +19,78 @@
 #define AUDIOWMARK_MP3_INPUT_STREAM_HH
 
 #include <string>
+#include <vector>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+
 #include <mpg123.h>
 
 #include "audiostream.hh"
 
 class MP3InputStream : public AudioInputStream
 {
+public:
+  /* frame index of a scanned file, for opening the same file again without scanning */
+  struct Index
+  {
+    std::vector<off_t> offsets;
+    off_t              step = 0;
+    size_t             n_frames = 0;
+  };
+private:
   enum class State {
     NEW,
     OPEN,
     CLOSED
   };
-  int         m_n_values = 0;
   int         m_n_channels = 0;
   int         m_sample_rate = 0;
+  size_t      m_n_frames = 0;
   size_t      m_frames_left = 0;
   bool        m_need_close = false;
   bool        m_eof = false;
+  bool        m_probe = false;
   State       m_state = State::NEW;
+  Index       m_index;
 
   mpg123_handle     *m_handle = nullptr;
   std::vector<float> m_read_buffer;
+
+  /* feed mode (pipes): data is read from m_feed_fd and passed to the decoder */
+  int                        m_feed_fd = -1;
+  std::vector<unsigned char> m_feed_buffer;
+
+  /* read ahead: a thread decodes blocks while the previous blocks are processed */
+  static constexpr size_t read_ahead_blocks = 32;
+
+  std::thread                    m_read_ahead_thread;
+  std::mutex                     m_read_ahead_mutex;
+  std::condition_variable        m_read_ahead_cond;
+  std::deque<std::vector<float>> m_read_ahead_queue;
+  std::vector<std::vector<float>> m_free_blocks;
+  bool                           m_read_ahead_stop = false;
+  bool                           m_read_ahead_eof = false;
+  Error                          m_read_ahead_error;
+
+  Error open_handle();
+  Error open_file (const std::string& filename, int min_sample_rate);
+  Error reduce_rate (const std::string& filename, int min_sample_rate);
+  Error open_decoder (bool read_ahead, const Index *index = nullptr);
+  Error feed_more (bool& feed_eof);
+  Error decode_block (std::vector<float>& buffer, bool& eof);
+  Error next_block (bool& eof);
+  void  read_ahead_loop();
 public:
   ~MP3InputStream();
 
-  Error   open (const std::string& filename);
-  Error   read_frames (std::vector<float>& samples, size_t count) override;
+  Error   open (const std::string& filename, bool read_ahead = false, int min_sample_rate = 0);
+  Error   open (const std::string& filename, const Index& index, int min_sample_rate = 0);
+  Error   open_stdin (const std::vector<unsigned char>& prefix, bool read_ahead = false);
+  Error   read_frames (float *samples, size_t count, size_t& frames_read) override;
+  using AudioInputStream::read_frames;
+  Error   seek (size_t frame);
   void    close();
 
   int     bit_depth() const override;
@@ -52,7 +98,9 @@ public:
   int     n_channels()  const override;
   size_t  n_frames() const override;
 
-  static bool detect (const std::string& filename);
+  const Index& index() const;
+
+  static bool is_mp3_prefix (const std::vector<unsigned char>& prefix);
 };
 
 #endif /* AUDIOWMARK_MP3_INPUT_STREAM_HH */
@@ -15,105 +15,60 @@
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 
-#include <array>
-#include <regex>
+#include <algorithm>
 
 #include <inttypes.h>
 #include <string.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
 #include "utils.hh"
 #include "mpegts.hh"
 
 using std::string;
 using std::vector;
 using std::map;
-using std::regex;
+using std::min;
 
-class TSPacket
-{
-public:
-  enum class ID { awmk_file, awmk_data, unknown };
-
-private:
-  std::array<unsigned char, 188> m_data;
-
-  std::array<unsigned char, 12>
-  get_id_bytes (ID type)
-  {
-    if (type == ID::awmk_file)
-     return { 'G', 0x1F, 0xFF, 0x10, 'A', 'W', 'M', 'K', 'f', 'i', 'l', 'e' };
-    if (type == ID::awmk_data)
-      return { 'G', 0x1F, 0xFF, 0x10, 'A', 'W', 'M', 'K', 'd', 'a', 't', 'a' };
-    return {0,};
-  }
-public:
-  bool
-  read (FILE *file, Error& err)
-  {
-    size_t bytes_read = fread (m_data.data(), 1, m_data.size(), file);
-    if (bytes_read == 0) /* probably eof */
-      return false;
+/*
+ * Our data is stored in transport stream packets with a special packet id (0x1FFF) that is
+ * ignored by players. The first 12 bytes of each packet identify the packet type:
+ *
+ *  - awmk_file: first packet of an entry, starting with the header "<data_size>:<filename>\0"
+ *  - awmk_data: following packets of the same entry
+ *
+ * and the remaining 176 bytes of each packet store the header and entry data (zero padded).
+ */
+static constexpr size_t ts_packet_size  = 188;
+static constexpr size_t ts_id_size      = 12;
+static constexpr size_t ts_payload_size = ts_packet_size - ts_id_size;
 
-    if (bytes_read == m_data.size()) /* successful read */
-      {
-        if (m_data[0] == 'G')
-          return true;
+/* number of packets we read/write at once */
+static constexpr size_t ts_io_packets   = 1024;
 
-        err = Error ("bad packet sync while reading transport (.ts) packet");
-        return false;
-      }
+static const unsigned char awmk_file_id[ts_id_size] = { 'G', 0x1F, 0xFF, 0x10, 'A', 'W', 'M', 'K', 'f', 'i', 'l', 'e' };
+static const unsigned char awmk_data_id[ts_id_size] = { 'G', 0x1F, 0xFF, 0x10, 'A', 'W', 'M', 'K', 'd', 'a', 't', 'a' };
 
-    err = Error ("short read while reading transport stream (.ts) packet");
-    return false;
-  }
-  Error
-  write (FILE *file)
-  {
-    size_t bytes_written = fwrite (m_data.data(), 1, m_data.size(), file);
-    if (bytes_written != m_data.size())
-      return Error ("short write while writing transport stream (.ts) packet");
-
-    return Error::Code::NONE;
-  }
-  void
-  clear (ID type)
-  {
-    std::fill (m_data.begin(), m_data.end(), 0);
-    auto id = get_id_bytes (type);
-    std::copy (id.begin(), id.end(), m_data.begin());
-  }
-  unsigned char&
-  operator[] (size_t n)
-  {
-    return m_data[n];
-  }
-  bool
-  id_eq (size_t offset, unsigned char a, unsigned char b, unsigned char c, unsigned char d)
-  {
-    return m_data[offset] == a && m_data[offset + 1] == b && m_data[offset + 2] == c && m_data[offset + 3] == d;
-  }
-  ID
-  get_id()
-  {
-    if (id_eq (0, 'G', 0x1F, 0xFF, 0x10) && id_eq (4, 'A', 'W', 'M', 'K'))
-      {
-        if (id_eq (8, 'f', 'i', 'l', 'e'))
-          return ID::awmk_file;
-        if (id_eq (8, 'd', 'a', 't', 'a'))
-          return ID::awmk_data;
-      }
-    return ID::unknown;
-  }
-  constexpr size_t
-  size()
-  {
-    return m_data.size(); // is constant
-  }
-  const std::array<unsigned char, 188>&
-  data()
-  {
-    return m_data;
-  }
-};
+static Error
+read_all (FILE *file, vector<unsigned char>& data)
+{
+  size_t size = 0;
+  for (;;)
+    {
+      data.resize (size + ts_io_packets * ts_packet_size);
+
+      size_t bytes_read = fread (&data[size], 1, data.size() - size, file);
+      size += bytes_read;
+      if (bytes_read == 0)
+        {
+          data.resize (size);
+          if (ferror (file))
+            return Error (strerror (errno));
+          return Error::Code::NONE;
+        }
+    }
+}
 
 Error
 TSWriter::append_file (const string& name, const string& filename)
@@ -123,11 +78,12 @@ TSWriter::append_file (const string& name, const string& filename)
   ScopedFile datafile_s (datafile);
   if (!datafile)
     return Error ("unable to open data file");
-  int c;
-  while ((c = fgetc (datafile)) >= 0)
-    data.push_back (c);
 
-  entries.push_back ({name, data});
+  Error err = read_all (datafile, data);
+  if (err)
+    return err;
+
+  entries.push_back ({name, std::move (data)});
   return Error::Code::NONE;
 }
 
@@ -145,13 +101,13 @@ TSWriter::append_vars (const string& name, const map<string, string>& vars)
       data.push_back (0);
     }
 
-  entries.push_back ({name, data});
+  entries.push_back ({name, std::move (data)});
 }
 
 void
-TSWriter::append_data (const string& name, const vector<unsigned char>& data)
+TSWriter::append_data (const string& name, vector<unsigned char> data)
 {
-  entries.push_back ({name, data});
+  entries.push_back ({name, std::move (data)});
 }
 
 Error
@@ -174,84 +130,82 @@ TSWriter::process (const string& inname, const string& outname)
       return Error (strerror (errno));
     }
 
-  while (!feof (infile))
+  /* copy input packets, many packets at a time */
+  vector<unsigned char> buffer (ts_io_packets * ts_packet_size);
+  for (;;)
     {
-      TSPacket p;
-      Error err;
-      bool read_ok = p.read (infile, err);
-      if (!read_ok)
-        {
-          if (err)
-            return err;
-        }
-      else
+      size_t bytes_read = fread (buffer.data(), 1, buffer.size(), infile);
+      if (bytes_read % ts_packet_size)
+        return Error ("short read while reading transport stream (.ts) packet");
+
+      for (size_t pos = 0; pos < bytes_read; pos += ts_packet_size)
+        if (buffer[pos] != 'G')
+          return Error ("bad packet sync while reading transport (.ts) packet");
+
+      if (fwrite (buffer.data(), 1, bytes_read, outfile) != bytes_read)
+        return Error ("short write while writing transport stream (.ts) packet");
+
+      if (bytes_read < buffer.size())
         {
-          err = p.write (outfile);
-          if (err)
-            return err;
+          if (ferror (infile))
+            return Error (strerror (errno));
+          break;
         }
     }
 
-  for (auto entry : entries)
+  /* append our entries: header and data are written into the packet payloads back to back */
+  for (const auto& entry : entries)
     {
-      string header = string_printf ("%zd:%s", entry.data.size(), entry.name.c_str()) + '\0';
-      vector<unsigned char> data = entry.data;
-      for (size_t i = 0; i < header.size(); i++)
-        data.insert (data.begin() + i, header[i]);
-
-      TSPacket p_file;
-      p_file.clear (TSPacket::ID::awmk_file);
-      size_t data_pos = 0;
-      int pos = 12;
-      while (data_pos < data.size())
-        {
-          p_file[pos++] = data[data_pos];
-          if (pos == 188)
-            {
-              Error err = p_file.write (outfile);
-              if (err)
-                return err;
+      const string header = string_printf ("%zd:%s", entry.data.size(), entry.name.c_str()) + '\0';
+      const size_t size = header.size() + entry.data.size();
+      const size_t n_packets = (size + ts_payload_size - 1) / ts_payload_size;
 
-              p_file.clear (TSPacket::ID::awmk_data);
-              pos = 12;
-            }
-          data_pos++;
-        }
-
-      if (pos != 12)
+      vector<unsigned char> packets (n_packets * ts_packet_size);
+      for (size_t p = 0; p < n_packets; p++)
         {
-          Error err = p_file.write (outfile);
-          if (err)
-            return err;
+          const unsigned char *id = p == 0 ? awmk_file_id : awmk_data_id;
+          std::copy (id, id + ts_id_size, &packets[p * ts_packet_size]);
         }
+
+      auto payload_pos = [] (size_t pos) {
+        return pos / ts_payload_size * ts_packet_size + ts_id_size + pos % ts_payload_size;
+      };
+      size_t pos = 0;
+      auto store = [&] (const unsigned char *data, size_t n) {
+        while (n)
+          {
+            const size_t len = min (n, ts_payload_size - pos % ts_payload_size);
+            std::copy (data, data + len, &packets[payload_pos (pos)]);
+            data += len;
+            pos += len;
+            n -= len;
+          }
+      };
+      store ((const unsigned char *) header.data(), header.size());
+      store (entry.data.data(), entry.data.size());
+
+      if (fwrite (packets.data(), 1, packets.size(), outfile) != packets.size())
+        return Error ("short write while writing transport stream (.ts) packet");
     }
 
   return Error::Code::NONE;
 }
 
+/* parse "<data_size>:<filename>" */
 bool
-TSReader::parse_header (Header& header, vector<unsigned char>& data)
+TSReader::parse_header (Header& header, const string& s)
 {
-  for (size_t i = 0; i < data.size(); i++)
-    {
-      if (data[i] == 0) // header is terminated with one single 0 byte
-        {
-          string s = (const char *) (&data[0]);
+  size_t colon = s.find (':');
+  if (colon == string::npos)
+    return false;
 
-          static const regex header_re ("([0-9]*):(.*)");
-          std::smatch sm;
-          if (regex_match (s, sm, header_re))
-            {
-              header.data_size = atoi (sm[1].str().c_str());
-              header.filename = sm[2];
+  for (size_t i = 0; i < colon; i++)
+    if (s[i] < '0' || s[i] > '9')
+      return false;
 
-              // erase header including null termination
-              data.erase (data.begin(), data.begin() + i + 1);
-              return true;
-            }
-        }
-    }
-  return false;
+  header.data_size = atoi (s.substr (0, colon).c_str());
+  header.filename = s.substr (colon + 1);
+  return true;
 }
 
 Error
@@ -267,6 +221,20 @@ TSReader::load (const string& inname)
       ScopedFile infile_s (infile);
       if (!infile)
         return Error (string_printf ("error opening input .ts '%s'", inname.c_str()));
+
+      /* map regular files, read everything else (like pipes) */
+      struct stat st;
+      if (fstat (fileno (infile), &st) == 0 && S_ISREG (st.st_mode) && st.st_size > 0)
+        {
+          void *map = mmap (nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fileno (infile), 0);
+          if (map != MAP_FAILED)
+            {
+              madvise (map, st.st_size, MADV_SEQUENTIAL);
+              Error err = parse (static_cast<const unsigned char *> (map), st.st_size);
+              munmap (map, st.st_size);
+              return err;
+            }
+        }
       return load (infile);
     }
 }
@@ -274,50 +242,76 @@ TSReader::load (const string& inname)
 Error
 TSReader::load (FILE *infile)
 {
-  vector<unsigned char> awmk_stream;
+  vector<unsigned char> data;
+  Error err = read_all (infile, data);
+  if (err)
+    return err;
+
+  return parse (data.data(), data.size());
+}
+
+Error
+TSReader::parse (const unsigned char *data, size_t size)
+{
+  enum class State { HEADER, DATA, SKIP } state = State::HEADER;
+  string header_str;
   Header header;
-  bool header_valid = false;
-  Error err;
-  while (!feof (infile))
+  Entry  entry;
+
+  for (size_t offset = 0; offset < size; offset += ts_packet_size)
     {
-      TSPacket p;
-      bool read_ok = p.read (infile, err);
-      if (!read_ok)
+      const unsigned char *packet = data + offset;
+
+      if (size - offset < ts_packet_size)
+        return Error ("short read while reading transport stream (.ts) packet");
+      if (packet[0] != 'G')
+        return Error ("bad packet sync while reading transport (.ts) packet");
+
+      /* only our own packets are relevant, all other packets are skipped */
+      const bool file_packet = memcmp (packet, awmk_file_id, ts_id_size) == 0;
+      if (!file_packet && memcmp (packet, awmk_data_id, ts_id_size) != 0)
+        continue;
+
+      if (file_packet)
         {
-          if (err)
-            return err;
+          /* new stream start, clear old contents */
+          state = State::HEADER;
+          header_str.clear();
         }
-      else
+      const unsigned char *payload = packet + ts_id_size;
+      const unsigned char *payload_end = packet + ts_packet_size;
+      if (state == State::HEADER)
         {
-          TSPacket::ID id = p.get_id();
-          if (id == TSPacket::ID::awmk_file)
+          /* header is terminated with one single 0 byte */
+          const unsigned char *zero = std::find (payload, payload_end, 0);
+          header_str.append (payload, zero);
+          if (zero == payload_end)
+            continue;
+
+          if (!parse_header (header, header_str))
             {
-              /* new stream start, clear old contents */
-              header_valid = false;
-              awmk_stream.clear();
+              state = State::SKIP;
+              continue;
             }
-          if (id == TSPacket::ID::awmk_file || id == TSPacket::ID::awmk_data)
+          entry.filename = header.filename;
+          entry.data.clear();
+          entry.data.reserve (header.data_size);
+          payload = zero + 1;
+          state = State::DATA;
+        }
+      if (state == State::DATA)
+        {
+          const size_t n = min<size_t> (payload_end - payload, header.data_size - entry.data.size());
+          entry.data.insert (entry.data.end(), payload, payload + n);
+
+          // done? do we have enough bytes for the complete entry?
+          if (entry.data.size() == header.data_size)
             {
-              awmk_stream.insert (awmk_stream.end(), p.data().begin() + 12, p.data().end());
-
-              if (!header_valid)
-                {
-                  if (parse_header (header, awmk_stream))
-                    {
-                      awmk_stream.reserve (header.data_size + p.size());
-                      header_valid = true;
-                    }
-                }
-              // done? do we have enough bytes for the complete entry?
-              if (header_valid && awmk_stream.size() >= header.data_size)
-                {
-                  awmk_stream.resize (header.data_size);
-
-                  m_entries.push_back ({ header.filename, std::move (awmk_stream)});
-
-                  header_valid = false;
-                  awmk_stream.clear();
-                }
+              m_entries.push_back (std::move (entry));
+              entry = Entry();
+
+              state = State::HEADER;
+              header_str.clear();
             }
         }
     }
@@ -35,7 +35,8 @@ private:
     size_t      data_size = 0;
   };
   std::vector<Entry> m_entries;
-  bool parse_header (Header& header, std::vector<unsigned char>& data);
+  bool parse_header (Header& header, const std::string& s);
+  Error parse (const unsigned char *data, size_t size);
   Error load (FILE *infile);
 public:
   Error load (const std::string& inname);
@@ -55,7 +56,7 @@ class TSWriter
 public:
   Error append_file (const std::string& name, const std::string& filename);
   void  append_vars (const std::string& name, const std::map<std::string, std::string>& vars);
-  void  append_data (const std::string& name, const std::vector<unsigned char>& data);
+  void  append_data (const std::string& name, std::vector<unsigned char> data);
   Error process (const std::string& in_name, const std::string& out_name);
 };
 
@@ -16,138 +16,131 @@
  */
 
 #include "rawconverter.hh"
+#include "sampleconv.hh"
 
-#include <array>
-
-#include <math.h>
-
-using std::vector;
+#include <string.h>
 
 RawConverter::~RawConverter()
 {
 }
 
-template<int BIT_DEPTH, RawFormat::Endian ENDIAN, RawFormat::Encoding ENCODING>
 class RawConverterImpl : public RawConverter
 {
+  int                 m_bit_depth;
+  RawFormat::Endian   m_endian;
+  RawFormat::Encoding m_encoding;
 public:
-  void to_raw (const std::vector<float>& samples, std::vector<unsigned char>& bytes);
-  void from_raw (const std::vector<unsigned char>& bytes, std::vector<float>& samples);
+  RawConverterImpl (const RawFormat& raw_format) :
+    m_bit_depth (raw_format.bit_depth()),
+    m_endian (raw_format.endian()),
+    m_encoding (raw_format.encoding())
+  {
+  }
+  void to_raw (const float *samples, size_t n_values, unsigned char *bytes);
+  void from_raw (const unsigned char *bytes, size_t n_values, float *samples);
 };
 
-template<int BIT_DEPTH, RawFormat::Endian ENDIAN>
-static RawConverter *
-create_with_bits_endian (const RawFormat& raw_format, Error& error)
-{
-  switch (raw_format.encoding())
-    {
-      case RawFormat::SIGNED:   return new RawConverterImpl<BIT_DEPTH, ENDIAN, RawFormat::SIGNED>();
-      case RawFormat::UNSIGNED: return new RawConverterImpl<BIT_DEPTH, ENDIAN, RawFormat::UNSIGNED>();
-    }
-  error = Error ("unsupported encoding");
-  return nullptr;
-}
-
-template<int BIT_DEPTH>
-static RawConverter *
-create_with_bits (const RawFormat& raw_format, Error& error)
+template<RawFormat::Endian ENDIAN>
+class RawConverterFloat : public RawConverter
 {
-  switch (raw_format.endian())
-    {
-      case RawFormat::LITTLE: return create_with_bits_endian <BIT_DEPTH, RawFormat::LITTLE> (raw_format, error);
-      case RawFormat::BIG:    return create_with_bits_endian <BIT_DEPTH, RawFormat::BIG> (raw_format, error);
-    }
-  error = Error ("unsupported endianness");
-  return nullptr;
-}
+public:
+  void to_raw (const float *samples, size_t n_values, unsigned char *bytes);
+  void from_raw (const unsigned char *bytes, size_t n_values, float *samples);
+  bool passthrough() const override;
+};
 
 RawConverter *
 RawConverter::create (const RawFormat& raw_format, Error& error)
 {
   error = Error::Code::NONE;
-  switch (raw_format.bit_depth())
-    {
-      case 16: return create_with_bits<16> (raw_format, error);
-      case 24: return create_with_bits<24> (raw_format, error);
-      default: error = Error ("unsupported bit depth");
-               return nullptr;
-    }
-}
 
-template<int BIT_DEPTH, RawFormat::Endian ENDIAN>
-constexpr std::array<int, 3>
-make_endian_shift ()
-{
-  if (BIT_DEPTH == 16)
+  const int bit_depth = raw_format.bit_depth();
+  if (bit_depth != 8 && bit_depth != 16 && bit_depth != 24 && bit_depth != 32)
     {
-      if (ENDIAN == RawFormat::Endian::LITTLE)
-        return { 16, 24, -1 };
-      else
-        return { 24, 16, -1 };
+      error = Error ("unsupported bit depth");
+      return nullptr;
     }
-  if (BIT_DEPTH == 24)
+  if (raw_format.encoding() == RawFormat::FLOAT)
     {
-      if (ENDIAN == RawFormat::Endian::LITTLE)
-        return {  8, 16, 24 };
+      if (bit_depth != 32)
+        {
+          error = Error ("float encoding needs 32 bit samples");
+          return nullptr;
+        }
+      if (raw_format.endian() == RawFormat::LITTLE)
+        return new RawConverterFloat<RawFormat::LITTLE>();
       else
-        return { 24, 16, 8 };
+        return new RawConverterFloat<RawFormat::BIG>();
     }
+  return new RawConverterImpl (raw_format);
+}
+
+/* true if the raw data has the same layout as the samples (no conversion needed) */
+bool
+RawConverter::passthrough() const
+{
+  return false;
 }
 
-template<int BIT_DEPTH, RawFormat::Endian ENDIAN, RawFormat::Encoding ENCODING>
 void
-RawConverterImpl<BIT_DEPTH, ENDIAN, ENCODING>::to_raw (const vector<float>& samples, vector<unsigned char>& output_bytes)
+RawConverterImpl::to_raw (const float *samples, size_t n_values, unsigned char *output_bytes)
 {
-  constexpr int  sample_width = BIT_DEPTH / 8;
-  constexpr auto eshift = make_endian_shift<BIT_DEPTH, ENDIAN>();
-  constexpr unsigned char sign_flip = ENCODING == RawFormat::SIGNED ? 0x00 : 0x80;
+  SampleConv::float_to_pcm (samples, n_values, output_bytes, m_bit_depth, m_endian, m_encoding);
+}
 
-  output_bytes.resize (sample_width * samples.size());
+void
+RawConverterImpl::from_raw (const unsigned char *input_bytes, size_t n_values, float *samples)
+{
+  SampleConv::pcm_to_float (input_bytes, n_values, samples, m_bit_depth, m_endian, m_encoding);
+}
 
-  unsigned char *ptr = output_bytes.data();
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+static constexpr RawFormat::Endian native_endian = RawFormat::LITTLE;
+#else
+static constexpr RawFormat::Endian native_endian = RawFormat::BIG;
+#endif
 
-  for (size_t i = 0; i < samples.size(); i++)
+template<RawFormat::Endian ENDIAN>
+void
+RawConverterFloat<ENDIAN>::to_raw (const float *samples, size_t n_values, unsigned char *output_bytes)
+{
+  if (ENDIAN == native_endian)
     {
-      const double norm      =  0x80000000LL;
-      const double min_value = -0x80000000LL;
-      const double max_value =  0x7FFFFFFF;
-
-      const int    sample = lrint (bound<double> (min_value, samples[i] * norm, max_value));
-
-      if (eshift[0] >= 0)
-        ptr[0] = (sample >> eshift[0]) ^ sign_flip;
-      if (eshift[1] >= 0)
-        ptr[1] = sample >> eshift[1];
-      if (eshift[2] >= 0)
-        ptr[2] = sample >> eshift[2];
-
-      ptr += sample_width;
+      memcpy (output_bytes, samples, n_values * sizeof (float));
+      return;
+    }
+  const unsigned char *in = reinterpret_cast<const unsigned char *> (samples);
+  for (size_t i = 0; i < n_values * 4; i += 4)
+    {
+      output_bytes[i]     = in[i + 3];
+      output_bytes[i + 1] = in[i + 2];
+      output_bytes[i + 2] = in[i + 1];
+      output_bytes[i + 3] = in[i];
     }
 }
 
-template<int BIT_DEPTH, RawFormat::Endian ENDIAN, RawFormat::Encoding ENCODING>
+template<RawFormat::Endian ENDIAN>
 void
-RawConverterImpl<BIT_DEPTH, ENDIAN, ENCODING>::from_raw (const vector<unsigned char>& input_bytes, vector<float>& samples)
+RawConverterFloat<ENDIAN>::from_raw (const unsigned char *input_bytes, size_t n_values, float *samples)
 {
-  const unsigned char *ptr = input_bytes.data();
-  constexpr int sample_width = BIT_DEPTH / 8;
-  constexpr auto eshift = make_endian_shift<BIT_DEPTH, ENDIAN>();
-  constexpr unsigned char sign_flip = ENCODING == RawFormat::SIGNED ? 0x00 : 0x80;
-
-  samples.resize (input_bytes.size() / sample_width);
-  const double norm = 1.0 / 0x80000000LL;
-  for (size_t i = 0; i < samples.size(); i++)
+  if (ENDIAN == native_endian)
     {
-      int s32 = 0;
-
-      if (eshift[0] >= 0)
-        s32 += (ptr[0] ^ sign_flip) << eshift[0];
-      if (eshift[1] >= 0)
-        s32 += ptr[1] << eshift[1];
-      if (eshift[2] >= 0)
-        s32 += ptr[2] << eshift[2];
-
-      samples[i] = s32 * norm;
-      ptr += sample_width;
+      memcpy (samples, input_bytes, n_values * sizeof (float));
+      return;
     }
+  unsigned char *out = reinterpret_cast<unsigned char *> (samples);
+  for (size_t i = 0; i < n_values * 4; i += 4)
+    {
+      out[i]     = input_bytes[i + 3];
+      out[i + 1] = input_bytes[i + 2];
+      out[i + 2] = input_bytes[i + 1];
+      out[i + 3] = input_bytes[i];
+    }
+}
+
+template<RawFormat::Endian ENDIAN>
+bool
+RawConverterFloat<ENDIAN>::passthrough() const
+{
+  return ENDIAN == native_endian;
 }
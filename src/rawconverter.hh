@@ -27,8 +27,11 @@ public:
 
   virtual ~RawConverter() = 0;
 
-  virtual void to_raw   (const std::vector<float>& samples, std::vector<unsigned char>& bytes) = 0;
-  virtual void from_raw (const std::vector<unsigned char>& bytes, std::vector<float>& samples) = 0;
+  /* bytes must have room for n_values samples of the raw format */
+  virtual void to_raw   (const float *samples, size_t n_values, unsigned char *bytes) = 0;
+  virtual void from_raw (const unsigned char *bytes, size_t n_values, float *samples) = 0;
+
+  virtual bool passthrough() const;
 };
 
 #endif /* AUDIOWMARK_RAW_CONVERTER_HH */
@@ -22,6 +22,8 @@
 #include <string.h>
 #include <errno.h>
 
+#include <algorithm>
+
 using std::string;
 using std::vector;
 
@@ -72,10 +74,8 @@ RawInputStream::~RawInputStream()
 }
 
 Error
-RawInputStream::open (const string& filename, const RawFormat& format)
+RawInputStream::init_format (const RawFormat& format)
 {
-  assert (m_state == State::NEW);
-
   if (!format.n_channels())
     return Error ("RawInputStream: input format: missing number of channels");
   if (!format.bit_depth())
@@ -88,6 +88,19 @@ RawInputStream::open (const string& filename, const RawFormat& format)
   if (err)
     return err;
 
+  m_format = format;
+  return Error::Code::NONE;
+}
+
+Error
+RawInputStream::open (const string& filename, const RawFormat& format)
+{
+  assert (m_state == State::NEW);
+
+  Error err = init_format (format);
+  if (err)
+    return err;
+
   if (filename == "-")
     {
       m_input_file = stdin;
@@ -102,11 +115,26 @@ RawInputStream::open (const string& filename, const RawFormat& format)
       m_close_file = true;
     }
 
-  m_format = format;
   m_state  = State::OPEN;
   return Error::Code::NONE;
 }
 
+/* read raw samples from memory; data must stay valid until the stream is closed */
+Error
+RawInputStream::open (const vector<unsigned char> *data, const RawFormat& format)
+{
+  assert (m_state == State::NEW);
+
+  Error err = init_format (format);
+  if (err)
+    return err;
+
+  m_mem_data = data;
+  m_mem_pos  = 0;
+  m_state    = State::OPEN;
+  return Error::Code::NONE;
+}
+
 int
 RawInputStream::sample_rate() const
 {
@@ -122,6 +150,9 @@ RawInputStream::bit_depth() const
 size_t
 RawInputStream::n_frames() const
 {
+  if (m_mem_data)
+    return m_mem_data->size() / (m_format.n_channels() * m_format.bit_depth() / 8);
+
   return N_FRAMES_UNKNOWN;
 }
 
@@ -132,22 +163,52 @@ RawInputStream::n_channels() const
 }
 
 Error
-RawInputStream::read_frames (vector<float>& samples, size_t count)
+RawInputStream::read_frames (float *samples, size_t count, size_t& frames_read)
 {
   assert (m_state == State::OPEN);
 
+  if (m_mem_data)
+    return read_mem_frames (samples, count, frames_read);
+
   const int n_channels   = m_format.n_channels();
   const int sample_width = m_format.bit_depth() / 8;
 
-  vector<unsigned char> input_bytes (count * n_channels * sample_width);
-  size_t r_count = fread (input_bytes.data(), n_channels * sample_width, count, m_input_file);
+  frames_read = 0;
+  if (m_raw_converter->passthrough())
+    {
+      /* raw data is native float: read directly into samples */
+      size_t r_count = fread (samples, n_channels * sample_width, count, m_input_file);
+      if (ferror (m_input_file))
+        return Error ("error reading sample data");
+
+      frames_read = r_count;
+      return Error::Code::NONE;
+    }
+  m_input_bytes.resize (count * n_channels * sample_width);
+  size_t r_count = fread (m_input_bytes.data(), n_channels * sample_width, count, m_input_file);
   if (ferror (m_input_file))
     return Error ("error reading sample data");
 
-  input_bytes.resize (r_count * n_channels * sample_width);
+  m_raw_converter->from_raw (m_input_bytes.data(), r_count * n_channels, samples);
+  frames_read = r_count;
+
+  return Error::Code::NONE;
+}
 
-  m_raw_converter->from_raw (input_bytes, samples);
+Error
+RawInputStream::read_mem_frames (float *samples, size_t count, size_t& frames_read)
+{
+  const size_t frame_bytes = m_format.n_channels() * m_format.bit_depth() / 8;
+  const size_t r_count     = std::min (count, (m_mem_data->size() - m_mem_pos) / frame_bytes);
+  const unsigned char *bytes = m_mem_data->data() + m_mem_pos;
+
+  if (m_raw_converter->passthrough())
+    memcpy (samples, bytes, r_count * frame_bytes);
+  else
+    m_raw_converter->from_raw (bytes, r_count * m_format.n_channels(), samples);
 
+  m_mem_pos += r_count * frame_bytes;
+  frames_read = r_count;
   return Error::Code::NONE;
 }
 
@@ -34,7 +34,8 @@ public:
   };
   enum Encoding {
     SIGNED,
-    UNSIGNED
+    UNSIGNED,
+    FLOAT
   };
 private:
   int       m_n_channels  = 2;
@@ -74,12 +75,21 @@ class RawInputStream : public AudioInputStream
   bool        m_close_file = false;
 
   std::unique_ptr<RawConverter> m_raw_converter;
+  std::vector<unsigned char>    m_input_bytes;
 
+  /* memory input: samples are converted directly from the data (no copy) */
+  const std::vector<unsigned char> *m_mem_data = nullptr;
+  size_t                            m_mem_pos = 0;
+
+  Error   init_format (const RawFormat& format);
+  Error   read_mem_frames (float *samples, size_t count, size_t& frames_read);
 public:
   ~RawInputStream();
 
   Error   open (const std::string& filename, const RawFormat& format);
-  Error   read_frames (std::vector<float>& samples, size_t count) override;
+  Error   open (const std::vector<unsigned char> *data, const RawFormat& format);
+  Error   read_frames (float *samples, size_t count, size_t& frames_read) override;
+  using AudioInputStream::read_frames;
   void    close();
 
   int     bit_depth() const override;
@@ -84,17 +84,26 @@ RawOutputStream::n_channels() const
 }
 
 Error
-RawOutputStream::write_frames (const vector<float>& samples)
+RawOutputStream::write_frames (const float *samples, size_t count)
 {
   assert (m_state == State::OPEN);
 
-  if (samples.empty())
+  if (!count)
     return Error::Code::NONE;
 
-  vector<unsigned char> bytes;
-  m_raw_converter->to_raw (samples, bytes);
+  const size_t n_values = count * m_format.n_channels();
+  if (m_raw_converter->passthrough())
+    {
+      /* raw data is native float: write samples directly */
+      fwrite (samples, sizeof (float), n_values, m_output_file);
+    }
+  else
+    {
+      m_bytes.resize (n_values * m_format.bit_depth() / 8);
+      m_raw_converter->to_raw (samples, n_values, m_bytes.data());
 
-  fwrite (&bytes[0], 1, bytes.size(), m_output_file);
+      fwrite (m_bytes.data(), 1, m_bytes.size(), m_output_file);
+    }
   if (ferror (m_output_file))
     return Error ("write sample data failed");
 
@@ -36,6 +36,7 @@ class RawOutputStream : public AudioOutputStream
   bool        m_close_file = false;
 
   std::unique_ptr<RawConverter> m_raw_converter;
+  std::vector<unsigned char>    m_bytes;
 public:
   ~RawOutputStream();
 
@@ -44,7 +45,8 @@ public:
   int   n_channels()  const override;
 
   Error open (const std::string& filename, const RawFormat& format);
-  Error write_frames (const std::vector<float>& frames) override;
+  Error write_frames (const float *samples, size_t count) override;
+  using AudioOutputStream::write_frames;
   Error close() override;
 };
 
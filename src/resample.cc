@@ -20,6 +20,8 @@
 #include <assert.h>
 #include <math.h>
 
+#include <algorithm>
+
 #include <zita-resampler/resampler.h>
 #include <zita-resampler/vresampler.h>
 
@@ -108,3 +110,164 @@ resample_ratio (const WavData& wav_data, double ratio, int new_rate)
 }
 
 
+
+static double
+bessel_i0 (double x)
+{
+  /* power series, converges quickly for the values we use */
+  double sum = 1, term = 1;
+  for (int k = 1; k < 100 && term > sum * 1e-12; k++)
+    {
+      term *= (x / (2 * k)) * (x / (2 * k));
+      sum += term;
+    }
+  return sum;
+}
+
+int
+BandResampler::setup (unsigned int fs_inp, unsigned int fs_out, unsigned int nchan, double pass_freq, double stop_freq)
+{
+  /* both sample rates must be able to represent the pass band */
+  if (nchan < 1 || pass_freq <= 0 || stop_freq <= pass_freq || 2 * pass_freq >= fs_inp || 2 * pass_freq >= fs_out)
+    return 1;
+
+  unsigned int g = fs_inp, r = fs_out;
+  while (r)
+    {
+      const unsigned int t = g % r;
+      g = r;
+      r = t;
+    }
+  m_up   = fs_out / g;
+  m_down = fs_inp / g;
+
+  /* the coefficient table has one filter for each phase, this only makes sense for simple ratios */
+  if (m_up > 1000)
+    return 1;
+
+  /* kaiser window design, 90 dB stop band attenuation */
+  const double atten = 90;
+  const double beta  = 0.1102 * (atten - 8.7);
+  const double delta_omega = 2 * M_PI * (stop_freq - pass_freq) / fs_inp;
+  const double cutoff = std::min ((pass_freq + stop_freq) / fs_inp, 1.0); // normalized to input nyquist frequency
+
+  m_taps = std::max (4, int (ceil ((atten - 7.95) / (2.285 * delta_omega))));
+  m_taps += m_taps & 1; // even number of taps
+
+  const int half = m_taps / 2;
+  m_coeffs.resize (m_up * m_taps);
+  for (unsigned int p = 0; p < m_up; p++)
+    {
+      float *coeffs = &m_coeffs[p * m_taps];
+      double dc_gain = 0;
+      for (unsigned int k = 0; k < m_taps; k++)
+        {
+          /* output position is between input k == half - 1 and k == half */
+          const double t = int (k) - (half - 1) - double (p) / m_up;
+          const double w = t / half;
+          const double sinc = fabs (t) < 1e-9 ? 1 : sin (M_PI * cutoff * t) / (M_PI * cutoff * t);
+
+          coeffs[k] = cutoff * sinc * bessel_i0 (beta * sqrt (std::max (1 - w * w, 0.0))) / bessel_i0 (beta);
+          dc_gain += coeffs[k];
+        }
+      for (unsigned int k = 0; k < m_taps; k++)
+        coeffs[k] /= dc_gain;
+    }
+  m_nchan = nchan;
+  m_buffer.assign ((m_taps + 512) * m_nchan, 0);
+  m_phase = 0;
+  m_start = 0;
+  m_fill  = 0;
+  return 0;
+}
+
+int
+BandResampler::nchan() const
+{
+  return m_nchan;
+}
+
+int
+BandResampler::inpsize() const
+{
+  return m_taps;
+}
+
+int
+BandResampler::process()
+{
+  const unsigned int buffer_frames = m_buffer.size() / m_nchan;
+  while (true)
+    {
+      /* compute output frames as long as we have enough input frames */
+      while (m_start + m_taps <= m_fill)
+        {
+          if (!out_count)
+            return 0;
+
+          if (out_data)
+            {
+              const float *coeffs = &m_coeffs[m_phase * m_taps];
+              const float *frame  = &m_buffer[m_start * m_nchan];
+              if (m_nchan == 2)
+                {
+                  /* stereo is the common case: use independent sums to avoid waiting for the adds */
+                  float l0 = 0, l1 = 0, r0 = 0, r1 = 0;
+                  for (unsigned int k = 0; k < m_taps; k += 2)
+                    {
+                      l0 += frame[k * 2]     * coeffs[k];
+                      r0 += frame[k * 2 + 1] * coeffs[k];
+                      l1 += frame[k * 2 + 2] * coeffs[k + 1];
+                      r1 += frame[k * 2 + 3] * coeffs[k + 1];
+                    }
+                  *out_data++ = l0 + l1;
+                  *out_data++ = r0 + r1;
+                }
+              else
+                {
+                  for (unsigned int c = 0; c < m_nchan; c++)
+                    {
+                      float acc0 = 0, acc1 = 0;
+                      for (unsigned int k = 0; k < m_taps; k += 2)
+                        {
+                          acc0 += frame[k * m_nchan + c] * coeffs[k];
+                          acc1 += frame[(k + 1) * m_nchan + c] * coeffs[k + 1];
+                        }
+                      *out_data++ = acc0 + acc1;
+                    }
+                }
+            }
+          out_count--;
+
+          /* advance to next output position (avoiding division, m_down / m_up is usually small) */
+          m_phase += m_down;
+          while (m_phase >= m_up)
+            {
+              m_phase -= m_up;
+              m_start++;
+            }
+        }
+      if (!inp_count)
+        return 0;
+
+      /* discard input frames which are no longer needed */
+      const unsigned int drop = std::min (m_start, m_fill);
+      std::copy (m_buffer.begin() + drop * m_nchan, m_buffer.begin() + m_fill * m_nchan, m_buffer.begin());
+      m_start -= drop;
+      m_fill  -= drop;
+
+      /* append input frames (nullptr input data means zeros) */
+      const unsigned int n = std::min (inp_count, buffer_frames - m_fill);
+      if (inp_data)
+        {
+          std::copy (inp_data, inp_data + n * m_nchan, &m_buffer[m_fill * m_nchan]);
+          inp_data += n * m_nchan;
+        }
+      else
+        {
+          std::fill_n (&m_buffer[m_fill * m_nchan], n * m_nchan, 0);
+        }
+      m_fill += n;
+      inp_count -= n;
+    }
+}
@@ -23,4 +23,35 @@
 WavData resample (const WavData& wav_data, int rate);
 WavData resample_ratio (const WavData& wav_data, double ratio, int new_rate);
 
+/* rational polyphase resampler for signals that only need to be accurate below pass_freq
+ *
+ * the filter only needs to suppress frequencies above stop_freq, so for a large
+ * transition band (like the watermark signal, which has no energy above 5 kHz) it is
+ * a lot shorter than a full band resampler; the interface is compatible with zita's
+ * Resampler (setup / process / inp_count / out_count / inp_data / out_data)
+ */
+class BandResampler
+{
+  unsigned int       m_nchan = 0;
+  unsigned int       m_taps  = 0;
+  unsigned int       m_up    = 1;
+  unsigned int       m_down  = 1;
+  unsigned int       m_phase = 0;
+  unsigned int       m_start = 0;   // first input frame for next output frame
+  unsigned int       m_fill  = 0;   // number of input frames in buffer
+
+  std::vector<float> m_coeffs;      // m_up filter phases with m_taps coefficients each
+  std::vector<float> m_buffer;      // input frames
+public:
+  unsigned int inp_count = 0;
+  unsigned int out_count = 0;
+  float       *inp_data  = nullptr;
+  float       *out_data  = nullptr;
+
+  int setup (unsigned int fs_inp, unsigned int fs_out, unsigned int nchan, double pass_freq, double stop_freq);
+  int nchan() const;
+  int inpsize() const;
+  int process();
+};
+
 #endif /* AUDIOWMARK_RESAMPLE_HH */
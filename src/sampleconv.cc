@@ -0,0 +1,623 @@
+/*
+ * Copyright (C) 2018-2020 Stefan Westerfeld
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "sampleconv.hh"
+#include "utils.hh"
+
+#include <array>
+
+#include <assert.h>
+#include <math.h>
+
+#if defined (__x86_64__) || defined (__i386__)
+#define SAMPLE_CONV_X86 1
+#include <immintrin.h>
+#define SAMPLE_CONV_TARGET(isa) __attribute__ ((target (isa)))
+#else
+#define SAMPLE_CONV_X86 0
+#endif
+
+namespace {
+
+typedef void (*ToPCMFunc)   (const float *samples, size_t n_values, unsigned char *bytes);
+typedef void (*FromPCMFunc) (const unsigned char *bytes, size_t n_values, float *samples);
+
+struct Kernels
+{
+  SampleConv::Impl impl;
+
+  void (*float_to_int32) (const float *samples, size_t n_values, int32_t *ivalues);
+  void (*int32_to_float) (const int32_t *ivalues, size_t n_values, float *samples);
+
+  ToPCMFunc   to_pcm[4][2][2];    // [bytes per sample - 1][big endian][unsigned]
+  FromPCMFunc from_pcm[4][2][2];
+};
+
+/* for each byte of a sample: bit position within a 32 bit sample (or -1 if unused) */
+template<int BIT_DEPTH, bool BIG_END>
+constexpr std::array<int, 4>
+make_endian_shift()
+{
+  if (BIT_DEPTH == 8)
+    return { 24, -1, -1, -1 };
+  if (BIT_DEPTH == 16)
+    {
+      if (!BIG_END)
+        return { 16, 24, -1, -1 };
+      else
+        return { 24, 16, -1, -1 };
+    }
+  if (BIT_DEPTH == 24)
+    {
+      if (!BIG_END)
+        return {  8, 16, 24, -1 };
+      else
+        return { 24, 16,  8, -1 };
+    }
+  if (!BIG_END)
+    return {  0,  8, 16, 24 };
+  else
+    return { 24, 16,  8,  0 };
+}
+
+/* scalar implementation: portable, and the reference for all other implementations */
+struct ScalarKernels
+{
+  static void
+  float_to_int32 (const float *samples, size_t n_values, int32_t *ivalues)
+  {
+    const double norm      =  0x80000000LL;
+    const double min_value = -0x80000000LL;
+    const double max_value =  0x7FFFFFFF;
+
+    for (size_t i = 0; i < n_values; i++)
+      ivalues[i] = lrint (bound<double> (min_value, samples[i] * norm, max_value));
+  }
+
+  static void
+  int32_to_float (const int32_t *ivalues, size_t n_values, float *samples)
+  {
+    const double norm = 1.0 / 0x80000000LL;
+
+    for (size_t i = 0; i < n_values; i++)
+      samples[i] = ivalues[i] * norm;
+  }
+
+  template<int BIT_DEPTH, bool BIG_END, bool UNSIGNED> static void
+  to_pcm (const float *samples, size_t n_values, unsigned char *bytes)
+  {
+    constexpr int  sample_width = BIT_DEPTH / 8;
+    constexpr auto eshift = make_endian_shift<BIT_DEPTH, BIG_END>();
+    /* unsigned encoding: flip the sign bit, which is in the most significant byte */
+    constexpr unsigned char sign_flip = UNSIGNED ? 0x80 : 0x00;
+
+    const double norm      =  0x80000000LL;
+    const double min_value = -0x80000000LL;
+    const double max_value =  0x7FFFFFFF;
+
+    unsigned char *ptr = bytes;
+    for (size_t i = 0; i < n_values; i++)
+      {
+        const uint32_t sample = lrint (bound<double> (min_value, samples[i] * norm, max_value));
+
+        for (int b = 0; b < sample_width; b++)
+          ptr[b] = (sample >> eshift[b]) ^ (eshift[b] == 24 ? sign_flip : 0);
+
+        ptr += sample_width;
+      }
+  }
+
+  template<int BIT_DEPTH, bool BIG_END, bool UNSIGNED> static void
+  from_pcm (const unsigned char *bytes, size_t n_values, float *samples)
+  {
+    constexpr int  sample_width = BIT_DEPTH / 8;
+    constexpr auto eshift = make_endian_shift<BIT_DEPTH, BIG_END>();
+    constexpr unsigned char sign_flip = UNSIGNED ? 0x80 : 0x00;
+
+    const double norm = 1.0 / 0x80000000LL;
+
+    const unsigned char *ptr = bytes;
+    for (size_t i = 0; i < n_values; i++)
+      {
+        uint32_t u32 = 0;
+
+        for (int b = 0; b < sample_width; b++)
+          u32 |= uint32_t (ptr[b] ^ (eshift[b] == 24 ? sign_flip : 0)) << eshift[b];
+
+        samples[i] = int32_t (u32) * norm;
+        ptr += sample_width;
+      }
+  }
+};
+
+#if SAMPLE_CONV_X86
+
+/* The SIMD versions convert with the same rounding (round to nearest even) and
+ * clipping as lrint (bound (...)) in the scalar code. The float to int conversion
+ * instruction returns 0x80000000 for values that don't fit, which is right for
+ * negative values but needs to be fixed for positive values (and NaN, which
+ * lrint converts to 0).
+ */
+SAMPLE_CONV_TARGET ("sse2") static inline __m128i
+sse2_float_to_int32 (__m128 samples)
+{
+  const __m128 norm = _mm_set1_ps (2147483648.f);
+  const __m128 v    = _mm_mul_ps (samples, norm);
+
+  __m128i i = _mm_cvtps_epi32 (v);
+  i = _mm_xor_si128 (i, _mm_castps_si128 (_mm_cmpge_ps (v, norm)));
+  return _mm_and_si128 (i, _mm_castps_si128 (_mm_cmpord_ps (v, v)));
+}
+
+SAMPLE_CONV_TARGET ("sse2") static inline __m128
+sse2_int32_to_float (__m128i ivalues)
+{
+  return _mm_mul_ps (_mm_cvtepi32_ps (ivalues), _mm_set1_ps (1.f / 2147483648.f));
+}
+
+SAMPLE_CONV_TARGET ("sse2") static inline __m128i
+sse2_bswap16 (__m128i x)
+{
+  return _mm_or_si128 (_mm_slli_epi16 (x, 8), _mm_srli_epi16 (x, 8));
+}
+
+SAMPLE_CONV_TARGET ("sse2") static inline __m128i
+sse2_bswap32 (__m128i x)
+{
+  x = sse2_bswap16 (x);
+  return _mm_or_si128 (_mm_slli_epi32 (x, 16), _mm_srli_epi32 (x, 16));
+}
+
+struct SSE2Kernels
+{
+  SAMPLE_CONV_TARGET ("sse2") static void
+  float_to_int32 (const float *samples, size_t n_values, int32_t *ivalues)
+  {
+    size_t i = 0;
+    for (; i + 4 <= n_values; i += 4)
+      _mm_storeu_si128 ((__m128i *) (ivalues + i), sse2_float_to_int32 (_mm_loadu_ps (samples + i)));
+
+    ScalarKernels::float_to_int32 (samples + i, n_values - i, ivalues + i);
+  }
+
+  SAMPLE_CONV_TARGET ("sse2") static void
+  int32_to_float (const int32_t *ivalues, size_t n_values, float *samples)
+  {
+    size_t i = 0;
+    for (; i + 4 <= n_values; i += 4)
+      _mm_storeu_ps (samples + i, sse2_int32_to_float (_mm_loadu_si128 ((const __m128i *) (ivalues + i))));
+
+    ScalarKernels::int32_to_float (ivalues + i, n_values - i, samples + i);
+  }
+
+  template<int BIT_DEPTH, bool BIG_END, bool UNSIGNED> SAMPLE_CONV_TARGET ("sse2") static void
+  to_pcm (const float *samples, size_t n_values, unsigned char *bytes)
+  {
+    constexpr int sample_width = BIT_DEPTH / 8;
+
+    size_t i = 0;
+    if (BIT_DEPTH == 16)
+      {
+        for (; i + 8 <= n_values; i += 8)
+          {
+            __m128i a = _mm_srai_epi32 (sse2_float_to_int32 (_mm_loadu_ps (samples + i)), 16);
+            __m128i b = _mm_srai_epi32 (sse2_float_to_int32 (_mm_loadu_ps (samples + i + 4)), 16);
+            __m128i x = _mm_packs_epi32 (a, b);
+            if (UNSIGNED)
+              x = _mm_xor_si128 (x, _mm_set1_epi16 (-0x8000));
+            if (BIG_END)
+              x = sse2_bswap16 (x);
+            _mm_storeu_si128 ((__m128i *) (bytes + 2 * i), x);
+          }
+      }
+    if (BIT_DEPTH == 24)
+      {
+        /* no byte shuffle instruction in SSE2: pack the bytes using scalar code */
+        alignas (16) int32_t ivalues[4];
+        for (; i + 4 <= n_values; i += 4)
+          {
+            _mm_store_si128 ((__m128i *) ivalues, sse2_float_to_int32 (_mm_loadu_ps (samples + i)));
+
+            unsigned char *ptr = bytes + 3 * i;
+            for (int j = 0; j < 4; j++)
+              {
+                const uint32_t s = ivalues[j] ^ (UNSIGNED ? 0x80000000 : 0);
+                ptr[0] = s >> (BIG_END ? 24 : 8);
+                ptr[1] = s >> 16;
+                ptr[2] = s >> (BIG_END ? 8 : 24);
+                ptr += 3;
+              }
+          }
+      }
+    if (BIT_DEPTH == 32)
+      {
+        for (; i + 4 <= n_values; i += 4)
+          {
+            __m128i x = sse2_float_to_int32 (_mm_loadu_ps (samples + i));
+            if (UNSIGNED)
+              x = _mm_xor_si128 (x, _mm_set1_epi32 (0x80000000));
+            if (BIG_END)
+              x = sse2_bswap32 (x);
+            _mm_storeu_si128 ((__m128i *) (bytes + 4 * i), x);
+          }
+      }
+    ScalarKernels::to_pcm<BIT_DEPTH, BIG_END, UNSIGNED> (samples + i, n_values - i, bytes + sample_width * i);
+  }
+
+  template<int BIT_DEPTH, bool BIG_END, bool UNSIGNED> SAMPLE_CONV_TARGET ("sse2") static void
+  from_pcm (const unsigned char *bytes, size_t n_values, float *samples)
+  {
+    constexpr int sample_width = BIT_DEPTH / 8;
+
+    size_t i = 0;
+    if (BIT_DEPTH == 16)
+      {
+        for (; i + 8 <= n_values; i += 8)
+          {
+            __m128i x = _mm_loadu_si128 ((const __m128i *) (bytes + 2 * i));
+            if (BIG_END)
+              x = sse2_bswap16 (x);
+            if (UNSIGNED)
+              x = _mm_xor_si128 (x, _mm_set1_epi16 (-0x8000));
+
+            /* interleave with zeros: 16 bit value in the upper half of the 32 bit value */
+            const __m128i zero = _mm_setzero_si128();
+            _mm_storeu_ps (samples + i,     sse2_int32_to_float (_mm_unpacklo_epi16 (zero, x)));
+            _mm_storeu_ps (samples + i + 4, sse2_int32_to_float (_mm_unpackhi_epi16 (zero, x)));
+          }
+      }
+    if (BIT_DEPTH == 24)
+      {
+        auto get = [] (const unsigned char *ptr) -> int {
+          const uint32_t s = (uint32_t (ptr[0]) << (BIG_END ? 24 : 8)) |
+                             (uint32_t (ptr[1]) << 16) |
+                             (uint32_t (ptr[2]) << (BIG_END ? 8 : 24));
+          return s ^ (UNSIGNED ? 0x80000000 : 0);
+        };
+        for (; i + 4 <= n_values; i += 4)
+          {
+            const unsigned char *ptr = bytes + 3 * i;
+            const __m128i x = _mm_setr_epi32 (get (ptr), get (ptr + 3), get (ptr + 6), get (ptr + 9));
+            _mm_storeu_ps (samples + i, sse2_int32_to_float (x));
+          }
+      }
+    if (BIT_DEPTH == 32)
+      {
+        for (; i + 4 <= n_values; i += 4)
+          {
+            __m128i x = _mm_loadu_si128 ((const __m128i *) (bytes + 4 * i));
+            if (BIG_END)
+              x = sse2_bswap32 (x);
+            if (UNSIGNED)
+              x = _mm_xor_si128 (x, _mm_set1_epi32 (0x80000000));
+            _mm_storeu_ps (samples + i, sse2_int32_to_float (x));
+          }
+      }
+    ScalarKernels::from_pcm<BIT_DEPTH, BIG_END, UNSIGNED> (bytes + sample_width * i, n_values - i, samples + i);
+  }
+};
+
+SAMPLE_CONV_TARGET ("avx2") static inline __m256i
+avx2_float_to_int32 (__m256 samples)
+{
+  const __m256 norm = _mm256_set1_ps (2147483648.f);
+  const __m256 v    = _mm256_mul_ps (samples, norm);
+
+  __m256i i = _mm256_cvtps_epi32 (v);
+  i = _mm256_xor_si256 (i, _mm256_castps_si256 (_mm256_cmp_ps (v, norm, _CMP_GE_OQ)));
+  return _mm256_and_si256 (i, _mm256_castps_si256 (_mm256_cmp_ps (v, v, _CMP_ORD_Q)));
+}
+
+SAMPLE_CONV_TARGET ("avx2") static inline __m256
+avx2_int32_to_float (__m256i ivalues)
+{
+  return _mm256_mul_ps (_mm256_cvtepi32_ps (ivalues), _mm256_set1_ps (1.f / 2147483648.f));
+}
+
+SAMPLE_CONV_TARGET ("avx2") static inline __m256i
+avx2_bswap16 (__m256i x)
+{
+  return _mm256_or_si256 (_mm256_slli_epi16 (x, 8), _mm256_srli_epi16 (x, 8));
+}
+
+SAMPLE_CONV_TARGET ("avx2") static inline __m256i
+avx2_bswap32 (__m256i x)
+{
+  const __m256i shuffle = _mm256_setr_epi8 (3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12,
+                                            3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12);
+  return _mm256_shuffle_epi8 (x, shuffle);
+}
+
+struct AVX2Kernels
+{
+  SAMPLE_CONV_TARGET ("avx2") static void
+  float_to_int32 (const float *samples, size_t n_values, int32_t *ivalues)
+  {
+    size_t i = 0;
+    for (; i + 8 <= n_values; i += 8)
+      _mm256_storeu_si256 ((__m256i *) (ivalues + i), avx2_float_to_int32 (_mm256_loadu_ps (samples + i)));
+
+    ScalarKernels::float_to_int32 (samples + i, n_values - i, ivalues + i);
+  }
+
+  SAMPLE_CONV_TARGET ("avx2") static void
+  int32_to_float (const int32_t *ivalues, size_t n_values, float *samples)
+  {
+    size_t i = 0;
+    for (; i + 8 <= n_values; i += 8)
+      _mm256_storeu_ps (samples + i, avx2_int32_to_float (_mm256_loadu_si256 ((const __m256i *) (ivalues + i))));
+
+    ScalarKernels::int32_to_float (ivalues + i, n_values - i, samples + i);
+  }
+
+  template<int BIT_DEPTH, bool BIG_END, bool UNSIGNED> SAMPLE_CONV_TARGET ("avx2") static void
+  to_pcm (const float *samples, size_t n_values, unsigned char *bytes)
+  {
+    constexpr int sample_width = BIT_DEPTH / 8;
+
+    size_t i = 0;
+    if (BIT_DEPTH == 16)
+      {
+        for (; i + 16 <= n_values; i += 16)
+          {
+            __m256i a = _mm256_srai_epi32 (avx2_float_to_int32 (_mm256_loadu_ps (samples + i)), 16);
+            __m256i b = _mm256_srai_epi32 (avx2_float_to_int32 (_mm256_loadu_ps (samples + i + 8)), 16);
+
+            /* packs works within 128 bit lanes: restore sample order afterwards */
+            __m256i x = _mm256_permute4x64_epi64 (_mm256_packs_epi32 (a, b), 0xd8);
+            if (UNSIGNED)
+              x = _mm256_xor_si256 (x, _mm256_set1_epi16 (-0x8000));
+            if (BIG_END)
+              x = avx2_bswap16 (x);
+            _mm256_storeu_si256 ((__m256i *) (bytes + 2 * i), x);
+          }
+      }
+    if (BIT_DEPTH == 24)
+      {
+        /* pack the upper three bytes of each 32 bit value: 12 bytes per 128 bit lane */
+        const __m256i shuffle = BIG_END ?
+          _mm256_setr_epi8 (3, 2, 1, 7, 6, 5, 11, 10, 9, 15, 14, 13, -1, -1, -1, -1,
+                            3, 2, 1, 7, 6, 5, 11, 10, 9, 15, 14, 13, -1, -1, -1, -1) :
+          _mm256_setr_epi8 (1, 2, 3, 5, 6, 7, 9, 10, 11, 13, 14, 15, -1, -1, -1, -1,
+                            1, 2, 3, 5, 6, 7, 9, 10, 11, 13, 14, 15, -1, -1, -1, -1);
+
+        /* each iteration writes 4 bytes more than 8 samples, which are overwritten by the next iteration */
+        for (; i + 10 <= n_values; i += 8)
+          {
+            __m256i x = avx2_float_to_int32 (_mm256_loadu_ps (samples + i));
+            if (UNSIGNED)
+              x = _mm256_xor_si256 (x, _mm256_set1_epi32 (0x80000000));
+            x = _mm256_shuffle_epi8 (x, shuffle);
+
+            _mm_storeu_si128 ((__m128i *) (bytes + 3 * i),      _mm256_castsi256_si128 (x));
+            _mm_storeu_si128 ((__m128i *) (bytes + 3 * i + 12), _mm256_extracti128_si256 (x, 1));
+          }
+      }
+    if (BIT_DEPTH == 32)
+      {
+        for (; i + 8 <= n_values; i += 8)
+          {
+            __m256i x = avx2_float_to_int32 (_mm256_loadu_ps (samples + i));
+            if (UNSIGNED)
+              x = _mm256_xor_si256 (x, _mm256_set1_epi32 (0x80000000));
+            if (BIG_END)
+              x = avx2_bswap32 (x);
+            _mm256_storeu_si256 ((__m256i *) (bytes + 4 * i), x);
+          }
+      }
+    ScalarKernels::to_pcm<BIT_DEPTH, BIG_END, UNSIGNED> (samples + i, n_values - i, bytes + sample_width * i);
+  }
+
+  template<int BIT_DEPTH, bool BIG_END, bool UNSIGNED> SAMPLE_CONV_TARGET ("avx2") static void
+  from_pcm (const unsigned char *bytes, size_t n_values, float *samples)
+  {
+    constexpr int sample_width = BIT_DEPTH / 8;
+
+    size_t i = 0;
+    if (BIT_DEPTH == 16)
+      {
+        for (; i + 8 <= n_values; i += 8)
+          {
+            __m128i x = _mm_loadu_si128 ((const __m128i *) (bytes + 2 * i));
+            if (BIG_END)
+              x = sse2_bswap16 (x);
+            if (UNSIGNED)
+              x = _mm_xor_si128 (x, _mm_set1_epi16 (-0x8000));
+
+            const __m256i ivalues = _mm256_slli_epi32 (_mm256_cvtepi16_epi32 (x), 16);
+            _mm256_storeu_ps (samples + i, avx2_int32_to_float (ivalues));
+          }
+      }
+    if (BIT_DEPTH == 24)
+      {
+        /* move the three bytes of each sample to the upper three bytes of a 32 bit value */
+        const __m256i shuffle = BIG_END ?
+          _mm256_setr_epi8 (-1, 2, 1, 0, -1, 5, 4, 3, -1, 8, 7, 6, -1, 11, 10, 9,
+                            -1, 2, 1, 0, -1, 5, 4, 3, -1, 8, 7, 6, -1, 11, 10, 9) :
+          _mm256_setr_epi8 (-1, 0, 1, 2, -1, 3, 4, 5, -1, 6, 7, 8, -1, 9, 10, 11,
+                            -1, 0, 1, 2, -1, 3, 4, 5, -1, 6, 7, 8, -1, 9, 10, 11);
+
+        /* each iteration reads 4 bytes more than 8 samples, so stop early enough to stay within the input */
+        for (; i + 10 <= n_values; i += 8)
+          {
+            const __m128i lo = _mm_loadu_si128 ((const __m128i *) (bytes + 3 * i));
+            const __m128i hi = _mm_loadu_si128 ((const __m128i *) (bytes + 3 * i + 12));
+
+            __m256i x = _mm256_shuffle_epi8 (_mm256_inserti128_si256 (_mm256_castsi128_si256 (lo), hi, 1), shuffle);
+            if (UNSIGNED)
+              x = _mm256_xor_si256 (x, _mm256_set1_epi32 (0x80000000));
+            _mm256_storeu_ps (samples + i, avx2_int32_to_float (x));
+          }
+      }
+    if (BIT_DEPTH == 32)
+      {
+        for (; i + 8 <= n_values; i += 8)
+          {
+            __m256i x = _mm256_loadu_si256 ((const __m256i *) (bytes + 4 * i));
+            if (BIG_END)
+              x = avx2_bswap32 (x);
+            if (UNSIGNED)
+              x = _mm256_xor_si256 (x, _mm256_set1_epi32 (0x80000000));
+            _mm256_storeu_ps (samples + i, avx2_int32_to_float (x));
+          }
+      }
+    ScalarKernels::from_pcm<BIT_DEPTH, BIG_END, UNSIGNED> (bytes + sample_width * i, n_values - i, samples + i);
+  }
+};
+
+#endif /* SAMPLE_CONV_X86 */
+
+template<class K, int BIT_DEPTH, bool BIG_END, bool UNSIGNED> void
+fill_pcm_kernels (Kernels& kernels)
+{
+  kernels.to_pcm[BIT_DEPTH / 8 - 1][BIG_END][UNSIGNED]   = K::template to_pcm<BIT_DEPTH, BIG_END, UNSIGNED>;
+  kernels.from_pcm[BIT_DEPTH / 8 - 1][BIG_END][UNSIGNED] = K::template from_pcm<BIT_DEPTH, BIG_END, UNSIGNED>;
+}
+
+template<class K, int BIT_DEPTH> void
+fill_pcm_kernels (Kernels& kernels)
+{
+  fill_pcm_kernels<K, BIT_DEPTH, false, false> (kernels);
+  fill_pcm_kernels<K, BIT_DEPTH, false, true>  (kernels);
+  fill_pcm_kernels<K, BIT_DEPTH, true,  false> (kernels);
+  fill_pcm_kernels<K, BIT_DEPTH, true,  true>  (kernels);
+}
+
+template<class K> Kernels
+make_kernels (SampleConv::Impl impl)
+{
+  Kernels kernels;
+
+  kernels.impl = impl;
+  kernels.float_to_int32 = K::float_to_int32;
+  kernels.int32_to_float = K::int32_to_float;
+
+  /* 8 bit samples are rare enough to always use the scalar code */
+  fill_pcm_kernels<ScalarKernels, 8> (kernels);
+  fill_pcm_kernels<K, 16> (kernels);
+  fill_pcm_kernels<K, 24> (kernels);
+  fill_pcm_kernels<K, 32> (kernels);
+  return kernels;
+}
+
+const Kernels *
+kernels_for (SampleConv::Impl impl)
+{
+  static const Kernels scalar_kernels = make_kernels<ScalarKernels> (SampleConv::Impl::SCALAR);
+#if SAMPLE_CONV_X86
+  static const Kernels sse2_kernels = make_kernels<SSE2Kernels> (SampleConv::Impl::SSE2);
+  static const Kernels avx2_kernels = make_kernels<AVX2Kernels> (SampleConv::Impl::AVX2);
+
+  if (impl == SampleConv::Impl::SSE2)
+    return &sse2_kernels;
+  if (impl == SampleConv::Impl::AVX2)
+    return &avx2_kernels;
+#endif
+  return &scalar_kernels;
+}
+
+const Kernels *&
+active_kernels()
+{
+  static const Kernels *kernels = kernels_for (SampleConv::best_impl());
+  return kernels;
+}
+
+}
+
+bool
+SampleConv::supported (Impl impl)
+{
+#if SAMPLE_CONV_X86
+  __builtin_cpu_init();
+  if (impl == Impl::SSE2)
+    return __builtin_cpu_supports ("sse2");
+  if (impl == Impl::AVX2)
+    return __builtin_cpu_supports ("avx2");
+#endif
+  return impl == Impl::SCALAR;
+}
+
+SampleConv::Impl
+SampleConv::best_impl()
+{
+  for (auto impl : { Impl::AVX2, Impl::SSE2 })
+    if (supported (impl))
+      return impl;
+
+  return Impl::SCALAR;
+}
+
+void
+SampleConv::set_impl (Impl impl)
+{
+  assert (supported (impl));
+
+  active_kernels() = kernels_for (impl);
+}
+
+SampleConv::Impl
+SampleConv::impl()
+{
+  return active_kernels()->impl;
+}
+
+const char *
+SampleConv::impl_name (Impl impl)
+{
+  switch (impl)
+    {
+      case Impl::SCALAR: return "scalar";
+      case Impl::SSE2:   return "sse2";
+      case Impl::AVX2:   return "avx2";
+    }
+  return "unknown";
+}
+
+void
+SampleConv::float_to_int32 (const float *samples, size_t n_values, int32_t *ivalues)
+{
+  active_kernels()->float_to_int32 (samples, n_values, ivalues);
+}
+
+void
+SampleConv::int32_to_float (const int32_t *ivalues, size_t n_values, float *samples)
+{
+  active_kernels()->int32_to_float (ivalues, n_values, samples);
+}
+
+void
+SampleConv::float_to_pcm (const float *samples, size_t n_values, unsigned char *bytes,
+                          int bit_depth, RawFormat::Endian endian, RawFormat::Encoding encoding)
+{
+  assert (bit_depth == 8 || bit_depth == 16 || bit_depth == 24 || bit_depth == 32);
+  assert (encoding == RawFormat::SIGNED || encoding == RawFormat::UNSIGNED);
+
+  auto to_pcm = active_kernels()->to_pcm[bit_depth / 8 - 1][endian == RawFormat::BIG][encoding == RawFormat::UNSIGNED];
+  to_pcm (samples, n_values, bytes);
+}
+
+void
+SampleConv::pcm_to_float (const unsigned char *bytes, size_t n_values, float *samples,
+                          int bit_depth, RawFormat::Endian endian, RawFormat::Encoding encoding)
+{
+  assert (bit_depth == 8 || bit_depth == 16 || bit_depth == 24 || bit_depth == 32);
+  assert (encoding == RawFormat::SIGNED || encoding == RawFormat::UNSIGNED);
+
+  auto from_pcm = active_kernels()->from_pcm[bit_depth / 8 - 1][endian == RawFormat::BIG][encoding == RawFormat::UNSIGNED];
+  from_pcm (bytes, n_values, samples);
+}
@@ -0,0 +1,55 @@
+/*
+ * Copyright (C) 2018-2020 Stefan Westerfeld
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef AUDIOWMARK_SAMPLE_CONV_HH
+#define AUDIOWMARK_SAMPLE_CONV_HH
+
+#include <stdint.h>
+
+#include "rawinputstream.hh"
+
+/* conversion between float samples and integer sample formats
+ *
+ * all implementations produce bit-exact identical results; the fastest one
+ * supported by the cpu is selected at runtime (SSE2/AVX2 on x86)
+ *
+ * the normalization is the same for all formats: a float sample of 1.0
+ * corresponds to 2^31 in 32 bit integer representation, smaller integer
+ * formats use the upper bits of the 32 bit value (with clipping)
+ */
+class SampleConv
+{
+public:
+  enum class Impl { SCALAR, SSE2, AVX2 };
+
+  static Impl        best_impl();
+  static bool        supported (Impl impl);
+  static void        set_impl (Impl impl); // for tests and benchmarks
+  static Impl        impl();
+  static const char *impl_name (Impl impl);
+
+  static void float_to_int32 (const float *samples, size_t n_values, int32_t *ivalues);
+  static void int32_to_float (const int32_t *ivalues, size_t n_values, float *samples);
+
+  /* bit_depth can be 8, 16, 24 or 32 (bytes must have room for n_values samples) */
+  static void float_to_pcm (const float *samples, size_t n_values, unsigned char *bytes,
+                            int bit_depth, RawFormat::Endian endian, RawFormat::Encoding encoding);
+  static void pcm_to_float (const unsigned char *bytes, size_t n_values, float *samples,
+                            int bit_depth, RawFormat::Endian endian, RawFormat::Encoding encoding);
+};
+
+#endif /* AUDIOWMARK_SAMPLE_CONV_HH */
@@ -16,8 +16,10 @@
  */
 
 #include "sfinputstream.hh"
+#include "sampleconv.hh"
 
 #include <assert.h>
+#include <errno.h>
 #include <string.h>
 #include <unistd.h>
 
@@ -45,6 +47,28 @@ SFInputStream::open (const string& filename)
   });
 }
 
+/* open stdin after the first bytes (prefix) have been read for format detection
+ *
+ * if prefix is empty, stdin is read directly (from the start); otherwise libsndfile reads
+ * using virtual io, which returns the prefix bytes followed by the rest of stdin
+ */
+Error
+SFInputStream::open_stdin (const vector<unsigned char>& prefix)
+{
+  if (prefix.empty())
+    return open ("-");
+
+  m_stdin_data.head       = prefix;
+  m_stdin_data.stream_pos = prefix.size();
+
+  Error err = open ([&] (SF_INFO *sfinfo) {
+    m_is_stdin = true;
+    return sf_open_virtual (&m_stdin_data.io, SFM_READ, sfinfo, &m_stdin_data);
+  });
+  /* header is parsed: sample data is not kept */
+  m_stdin_data.keep_head = false;
+  return err;
+}
 
 Error
 SFInputStream::open (std::function<SNDFILE* (SF_INFO *)> open_func)
@@ -70,6 +94,7 @@ SFInputStream::open (std::function<SNDFILE* (SF_INFO *)> open_func)
   m_n_channels  = sfinfo.channels;
   m_n_frames    = (sfinfo.frames == SF_COUNT_MAX) ? N_FRAMES_UNKNOWN : sfinfo.frames;
   m_sample_rate = sfinfo.samplerate;
+  m_is_flac     = (sfinfo.format & SF_FORMAT_TYPEMASK) == SF_FORMAT_FLAC;
 
   switch (sfinfo.format & SF_FORMAT_SUBMASK)
     {
@@ -121,26 +146,25 @@ SFInputStream::bit_depth() const
 }
 
 Error
-SFInputStream::read_frames (vector<float>& samples, size_t count)
+SFInputStream::read_frames (float *samples, size_t count, size_t& frames_read)
 {
   assert (m_state == State::OPEN);
 
+  frames_read = 0;
   if (m_read_float_data) /* float or double input */
     {
-      samples.resize (count * m_n_channels);
-
-      sf_count_t r_count = sf_readf_float (m_sndfile, &samples[0], count);
+      sf_count_t r_count = sf_readf_float (m_sndfile, samples, count);
 
       if (sf_error (m_sndfile))
         return Error (sf_strerror (m_sndfile));
 
-      samples.resize (r_count * m_n_channels);
+      frames_read = r_count;
     }
   else /* integer input */
     {
-      vector<int> isamples (count * m_n_channels);
+      m_isamples.resize (count * m_n_channels);
 
-      sf_count_t r_count = sf_readf_int (m_sndfile, &isamples[0], count);
+      sf_count_t r_count = sf_readf_int (m_sndfile, m_isamples.data(), count);
 
       if (sf_error (m_sndfile))
         return Error (sf_strerror (m_sndfile));
@@ -153,15 +177,26 @@ SFInputStream::read_frames (vector<float>& samples, size_t count)
        * and float manually - the important part is that the normalization factors
        * used during read and write are identical
        */
-      samples.resize (r_count * m_n_channels);
-      const double norm = 1.0 / 0x80000000LL;
-      for (size_t i = 0; i < samples.size(); i++)
-        samples[i] = isamples[i] * norm;
+      SampleConv::int32_to_float (m_isamples.data(), r_count * m_n_channels, samples);
+
+      frames_read = r_count;
     }
 
   return Error::Code::NONE;
 }
 
+/* flac seeking is sample accurate, so decoding after seek gives the same samples as serial decoding */
+Error
+SFInputStream::seek (size_t frame)
+{
+  assert (m_state == State::OPEN);
+
+  if (sf_seek (m_sndfile, frame, SEEK_SET) < 0)
+    return Error (sf_strerror (m_sndfile));
+
+  return Error::Code::NONE;
+}
+
 void
 SFInputStream::close()
 {
@@ -295,3 +330,109 @@ SFInputStream::open (const vector<unsigned char> *data)
     return sf_open_virtual (&m_virtual_data.io, SFM_READ, sfinfo, &m_virtual_data);
   });
 }
+
+static size_t
+read_stdin_bytes (unsigned char *ptr, size_t count)
+{
+  size_t n = 0;
+  while (n < count)
+    {
+      ssize_t r = read (STDIN_FILENO, ptr + n, count - n);
+      if (r == -1 && errno == EINTR)
+        continue;
+      if (r <= 0)
+        break;
+      n += r;
+    }
+  return n;
+}
+
+static sf_count_t
+stdin_get_len (void *data)
+{
+  return SF_COUNT_MAX; /* unknown */
+}
+
+static sf_count_t
+stdin_seek (sf_count_t offset, int whence, void *data)
+{
+  SFStdinData *sdata = static_cast<SFStdinData *> (data);
+
+  sf_count_t new_offset;
+  if (whence == SEEK_SET)
+    new_offset = offset;
+  else if (whence == SEEK_CUR)
+    new_offset = sdata->offset + offset;
+  else
+    return -1;
+
+  /* seeking forward is done when reading, seeking back is only possible within the head */
+  if (new_offset < 0 || (new_offset >= sf_count_t (sdata->head.size()) && new_offset < sdata->stream_pos))
+    return -1;
+
+  sdata->offset = new_offset;
+  return new_offset;
+}
+
+static sf_count_t
+stdin_read (void *ptr, sf_count_t count, void *data)
+{
+  SFStdinData *sdata = static_cast<SFStdinData *> (data);
+  unsigned char *uptr = static_cast<unsigned char *> (ptr);
+  sf_count_t rcount = 0;
+
+  if (sdata->offset < sf_count_t (sdata->head.size()))
+    {
+      sf_count_t n = std::min<sf_count_t> (count, sdata->head.size() - sdata->offset);
+      memcpy (uptr, &sdata->head[sdata->offset], n);
+      sdata->offset += n;
+      rcount += n;
+    }
+  if (rcount < count && sdata->offset < sdata->stream_pos)
+    return rcount; /* data after the head was not kept */
+
+  while (sdata->offset > sdata->stream_pos)
+    {
+      unsigned char junk[16 * 1024];
+      size_t n = read_stdin_bytes (junk, std::min<sf_count_t> (sizeof (junk), sdata->offset - sdata->stream_pos));
+      if (!n)
+        return rcount;
+      if (sdata->keep_head)
+        sdata->head.insert (sdata->head.end(), junk, junk + n);
+      sdata->stream_pos += n;
+    }
+  if (rcount < count)
+    {
+      size_t n = read_stdin_bytes (uptr + rcount, count - rcount);
+      if (sdata->keep_head)
+        sdata->head.insert (sdata->head.end(), uptr + rcount, uptr + rcount + n);
+      sdata->stream_pos += n;
+      sdata->offset += n;
+      rcount += n;
+    }
+  return rcount;
+}
+
+static sf_count_t
+stdin_write (const void *ptr, sf_count_t count, void *data)
+{
+  return 0; /* read only */
+}
+
+static sf_count_t
+stdin_tell (void *data)
+{
+  SFStdinData *sdata = static_cast<SFStdinData *> (data);
+  return sdata->offset;
+}
+
+SFStdinData::SFStdinData() :
+  io {
+    stdin_get_len,
+    stdin_seek,
+    stdin_read,
+    stdin_write,
+    stdin_tell
+  }
+{
+}
@@ -35,10 +35,26 @@ struct SFVirtualData
   SF_VIRTUAL_IO               io;
 };
 
+/* to read stdin after the first bytes (prefix) have been consumed for format detection
+ *
+ * the bytes read while the header is parsed are kept, so libsndfile can seek back within the header
+ */
+struct SFStdinData
+{
+  SFStdinData();
+
+  std::vector<unsigned char>  head;
+  bool                        keep_head  = true;
+  sf_count_t                  offset     = 0;  // read position (may be ahead of stream_pos after seeking)
+  sf_count_t                  stream_pos = 0;  // number of bytes consumed from stdin (including prefix)
+  SF_VIRTUAL_IO               io;
+};
+
 class SFInputStream : public AudioInputStream
 {
 private:
   SFVirtualData m_virtual_data;
+  SFStdinData   m_stdin_data;
 
   SNDFILE    *m_sndfile = nullptr;
   int         m_n_channels = 0;
@@ -47,6 +63,8 @@ private:
   int         m_sample_rate = 0;
   bool        m_read_float_data = false;
   bool        m_is_stdin = false;
+  bool        m_is_flac = false;
+  std::vector<int> m_isamples;
 
   enum class State {
     NEW,
@@ -61,7 +79,10 @@ public:
 
   Error               open (const std::string& filename);
   Error               open (const std::vector<unsigned char> *data);
-  Error               read_frames (std::vector<float>& samples, size_t count) override;
+  Error               open_stdin (const std::vector<unsigned char>& prefix);
+  Error               read_frames (float *samples, size_t count, size_t& frames_read) override;
+  using AudioInputStream::read_frames;
+  Error               seek (size_t frame);
   void                close();
 
   int
@@ -71,6 +92,11 @@ public:
   }
   int sample_rate() const override;
   int bit_depth() const override;
+  bool
+  is_flac() const
+  {
+    return m_is_flac;
+  }
   size_t
   n_frames() const override
   {
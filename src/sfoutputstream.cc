@@ -17,6 +17,7 @@
 
 #include "sfoutputstream.hh"
 #include "utils.hh"
+#include "sampleconv.hh"
 
 #include <math.h>
 #include <assert.h>
@@ -30,15 +31,15 @@ SFOutputStream::~SFOutputStream()
 }
 
 Error
-SFOutputStream::open (const string& filename, int n_channels, int sample_rate, int bit_depth, OutFormat out_format)
+SFOutputStream::open (const string& filename, int n_channels, int sample_rate, int bit_depth, OutFormat out_format, bool float_data)
 {
   return open ([&] (SF_INFO *sfinfo) {
     return sf_open (filename.c_str(), SFM_WRITE, sfinfo);
-  }, n_channels, sample_rate, bit_depth, out_format);
+  }, n_channels, sample_rate, bit_depth, out_format, float_data);
 }
 
 Error
-SFOutputStream::open (std::function<SNDFILE* (SF_INFO *)> open_func, int n_channels, int sample_rate, int bit_depth, OutFormat out_format)
+SFOutputStream::open (std::function<SNDFILE* (SF_INFO *)> open_func, int n_channels, int sample_rate, int bit_depth, OutFormat out_format, bool float_data)
 {
   assert (m_state == State::NEW);
 
@@ -57,7 +58,12 @@ SFOutputStream::open (std::function<SNDFILE* (SF_INFO *)> open_func, int n_chann
                              break;
        default:              assert (false);
      }
-  if (bit_depth > 16)
+  if (float_data)
+    {
+      sfinfo.format |= SF_FORMAT_FLOAT;
+      m_bit_depth   = 32;
+    }
+  else if (bit_depth > 16)
     {
       sfinfo.format |= SF_FORMAT_PCM_24;
       m_bit_depth   = 24;
@@ -78,6 +84,7 @@ SFOutputStream::open (std::function<SNDFILE* (SF_INFO *)> open_func, int n_chann
 
       return Error (msg);
     }
+  m_float_data  = float_data;
   m_state       = State::OPEN;
   return Error::Code::NONE;
 }
@@ -97,25 +104,28 @@ SFOutputStream::close()
 }
 
 Error
-SFOutputStream::write_frames (const vector<float>& samples)
+SFOutputStream::write_frames (const float *samples, size_t count)
 {
-  vector<int> isamples (samples.size());
-  for (size_t i = 0; i < samples.size(); i++)
-    {
-      const double norm      =  0x80000000LL;
-      const double min_value = -0x80000000LL;
-      const double max_value =  0x7FFFFFFF;
+  sf_count_t frames = count;
+  sf_count_t w_count;
 
-      isamples[i] = lrint (bound<double> (min_value, samples[i] * norm, max_value));
+  if (m_float_data)
+    {
+      /* float output: no conversion (and no clipping) necessary */
+      w_count = sf_writef_float (m_sndfile, samples, frames);
     }
+  else
+    {
+      m_isamples.resize (count * m_n_channels);
+      SampleConv::float_to_int32 (samples, m_isamples.size(), m_isamples.data());
 
-  sf_count_t frames = samples.size() / m_n_channels;
-  sf_count_t count = sf_writef_int (m_sndfile, isamples.data(), frames);
+      w_count = sf_writef_int (m_sndfile, m_isamples.data(), frames);
+    }
 
   if (sf_error (m_sndfile))
     return Error (sf_strerror (m_sndfile));
 
-  if (count != frames)
+  if (w_count != frames)
     return Error ("writing sample data failed: short write");
 
   return Error::Code::NONE;
@@ -146,5 +156,5 @@ SFOutputStream::open (vector<unsigned char> *data, int n_channels, int sample_ra
 
   return open ([&] (SF_INFO *sfinfo) {
     return sf_open_virtual (&m_virtual_data.io, SFM_WRITE, sfinfo, &m_virtual_data);
-  }, n_channels, sample_rate, bit_depth, out_format);
+  }, n_channels, sample_rate, bit_depth, out_format, /* float_data */ false);
 }
@@ -37,6 +37,8 @@ private:
   int         m_bit_depth = 0;
   int         m_sample_rate = 0;
   int         m_n_channels = 0;
+  bool        m_float_data = false;
+  std::vector<int> m_isamples;
 
   enum class State {
     NEW,
@@ -45,13 +47,15 @@ private:
   };
   State       m_state = State::NEW;
 
-  Error open (std::function<SNDFILE* (SF_INFO *)> open_func, int n_channels, int sample_rate, int bit_depth, OutFormat out_format);
+  Error open (std::function<SNDFILE* (SF_INFO *)> open_func, int n_channels, int sample_rate, int bit_depth, OutFormat out_format, bool float_data);
 public:
   ~SFOutputStream();
 
-  Error  open (const std::string& filename, int n_channels, int sample_rate, int bit_depth, OutFormat out_format = OutFormat::WAV);
+  Error  open (const std::string& filename, int n_channels, int sample_rate, int bit_depth, OutFormat out_format = OutFormat::WAV,
+               bool float_data = false);
   Error  open (std::vector<unsigned char> *data, int n_channels, int sample_rate, int bit_depth, OutFormat out_format = OutFormat::WAV);
-  Error  write_frames (const std::vector<float>& frames) override;
+  Error  write_frames (const float *samples, size_t count) override;
+  using AudioOutputStream::write_frames;
   Error  close() override;
   int    bit_depth() const override;
   int    sample_rate() const override;
@@ -0,0 +1,86 @@
+/*
+ * Copyright (C) 2018-2020 Stefan Westerfeld
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "shminputstream.hh"
+
+#include <assert.h>
+
+using std::string;
+
+ShmInputStream::~ShmInputStream()
+{
+  close();
+}
+
+Error
+ShmInputStream::open (const string& name)
+{
+  assert (m_state == State::NEW);
+
+  Error err = m_ring.open (name);
+  if (err)
+    return err;
+
+  m_state = State::OPEN;
+  return Error::Code::NONE;
+}
+
+Error
+ShmInputStream::read_frames (float *samples, size_t count, size_t& frames_read)
+{
+  assert (m_state == State::OPEN);
+
+  return m_ring.read_frames (samples, count, frames_read);
+}
+
+void
+ShmInputStream::close()
+{
+  if (m_state == State::OPEN)
+    {
+      /* the consumer removes the ring, the producer may still have it mapped */
+      m_ring.set_closed();
+      m_ring.unlink();
+      m_ring.close();
+
+      m_state = State::CLOSED;
+    }
+}
+
+int
+ShmInputStream::bit_depth() const
+{
+  return 32; /* float */
+}
+
+int
+ShmInputStream::sample_rate() const
+{
+  return m_ring.sample_rate();
+}
+
+int
+ShmInputStream::n_channels() const
+{
+  return m_ring.n_channels();
+}
+
+size_t
+ShmInputStream::n_frames() const
+{
+  return N_FRAMES_UNKNOWN;
+}
@@ -0,0 +1,80 @@
+/*
+ * Copyright (C) 2018-2020 Stefan Westerfeld
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "shmoutputstream.hh"
+
+#include <assert.h>
+
+using std::string;
+
+ShmOutputStream::~ShmOutputStream()
+{
+  close();
+}
+
+Error
+ShmOutputStream::open (const string& name, int n_channels, int sample_rate, size_t capacity)
+{
+  assert (m_state == State::NEW);
+
+  Error err = m_ring.create (name, n_channels, sample_rate, capacity);
+  if (err)
+    return err;
+
+  m_state = State::OPEN;
+  return Error::Code::NONE;
+}
+
+int
+ShmOutputStream::sample_rate() const
+{
+  return m_ring.sample_rate();
+}
+
+int
+ShmOutputStream::bit_depth() const
+{
+  return 32; /* float */
+}
+
+int
+ShmOutputStream::n_channels() const
+{
+  return m_ring.n_channels();
+}
+
+Error
+ShmOutputStream::write_frames (const float *samples, size_t count)
+{
+  assert (m_state == State::OPEN);
+
+  return m_ring.write_frames (samples, count);
+}
+
+Error
+ShmOutputStream::close()
+{
+  if (m_state == State::OPEN)
+    {
+      /* the consumer may still read the remaining frames, it unlinks the ring when done */
+      m_ring.set_done();
+      m_ring.close();
+
+      m_state = State::CLOSED;
+    }
+  return Error::Code::NONE;
+}
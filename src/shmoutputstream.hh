@@ -0,0 +1,49 @@
+/*
+ * Copyright (C) 2018-2020 Stefan Westerfeld
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef AUDIOWMARK_SHM_OUTPUT_STREAM_HH
+#define AUDIOWMARK_SHM_OUTPUT_STREAM_HH
+
+#include "audiostream.hh"
+#include "shmring.hh"
+
+/* writes float samples to a shared memory ring buffer (see shmring.hh for the layout) */
+class ShmOutputStream : public AudioOutputStream
+{
+  enum class State {
+    NEW,
+    OPEN,
+    CLOSED
+  };
+  State       m_state = State::NEW;
+  ShmRing     m_ring;
+public:
+  static constexpr size_t default_capacity = 65536; // ring size in frames
+
+  ~ShmOutputStream();
+
+  int   bit_depth() const override;
+  int   sample_rate() const override;
+  int   n_channels()  const override;
+
+  Error open (const std::string& name, int n_channels, int sample_rate, size_t capacity = default_capacity);
+  Error write_frames (const float *samples, size_t count) override;
+  using AudioOutputStream::write_frames;
+  Error close() override;
+};
+
+#endif /* AUDIOWMARK_SHM_OUTPUT_STREAM_HH */
@@ -0,0 +1,327 @@
+/*
+ * Copyright (C) 2018-2020 Stefan Westerfeld
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "shmring.hh"
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <signal.h>
+#include <time.h>
+#include <assert.h>
+
+#include <algorithm>
+
+using std::string;
+using std::min;
+
+static_assert (sizeof (ShmRingHeader) == 192, "shm ring header layout");
+
+/* waiting is done with a timeout, so that state changes are noticed even without wakeup */
+static constexpr int  wait_timeout_ms = 100;
+static constexpr int  open_timeout_ms = 5000;
+
+static void
+futex_wait (uint32_t *addr, uint32_t value)
+{
+  struct timespec ts = { 0, wait_timeout_ms * 1000000L };
+  syscall (SYS_futex, addr, FUTEX_WAIT, value, &ts, nullptr, 0);
+}
+
+static void
+futex_wake (uint32_t *addr)
+{
+  syscall (SYS_futex, addr, FUTEX_WAKE, INT_MAX, nullptr, nullptr, 0);
+}
+
+static bool
+process_alive (uint32_t pid)
+{
+  if (!pid)
+    return true;
+  return kill (pid, 0) == 0 || errno != ESRCH;
+}
+
+/* check whether the producer or consumer of an existing ring (with a known pid) is still running */
+static bool
+ring_in_use (const string& name)
+{
+  int fd = shm_open (name.c_str(), O_RDONLY, 0);
+  if (fd < 0)
+    return false;
+
+  bool in_use = false;
+  struct stat st;
+  if (fstat (fd, &st) == 0 && size_t (st.st_size) >= sizeof (ShmRingHeader))
+    {
+      void *ptr = mmap (nullptr, sizeof (ShmRingHeader), PROT_READ, MAP_SHARED, fd, 0);
+      if (ptr != MAP_FAILED)
+        {
+          const ShmRingHeader *header = static_cast<const ShmRingHeader *> (ptr);
+          const uint32_t producer_pid = __atomic_load_n (&header->producer_pid, __ATOMIC_ACQUIRE);
+          const uint32_t consumer_pid = __atomic_load_n (&header->consumer_pid, __ATOMIC_ACQUIRE);
+
+          in_use = (producer_pid && process_alive (producer_pid)) || (consumer_pid && process_alive (consumer_pid));
+          munmap (ptr, sizeof (ShmRingHeader));
+        }
+    }
+  ::close (fd);
+  return in_use;
+}
+
+/* shm_open needs names like "/name" */
+static string
+shm_name (const string& name)
+{
+  return name.size() && name[0] == '/' ? name : "/" + name;
+}
+
+ShmRing::~ShmRing()
+{
+  close();
+}
+
+Error
+ShmRing::map (int fd, size_t size)
+{
+  void *ptr = mmap (nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if (ptr == MAP_FAILED)
+    return Error (string_printf ("mmap failed: %s", strerror (errno)));
+
+  m_map_size = size;
+  m_header   = static_cast<ShmRingHeader *> (ptr);
+  m_samples  = reinterpret_cast<float *> (m_header + 1);
+  return Error::Code::NONE;
+}
+
+Error
+ShmRing::create (const string& name, int n_channels, int sample_rate, size_t capacity)
+{
+  assert (!m_header);
+
+  m_name = shm_name (name);
+
+  /* an old ring with the same name (from a crashed run) is replaced, a ring that is still used is not */
+  if (ring_in_use (m_name))
+    return Error (string_printf ("shared memory ring %s is in use by another process", m_name.c_str()));
+
+  shm_unlink (m_name.c_str());
+  int fd = shm_open (m_name.c_str(), O_RDWR | O_CREAT | O_EXCL, 0644);
+  if (fd < 0)
+    return Error (string_printf ("shm_open %s failed: %s", m_name.c_str(), strerror (errno)));
+
+  const size_t size = sizeof (ShmRingHeader) + capacity * n_channels * sizeof (float);
+  Error err;
+  if (ftruncate (fd, size) < 0)
+    err = Error (string_printf ("ftruncate %s failed: %s", m_name.c_str(), strerror (errno)));
+  else
+    err = map (fd, size);
+  ::close (fd);
+  if (err)
+    {
+      shm_unlink (m_name.c_str());
+      return err;
+    }
+
+  /* the object is zero filled after ftruncate */
+  m_header->version     = version;
+  m_header->n_channels  = n_channels;
+  m_header->sample_rate = sample_rate;
+  m_header->capacity    = capacity;
+  m_header->producer_pid = getpid();
+  __atomic_store_n (&m_header->magic, magic, __ATOMIC_RELEASE);
+  return Error::Code::NONE;
+}
+
+/* the ring may not exist yet (or not be initialized) if the producer is started at the same time */
+Error
+ShmRing::open (const string& name)
+{
+  assert (!m_header);
+
+  m_name = shm_name (name);
+  for (int waited_ms = 0; ; waited_ms += 10)
+    {
+      int fd = shm_open (m_name.c_str(), O_RDWR, 0);
+      if (fd >= 0)
+        {
+          struct stat st;
+          Error err;
+          if (fstat (fd, &st) < 0)
+            err = Error (string_printf ("fstat %s failed: %s", m_name.c_str(), strerror (errno)));
+          else if (size_t (st.st_size) >= sizeof (ShmRingHeader))
+            err = map (fd, st.st_size);
+          ::close (fd);
+          if (err)
+            return err;
+
+          if (m_header && __atomic_load_n (&m_header->magic, __ATOMIC_ACQUIRE) == magic)
+            break;
+          close();
+        }
+      else if (errno != ENOENT)
+        {
+          return Error (string_printf ("shm_open %s failed: %s", m_name.c_str(), strerror (errno)));
+        }
+      if (waited_ms >= open_timeout_ms)
+        return Error (string_printf ("shared memory ring %s not found", m_name.c_str()));
+      usleep (10 * 1000);
+    }
+
+  if (m_header->version != version)
+    return Error (string_printf ("shared memory ring %s: unsupported version %u", m_name.c_str(), m_header->version));
+
+  if (m_header->n_channels < 1 || m_header->sample_rate < 1 || m_header->capacity < 1 ||
+      m_map_size < sizeof (ShmRingHeader) + m_header->capacity * m_header->n_channels * sizeof (float))
+    return Error (string_printf ("shared memory ring %s: bad header", m_name.c_str()));
+
+  __atomic_store_n (&m_header->consumer_pid, getpid(), __ATOMIC_RELEASE);
+  return Error::Code::NONE;
+}
+
+void
+ShmRing::close()
+{
+  if (m_header)
+    munmap (m_header, m_map_size);
+
+  m_header = nullptr;
+  m_samples = nullptr;
+  m_map_size = 0;
+}
+
+void
+ShmRing::unlink()
+{
+  shm_unlink (m_name.c_str());
+}
+
+Error
+ShmRing::write_frames (const float *samples, size_t count)
+{
+  const size_t   capacity   = m_header->capacity;
+  const uint32_t n_channels = m_header->n_channels;
+
+  uint64_t write_pos = m_header->write_pos;
+  while (count)
+    {
+      const uint32_t seq = __atomic_load_n (&m_header->read_seq, __ATOMIC_ACQUIRE);
+      uint64_t read_pos  = __atomic_load_n (&m_header->read_pos, __ATOMIC_ACQUIRE);
+
+      if (__atomic_load_n (&m_header->state, __ATOMIC_ACQUIRE) & STATE_CLOSED)
+        return Error ("shared memory ring was closed by the consumer");
+
+      if (write_pos - read_pos == capacity)
+        {
+          /* full: announce that we wait, then check again to avoid missing the wakeup */
+          __atomic_store_n (&m_header->producer_waiting, 1, __ATOMIC_SEQ_CST);
+          read_pos = __atomic_load_n (&m_header->read_pos, __ATOMIC_SEQ_CST);
+          if (write_pos - read_pos == capacity)
+            {
+              futex_wait (&m_header->read_seq, seq);
+              if (!process_alive (__atomic_load_n (&m_header->consumer_pid, __ATOMIC_ACQUIRE)))
+                return Error ("shared memory ring consumer terminated");
+            }
+          continue;
+        }
+      const size_t pos = write_pos % capacity;
+      const size_t n   = min<size_t> ({ count, capacity - (write_pos - read_pos), capacity - pos });
+
+      std::copy (samples, samples + n * n_channels, m_samples + pos * n_channels);
+      samples   += n * n_channels;
+      count     -= n;
+      write_pos += n;
+
+      __atomic_store_n (&m_header->write_pos, write_pos, __ATOMIC_SEQ_CST);
+      __atomic_add_fetch (&m_header->write_seq, 1, __ATOMIC_SEQ_CST);
+      if (__atomic_exchange_n (&m_header->consumer_waiting, 0, __ATOMIC_SEQ_CST))
+        futex_wake (&m_header->write_seq);
+    }
+  return Error::Code::NONE;
+}
+
+void
+ShmRing::set_done()
+{
+  __atomic_or_fetch (&m_header->state, STATE_DONE, __ATOMIC_SEQ_CST);
+  __atomic_add_fetch (&m_header->write_seq, 1, __ATOMIC_SEQ_CST);
+  futex_wake (&m_header->write_seq);
+}
+
+Error
+ShmRing::read_frames (float *samples, size_t count, size_t& frames_read)
+{
+  const size_t   capacity   = m_header->capacity;
+  const uint32_t n_channels = m_header->n_channels;
+
+  uint64_t read_pos = m_header->read_pos;
+  frames_read = 0;
+  while (frames_read < count)
+    {
+      const uint32_t seq = __atomic_load_n (&m_header->write_seq, __ATOMIC_ACQUIRE);
+      const bool done    = __atomic_load_n (&m_header->state, __ATOMIC_ACQUIRE) & STATE_DONE;
+      uint64_t write_pos = __atomic_load_n (&m_header->write_pos, __ATOMIC_ACQUIRE);
+
+      if (write_pos == read_pos)
+        {
+          /* the producer sets the done flag after writing the last frames */
+          if (done)
+            break;
+
+          /* empty: announce that we wait, then check again to avoid missing the wakeup */
+          __atomic_store_n (&m_header->consumer_waiting, 1, __ATOMIC_SEQ_CST);
+          write_pos = __atomic_load_n (&m_header->write_pos, __ATOMIC_SEQ_CST);
+          if (write_pos == read_pos)
+            {
+              futex_wait (&m_header->write_seq, seq);
+
+              /* a producer that sets the done flag and exits is fine */
+              if (!process_alive (m_header->producer_pid) &&
+                  !(__atomic_load_n (&m_header->state, __ATOMIC_ACQUIRE) & STATE_DONE))
+                return Error ("shared memory ring producer terminated");
+            }
+          continue;
+        }
+      const size_t pos = read_pos % capacity;
+      const size_t n   = min<size_t> ({ count - frames_read, write_pos - read_pos, capacity - pos });
+
+      const float *src = m_samples + pos * n_channels;
+      std::copy (src, src + n * n_channels, samples + frames_read * n_channels);
+      frames_read += n;
+      read_pos    += n;
+
+      __atomic_store_n (&m_header->read_pos, read_pos, __ATOMIC_SEQ_CST);
+      __atomic_add_fetch (&m_header->read_seq, 1, __ATOMIC_SEQ_CST);
+      if (__atomic_exchange_n (&m_header->producer_waiting, 0, __ATOMIC_SEQ_CST))
+        futex_wake (&m_header->read_seq);
+    }
+  return Error::Code::NONE;
+}
+
+void
+ShmRing::set_closed()
+{
+  __atomic_or_fetch (&m_header->state, STATE_CLOSED, __ATOMIC_SEQ_CST);
+  __atomic_add_fetch (&m_header->read_seq, 1, __ATOMIC_SEQ_CST);
+  futex_wake (&m_header->read_seq);
+}
@@ -0,0 +1,118 @@
+/*
+ * Copyright (C) 2018-2020 Stefan Westerfeld
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef AUDIOWMARK_SHM_RING_HH
+#define AUDIOWMARK_SHM_RING_HH
+
+#include <string>
+
+#include <stdint.h>
+
+#include "utils.hh"
+
+/*
+ * Lock-free single producer / single consumer ring buffer for audio samples in POSIX shared
+ * memory (shm_open), so that processes written in any language can exchange audio with
+ * audiowmark without copying it through the kernel (as pipes do).
+ *
+ * The shared memory object starts with a 192 byte header (native byte order):
+ *
+ *   offset  type      field
+ *        0  uint32    magic            0x42525741 ("AWRB"), written last by the creator
+ *        4  uint32    version          1
+ *        8  uint32    n_channels
+ *       12  uint32    sample_rate
+ *       16  uint64    capacity         ring size in frames
+ *       24  uint32    state            bit 0: producer done (no more frames), bit 1: consumer closed
+ *       28  uint32    producer_pid     process id of the producer (0: unknown)
+ *       32  uint32    consumer_pid     process id of the consumer (0: unknown)
+ *       64  uint64    write_pos        total number of frames written (only changed by the producer)
+ *       72  uint32    write_seq        incremented after each write, futex word the consumer waits on
+ *       76  uint32    consumer_waiting set to 1 by the consumer before it waits on write_seq
+ *      128  uint64    read_pos         total number of frames read (only changed by the consumer)
+ *      136  uint32    read_seq         incremented after each read, futex word the producer waits on
+ *      140  uint32    producer_waiting set to 1 by the producer before it waits on read_seq
+ *      192  float32[] samples          capacity * n_channels interleaved samples
+ *
+ * Frame number f is stored at index (f % capacity). The producer writes samples, then stores
+ * write_pos (release), increments write_seq and wakes the consumer (FUTEX_WAKE on write_seq)
+ * if consumer_waiting was set; the consumer does the same with read_pos / read_seq after
+ * reading. Both sides may also poll the positions instead of using futexes.
+ *
+ * The producer creates the object, the consumer unlinks it when it is done. While waiting,
+ * each side checks whether the other process still exists (if its pid is known), so that a
+ * crashed peer results in an error instead of a hang. An existing object is only replaced by
+ * create() if none of the processes in its header are running anymore. Processes in a different pid namespace
+ * should leave their pid at 0.
+ */
+struct ShmRingHeader
+{
+  uint32_t magic;
+  uint32_t version;
+  uint32_t n_channels;
+  uint32_t sample_rate;
+  uint64_t capacity;
+  uint32_t state;
+  uint32_t producer_pid;
+  uint32_t consumer_pid;
+  uint32_t pad0[7];
+
+  uint64_t write_pos;
+  uint32_t write_seq;
+  uint32_t consumer_waiting;
+  uint32_t pad1[12];
+
+  uint64_t read_pos;
+  uint32_t read_seq;
+  uint32_t producer_waiting;
+  uint32_t pad2[12];
+};
+
+class ShmRing
+{
+  ShmRingHeader *m_header = nullptr;
+  float         *m_samples = nullptr;
+  size_t         m_map_size = 0;
+  std::string    m_name;
+
+  Error map (int fd, size_t size);
+public:
+  static constexpr uint32_t magic          = 0x42525741;
+  static constexpr uint32_t version        = 1;
+  static constexpr uint32_t STATE_DONE     = 1;
+  static constexpr uint32_t STATE_CLOSED   = 2;
+
+  ~ShmRing();
+
+  Error create (const std::string& name, int n_channels, int sample_rate, size_t capacity);
+  Error open (const std::string& name);
+  void  close();
+  void  unlink();
+
+  int    n_channels() const  { return m_header->n_channels; }
+  int    sample_rate() const { return m_header->sample_rate; }
+
+  /* producer: blocks while the ring is full */
+  Error  write_frames (const float *samples, size_t count);
+  void   set_done();
+
+  /* consumer: blocks until count frames are available (returns less only after the producer is done) */
+  Error  read_frames (float *samples, size_t count, size_t& frames_read);
+  void   set_closed();
+};
+
+#endif /* AUDIOWMARK_SHM_RING_HH */
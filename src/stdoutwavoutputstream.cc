@@ -18,8 +18,11 @@
 #include "stdoutwavoutputstream.hh"
 #include "utils.hh"
 
+#include <algorithm>
+
 #include <assert.h>
 #include <math.h>
+#include <fcntl.h>
 
 using std::string;
 using std::vector;
@@ -70,22 +73,38 @@ header_append_u16 (vector<unsigned char>& bytes, uint16_t u)
   bytes.push_back (u >> 8);
 }
 
+/* sizes in the wav header are 32 bit: use the maximum for sizes that are unknown or too large */
+static uint32_t
+wav_size (size_t size)
+{
+  return std::min<size_t> (size, StdoutWavOutputStream::WAV_SIZE_UNKNOWN);
+}
+
+static uint32_t
+riff_size (size_t data_size)
+{
+  if (data_size == StdoutWavOutputStream::WAV_SIZE_UNKNOWN)
+    return StdoutWavOutputStream::WAV_SIZE_UNKNOWN;
+
+  const size_t padding = data_size & 1; // padding to ensure even data size
+  return wav_size (36 + data_size + padding);
+}
+
 Error
-StdoutWavOutputStream::open (int n_channels, int sample_rate, int bit_depth, size_t n_frames)
+StdoutWavOutputStream::open (int n_channels, int sample_rate, int bit_depth, size_t n_frames, bool float_data)
 {
   assert (m_state == State::NEW);
 
-  if (bit_depth != 16 && bit_depth != 24)
+  if (float_data)
+    bit_depth = 32;
+  else if (bit_depth != 16 && bit_depth != 24)
     {
       return Error ("StdoutWavOutputStream::open: unsupported bit depth");
     }
-  if (n_frames == AudioInputStream::N_FRAMES_UNKNOWN)
-    {
-      return Error ("unable to write wav format to standard out without input length information");
-    }
-
   RawFormat format;
   format.set_bit_depth (bit_depth);
+  if (float_data)
+    format.set_encoding (RawFormat::FLOAT);
 
   Error err = Error::Code::NONE;
   m_raw_converter.reset (RawConverter::create (format, err));
@@ -94,19 +113,22 @@ StdoutWavOutputStream::open (int n_channels, int sample_rate, int bit_depth, siz
 
   vector<unsigned char> header_bytes;
 
-  size_t data_size = n_frames * n_channels * ((bit_depth + 7) / 8);
-
-  m_close_padding = data_size & 1; // padding to ensure even data size
-  size_t aligned_data_size = data_size + m_close_padding;
+  /* for streams without length information, we use the maximum size in the header,
+   * which means: read until end of file; if possible, the sizes are fixed in close()
+   */
+  if (n_frames == AudioInputStream::N_FRAMES_UNKNOWN)
+    m_header_data_size = WAV_SIZE_UNKNOWN;
+  else
+    m_header_data_size = n_frames * n_channels * ((bit_depth + 7) / 8);
 
   header_append_str (header_bytes, "RIFF");
-  header_append_u32 (header_bytes, 36 + aligned_data_size);
+  header_append_u32 (header_bytes, riff_size (m_header_data_size));
   header_append_str (header_bytes, "WAVE");
 
   // subchunk 1
   header_append_str (header_bytes, "fmt ");
   header_append_u32 (header_bytes, 16); // subchunk size
-  header_append_u16 (header_bytes, 1);  // uncompressed audio
+  header_append_u16 (header_bytes, float_data ? 3 : 1);  // uncompressed audio (3: float, 1: integer pcm)
   header_append_u16 (header_bytes, n_channels);
   header_append_u32 (header_bytes, sample_rate);
   header_append_u32 (header_bytes, sample_rate * n_channels * bit_depth / 8); // byte rate
@@ -115,7 +137,10 @@ StdoutWavOutputStream::open (int n_channels, int sample_rate, int bit_depth, siz
 
   // subchunk 2
   header_append_str (header_bytes, "data");
-  header_append_u32 (header_bytes, data_size);
+  header_append_u32 (header_bytes, wav_size (m_header_data_size));
+
+  /* position of the header, -1 if stdout is not seekable */
+  m_header_pos = ftell (stdout);
 
   fwrite (&header_bytes[0], 1, header_bytes.size(), stdout);
   if (ferror (stdout))
@@ -130,19 +155,54 @@ StdoutWavOutputStream::open (int n_channels, int sample_rate, int bit_depth, siz
 }
 
 Error
-StdoutWavOutputStream::write_frames (const vector<float>& samples)
+StdoutWavOutputStream::write_frames (const float *samples, size_t count)
 {
-  if (samples.empty())
+  if (!count)
     return Error::Code::NONE;
 
-  vector<unsigned char> output_bytes;
+  const size_t n_values = count * m_n_channels;
+  m_output_bytes.resize (n_values * m_bit_depth / 8);
+  m_raw_converter->to_raw (samples, n_values, m_output_bytes.data());
 
-  m_raw_converter->to_raw (samples, output_bytes);
-
-  fwrite (&output_bytes[0], 1, output_bytes.size(), stdout);
+  fwrite (m_output_bytes.data(), 1, m_output_bytes.size(), stdout);
   if (ferror (stdout))
     return Error ("write sample data failed");
 
+  m_data_size += m_output_bytes.size();
+
+  return Error::Code::NONE;
+}
+
+/* write the correct sizes into the header, if stdout is a (seekable) file */
+Error
+StdoutWavOutputStream::update_header()
+{
+  if (m_header_pos < 0)
+    return Error::Code::NONE;
+
+  /* in append mode, all writes would go to the end of the file */
+  int flags = fcntl (fileno (stdout), F_GETFL);
+  if (flags == -1 || (flags & O_APPEND))
+    return Error::Code::NONE;
+
+  const long end_pos = ftell (stdout);
+  if (end_pos < 0)
+    return Error::Code::NONE;
+
+  vector<unsigned char> riff_bytes, data_bytes;
+  header_append_u32 (riff_bytes, riff_size (m_data_size));
+  header_append_u32 (data_bytes, wav_size (m_data_size));
+
+  if (fseek (stdout, m_header_pos + 4, SEEK_SET) != 0)
+    return Error::Code::NONE; /* not seekable: keep the header as it is */
+
+  fwrite (riff_bytes.data(), 1, riff_bytes.size(), stdout);
+  fseek (stdout, m_header_pos + 40, SEEK_SET);
+  fwrite (data_bytes.data(), 1, data_bytes.size(), stdout);
+  fseek (stdout, end_pos, SEEK_SET);
+  if (ferror (stdout))
+    return Error ("update wav header failed");
+
   return Error::Code::NONE;
 }
 
@@ -151,12 +211,18 @@ StdoutWavOutputStream::close()
 {
   if (m_state == State::OPEN)
     {
-      for (size_t i = 0; i < m_close_padding; i++)
+      if (m_data_size & 1) // padding to ensure even data size
         {
           fputc (0, stdout);
           if (ferror (stdout))
             return Error ("write wav padding failed");
         }
+      if (m_data_size != m_header_data_size)
+        {
+          Error err = update_header();
+          if (err)
+            return err;
+        }
       fflush (stdout);
       if (ferror (stdout))
         return Error ("error during flush");
@@ -28,7 +28,9 @@ class StdoutWavOutputStream : public AudioOutputStream
   int         m_bit_depth = 0;
   int         m_sample_rate = 0;
   int         m_n_channels = 0;
-  size_t      m_close_padding = 0;
+  size_t      m_header_data_size = 0;
+  size_t      m_data_size = 0;
+  long        m_header_pos = -1;
 
   enum class State {
     NEW,
@@ -38,12 +40,17 @@ class StdoutWavOutputStream : public AudioOutputStream
   State       m_state = State::NEW;
 
   std::unique_ptr<RawConverter> m_raw_converter;
+  std::vector<unsigned char>    m_output_bytes;
 
+  Error update_header();
 public:
+  static constexpr uint32_t WAV_SIZE_UNKNOWN = 0xFFFFFFFF;
+
   ~StdoutWavOutputStream();
 
-  Error open (int n_channels, int sample_rate, int bit_depth, size_t n_frames);
-  Error write_frames (const std::vector<float>& frames) override;
+  Error open (int n_channels, int sample_rate, int bit_depth, size_t n_frames, bool float_data = false);
+  Error write_frames (const float *samples, size_t count) override;
+  using AudioOutputStream::write_frames;
   Error close() override;
   int  sample_rate() const override;
   int  bit_depth() const override;
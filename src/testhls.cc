@@ -64,14 +64,15 @@ public:
     return wav_data->n_values() / wav_data->n_channels();
   }
   Error
-  read_frames (std::vector<float>& samples, size_t count) override
+  read_frames (float *samples, size_t count, size_t& frames_read) override
   {
     size_t read_count = min (n_frames() - read_pos, count);
 
     const auto& wsamples = wav_data->samples();
-    samples.assign (wsamples.begin() + read_pos * n_channels(), wsamples.begin() + (read_pos + read_count) * n_channels());
+    std::copy (wsamples.begin() + read_pos * n_channels(), wsamples.begin() + (read_pos + read_count) * n_channels(), samples);
 
     read_pos += read_count;
+    frames_read = read_count;
 
     return Error::Code::NONE;
   }
@@ -102,9 +103,9 @@ public:
     return wav_data->n_channels();
   }
   Error
-  write_frames (const std::vector<float>& frames) override
+  write_frames (const float *frames, size_t count) override
   {
-    samples.insert (samples.end(), frames.begin(), frames.end());
+    samples.insert (samples.end(), frames, frames + count * n_channels());
     return Error::Code::NONE;
   }
   Error
@@ -188,6 +189,52 @@ seek_perf (int sample_rate, double seconds)
   return 0;
 }
 
+/* decoding hls segments in parallel must give the same samples as decoding all segments as one stream */
+int
+load_cmp (const string& playlist)
+{
+  vector<string> segments;
+  Error err = hls_input_segments (playlist, segments);
+  if (err)
+    {
+      error ("audiowmark: hls: %s\n", err.message());
+      return 1;
+    }
+  /* read all segments as one transport stream, with one decoder */
+  string url = "concat:";
+  for (size_t i = 0; i < segments.size(); i++)
+    url += (i ? "|file:" : "file:") + segments[i];
+
+  WavData stream_wd;
+  err = ff_decode (url, stream_wd);
+  if (err)
+    {
+      error ("audiowmark: hls: ff_decode failed: %s\n", err.message());
+      return 1;
+    }
+  WavData parallel_wd;
+  err = hls_load_input (playlist, parallel_wd);
+  if (err)
+    {
+      error ("audiowmark: hls: hls_load_input failed: %s\n", err.message());
+      return 1;
+    }
+  if (stream_wd.n_channels() != parallel_wd.n_channels() || stream_wd.sample_rate() != parallel_wd.sample_rate())
+    {
+      error ("testhls: %s: format mismatch\n", playlist.c_str());
+      return 1;
+    }
+  if (stream_wd.samples() != parallel_wd.samples())
+    {
+      error ("testhls: %s: samples mismatch (stream: %zd frames, parallel: %zd frames)\n", playlist.c_str(),
+             stream_wd.n_frames(), parallel_wd.n_frames());
+      return 1;
+    }
+  info ("%s: %zd frames, stream and parallel (%zd segments) decoding match\n", playlist.c_str(),
+        stream_wd.n_frames(), segments.size());
+  return 0;
+}
+
 int
 main (int argc, char **argv)
 {
@@ -216,6 +263,10 @@ main (int argc, char **argv)
         }
       return 0;
     }
+  else if (argc == 3 && strcmp (argv[1], "load-cmp") == 0)
+    {
+      return load_cmp (argv[2]);
+    }
   else
     {
       error ("testhls: error parsing command line arguments\n");
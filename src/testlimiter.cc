@@ -87,6 +87,43 @@ impulses()
   return 0;
 }
 
+int
+lookahead()
+{
+  LookaheadLimiter limiter (2, 44100);
+  limiter.set_lookahead_ms (5);
+  limiter.set_release_ms (40);
+  limiter.set_ceiling (0.9);
+
+  vector<float> in_all, out_all;
+  int pos = 0;
+  for (int block = 0; block < 10; block++)
+    {
+      vector<float> in_samples;
+      for (int i = 0; i < 1000 + block; i++) /* odd block sizes */
+        {
+          double d = (pos++ % 441) == 440 ? 1.0 : 0.5;
+          in_samples.push_back (d);
+          in_samples.push_back (-d); /* stereo */
+        }
+      vector<float> out_samples = limiter.process (in_samples);
+
+      in_all.insert (in_all.end(), in_samples.begin(), in_samples.end());
+      out_all.insert (out_all.end(), out_samples.begin(), out_samples.end());
+    }
+  vector<float> out_samples = limiter.flush();
+  out_all.insert (out_all.end(), out_samples.begin(), out_samples.end());
+  assert (in_all.size() == out_all.size());
+  for (size_t i = 0; i < out_all.size(); i += 2)
+    {
+      assert (out_all[i] == -out_all[i + 1]); /* stereo */
+      assert (out_all[i] <= 0.9 + 1e-6);      /* ceiling */
+      assert (out_all[i] <= in_all[i]);       /* gain is never above 1 */
+      printf ("%f %f\n", in_all[i], out_all[i]);
+    }
+  return 0;
+}
+
 int
 main (int argc, char **argv)
 {
@@ -94,6 +131,8 @@ main (int argc, char **argv)
     return perf();
   if (argc == 2 && strcmp (argv[1], "impulses") == 0)
     return impulses();
+  if (argc == 2 && strcmp (argv[1], "lookahead") == 0)
+    return lookahead();
 
   SFInputStream in;
   SFOutputStream out;
@@ -0,0 +1,79 @@
+/*
+ * Copyright (C) 2018-2020 Stefan Westerfeld
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <memory>
+
+#include "audiostream.hh"
+#include "wavdata.hh"
+
+using std::string;
+
+/* decoding a file in parallel parts must give the same samples as decoding it serially */
+int
+main (int argc, char **argv)
+{
+  if (argc != 3)
+    {
+      printf ("usage: testload <filename> <n_parts>\n");
+      return 1;
+    }
+  const string filename = argv[1];
+  const size_t n_parts  = atoi (argv[2]);
+
+  Error err;
+  std::unique_ptr<AudioInputStream> in_stream = AudioInputStream::create (filename, err);
+  if (err)
+    {
+      printf ("open %s failed: %s\n", filename.c_str(), err.message());
+      return 1;
+    }
+  WavData serial_wd;
+  err = serial_wd.load (in_stream.get());
+  if (err)
+    {
+      printf ("serial load %s failed: %s\n", filename.c_str(), err.message());
+      return 1;
+    }
+
+  in_stream = AudioInputStream::create (filename, err);
+  if (err)
+    {
+      printf ("open %s failed: %s\n", filename.c_str(), err.message());
+      return 1;
+    }
+  WavData parallel_wd;
+  if (!parallel_wd.load_parallel (filename, in_stream.get(), n_parts))
+    {
+      printf ("parallel load %s failed\n", filename.c_str());
+      return 1;
+    }
+
+  if (serial_wd.n_channels() != parallel_wd.n_channels() || serial_wd.sample_rate() != parallel_wd.sample_rate())
+    {
+      printf ("%s: format mismatch\n", filename.c_str());
+      return 1;
+    }
+  if (serial_wd.samples() != parallel_wd.samples())
+    {
+      printf ("%s: samples mismatch (serial: %zd frames, parallel: %zd frames)\n", filename.c_str(),
+              serial_wd.n_frames(), parallel_wd.n_frames());
+      return 1;
+    }
+  printf ("%s: %zd frames, serial and parallel (%zd parts) decoding match\n", filename.c_str(),
+          serial_wd.n_frames(), n_parts);
+  return 0;
+}
@@ -0,0 +1,191 @@
+/*
+ * Copyright (C) 2018-2020 Stefan Westerfeld
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <string>
+#include <vector>
+
+#include <assert.h>
+#include <math.h>
+#include <string.h>
+
+#include <zita-resampler/resampler.h>
+#include <zita-resampler/vresampler.h>
+
+#include "resample.hh"
+#include "utils.hh"
+#include "wmcommon.hh"
+
+using std::vector;
+using std::string;
+using std::max;
+
+static double
+pass_freq()
+{
+  return double (Params::max_band + 1) * Params::mark_sample_rate / Params::frame_size;
+}
+
+/* resample a stereo signal in blocks, compensating the resampler delay like BufferedResamplerImpl does */
+template<class R> static vector<float>
+run_resampler (R& resampler, const vector<float>& in, size_t block_size)
+{
+  const int n_channels = resampler.nchan();
+  vector<float> out;
+  vector<float> out_block (block_size * n_channels * 2);
+
+  resampler.inp_count = resampler.inpsize() / 2 - 1;
+  resampler.inp_data  = nullptr;
+  resampler.out_count = 1000000;
+  resampler.out_data  = nullptr;
+  resampler.process();
+
+  size_t pos = 0;
+  while (pos < in.size() / n_channels)
+    {
+      const size_t todo = std::min (block_size, in.size() / n_channels - pos);
+
+      resampler.inp_count = todo;
+      resampler.inp_data  = const_cast<float *> (&in[pos * n_channels]);
+      while (resampler.inp_count)
+        {
+          resampler.out_count = out_block.size() / n_channels;
+          resampler.out_data  = &out_block[0];
+          resampler.process();
+          out.insert (out.end(), out_block.begin(), out_block.end() - resampler.out_count * n_channels);
+        }
+      pos += todo;
+    }
+  return out;
+}
+
+static vector<float>
+gen_sines (const vector<double>& freqs, int rate, size_t n_frames)
+{
+  vector<float> samples;
+  for (size_t i = 0; i < n_frames; i++)
+    {
+      double left = 0, right = 0;
+      for (size_t f = 0; f < freqs.size(); f++)
+        {
+          left  += sin (2 * M_PI * freqs[f] * i / rate) / freqs.size();
+          right += cos (2 * M_PI * freqs[f] * i / rate) / freqs.size();
+        }
+      samples.push_back (left);
+      samples.push_back (right);
+    }
+  return samples;
+}
+
+/* resample sine waves within the pass band and compare with the expected signal */
+static double
+accuracy (int in_rate, int out_rate, double stop_freq, const vector<double>& freqs, const vector<double>& alias_freqs)
+{
+  BandResampler resampler;
+  int r = resampler.setup (in_rate, out_rate, 2, pass_freq(), stop_freq);
+  assert (r == 0);
+
+  const size_t n_frames = in_rate * 2;
+
+  /* frequencies which are allowed to alias, but not into the pass band are added to the input */
+  vector<float> in = gen_sines (freqs, in_rate, n_frames);
+  vector<float> noise = gen_sines (alias_freqs, in_rate, n_frames);
+  for (size_t i = 0; i < in.size(); i++)
+    in[i] += noise[i];
+
+  vector<float> out = run_resampler (resampler, in, 1000);
+  vector<float> expect = gen_sines (freqs, out_rate, out.size() / 2);
+
+  /* measure the error in the pass band (with a simple DFT of the error signal) */
+  double max_err = 0;
+  const size_t skip = out_rate / 10; /* ignore start and end */
+  const size_t len = out.size() / 2 - 2 * skip;
+  for (double f = 100; f < pass_freq(); f += 100)
+    {
+      double re = 0, im = 0;
+      for (size_t i = skip; i < skip + len; i++)
+        {
+          const double err = out[i * 2] - expect[i * 2];
+          re += err * cos (2 * M_PI * f * i / out_rate);
+          im += err * sin (2 * M_PI * f * i / out_rate);
+        }
+      max_err = max (max_err, sqrt (re * re + im * im) * 2 / len);
+    }
+  const double db = 20 * log10 (max (max_err, 1e-10));
+  printf ("%d -> %d Hz: %d taps, max pass band error %.1f dB\n", in_rate, out_rate, resampler.inpsize(), db);
+  return db;
+}
+
+template<class R> static void
+perf_resampler (const string& label, R& resampler, int in_rate)
+{
+  vector<float> in (in_rate * 10 * 2);
+  double start = get_time();
+  run_resampler (resampler, in, 1024);
+  double end = get_time();
+  printf ("%-30s %f ns/frame\n", label.c_str(), (end - start) * 1000 * 1000 * 1000 / (in.size() / 2));
+}
+
+static int
+perf()
+{
+  const int mark_rate = Params::mark_sample_rate;
+  for (int rate : { 44100, 32000 })
+    {
+      /* output side: watermark signal from 48 kHz to original rate */
+      Resampler zita16;
+      zita16.setup (mark_rate, rate, 2, 16);
+      perf_resampler (string_printf ("out %d: zita hlen=16", rate), zita16, mark_rate);
+
+      BandResampler band_out;
+      band_out.setup (mark_rate, rate, 2, pass_freq(), mark_rate - pass_freq());
+      perf_resampler (string_printf ("out %d: band", rate), band_out, mark_rate);
+
+      /* input side: original signal to 48 kHz */
+      Resampler zita32;
+      zita32.setup (rate, mark_rate, 2, 32);
+      perf_resampler (string_printf ("in %d: zita hlen=32 (high)", rate), zita32, rate);
+
+      Resampler zita16_in;
+      zita16_in.setup (rate, mark_rate, 2, 16);
+      perf_resampler (string_printf ("in %d: zita hlen=16 (normal)", rate), zita16_in, rate);
+
+      BandResampler band_in;
+      band_in.setup (rate, mark_rate, 2, pass_freq(), std::min (rate, mark_rate) - pass_freq());
+      perf_resampler (string_printf ("in %d: band (fast)", rate), band_in, rate);
+    }
+  return 0;
+}
+
+int
+main (int argc, char **argv)
+{
+  if (argc == 2 && strcmp (argv[1], "perf") == 0)
+    return perf();
+
+  const int mark_rate = Params::mark_sample_rate;
+  for (int rate : { 44100, 32000, 22050, 96000 })
+    {
+      /* output side: input only contains pass band frequencies */
+      double db = accuracy (mark_rate, rate, mark_rate - pass_freq(), { 440, 1000, 3000, 4500 }, {});
+      assert (db < -70);
+
+      /* input side (fast): full band input, anything above the pass band may alias, but not into the pass band */
+      db = accuracy (rate, mark_rate, std::min (rate, mark_rate) - pass_freq(), { 440, 1000, 3000, 4500 }, { 7000, 10000, rate * 0.45 });
+      assert (db < -70);
+    }
+  return 0;
+}
@@ -0,0 +1,199 @@
+/*
+ * Copyright (C) 2018-2020 Stefan Westerfeld
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <functional>
+#include <random>
+#include <string>
+#include <vector>
+
+#include <assert.h>
+#include <math.h>
+#include <string.h>
+
+#include "sampleconv.hh"
+#include "utils.hh"
+
+using std::string;
+using std::vector;
+
+typedef SampleConv::Impl Impl;
+
+static vector<Impl>
+supported_impls()
+{
+  vector<Impl> impls;
+  for (auto impl : { Impl::SCALAR, Impl::SSE2, Impl::AVX2 })
+    if (SampleConv::supported (impl))
+      impls.push_back (impl);
+  return impls;
+}
+
+/* random samples, including values that are hard to get right (clipping, rounding, NaN, ...) */
+static vector<float>
+gen_samples (size_t n, std::mt19937& rng)
+{
+  std::uniform_real_distribution<float> dist (-1.2, 1.2);
+  std::uniform_int_distribution<int> idist (-0x800000, 0x800000);
+
+  const float special[] = {
+    0, -0.0f, 1, -1, 0.5, -0.5, nextafterf (1, 0), nextafterf (1, 2), nextafterf (-1, -2), 2, -2, 1e10, -1e10,
+    INFINITY, -INFINITY, NAN, 1e-40f, -1e-40f, 1.f / 65536, -1.f / 65536, 1.f / 16777216, 0.5f / 2147483648.f,
+    1.5f / 2147483648.f, -2.5f / 2147483648.f
+  };
+  vector<float> samples (n);
+  for (size_t i = 0; i < n; i++)
+    {
+      switch (rng() % 4)
+        {
+          case 0:  samples[i] = special[rng() % (sizeof (special) / sizeof (special[0]))];
+                   break;
+          case 1:  samples[i] = (idist (rng) + 0.5) / 2147483648.; // exactly between two integer values
+                   break;
+          default: samples[i] = dist (rng);
+        }
+    }
+  return samples;
+}
+
+static int
+check_impl (Impl impl)
+{
+  std::mt19937 rng (42);
+  int errors = 0;
+
+  auto check = [&] (const string& what, const void *expect, const void *got, size_t size, size_t n) {
+    if (memcmp (expect, got, size) != 0)
+      {
+        printf ("%s: %s mismatch (n = %zd)\n", SampleConv::impl_name (impl), what.c_str(), n);
+        errors++;
+      }
+  };
+  for (size_t n = 0; n < 5000; n += (n < 100) ? 1 : 997)
+    {
+      /* use an odd offset to test unaligned access */
+      const size_t offset = n % 3;
+      vector<float> samples = gen_samples (n + offset, rng);
+      const float *in = samples.data() + offset;
+
+      vector<int32_t> ivalues_ref (n), ivalues (n);
+      SampleConv::set_impl (Impl::SCALAR);
+      SampleConv::float_to_int32 (in, n, ivalues_ref.data());
+      SampleConv::set_impl (impl);
+      SampleConv::float_to_int32 (in, n, ivalues.data());
+      check ("float_to_int32", ivalues_ref.data(), ivalues.data(), n * sizeof (int32_t), n);
+
+      vector<float> out_ref (n), out (n);
+      SampleConv::set_impl (Impl::SCALAR);
+      SampleConv::int32_to_float (ivalues_ref.data(), n, out_ref.data());
+      SampleConv::set_impl (impl);
+      SampleConv::int32_to_float (ivalues_ref.data(), n, out.data());
+      check ("int32_to_float", out_ref.data(), out.data(), n * sizeof (float), n);
+
+      for (int bit_depth : { 8, 16, 24, 32 })
+        for (auto endian : { RawFormat::LITTLE, RawFormat::BIG })
+          for (auto encoding : { RawFormat::SIGNED, RawFormat::UNSIGNED })
+            {
+              const string fmt = string_printf ("%d bit %s %s", bit_depth,
+                                                encoding == RawFormat::SIGNED ? "signed" : "unsigned",
+                                                endian == RawFormat::LITTLE ? "little" : "big");
+              const size_t n_bytes = n * bit_depth / 8;
+
+              /* guard bytes at the end detect writes after the last sample */
+              vector<unsigned char> bytes_ref (n_bytes + 32, 0x55), bytes (n_bytes + 32, 0x55);
+              SampleConv::set_impl (Impl::SCALAR);
+              SampleConv::float_to_pcm (in, n, bytes_ref.data(), bit_depth, endian, encoding);
+              SampleConv::set_impl (impl);
+              SampleConv::float_to_pcm (in, n, bytes.data(), bit_depth, endian, encoding);
+              check ("float_to_pcm " + fmt, bytes_ref.data(), bytes.data(), bytes.size(), n);
+
+              /* random bytes as input */
+              vector<unsigned char> rbytes (n_bytes + offset);
+              for (auto& b : rbytes)
+                b = rng();
+              SampleConv::set_impl (Impl::SCALAR);
+              SampleConv::pcm_to_float (rbytes.data() + offset, n, out_ref.data(), bit_depth, endian, encoding);
+              SampleConv::set_impl (impl);
+              SampleConv::pcm_to_float (rbytes.data() + offset, n, out.data(), bit_depth, endian, encoding);
+              check ("pcm_to_float " + fmt, out_ref.data(), out.data(), n * sizeof (float), n);
+            }
+    }
+  SampleConv::set_impl (SampleConv::best_impl());
+  printf ("%-8s %s\n", SampleConv::impl_name (impl), errors ? "FAIL" : "OK");
+  return errors;
+}
+
+static int
+perf()
+{
+  const size_t n = 64 * 1024;
+  const int    runs = 500;
+
+  std::mt19937 rng (42);
+  std::uniform_real_distribution<float> dist (-1, 1);
+  vector<float> samples (n);
+  for (auto& s : samples)
+    s = dist (rng);
+
+  vector<unsigned char> bytes (n * 4);
+  vector<int32_t>       ivalues (n);
+  vector<float>         out (n);
+
+  auto measure = [&] (Impl impl, const string& label, std::function<void()> fun) {
+    double best_time = 1e10;
+    for (int rep = 0; rep < 5; rep++)
+      {
+        double start = get_time();
+        for (int r = 0; r < runs; r++)
+          fun();
+        best_time = std::min (best_time, get_time() - start);
+      }
+    printf ("%-8s %-24s %f ns/sample\n", SampleConv::impl_name (impl), label.c_str(), best_time * 1e9 / (n * runs));
+  };
+  for (auto impl : supported_impls())
+    {
+      SampleConv::set_impl (impl);
+      measure (impl, "float -> int32", [&]() { SampleConv::float_to_int32 (samples.data(), n, ivalues.data()); });
+      measure (impl, "int32 -> float", [&]() { SampleConv::int32_to_float (ivalues.data(), n, out.data()); });
+      for (int bit_depth : { 16, 24 })
+        {
+          measure (impl, string_printf ("float -> %d bit", bit_depth), [&]() {
+            SampleConv::float_to_pcm (samples.data(), n, bytes.data(), bit_depth, RawFormat::LITTLE, RawFormat::SIGNED);
+          });
+          measure (impl, string_printf ("%d bit -> float", bit_depth), [&]() {
+            SampleConv::pcm_to_float (bytes.data(), n, out.data(), bit_depth, RawFormat::LITTLE, RawFormat::SIGNED);
+          });
+          measure (impl, string_printf ("float -> %d bit big", bit_depth), [&]() {
+            SampleConv::float_to_pcm (samples.data(), n, bytes.data(), bit_depth, RawFormat::BIG, RawFormat::SIGNED);
+          });
+        }
+    }
+  SampleConv::set_impl (SampleConv::best_impl());
+  return 0;
+}
+
+int
+main (int argc, char **argv)
+{
+  if (argc == 2 && strcmp (argv[1], "perf") == 0)
+    return perf();
+
+  int errors = 0;
+  for (auto impl : supported_impls())
+    errors += check_impl (impl);
+
+  return errors ? 1 : 0;
+}
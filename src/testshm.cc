@@ -0,0 +1,117 @@
+/*
+ * Copyright (C) 2018-2020 Stefan Westerfeld
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <string>
+#include <vector>
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+
+#include "shminputstream.hh"
+#include "shmoutputstream.hh"
+#include "wavdata.hh"
+#include "utils.hh"
+
+using std::string;
+using std::vector;
+
+/* producer: write the samples of a wav file into a shared memory ring */
+static int
+shm_write (const string& infile, const string& ring)
+{
+  WavData wav_data;
+  Error err = wav_data.load (infile);
+  if (err)
+    {
+      fprintf (stderr, "testshm: error loading %s: %s\n", infile.c_str(), err.message());
+      return 1;
+    }
+  ShmOutputStream out;
+  err = out.open (ring, wav_data.n_channels(), wav_data.sample_rate());
+  if (err)
+    {
+      fprintf (stderr, "testshm: error creating ring %s: %s\n", ring.c_str(), err.message());
+      return 1;
+    }
+  const vector<float>& samples = wav_data.samples();
+  const size_t block_size = 1000; // not a multiple of the ring size
+  for (size_t f = 0; f < wav_data.n_frames(); f += block_size)
+    {
+      size_t count = std::min (block_size, wav_data.n_frames() - f);
+      err = out.write_frames (&samples[f * wav_data.n_channels()], count);
+      if (err)
+        {
+          fprintf (stderr, "testshm: write failed: %s\n", err.message());
+          return 1;
+        }
+    }
+  out.close();
+  return 0;
+}
+
+/* consumer: read all samples from a shared memory ring, save them as raw (native) float data */
+static int
+shm_read (const string& ring, const string& outfile)
+{
+  ShmInputStream in;
+  Error err = in.open (ring);
+  if (err)
+    {
+      fprintf (stderr, "testshm: error opening ring %s: %s\n", ring.c_str(), err.message());
+      return 1;
+    }
+  FILE *out_file = fopen (outfile.c_str(), "w");
+  if (!out_file)
+    {
+      fprintf (stderr, "testshm: error opening %s: %s\n", outfile.c_str(), strerror (errno));
+      return 1;
+    }
+  vector<float> samples;
+  do
+    {
+      err = in.read_frames (samples, 777);
+      if (err)
+        {
+          fprintf (stderr, "testshm: read failed: %s\n", err.message());
+          return 1;
+        }
+      fwrite (samples.data(), sizeof (float), samples.size(), out_file);
+    }
+  while (samples.size());
+  in.close();
+
+  if (fclose (out_file) != 0)
+    {
+      fprintf (stderr, "testshm: error writing %s\n", outfile.c_str());
+      return 1;
+    }
+  return 0;
+}
+
+int
+main (int argc, char **argv)
+{
+  if (argc == 4 && strcmp (argv[1], "write") == 0)
+    return shm_write (argv[2], argv[3]);
+  if (argc == 4 && strcmp (argv[1], "read") == 0)
+    return shm_read (argv[2], argv[3]);
+
+  fprintf (stderr, "usage: testshm write <input.wav> <ring>\n");
+  fprintf (stderr, "       testshm read <ring> <output.raw>\n");
+  return 1;
+}
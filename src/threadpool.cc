@@ -55,9 +55,9 @@ ThreadPool::worker_run()
     }
 }
 
-ThreadPool::ThreadPool()
+ThreadPool::ThreadPool (unsigned int n_threads)
 {
-  for (unsigned int i = 0; i < std::thread::hardware_concurrency(); i++)
+  for (unsigned int i = 0; i < n_threads; i++)
     {
       threads.push_back (std::thread (&ThreadPool::worker_run, this));
     }
@@ -46,7 +46,7 @@ class ThreadPool
   void worker_run();
 
 public:
-  ThreadPool();
+  ThreadPool (unsigned int n_threads = std::thread::hardware_concurrency());
   ~ThreadPool();
 
   void add_job (std::function<void()> fun);
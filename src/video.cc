@@ -0,0 +1,128 @@
+/*
+ * Copyright (C) 2018-2020 Stefan Westerfeld
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <memory>
+
+#include "utils.hh"
+#include "wmcommon.hh"
+#include "wavdata.hh"
+#include "video.hh"
+
+#include "config.h"
+
+using std::string;
+
+#if !HAVE_FFMPEG
+int
+video_add (const string& infile, const string& outfile, const string& bits)
+{
+  error ("audiowmark: video support is not available in this build of audiowmark\n");
+  return 1;
+}
+
+int
+video_get (const string& infile, const string& orig_pattern)
+{
+  error ("audiowmark: video support is not available in this build of audiowmark\n");
+  return 1;
+}
+#else
+
+#include "ffinputstream.hh"
+#include "videooutputstream.hh"
+
+/* the watermark is only added to one audio stream, so other audio streams must not be copied unchanged */
+static Error
+check_audio_streams (const FFInputStream& in_stream)
+{
+  const AVFormatContext *fmt_ctx = in_stream.format_context();
+
+  int n_audio_streams = 0;
+  for (unsigned int i = 0; i < fmt_ctx->nb_streams; i++)
+    if (fmt_ctx->streams[i]->codecpar->codec_type == AVMEDIA_TYPE_AUDIO)
+      n_audio_streams++;
+
+  if (n_audio_streams != 1)
+    return Error (string_printf ("input file must have exactly one audio stream (found %d)", n_audio_streams));
+
+  return Error::Code::NONE;
+}
+
+/* watermark the audio stream of a video file in one pass: the audio is decoded, watermarked and encoded
+ * again, all video packets that the demuxer reads meanwhile are copied to the output file
+ */
+int
+video_add (const string& infile, const string& outfile, const string& bits)
+{
+  FFInputStream in_stream;
+  std::unique_ptr<VideoOutputStream> out_stream;
+
+  in_stream.set_other_packet_handler ([&out_stream] (AVPacket *pkt) {
+    return out_stream->write_packet (pkt);
+  });
+  Error err = in_stream.open (infile);
+  if (!err)
+    err = check_audio_streams (in_stream);
+  if (err)
+    {
+      error ("audiowmark: error opening %s: %s\n", infile.c_str(), err.message());
+      return 1;
+    }
+
+  const int out_bit_depth = in_stream.bit_depth() > 16 ? 24 : 16;
+  out_stream.reset (new VideoOutputStream (in_stream.n_channels(), in_stream.sample_rate(), out_bit_depth));
+  out_stream->set_channel_layout (in_stream.channel_layout());
+  out_stream->set_bit_rate (Params::output_bit_rate);
+
+  err = out_stream->open (outfile, in_stream.format_context(), in_stream.stream_index(), Params::output_codec);
+  if (err)
+    {
+      error ("audiowmark: error writing to %s: %s\n", outfile.c_str(), err.message());
+      return 1;
+    }
+
+  info ("Input:        %s\n", Params::input_label.size() ? Params::input_label.c_str() : infile.c_str());
+  info ("Output:       %s\n", Params::output_label.size() ? Params::output_label.c_str() : outfile.c_str());
+  info ("Audio Codec:  %s\n", out_stream->audio_codec_info().c_str());
+
+  return add_stream_watermark (&in_stream, out_stream.get(), bits, 0);
+}
+
+int
+video_get (const string& infile, const string& orig_pattern)
+{
+  FFInputStream in_stream;
+
+  Error err = in_stream.open (infile);
+  if (!err)
+    err = check_audio_streams (in_stream);
+  if (err)
+    {
+      error ("audiowmark: error opening %s: %s\n", infile.c_str(), err.message());
+      return 1;
+    }
+
+  WavData wav_data;
+  err = wav_data.load (&in_stream);
+  if (err)
+    {
+      error ("audiowmark: error loading %s: %s\n", infile.c_str(), err.message());
+      return 1;
+    }
+  return get_watermark (std::move (wav_data), orig_pattern);
+}
+#endif
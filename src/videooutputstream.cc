@@ -0,0 +1,164 @@
+/*
+ * Copyright (C) 2018-2020 Stefan Westerfeld
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "videooutputstream.hh"
+
+#undef av_err2str
+#define av_err2str(errnum) av_make_error_string((char*)__builtin_alloca(AV_ERROR_MAX_STRING_SIZE), AV_ERROR_MAX_STRING_SIZE, errnum)
+
+using std::string;
+
+VideoOutputStream::VideoOutputStream (int n_channels, int sample_rate, int bit_depth) :
+  FFOutputStream (n_channels, sample_rate, bit_depth)
+{
+}
+
+VideoOutputStream::~VideoOutputStream()
+{
+  close();
+}
+
+/* the container format is chosen by the extension of the output filename; all video and subtitle
+ * streams are copied, the audio stream is replaced by the encoder output at the same stream position
+ *
+ * the audio codec is either codec_name or the codec of the input audio stream
+ */
+Error
+VideoOutputStream::open (const string& out_filename, const AVFormatContext *in_fmt_ctx, int audio_stream_index, const string& codec_name)
+{
+  assert (m_state == State::NEW);
+
+  Error err = open_format ("", out_filename);
+  if (err)
+    return err;
+
+  const AVStream *in_audio_st = in_fmt_ctx->streams[audio_stream_index];
+
+  /* opus encoder is experimental, ffmpeg recommends libopus for encoding */
+  const AVCodec *audio_codec = nullptr;
+  if (codec_name != "")
+    {
+      audio_codec = avcodec_find_encoder_by_name (codec_name.c_str());
+      if (!audio_codec)
+        return Error (string_printf ("could not find encoder '%s'", codec_name.c_str()));
+    }
+  else if (in_audio_st->codecpar->codec_id == AV_CODEC_ID_OPUS)
+    audio_codec = avcodec_find_encoder_by_name ("libopus");
+  if (!audio_codec)
+    {
+      err = find_encoder (in_audio_st->codecpar->codec_id, &audio_codec);
+      if (err)
+        return err;
+    }
+  if (!m_bit_rate)
+    m_bit_rate = in_audio_st->codecpar->bit_rate;
+
+  for (unsigned int i = 0; i < in_fmt_ctx->nb_streams; i++)
+    {
+      const AVStream *in_st = in_fmt_ctx->streams[i];
+      const AVMediaType type = in_st->codecpar->codec_type;
+
+      m_in_time_base.push_back (in_st->time_base);
+      if (int (i) == audio_stream_index)
+        {
+          err = add_stream (audio_codec);
+          if (err)
+            return err;
+
+          m_stream_map.push_back (-1); // audio packets are generated by the encoder
+        }
+      else if (type == AVMEDIA_TYPE_VIDEO || type == AVMEDIA_TYPE_SUBTITLE)
+        {
+          AVStream *out_st = avformat_new_stream (m_fmt_ctx, nullptr);
+          if (!out_st)
+            return Error ("could not allocate stream");
+
+          int ret = avcodec_parameters_copy (out_st->codecpar, in_st->codecpar);
+          if (ret < 0)
+            return Error ("could not copy the stream parameters");
+
+          /* the codec tag of the input container may not be valid for the output container */
+          out_st->codecpar->codec_tag = 0;
+          out_st->time_base = in_st->time_base;
+          out_st->disposition = in_st->disposition;
+          out_st->avg_frame_rate = in_st->avg_frame_rate;
+          out_st->sample_aspect_ratio = in_st->sample_aspect_ratio;
+          av_dict_copy (&out_st->metadata, in_st->metadata, 0);
+
+          m_stream_map.push_back (out_st->index);
+        }
+      else
+        {
+          m_stream_map.push_back (-1); // data streams, attachments, ...
+        }
+    }
+  av_dict_copy (&m_fmt_ctx->metadata, in_fmt_ctx->metadata, 0);
+
+  /* keep the audio in sync with the video if the audio doesn't start at time 0 */
+  if (in_audio_st->start_time != AV_NOPTS_VALUE)
+    m_start_pos = av_rescale_q (in_audio_st->start_time, in_audio_st->time_base, (AVRational) { 1, m_sample_rate });
+
+  err = open_file (out_filename);
+  if (err)
+    return err;
+
+  err = open_audio (audio_codec, nullptr);
+  if (err)
+    return err;
+
+  err = write_header();
+  if (err)
+    return err;
+
+  m_state = State::OPEN;
+  return Error::Code::NONE;
+}
+
+/* write one packet of the input file: the packet is muxed (if its stream is copied) and unreferenced */
+Error
+VideoOutputStream::write_packet (AVPacket *pkt)
+{
+  assert (m_state == State::OPEN);
+
+  const int in_index = pkt->stream_index;
+  if (in_index < 0 || in_index >= int (m_stream_map.size()) || m_stream_map[in_index] < 0)
+    {
+      av_packet_unref (pkt);
+      return Error::Code::NONE;
+    }
+  AVStream *out_st = m_fmt_ctx->streams[m_stream_map[in_index]];
+
+  av_packet_rescale_ts (pkt, m_in_time_base[in_index], out_st->time_base);
+  pkt->stream_index = out_st->index;
+  pkt->pos = -1;
+
+  /* the audio encoder output lags behind, so the muxer needs to interleave the packets */
+  int ret = av_interleaved_write_frame (m_fmt_ctx, pkt);
+  if (ret < 0)
+    return Error (string_printf ("error while writing packet: %s", av_err2str (ret)));
+
+  return Error::Code::NONE;
+}
+
+/* codec and bit rate of the audio encoder */
+string
+VideoOutputStream::audio_codec_info() const
+{
+  if (m_enc->bit_rate)
+    return string_printf ("%s, %d bit/s", m_enc->codec->name, int (m_enc->bit_rate));
+  return m_enc->codec->name;
+}
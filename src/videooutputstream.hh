@@ -0,0 +1,42 @@
+/*
+ * Copyright (C) 2018-2020 Stefan Westerfeld
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef AUDIOWMARK_VIDEO_OUTPUT_STREAM_HH
+#define AUDIOWMARK_VIDEO_OUTPUT_STREAM_HH
+
+#include "ffoutputstream.hh"
+
+#include <vector>
+
+/* encode the (watermarked) audio stream of a video file, using the codec parameters of the input audio
+ * stream, and mux it with the other streams of the input file, which are copied without re-encoding
+ */
+class VideoOutputStream : public FFOutputStream {
+  std::vector<int>        m_stream_map;    // input stream index -> output stream index (-1: not copied)
+  std::vector<AVRational> m_in_time_base;
+public:
+  VideoOutputStream (int n_channels, int sample_rate, int bit_depth);
+  ~VideoOutputStream();
+
+  Error open (const std::string& output_filename, const AVFormatContext *in_fmt_ctx, int audio_stream_index,
+              const std::string& codec_name = "");
+  Error write_packet (AVPacket *pkt);
+
+  std::string audio_codec_info() const;
+};
+
+#endif /* AUDIOWMARK_VIDEO_OUTPUT_STREAM_HH */
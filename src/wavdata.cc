@@ -21,8 +21,13 @@
 #include "sfinputstream.hh"
 #include "sfoutputstream.hh"
 #include "mp3inputstream.hh"
+#include "mmapwavfile.hh"
+#include "wmcommon.hh"
+#include "threadpool.hh"
 
 #include <memory>
+#include <functional>
+#include <algorithm>
 #include <math.h>
 
 using std::string;
@@ -40,15 +45,173 @@ WavData::WavData (const vector<float>& samples, int n_channels, int sample_rate,
   m_bit_depth   = bit_depth;
 }
 
+static Error
+read_part (AudioInputStream *in_stream, size_t count, float *samples, size_t& frames_read)
+{
+  const size_t block_size = 16 * 1024;
+  const int    n_channels = in_stream->n_channels();
+
+  frames_read = 0;
+  while (frames_read < count)
+    {
+      size_t block_frames;
+      Error err = in_stream->read_frames (samples + frames_read * n_channels, std::min (block_size, count - frames_read), block_frames);
+      if (err)
+        return err;
+
+      if (!block_frames)
+        break;
+
+      frames_read += block_frames;
+    }
+  return Error::Code::NONE;
+}
+
+template<class Stream, class... OpenArgs> static Error
+read_part (const string& filename, size_t start, size_t count, float *samples, size_t& frames_read, OpenArgs... open_args)
+{
+  Stream stream;
+
+  Error err = stream.open (filename, open_args...);
+  if (err)
+    return err;
+
+  err = stream.seek (start);
+  if (err)
+    return err;
+
+  return read_part (&stream, count, samples, frames_read);
+}
+
+/* number of parts for parallel decoding (or 1 if the stream should be decoded serially) */
+static size_t
+parallel_parts (AudioInputStream *in_stream)
+{
+  SFInputStream  *sf_stream  = dynamic_cast<SFInputStream *> (in_stream);
+  MP3InputStream *mp3_stream = dynamic_cast<MP3InputStream *> (in_stream);
+
+  if (!(sf_stream && sf_stream->is_flac()) && !mp3_stream)
+    return 1;
+
+  const size_t n_frames = in_stream->n_frames();
+  if (n_frames == AudioInputStream::N_FRAMES_UNKNOWN)
+    return 1;
+
+  /* parts should be large enough to make the seek overhead irrelevant */
+  const size_t min_part_frames = std::max<size_t> (in_stream->sample_rate() * 30, 1);
+  return std::max<size_t> (std::min<size_t> (std::thread::hardware_concurrency(), n_frames / min_part_frames), 1);
+}
+
+/* decoding flac/mp3 files can take longer than watermark detection, so we split the file
+ * into parts and decode each part in its own thread, with its own decoder, seeking to
+ * the start of the part; seeking is sample accurate, so the result is identical to
+ * decoding the file serially
+ *
+ * returns false if decoding one of the parts failed (in this case in_stream has been used)
+ */
+bool
+WavData::load_parallel (const string& filename, AudioInputStream *in_stream, size_t n_parts)
+{
+  MP3InputStream *mp3_stream = dynamic_cast<MP3InputStream *> (in_stream);
+  const size_t    n_frames   = in_stream->n_frames();
+  const int       n_channels = in_stream->n_channels();
+
+  struct Part
+  {
+    size_t start = 0;
+    size_t count = 0;
+    size_t frames_read = 0;
+    Error  err;
+  };
+  vector<Part> parts (n_parts);
+  for (size_t p = 0; p < n_parts; p++)
+    {
+      parts[p].start = n_frames * p / n_parts;
+      parts[p].count = n_frames * (p + 1) / n_parts - parts[p].start;
+    }
+
+  vector<float> samples (n_frames * n_channels);
+  ThreadPool thread_pool;
+  for (size_t p = 0; p < n_parts; p++)
+    {
+      thread_pool.add_job ([&, p] {
+        Part& part = parts[p];
+        float *part_samples = &samples[part.start * n_channels];
+
+        if (p == 0) /* first part: no need to seek */
+          part.err = read_part (in_stream, part.count, part_samples, part.frames_read);
+        else if (mp3_stream) /* reuse the frame index, so the parts don't need to scan the file */
+          part.err = read_part<MP3InputStream> (filename, part.start, part.count, part_samples, part.frames_read,
+                                                std::cref (mp3_stream->index()), Params::mp3_min_sample_rate);
+        else
+          part.err = read_part<SFInputStream> (filename, part.start, part.count, part_samples, part.frames_read);
+      });
+    }
+  thread_pool.wait_all();
+
+  /* all parts except the last one must be complete, otherwise fall back to serial decoding */
+  for (size_t p = 0; p < n_parts; p++)
+    {
+      if (parts[p].err)
+        return false;
+      if (p + 1 < n_parts && parts[p].frames_read != parts[p].count)
+        return false;
+    }
+  samples.resize ((parts.back().start + parts.back().frames_read) * n_channels);
+
+  m_samples     = std::move (samples);
+  m_sample_rate = in_stream->sample_rate();
+  m_n_channels  = n_channels;
+  m_bit_depth   = in_stream->bit_depth();
+  return true;
+}
+
 Error
 WavData::load (const string& filename)
 {
   Error err;
 
+  /* fast path for uncompressed wav files: convert directly from the memory mapped file */
+  if (Params::input_format == Format::AUTO && filename != "-")
+    {
+      MMapWavFile wav_file;
+      if (!wav_file.open (filename, /* writable */ false))
+        {
+          const size_t n_frames = wav_file.n_frames();
+          const size_t block_size = 256 * 1024;
+
+          m_samples.resize (n_frames * wav_file.n_channels());
+          for (size_t pos = 0; pos < n_frames; pos += block_size)
+            {
+              const size_t count = std::min (block_size, n_frames - pos);
+
+              wav_file.read_frames (pos, count, &m_samples[pos * wav_file.n_channels()]);
+              wav_file.release_frames (pos, count);
+            }
+
+          m_sample_rate = wav_file.sample_rate();
+          m_n_channels  = wav_file.n_channels();
+          m_bit_depth   = wav_file.bit_depth();
+          return Error::Code::NONE;
+        }
+      /* other formats (or unsupported wav files) are read using a stream */
+    }
+
   std::unique_ptr<AudioInputStream> in_stream = AudioInputStream::create (filename, err);
   if (err)
     return err;
 
+  const size_t n_parts = parallel_parts (in_stream.get());
+  if (Params::input_format == Format::AUTO && filename != "-" && n_parts > 1)
+    {
+      if (load_parallel (filename, in_stream.get(), n_parts))
+        return Error::Code::NONE;
+
+      /* in_stream has been used, so start again */
+      in_stream = AudioInputStream::create (filename, err);
+      if (err)
+        return err;
+    }
   return load (in_stream.get());
 }
 
@@ -57,20 +220,33 @@ WavData::load (AudioInputStream *in_stream)
 {
   m_samples.clear(); // get rid of old contents
 
-  vector<float> m_buffer;
+  const size_t block_size = 16 * 1024;
+  const int    n_channels = in_stream->n_channels();
+  size_t       n_values   = 0;
+
+  /* avoid reallocations while reading if we know the size in advance */
+  if (in_stream->n_frames() != AudioInputStream::N_FRAMES_UNKNOWN)
+    m_samples.reserve ((in_stream->n_frames() + block_size) * n_channels);
+
+  /* read directly into m_samples */
   while (true)
     {
-      Error err = in_stream->read_frames (m_buffer, 1024);
+      if (m_samples.size() < n_values + block_size * n_channels)
+        m_samples.resize (n_values + block_size * n_channels);
+
+      size_t frames_read;
+      Error err = in_stream->read_frames (m_samples.data() + n_values, block_size, frames_read);
       if (err)
         return err;
 
-      if (!m_buffer.size())
+      if (!frames_read)
         {
           /* reached eof */
           break;
         }
-      m_samples.insert (m_samples.end(), m_buffer.begin(), m_buffer.end());
+      n_values += frames_read * n_channels;
     }
+  m_samples.resize (n_values);
   m_sample_rate = in_stream->sample_rate();
   m_n_channels  = in_stream->n_channels();
   m_bit_depth   = in_stream->bit_depth();
@@ -88,7 +264,7 @@ WavData::save (const string& filename) const
   if (err)
     return err;
 
-  err = out_stream->write_frames (m_samples);
+  err = out_stream->write_frames (m_samples.data(), n_frames());
   if (err)
     return err;
 
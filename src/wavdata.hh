@@ -37,6 +37,7 @@ public:
 
   Error load (AudioInputStream *in_stream);
   Error load (const std::string& filename);
+  bool  load_parallel (const std::string& filename, AudioInputStream *in_stream, size_t n_parts);
   Error save (const std::string& filename) const;
 
   int                         sample_rate() const;
@@ -32,6 +32,9 @@
 #include "stdoutwavoutputstream.hh"
 #include "shortcode.hh"
 #include "audiobuffer.hh"
+#include "resample.hh"
+#include "inplacestream.hh"
+#include "threadpool.hh"
 
 using std::string;
 using std::vector;
@@ -162,12 +165,16 @@ init_frame_mod_vec (vector<vector<FrameMod>>& frame_mod_vec, int ab, const vecto
  *
  * input:  per-channel fft delta values (always one frame)
  * output: samples
+ *
+ * synth_samples is a circular buffer of three frames, synth_pos is the index of
+ * the oldest frame, which is the one that gets completed (and returned) by run()
  */
 class WatermarkSynth
 {
   const int     n_channels = 0;
   vector<float> window;
   vector<float> synth_samples;
+  size_t        synth_pos = 0;
   bool          first_frame = true;
   FFTProcessor  fft_processor;
 
@@ -209,24 +216,28 @@ public:
     generate_window();
     synth_samples.resize (window.size() * n_channels);
   }
-  vector<float>
-  run (const vector<vector<complex<float>>>& fft_delta_spect)
+  void
+  run (const vector<vector<complex<float>>>& fft_delta_spect, vector<float>& out_samples)
   {
     const size_t synth_frame_sz = Params::frame_size * n_channels;
-    /* move frame 1 and frame 2 to frame 0 and frame 1 */
-    std::copy (synth_samples.begin() + synth_frame_sz, synth_samples.end(), synth_samples.begin());
-    /* zero out frame 2 */
-    std::fill (synth_samples.begin() + synth_frame_sz * 2, synth_samples.end(), 0);
+
+    /* frame 0 was returned by the last call: reuse it as (zeroed) frame 2 */
+    std::fill (synth_samples.begin() + synth_pos * synth_frame_sz, synth_samples.begin() + (synth_pos + 1) * synth_frame_sz, 0);
+    synth_pos = (synth_pos + 1) % 3;
+
     for (int ch = 0; ch < n_channels; ch++)
       {
-        /* mix watermark signal to output frame */
-        vector<float> fft_delta_out = fft_processor.ifft (fft_delta_spect[ch]);
+        /* complex<float> vector and fft_processor.in() have the same layout in memory */
+        std::copy (fft_delta_spect[ch].begin(), fft_delta_spect[ch].end(), reinterpret_cast<complex<float> *> (fft_processor.in()));
+        fft_processor.ifft();
 
+        /* mix watermark signal to output frame */
+        const float *fft_delta_out = fft_processor.out();
         for (int dframe = 0; dframe <= 2; dframe++)
           {
             const int wstart = dframe * Params::frame_size;
 
-            int pos = dframe * Params::frame_size * n_channels + ch;
+            int pos = ((synth_pos + dframe) % 3) * synth_frame_sz + ch;
             for (size_t x = 0; x < Params::frame_size; x++)
               {
                 synth_samples[pos] += fft_delta_out[x] * window[wstart + x];
@@ -237,12 +248,12 @@ public:
     if (first_frame)
       {
         first_frame = false;
-        return {};
+        out_samples.clear();
       }
     else
       {
-        vector<float> out_samples (synth_samples.begin(), synth_samples.begin() + Params::frame_size * n_channels);
-        return out_samples;
+        const auto begin = synth_samples.begin() + synth_pos * synth_frame_sz;
+        out_samples.assign (begin, begin + synth_frame_sz);
       }
   }
   size_t
@@ -260,9 +271,12 @@ public:
   }
 };
 
+/* spectrum of one frame of the original signal (one fft per watermark channel) */
+typedef vector<vector<complex<float>>> FrameSpectrum;
+
 /* generates a watermark signal
  *
- * input:  original signal samples (always for one complete frame)
+ * input:  spectrum of the original signal (always for one complete frame)
  * output: watermark signal (to be mixed to the original sample)
  */
 class WatermarkGen
@@ -272,17 +286,18 @@ class WatermarkGen
   size_t                    frame_number = 0;
   int                       m_data_blocks = 0;
 
-  FFTAnalyzer               fft_analyzer;
   WatermarkSynth            wm_synth;
 
   vector<int>               bitvec;
   vector<vector<FrameMod>>  frame_mod_vec_a;
   vector<vector<FrameMod>>  frame_mod_vec_b;
+
+  /* per frame scratch buffer, allocated once */
+  vector<vector<complex<float>>> fft_delta_spect;
 public:
   WatermarkGen (int n_channels, const vector<int>& bitvec) :
     n_channels (n_channels),
     frames_per_block (mark_sync_frame_count() + mark_data_frame_count()),
-    fft_analyzer (n_channels),
     wm_synth (n_channels),
     bitvec (bitvec)
   {
@@ -290,17 +305,18 @@ public:
     /* start writing a partial B-block as padding */
     assert (frames_per_block > Params::frames_pad_start);
     frame_number = 2 * frames_per_block - Params::frames_pad_start;
+
+    fft_delta_spect.resize (n_channels);
+    for (auto& spect : fft_delta_spect)
+      spect.resize (Params::frame_size / 2 + 1);
   }
-  vector<float>
-  run (const vector<float>& samples)
+  void
+  run (const FrameSpectrum& fft_out, vector<float>& out_samples)
   {
-    assert (samples.size() == Params::frame_size * n_channels);
-
-    vector<vector<complex<float>>> fft_out = fft_analyzer.run_fft (samples, 0);
+    assert (fft_out.size() == size_t (n_channels));
 
-    vector<vector<complex<float>>> fft_delta_spect;
-    for (int ch = 0; ch < n_channels; ch++)
-      fft_delta_spect.push_back (vector<complex<float>> (fft_out.back().size()));
+    for (auto& spect : fft_delta_spect)
+      std::fill (spect.begin(), spect.end(), 0);
 
     const vector<FrameMod>& frame_mod = get_frame_mod();
     for (int ch = 0; ch < n_channels; ch++)
@@ -310,7 +326,7 @@ public:
     if (frame_number % frames_per_block == 0)
       m_data_blocks++;
 
-    return wm_synth.run (fft_delta_spect);
+    wm_synth.run (fft_delta_spect, out_samples);
   }
   size_t
   skip (size_t zeros)
@@ -357,8 +373,9 @@ public:
 
   virtual size_t        skip (size_t zeros) = 0;
   virtual void          write_frames (const vector<float>& frames) = 0;
-  virtual vector<float> read_frames (size_t frames) = 0;
+  virtual void          read_frames (size_t frames, vector<float>& out) = 0;
   virtual size_t        can_read_frames() const = 0;
+  virtual size_t        delay_frames() const = 0;
 };
 
 template<class Resampler>
@@ -371,6 +388,7 @@ class BufferedResamplerImpl : public ResamplerImpl
   Resampler     m_resampler;
 
   vector<float> buffer;
+  vector<float> skip_buffer;
 public:
   BufferedResamplerImpl (int n_channels, int old_rate, int new_rate) :
     n_channels (n_channels),
@@ -398,7 +416,7 @@ public:
 
     size_t out = can_read_frames() + extra;
     out -= out % Params::frame_size; /* always skip whole frames */
-    read_frames (out - extra);
+    read_frames (out - extra, skip_buffer);
     return out;
   }
   void
@@ -436,25 +454,30 @@ public:
         start = frames.size() / n_channels - m_resampler.inp_count;
       }
   }
-  vector<float>
-  read_frames (size_t frames)
+  void
+  read_frames (size_t frames, vector<float>& out)
   {
     assert (frames * n_channels <= buffer.size());
     const auto begin = buffer.begin();
     const auto end   = begin + frames * n_channels;
-    vector<float> result (begin, end);
+    out.assign (begin, end);
     buffer.erase (begin, end);
-    return result;
   }
   size_t
   can_read_frames() const
   {
     return buffer.size() / n_channels;
   }
+  size_t
+  delay_frames() const
+  {
+    /* number of input frames the resampler needs to see before an output frame is available */
+    return m_resampler.inpsize() / 2;
+  }
 };
 
 static ResamplerImpl *
-create_resampler (int n_channels, int old_rate, int new_rate)
+create_resampler (int n_channels, int old_rate, int new_rate, int hlen)
 {
   if (old_rate == new_rate)
     {
@@ -473,8 +496,6 @@ create_resampler (int n_channels, int old_rate, int new_rate)
        *
        * so we try using Resampler, and if that fails fall back to VResampler
        */
-      const int hlen = 16;
-
       auto resampler = new BufferedResamplerImpl<Resampler> (n_channels, old_rate, new_rate);
       if (resampler->resampler().setup (old_rate, new_rate, n_channels, hlen) == 0)
         {
@@ -498,61 +519,217 @@ create_resampler (int n_channels, int old_rate, int new_rate)
     }
 }
 
-/* generate a watermark at Params::mark_sample_rate and resample to whatever the original signal has
+/* resampler which is only accurate for frequencies up to pass_freq, and is allowed to
+ * produce aliasing for frequencies above stop_freq (returns nullptr if not supported)
+ */
+static ResamplerImpl *
+create_band_resampler (int n_channels, int old_rate, int new_rate, double pass_freq, double stop_freq)
+{
+  auto resampler = new BufferedResamplerImpl<BandResampler> (n_channels, old_rate, new_rate);
+  if (resampler->resampler().setup (old_rate, new_rate, n_channels, pass_freq, stop_freq) == 0)
+    return resampler;
+
+  delete resampler;
+  return nullptr;
+}
+
+/* analyzes the original signal at Params::mark_sample_rate (independent of the message,
+ * so the analysis can be shared if more than one watermark is generated for the same input)
  *
  * input:  samples from original signal (always one frame)
- * output: watermark signal resampled to original signal sample rate
+ * output: spectrum of each watermark frame that was completed by the input (n_spectra)
  */
-class WatermarkResampler
+class WatermarkAnalyzer
 {
+  const WatermarkChannels        wm_channels;
   std::unique_ptr<ResamplerImpl> in_resampler;
-  std::unique_ptr<ResamplerImpl> out_resampler;
-  WatermarkGen                   wm_gen;
+  FFTAnalyzer                    fft_analyzer;
+  const int                      input_rate = 0;
   const bool                     need_resampler = false;
+
+  vector<float>                  r_samples;
+  vector<float>                  wm_channel_in;
+
+  void
+  add_spectrum (const vector<float>& samples, vector<FrameSpectrum>& spectra, size_t& n_spectra)
+  {
+    /* spectra are reused to avoid allocations */
+    if (n_spectra == spectra.size())
+      spectra.emplace_back();
+
+    fft_analyzer.run_fft (samples, 0, spectra[n_spectra++]);
+  }
 public:
-  WatermarkResampler (int n_channels, int input_rate, const vector<int>& bitvec) :
-    wm_gen (n_channels, bitvec),
+  WatermarkAnalyzer (int n_channels, int input_rate) :
+    wm_channels (n_channels),
+    fft_analyzer (wm_channels.n_wm_channels()),
+    input_rate (input_rate),
     need_resampler (input_rate != Params::mark_sample_rate)
   {
+    /* resamplers only process the watermark channels */
+    const int n_wm_channels = wm_channels.n_wm_channels();
+
     if (need_resampler)
       {
-        in_resampler.reset (create_resampler (n_channels, input_rate, Params::mark_sample_rate));
-        out_resampler.reset (create_resampler (n_channels, Params::mark_sample_rate, input_rate));
+        /* the watermark only modifies bands up to max_band, so frequencies above that don't need to be accurate */
+        const double pass_freq = double (Params::max_band + 1) * Params::mark_sample_rate / Params::frame_size;
+        const int    mark_rate = Params::mark_sample_rate;
+
+        /* input: the resampled signal is only analyzed, so aliasing is fine as long as it doesn't reach the pass band */
+        if (Params::resample_quality == ResampleQuality::FAST)
+          in_resampler.reset (create_band_resampler (n_wm_channels, input_rate, mark_rate, pass_freq, min (input_rate, mark_rate) - pass_freq));
+        if (!in_resampler)
+          {
+            const int hlen = Params::resample_quality == ResampleQuality::HIGH ? 32 : 16;
+            in_resampler.reset (create_resampler (n_wm_channels, input_rate, mark_rate, hlen));
+          }
       }
   }
   bool
   init_ok()
   {
+    if (!wm_channels.check())
+      return false;
+
     if (need_resampler)
-      return (in_resampler && out_resampler);
+      return !!in_resampler;
     else
       return true;
   }
-  vector<float>
-  run (const vector<float>& samples)
+  void
+  run (const vector<float>& samples, vector<FrameSpectrum>& spectra, size_t& n_spectra)
   {
+    n_spectra = 0;
+
+    /* only analyze the selected channels (or their downmix) */
+    const vector<float> *wm_samples = &samples;
+    if (!wm_channels.all())
+      {
+        wm_channels.select (samples, wm_channel_in);
+        wm_samples = &wm_channel_in;
+      }
+
     if (!need_resampler)
       {
-        /* cheap case: if no resampling is necessary, just generate the watermark signal */
-        return wm_gen.run (samples);
+        /* cheap case: if no resampling is necessary, just analyze the frame */
+        add_spectrum (*wm_samples, spectra, n_spectra);
+        return;
       }
 
     /* resample to the watermark sample rate */
-    in_resampler->write_frames (samples);
+    in_resampler->write_frames (*wm_samples);
     while (in_resampler->can_read_frames() >= Params::frame_size)
       {
-        vector<float> r_samples = in_resampler->read_frames (Params::frame_size);
+        in_resampler->read_frames (Params::frame_size, r_samples);
+        add_spectrum (r_samples, spectra, n_spectra);
+      }
+  }
+  size_t
+  skip (size_t zeros)
+  {
+    assert (zeros % Params::frame_size == 0);
+    if (!need_resampler)
+      return zeros;
 
+    return in_resampler->skip (zeros);
+  }
+  /* worst case algorithmic delay (in input frames), see WatermarkResampler::out_delay_frames()
+   *
+   * reading the input in frames and the overlap-add synthesis delay the output by up to
+   * two frames; with resampling, watermark frames are not aligned with input frames,
+   * and the resampler filters add some delay
+   */
+  size_t
+  delay_frames (size_t out_delay_frames) const
+  {
+    if (!need_resampler)
+      return 2 * Params::frame_size;
+
+    const double rate_factor = double (input_rate) / Params::mark_sample_rate;
+    return Params::frame_size + in_resampler->delay_frames() +
+           lrint ((2 * Params::frame_size + out_delay_frames) * rate_factor);
+  }
+};
+
+/* generate a watermark at Params::mark_sample_rate and resample to whatever the original signal has
+ *
+ * input:  spectra of the original signal (from WatermarkAnalyzer)
+ * output: watermark signal resampled to original signal sample rate
+ */
+class WatermarkResampler
+{
+  const WatermarkChannels        wm_channels;
+  std::unique_ptr<ResamplerImpl> out_resampler;
+  WatermarkGen                   wm_gen;
+  const bool                     need_resampler = false;
+
+  vector<float>                  wm_samples;
+  vector<float>                  wm_channel_out;
+
+  void
+  run_wm_channels (const vector<FrameSpectrum>& spectra, size_t n_spectra, vector<float>& out_samples)
+  {
+    if (!need_resampler)
+      {
+        /* cheap case: if no resampling is necessary, just generate the watermark signal */
+        assert (n_spectra == 1);
+        wm_gen.run (spectra[0], out_samples);
+        return;
+      }
+
+    for (size_t i = 0; i < n_spectra; i++)
+      {
         /* generate watermark at normalized sample rate */
-        vector<float> wm_samples = wm_gen.run (r_samples);
+        wm_gen.run (spectra[i], wm_samples);
 
         /* resample back to the original sample rate of the audio file */
         out_resampler->write_frames (wm_samples);
       }
 
     size_t to_read = out_resampler->can_read_frames();
-    return out_resampler->read_frames (to_read);
+    out_resampler->read_frames (to_read, out_samples);
   }
+public:
+  WatermarkResampler (int n_channels, int input_rate, const vector<int>& bitvec) :
+    wm_channels (n_channels),
+    wm_gen (wm_channels.n_wm_channels(), bitvec),
+    need_resampler (input_rate != Params::mark_sample_rate)
+  {
+    /* resamplers only process the watermark channels */
+    const int n_wm_channels = wm_channels.n_wm_channels();
+
+    if (need_resampler)
+      {
+        const double pass_freq = double (Params::max_band + 1) * Params::mark_sample_rate / Params::frame_size;
+        const int    mark_rate = Params::mark_sample_rate;
+
+        /* output: the watermark signal has no energy above pass_freq, so only the images need to be removed */
+        out_resampler.reset (create_band_resampler (n_wm_channels, mark_rate, input_rate, pass_freq, mark_rate - pass_freq));
+        if (!out_resampler)
+          out_resampler.reset (create_resampler (n_wm_channels, mark_rate, input_rate, 16));
+      }
+  }
+  bool
+  init_ok()
+  {
+    if (need_resampler)
+      return !!out_resampler;
+    else
+      return true;
+  }
+  void
+  run (const vector<FrameSpectrum>& spectra, size_t n_spectra, vector<float>& out_samples)
+  {
+    if (wm_channels.all())
+      {
+        run_wm_channels (spectra, n_spectra, out_samples);
+        return;
+      }
+    /* the watermark is only generated for the selected channels (or their downmix) */
+    run_wm_channels (spectra, n_spectra, wm_channel_out);
+    wm_channels.expand (wm_channel_out, out_samples);
+  }
+  /* zeros: result of WatermarkAnalyzer::skip() */
   size_t
   skip (size_t zeros)
   {
@@ -563,10 +740,7 @@ public:
       }
     else
       {
-        /* resample to the watermark sample rate */
-        size_t out = in_resampler->skip (zeros);
-
-        out = wm_gen.skip (out);
+        size_t out = wm_gen.skip (zeros);
 
         return out_resampler->skip (out);
       }
@@ -576,38 +750,203 @@ public:
   {
     return wm_gen.data_blocks();
   }
+  size_t
+  out_delay_frames() const
+  {
+    return need_resampler ? out_resampler->delay_frames() : 0;
+  }
 };
 
+static const char *
+encoding_name (RawFormat::Encoding encoding)
+{
+  switch (encoding)
+    {
+      case RawFormat::Encoding::SIGNED:   return "signed";
+      case RawFormat::Encoding::UNSIGNED: return "unsigned";
+      case RawFormat::Encoding::FLOAT:    return "float";
+    }
+  return "unknown";
+}
+
 void
 info_format (const string& label, const RawFormat& format)
 {
   info ("%-13s %d Hz, %d Channels, %d Bit (%s %s-endian)\n", (label + ":").c_str(),
       format.sample_rate(), format.n_channels(), format.bit_depth(),
-      format.encoding() == RawFormat::Encoding::SIGNED ? "signed" : "unsigned",
+      encoding_name (format.encoding()),
       format.endian() == RawFormat::Endian::LITTLE ? "little" : "big");
 }
 
+/* one frame of input for add_stream_watermark, with the analysis results */
+struct AnalyzedFrame
+{
+  vector<float>         samples;
+  vector<FrameSpectrum> spectra;
+  size_t                n_spectra = 0;
+  size_t                total_input_frames = 0;
+};
+
+/* per message state of add_stream_watermark: watermark generation, limiter and output stream */
+class WatermarkOutput
+{
+  const int           n_channels = 0;
+  AudioOutputStream  *out_stream = nullptr;
+  AudioBuffer         audio_buffer;
+  Limiter             limiter;
+  LookaheadLimiter    live_limiter;
+
+  /* buffers are reused for all frames, so the steady state loop doesn't allocate memory */
+  vector<float>       wm_samples;
+  vector<float>       orig_samples;
+  vector<float>       limiter_samples;
+public:
+  WatermarkResampler  wm_resampler;
+
+  /* for signal to noise ratio */
+  double              snr_delta_power = 0;
+  double              snr_signal_power = 0;
+
+  size_t              total_output_frames = 0;
+  size_t              zero_frames_out = 0;
+  Error               write_err;
+
+  WatermarkOutput (AudioOutputStream *out_stream, int n_channels, int sample_rate, const vector<int>& bitvec, size_t zero_frames) :
+    n_channels (n_channels),
+    out_stream (out_stream),
+    audio_buffer (n_channels),
+    limiter (n_channels, sample_rate),
+    live_limiter (n_channels, sample_rate),
+    wm_resampler (n_channels, sample_rate, bitvec),
+    zero_frames_out (zero_frames)
+  {
+    limiter.set_block_size_ms (Params::limiter_block_size_ms);
+    limiter.set_ceiling (Params::limiter_ceiling);
+
+    /* live mode: the block based limiter would add seconds of latency, so we use a short lookahead limiter */
+    live_limiter.set_ceiling (Params::limiter_ceiling);
+    live_limiter.set_release_ms (Params::live_limiter_release_ms);
+  }
+  void
+  set_live_lookahead_ms (double lookahead_ms)
+  {
+    live_limiter.set_lookahead_ms (lookahead_ms);
+  }
+  size_t
+  live_lookahead_frames() const
+  {
+    return live_limiter.lookahead_frames();
+  }
+  /* skip_frames: number of input frames skipped, mark_frames: WatermarkAnalyzer::skip() result */
+  void
+  skip (size_t skip_frames, size_t mark_frames)
+  {
+    size_t out = wm_resampler.skip (mark_frames);
+
+    audio_buffer.write_frames (std::vector<float> ((skip_frames - out) * n_channels));
+
+    out = Params::live ? live_limiter.skip (out) : limiter.skip (out);
+    assert (out < zero_frames_out);
+
+    zero_frames_out -= out;
+    total_output_frames += out;
+  }
+  bool
+  process (const AnalyzedFrame& frame)
+  {
+    audio_buffer.write_frames (frame.samples);
+    wm_resampler.run (frame.spectra, frame.n_spectra, wm_samples);
+    size_t to_read = wm_samples.size() / n_channels;
+    audio_buffer.read_frames (to_read, orig_samples);
+    assert (wm_samples.size() == orig_samples.size());
+
+    if (Params::snr)
+      {
+        for (size_t i = 0; i < wm_samples.size(); i++)
+          {
+            const double orig  = orig_samples[i]; // original sample
+            const double delta = wm_samples[i];   // watermark
+
+            snr_delta_power += delta * delta;
+            snr_signal_power += orig * orig;
+          }
+      }
+    for (size_t i = 0; i < wm_samples.size(); i++)
+      wm_samples[i] += orig_samples[i];
+
+    vector<float>& out_samples = Params::test_no_limiter ? wm_samples : limiter_samples;
+    if (!Params::test_no_limiter)
+      {
+        if (Params::live)
+          live_limiter.process (wm_samples, limiter_samples);
+        else
+          limiter.process (wm_samples, limiter_samples);
+      }
+
+    size_t max_write_frames = frame.total_input_frames - total_output_frames;
+    if (out_samples.size() > max_write_frames * n_channels)
+      out_samples.resize (max_write_frames * n_channels);
+
+    const size_t cut_frames = min (out_samples.size() / n_channels, zero_frames_out);
+    if (cut_frames > 0)
+      {
+        total_output_frames += cut_frames;
+        zero_frames_out -= cut_frames;
+      }
+
+    const size_t write_frames = out_samples.size() / n_channels - cut_frames;
+    write_err = out_stream->write_frames (out_samples.data() + cut_frames * n_channels, write_frames);
+    if (write_err)
+      return false;
+
+    total_output_frames += write_frames;
+    return true;
+  }
+};
+
 int
 add_stream_watermark (AudioInputStream *in_stream, AudioOutputStream *out_stream, const string& bits, size_t zero_frames)
 {
-  auto bitvec = parse_payload (bits);
-  if (bitvec.empty())
-    return 1;
+  return add_stream_watermark (in_stream, vector<AudioOutputStream *> { out_stream }, vector<string> { bits }, zero_frames);
+}
 
-  /* sanity checks */
-  if (in_stream->sample_rate() != out_stream->sample_rate())
+/* add a different watermark message to each output stream
+ *
+ * reading and analyzing the input is done only once; watermark generation, limiter and
+ * encoding the output for each message run in parallel (in chunks of frames)
+ */
+int
+add_stream_watermark (AudioInputStream *in_stream, const vector<AudioOutputStream *>& out_streams, const vector<string>& bits, size_t zero_frames)
+{
+  assert (out_streams.size() == bits.size() && !out_streams.empty());
+
+  vector<vector<int>> bitvecs;
+  for (auto& b : bits)
     {
-      error ("audiowmark: input sample rate (%d) and output sample rate (%d) don't match\n", in_stream->sample_rate(), out_stream->sample_rate());
-      return 1;
+      auto bitvec = parse_payload (b);
+      if (bitvec.empty())
+        return 1;
+      bitvecs.push_back (bitvec);
     }
-  if (in_stream->n_channels() != out_stream->n_channels())
+
+  /* sanity checks */
+  for (auto out_stream : out_streams)
     {
-      error ("audiowmark: input channels (%d) and output channels (%d) don't match\n", in_stream->n_channels(), out_stream->n_channels());
-      return 1;
+      if (in_stream->sample_rate() != out_stream->sample_rate())
+        {
+          error ("audiowmark: input sample rate (%d) and output sample rate (%d) don't match\n", in_stream->sample_rate(), out_stream->sample_rate());
+          return 1;
+        }
+      if (in_stream->n_channels() != out_stream->n_channels())
+        {
+          error ("audiowmark: input channels (%d) and output channels (%d) don't match\n", in_stream->n_channels(), out_stream->n_channels());
+          return 1;
+        }
     }
 
   /* write some informational messages */
-  info ("Message:      %s\n", bit_vec_to_str (bitvec).c_str());
+  for (auto& bitvec : bitvecs)
+    info ("Message:      %s\n", bit_vec_to_str (bitvec).c_str());
   info ("Strength:     %.6g\n\n", Params::water_delta * 1000);
 
   if (in_stream->n_frames() == AudioInputStream::N_FRAMES_UNKNOWN)
@@ -622,122 +961,149 @@ add_stream_watermark (AudioInputStream *in_stream, AudioOutputStream *out_stream
   info ("Sample Rate:  %d\n", in_stream->sample_rate());
   info ("Channels:     %d\n", in_stream->n_channels());
 
-  vector<float> samples;
-
   const int n_channels = in_stream->n_channels();
-  AudioBuffer audio_buffer (n_channels);
-  WatermarkResampler wm_resampler (n_channels, in_stream->sample_rate(), bitvec);
-  if (!wm_resampler.init_ok())
+  WatermarkAnalyzer wm_analyzer (n_channels, in_stream->sample_rate());
+  if (!wm_analyzer.init_ok())
     return 1;
 
-  Limiter limiter (n_channels, in_stream->sample_rate());
-  limiter.set_block_size_ms (Params::limiter_block_size_ms);
-  limiter.set_ceiling (Params::limiter_ceiling);
+  vector<std::unique_ptr<WatermarkOutput>> outputs;
+  for (size_t i = 0; i < out_streams.size(); i++)
+    {
+      outputs.emplace_back (new WatermarkOutput (out_streams[i], n_channels, in_stream->sample_rate(), bitvecs[i], zero_frames));
+      if (!outputs.back()->wm_resampler.init_ok())
+        return 1;
+    }
 
-  /* for signal to noise ratio */
-  double snr_delta_power = 0;
-  double snr_signal_power = 0;
+  if (Params::live)
+    {
+      const double sample_rate = in_stream->sample_rate();
+      const size_t wm_delay    = wm_analyzer.delay_frames (outputs[0]->wm_resampler.out_delay_frames());
+      const double wm_delay_ms = wm_delay * 1000 / sample_rate;
+
+      double lookahead_ms = Params::live_limiter_lookahead_ms;
+      if (Params::max_latency_ms > 0)
+        {
+          lookahead_ms = min (lookahead_ms, Params::max_latency_ms - wm_delay_ms);
+          if (lookahead_ms < 0)
+            {
+              error ("audiowmark: latency budget (%d ms) is too small, watermark generation needs %.1f ms\n",
+                     Params::max_latency_ms, wm_delay_ms);
+              return 1;
+            }
+        }
+      for (auto& output : outputs)
+        output->set_live_lookahead_ms (lookahead_ms);
+
+      const size_t latency_frames = wm_delay + outputs[0]->live_lookahead_frames();
+      info ("Latency:      %.1f ms (%zd frames)\n", latency_frames * 1000 / sample_rate, latency_frames);
+    }
 
+  /* with more than one output, frames are processed in chunks to keep the threading overhead low */
+  std::unique_ptr<ThreadPool> thread_pool;
+  if (outputs.size() > 1)
+    thread_pool.reset (new ThreadPool());
+
+  vector<AnalyzedFrame> chunk (outputs.size() > 1 ? 32 : 1);
+  size_t                chunk_used = 0;
+
+  auto process_chunk = [&] () {
+    for (auto& output : outputs)
+      {
+        WatermarkOutput *out = output.get();
+        auto job = [&chunk, chunk_used, out] {
+          for (size_t i = 0; i < chunk_used; i++)
+            if (!out->process (chunk[i]))
+              return;
+        };
+        if (thread_pool)
+          thread_pool->add_job (job);
+        else
+          job();
+      }
+    if (thread_pool)
+      thread_pool->wait_all();
+
+    chunk_used = 0;
+    for (auto& output : outputs)
+      {
+        if (output->write_err)
+          {
+            error ("audiowmark output write failed: %s\n", output->write_err.message());
+            return false;
+          }
+      }
+    return true;
+  };
+
+  vector<float> samples;
   size_t total_input_frames = 0;
-  size_t total_output_frames = 0;
   size_t zero_frames_in  = zero_frames;
-  size_t zero_frames_out = zero_frames;
   Error err;
   if (zero_frames_in >= Params::frame_size)
     {
       const size_t skip_frames = zero_frames_in - zero_frames_in % Params::frame_size;
 
       total_input_frames += skip_frames;
-      size_t out = wm_resampler.skip (skip_frames);
-
-      audio_buffer.write_frames (std::vector<float> ((skip_frames - out) * n_channels));
+      size_t mark_frames = wm_analyzer.skip (skip_frames);
+      for (auto& output : outputs)
+        output->skip (skip_frames, mark_frames);
 
-      out = limiter.skip (out);
-      assert (out < zero_frames_out);
-
-      zero_frames_out -= out;
-      total_output_frames += out;
       zero_frames_in -= skip_frames;
     }
   while (true)
     {
-      if (zero_frames_in > 0)
-        {
-          err = in_stream->read_frames (samples, Params::frame_size - zero_frames_in);
-          samples.insert (samples.begin(), zero_frames_in * n_channels, 0);
-          zero_frames_in = 0;
-        }
-      else
-        {
-          err = in_stream->read_frames (samples, Params::frame_size);
-        }
+      /* read one frame of input; zero frames that were not skipped are inserted before the input */
+      samples.resize (Params::frame_size * n_channels);
+      std::fill (samples.begin(), samples.begin() + zero_frames_in * n_channels, 0);
+
+      size_t frames_read = 0;
+      err = in_stream->read_frames (samples.data() + zero_frames_in * n_channels, Params::frame_size - zero_frames_in, frames_read);
       if (err)
         {
           error ("audiowmark: input stream read failed: %s\n", err.message());
           return 1;
         }
-      total_input_frames += samples.size() / n_channels;
+      const size_t frames = zero_frames_in + frames_read;
+      zero_frames_in = 0;
+      total_input_frames += frames;
 
-      if (samples.size() < Params::frame_size * n_channels)
+      if (frames < Params::frame_size)
         {
-          if (total_input_frames == total_output_frames)
+          /* all outputs need to be up to date to decide whether we're done */
+          if (chunk_used && !process_chunk())
+            return 1;
+
+          if (total_input_frames == outputs[0]->total_output_frames)
             break;
 
           /* zero sample padding after the actual input */
-          samples.resize (Params::frame_size * n_channels);
-        }
-      audio_buffer.write_frames (samples);
-      samples = wm_resampler.run (samples);
-      size_t to_read = samples.size() / n_channels;
-      vector<float> orig_samples  = audio_buffer.read_frames (to_read);
-      assert (samples.size() == orig_samples.size());
-
-      if (Params::snr)
-        {
-          for (size_t i = 0; i < samples.size(); i++)
-            {
-              const double orig  = orig_samples[i]; // original sample
-              const double delta = samples[i];      // watermark
-
-              snr_delta_power += delta * delta;
-              snr_signal_power += orig * orig;
-            }
+          std::fill (samples.begin() + frames * n_channels, samples.end(), 0);
         }
-      for (size_t i = 0; i < samples.size(); i++)
-        samples[i] += orig_samples[i];
-
-      if (!Params::test_no_limiter)
-        samples = limiter.process (samples);
+      AnalyzedFrame& frame = chunk[chunk_used++];
+      frame.samples.assign (samples.begin(), samples.end());
+      frame.total_input_frames = total_input_frames;
+      wm_analyzer.run (samples, frame.spectra, frame.n_spectra);
 
-      size_t max_write_frames = total_input_frames - total_output_frames;
-      if (samples.size() > max_write_frames * n_channels)
-        samples.resize (max_write_frames * n_channels);
-
-      const size_t cut_frames = min (samples.size() / n_channels, zero_frames_out);
-      if (cut_frames > 0)
+      if (chunk_used == chunk.size() || frames < Params::frame_size)
         {
-          samples.erase (samples.begin(), samples.begin() + cut_frames * n_channels);
-          total_output_frames += cut_frames;
-          zero_frames_out -= cut_frames;
-        }
-
-      err = out_stream->write_frames (samples);
-      if (err)
-        {
-          error ("audiowmark output write failed: %s\n", err.message());
-          return 1;
+          if (!process_chunk())
+            return 1;
         }
-      total_output_frames += samples.size() / n_channels;
     }
 
-  if (Params::snr)
-    info ("SNR:          %f dB\n", 10 * log10 (snr_signal_power / snr_delta_power));
+  for (auto& output : outputs)
+    {
+      if (Params::snr)
+        info ("SNR:          %f dB\n", 10 * log10 (output->snr_signal_power / output->snr_delta_power));
+    }
 
-  info ("Data Blocks:  %d\n", wm_resampler.data_blocks());
+  info ("Data Blocks:  %d\n", outputs[0]->wm_resampler.data_blocks());
 
   if (in_stream->n_frames() != AudioInputStream::N_FRAMES_UNKNOWN)
     {
+      /* all outputs have the same number of frames */
       const size_t expect_frames = in_stream->n_frames() + zero_frames;
+      const size_t total_output_frames = outputs[0]->total_output_frames;
       if (total_output_frames != expect_frames)
         {
           auto msg = string_printf ("unexpected EOF; input frames (%zd) != output frames (%zd)", expect_frames, total_output_frames);
@@ -750,11 +1116,14 @@ add_stream_watermark (AudioInputStream *in_stream, AudioOutputStream *out_stream
         }
     }
 
-  err = out_stream->close();
-  if (err)
+  for (auto out_stream : out_streams)
     {
-      error ("audiowmark: closing output stream failed: %s\n", err.message());
-      return 1;
+      err = out_stream->close();
+      if (err)
+        {
+          error ("audiowmark: closing output stream failed: %s\n", err.message());
+          return 1;
+        }
     }
   return 0;
 }
@@ -762,6 +1131,12 @@ add_stream_watermark (AudioInputStream *in_stream, AudioOutputStream *out_stream
 int
 add_watermark (const string& infile, const string& outfile, const string& bits)
 {
+  if (Params::live && outfile == "-")
+    {
+      /* live mode: write each block to stdout as soon as it is available */
+      setvbuf (stdout, nullptr, _IONBF, 0);
+    }
+
   /* open input stream */
   Error err;
   std::unique_ptr<AudioInputStream> in_stream = AudioInputStream::create (infile, err);
@@ -772,7 +1147,9 @@ add_watermark (const string& infile, const string& outfile, const string& bits)
     }
 
   /* open output stream */
-  const int out_bit_depth = in_stream->bit_depth() > 16 ? 24 : 16;
+  int out_bit_depth = in_stream->bit_depth() > 16 ? 24 : 16;
+  if (Params::output_float)
+    out_bit_depth = 32;
   std::unique_ptr<AudioOutputStream> out_stream;
   out_stream = AudioOutputStream::create (outfile, in_stream->n_channels(), in_stream->sample_rate(), out_bit_depth, in_stream->n_frames(), err);
   if (err)
@@ -792,4 +1169,85 @@ add_watermark (const string& infile, const string& outfile, const string& bits)
   return add_stream_watermark (in_stream.get(), out_stream.get(), bits, 0);
 }
 
+/* settings that must be the same when resuming an interrupted in-place run (the key can't be checked) */
+static string
+in_place_settings (const vector<int>& bitvec)
+{
+  string channels;
+  for (auto ch : Params::channels)
+    channels += string_printf ("%s%d", channels.empty() ? "" : ",", ch);
+
+  return string_printf ("message=%s strength=%.6g channels=%s mid=%d resample-quality=%d limiter=%d",
+                        bit_vec_to_str (bitvec).c_str(), Params::water_delta * 1000, channels.c_str(), Params::mid,
+                        int (Params::resample_quality), !Params::test_no_limiter);
+}
 
+int
+add_watermark_in_place (const string& filename, const string& bits)
+{
+  if (Params::input_format != Format::AUTO || Params::output_format != Format::AUTO || Params::live)
+    {
+      error ("audiowmark: in-place watermarking can not be used with raw/shm streams or in live mode\n");
+      return 1;
+    }
+  auto bitvec = parse_payload (bits);
+  if (bitvec.empty())
+    return 1;
+
+  MMapWavFile wav_file;
+  Error err = wav_file.open (filename, /* writable */ true);
+  if (err)
+    {
+      error ("audiowmark: error opening %s: %s\n", filename.c_str(), err.message());
+      return 1;
+    }
+  if (wav_file.is_float() || (wav_file.bit_depth() != 16 && wav_file.bit_depth() != 24))
+    {
+      error ("audiowmark: in-place watermarking only supports 16 and 24 bit PCM wav files\n");
+      return 1;
+    }
+
+  /* if a previous run was interrupted, restore the file to the last checkpoint and continue from there */
+  InPlaceJournal journal (&wav_file, filename, in_place_settings (bitvec));
+  size_t checkpoint = 0;
+  vector<unsigned char> preroll;
+  if (journal.exists())
+    {
+      err = journal.recover (checkpoint, preroll);
+      if (err)
+        {
+          error ("audiowmark: error resuming interrupted in-place watermarking of %s: %s\n", filename.c_str(), err.message());
+          return 1;
+        }
+    }
+  err = journal.start (checkpoint, preroll);
+  if (err)
+    {
+      error ("audiowmark: error creating journal for %s: %s\n", filename.c_str(), err.message());
+      return 1;
+    }
+
+  const size_t preroll_frames = preroll.size() / wav_file.frame_bytes();
+
+  InPlaceInputStream in_stream;
+  err = in_stream.open (&wav_file, checkpoint, preroll);
+  if (!err)
+    {
+      InPlaceOutputStream out_stream;
+      err = out_stream.open (&wav_file, &journal, checkpoint, preroll_frames);
+      if (!err)
+        {
+          info ("In-Place:     %s\n", filename.c_str());
+          info ("Journal:      %s\n", journal.filename().c_str());
+          if (checkpoint > 0)
+            {
+              size_t seconds = checkpoint / wav_file.sample_rate();
+              info ("Resume:       %zd:%02zd\n", seconds / 60, seconds % 60);
+            }
+          /* the watermark generator is started at the preroll position, as if the file was processed from the start */
+          return add_stream_watermark (&in_stream, &out_stream, bits, checkpoint - preroll_frames);
+        }
+    }
+  error ("audiowmark: error opening %s: %s\n", filename.c_str(), err.message());
+  return 1;
+}
@@ -40,16 +40,30 @@ bool   Params::payload_short   = false;
 int    Params::test_cut        = 0; // for sync test
 bool   Params::test_no_sync    = false; // disable sync
 bool   Params::test_no_limiter = false; // disable limiter
+bool   Params::live            = false;
+int    Params::max_latency_ms  = 0;
 int    Params::test_truncate   = 0;
+int    Params::test_in_place_crash = 0;
+bool   Params::test_hls_sequential = false;
 int    Params::expect_matches  = -1;
 
 Format Params::input_format     = Format::AUTO;
 Format Params::output_format    = Format::AUTO;
+bool   Params::output_float     = false;
+string Params::output_codec;
+int    Params::output_bit_rate  = 0;
+
+ResampleQuality Params::resample_quality = ResampleQuality::NORMAL;
+int             Params::mp3_min_sample_rate = 0;
+
+vector<int> Params::channels;
+bool        Params::mid = false;
 
 RawFormat Params::raw_input_format;
 RawFormat Params::raw_output_format;
 
 int    Params::hls_bit_rate = 0;
+ContextFormat Params::hls_context_format = ContextFormat::FLAC;
 
 string Params::json_output;
 string Params::input_label;
@@ -90,13 +104,22 @@ FFTAnalyzer::gen_normalized_window (size_t n_values)
 
 vector<vector<complex<float>>>
 FFTAnalyzer::run_fft (const vector<float>& samples, size_t start_index)
+{
+  vector<vector<complex<float>>> fft_out;
+  run_fft (samples, start_index, fft_out);
+  return fft_out;
+}
+
+/* same as above, but reuses the storage of fft_out (no allocations after the first call) */
+void
+FFTAnalyzer::run_fft (const vector<float>& samples, size_t start_index, vector<vector<complex<float>>>& fft_out)
 {
   assert (samples.size() >= (Params::frame_size + start_index) * m_n_channels);
 
   float *frame     = m_fft_processor.in();
   float *frame_fft = m_fft_processor.out();
 
-  vector<vector<complex<float>>> fft_out;
+  fft_out.resize (m_n_channels);
   for (int ch = 0; ch < m_n_channels; ch++)
     {
       size_t pos = start_index * m_n_channels + ch;
@@ -114,10 +137,102 @@ FFTAnalyzer::run_fft (const vector<float>& samples, size_t start_index)
       /* complex<float> and frame_fft have the same layout in memory */
       const complex<float> *first = (complex<float> *) frame_fft;
       const complex<float> *last  = first + Params::frame_size / 2 + 1;
-      fft_out.emplace_back (first, last);
+      fft_out[ch].assign (first, last);
     }
+}
 
-  return fft_out;
+WatermarkChannels::WatermarkChannels (int n_channels) :
+  m_n_channels (n_channels),
+  m_channels (Params::channels)
+{
+  if (m_channels.empty())
+    {
+      for (int ch = 0; ch < n_channels; ch++)
+        m_channels.push_back (ch);
+    }
+  /* default case: process all channels independently, no need to reorder samples */
+  for (size_t i = 0; i < m_channels.size(); i++)
+    if (m_channels[i] != int (i))
+      m_all = false;
+
+  if (Params::mid || int (m_channels.size()) != n_channels)
+    m_all = false;
+}
+
+bool
+WatermarkChannels::check() const
+{
+  for (size_t i = 0; i < m_channels.size(); i++)
+    {
+      if (m_channels[i] < 0 || m_channels[i] >= m_n_channels)
+        {
+          error ("audiowmark: watermark channel %d out of range (audio has %d channels)\n", m_channels[i], m_n_channels);
+          return false;
+        }
+      for (size_t j = 0; j < i; j++)
+        {
+          if (m_channels[j] == m_channels[i])
+            {
+              error ("audiowmark: watermark channel %d selected more than once\n", m_channels[i]);
+              return false;
+            }
+        }
+    }
+  return true;
+}
+
+bool
+WatermarkChannels::all() const
+{
+  return m_all;
+}
+
+int
+WatermarkChannels::n_wm_channels() const
+{
+  return Params::mid ? 1 : m_channels.size();
+}
+
+/* extract watermark channels (or downmix) from samples */
+void
+WatermarkChannels::select (const vector<float>& samples, vector<float>& wm_samples) const
+{
+  const size_t n_frames = samples.size() / m_n_channels;
+  const int    n_wm_ch  = n_wm_channels();
+
+  wm_samples.resize (n_frames * n_wm_ch);
+  for (size_t f = 0; f < n_frames; f++)
+    {
+      const float *frame = &samples[f * m_n_channels];
+      if (Params::mid)
+        {
+          float sum = 0;
+          for (auto ch : m_channels)
+            sum += frame[ch];
+          wm_samples[f] = sum / m_channels.size();
+        }
+      else
+        {
+          for (int i = 0; i < n_wm_ch; i++)
+            wm_samples[f * n_wm_ch + i] = frame[m_channels[i]];
+        }
+    }
+}
+
+/* distribute watermark signal to the selected channels (other channels are zero) */
+void
+WatermarkChannels::expand (const vector<float>& wm_samples, vector<float>& samples) const
+{
+  const int    n_wm_ch  = n_wm_channels();
+  const size_t n_frames = wm_samples.size() / n_wm_ch;
+
+  samples.assign (n_frames * m_n_channels, 0);
+  for (size_t f = 0; f < n_frames; f++)
+    {
+      float *frame = &samples[f * m_n_channels];
+      for (size_t i = 0; i < m_channels.size(); i++)
+        frame[m_channels[i]] = wm_samples[f * n_wm_ch + (Params::mid ? 0 : i)];
+    }
 }
 
 vector<vector<complex<float>>>
@@ -28,7 +28,9 @@
 
 #include <assert.h>
 
-enum class Format { AUTO = 1, RAW = 2 };
+enum class Format { AUTO = 1, RAW = 2, SHM = 3 };
+enum class ResampleQuality { FAST = 1, NORMAL = 2, HIGH = 3 };
+enum class ContextFormat { FLAC = 1, PCM16 = 2, FLOAT = 3 };
 
 class Params
 {
@@ -67,19 +69,36 @@ public:
   static constexpr double limiter_block_size_ms = 1000;
   static constexpr double limiter_ceiling       = 0.99;
 
+  static           bool live;                      // low latency mode for live streams
+  static           int  max_latency_ms;            // latency budget for live mode (0: no limit)
+  static constexpr double live_limiter_lookahead_ms = 5;
+  static constexpr double live_limiter_release_ms   = 40;
+
   static           int test_cut; // for sync test
   static           bool test_no_sync;
   static           bool test_no_limiter;
   static           int test_truncate;
+  static           int test_in_place_crash; // for in-place resume test: exit after writing part of this block
+  static           bool test_hls_sequential; // for hls-prepare test: process segments in one thread
   static           int expect_matches;
 
   static           Format input_format;
   static           Format output_format;
+  static           bool   output_float;            // write float wav files (instead of 16/24 bit integer)
+  static           std::string output_codec;       // encode output using ffmpeg with this codec
+  static           int    output_bit_rate;         // bit rate for encoded output (0: codec default)
 
   static           RawFormat raw_input_format;
   static           RawFormat raw_output_format;
 
   static           int hls_bit_rate;
+  static           ContextFormat hls_context_format; // audio context format for hls-prepare
+
+  static           ResampleQuality resample_quality; // input resampler quality for add
+  static           int  mp3_min_sample_rate;       // decode mp3 at a reduced rate, down to this rate (0: full rate)
+
+  static           std::vector<int> channels;      // channels that carry the watermark (empty: all)
+  static           bool mid;                       // embed/detect one watermark in the downmix of the channels
 
   // input/output labels can be set for pretty output for videowmark add
   static           std::string input_label;
@@ -129,11 +148,34 @@ public:
   FFTAnalyzer (int n_channels);
 
   std::vector<std::vector<std::complex<float>>> run_fft (const std::vector<float>& samples, size_t start_index);
+  void run_fft (const std::vector<float>& samples, size_t start_index, std::vector<std::vector<std::complex<float>>>& fft_out);
   std::vector<std::vector<std::complex<float>>> fft_range (const std::vector<float>& samples, size_t start_index, size_t frame_count);
 
   static std::vector<float> gen_normalized_window (size_t n_values);
 };
 
+/* channels that carry the watermark (selected using Params::channels and Params::mid)
+ *
+ * watermark generation and detection only process n_wm_channels() channels: either the
+ * selected channels, or in mid mode a single downmix of the selected channels; when adding
+ * a watermark in mid mode, the same watermark signal is added to all selected channels
+ */
+class WatermarkChannels
+{
+  int              m_n_channels = 0;
+  std::vector<int> m_channels;
+  bool             m_all = true;
+public:
+  WatermarkChannels (int n_channels);
+
+  bool check() const;
+  bool all() const;
+  int  n_wm_channels() const;
+
+  void select (const std::vector<float>& samples, std::vector<float>& wm_samples) const;
+  void expand (const std::vector<float>& wm_samples, std::vector<float>& samples) const;
+};
+
 struct MixEntry
 {
   int  frame;
@@ -215,7 +257,12 @@ db_from_complex (std::complex<float> f, float min_dB)
 }
 
 int add_stream_watermark (AudioInputStream *in_stream, AudioOutputStream *out_stream, const std::string& bits, size_t zero_frames);
+int add_stream_watermark (AudioInputStream *in_stream, const std::vector<AudioOutputStream *>& out_streams,
+                          const std::vector<std::string>& bits, size_t zero_frames);
 int add_watermark (const std::string& infile, const std::string& outfile, const std::string& bits);
+int add_watermark_in_place (const std::string& filename, const std::string& bits);
 int get_watermark (const std::string& infile, const std::string& orig_pattern);
+int get_watermark (WavData wav_data, const std::string& orig_pattern);
+int get_ab_watermark (const std::string& infile, const std::vector<double>& segment_durations, const std::string& orig_pattern);
 
 #endif /* AUDIOWMARK_WM_COMMON_HH */
@@ -26,6 +26,7 @@
 #include "syncfinder.hh"
 #include "resample.hh"
 #include "fft.hh"
+#include "hls.hh"
 
 using std::string;
 using std::vector;
@@ -580,6 +581,193 @@ public:
   }
 };
 
+/*
+ * The A/B decoder is used for streams that were assembled from A/B variant
+ * segments (see hls-prepare-ab). Each segment is available in two variants,
+ * watermarked with a payload of all zero bits (A) and with a payload of all
+ * one bits (B); segment i of the stream uses the variant for message bit
+ * (i % payload_size).
+ *
+ * Both variants use the same sync pattern, so the sync finder can locate the
+ * watermark blocks in the stream as usual. Since the blocks are periodic,
+ * this gives us the position of every data frame in the input (including
+ * incomplete blocks at the start and end). We correlate the up/down band
+ * levels of each data frame with the difference between the A and B
+ * codewords, and sum up the result for each segment.
+ */
+class ABDecoder
+{
+  struct Entry
+  {
+    int up;
+    int down;
+    int bit;  // index of the coded bit
+  };
+  const int             frames_per_block = 0;
+  vector<vector<Entry>> frame_entries;  // entries for each frame of a block
+  vector<vector<int>>   bit_signs;      // +1: B pattern has bit set, -1: A pattern has bit set, 0: same for A/B
+
+  vector<int>
+  coded_bits (ConvBlockType block_type, int bit)
+  {
+    return randomize_bit_order (code_encode (block_type, vector<int> (Params::payload_size, bit)), /* encode */ true);
+  }
+  /* find offset of the input start relative to the start of an A+B block pair (of type block_type) */
+  bool
+  find_block_offset (const WavData& wav_data, size_t& offset, ConvBlockType& block_type)
+  {
+    SyncFinder sync_finder;
+    vector<SyncFinder::Score> sync_scores = sync_finder.search (wav_data, SyncFinder::Mode::BLOCK);
+    size_t pad_frames = 0;
+    if (sync_scores.empty())
+      {
+        /* input is shorter than one block: zeropad and search like the clip decoder */
+        pad_frames = (frames_per_block + 5) * Params::frame_size;
+
+        vector<float> ext_samples (wav_data.samples());
+        ext_samples.insert (ext_samples.begin(), pad_frames * wav_data.n_channels(), 0);
+        ext_samples.insert (ext_samples.end(),   pad_frames * wav_data.n_channels(), 0);
+
+        WavData l_wav_data (ext_samples, wav_data.n_channels(), wav_data.sample_rate(), wav_data.bit_depth());
+        sync_scores = sync_finder.search (l_wav_data, SyncFinder::Mode::CLIP);
+      }
+    if (sync_scores.empty())
+      return false;
+
+    SyncFinder::Score best_score = sync_scores[0];
+    for (auto score : sync_scores)
+      if (score.quality > best_score.quality)
+        best_score = score;
+
+    /* blocks are periodic, so the first block pair of this type starts at offset > 0 before the input */
+    const size_t ab_block_size = 2 * frames_per_block * Params::frame_size;
+    offset = ab_block_size - (best_score.index + ab_block_size - pad_frames % ab_block_size) % ab_block_size;
+    block_type = best_score.block_type;
+    return true;
+  }
+public:
+  ABDecoder() :
+    frames_per_block (mark_sync_frame_count() + mark_data_frame_count())
+  {
+    frame_entries.resize (frames_per_block);
+
+    const int frame_count = mark_data_frame_count();
+    if (Params::mix)
+      {
+        vector<MixEntry> mix_entries = gen_mix_entries();
+
+        for (int f = 0; f < frame_count; f++)
+          {
+            for (size_t frame_b = 0; frame_b < Params::bands_per_frame; frame_b++)
+              {
+                const MixEntry& m = mix_entries[f * Params::bands_per_frame + frame_b];
+                frame_entries[m.frame].push_back ({ m.up, m.down, f / Params::frames_per_bit });
+              }
+          }
+      }
+    else
+      {
+        UpDownGen up_down_gen (Random::Stream::data_up_down);
+
+        for (int f = 0; f < frame_count; f++)
+          {
+            UpDownArray up, down;
+            up_down_gen.get (f, up, down);
+
+            for (size_t i = 0; i < up.size(); i++)
+              frame_entries[data_frame_pos (f)].push_back ({ up[i], down[i], f / Params::frames_per_bit });
+          }
+      }
+    for (auto block_type : { ConvBlockType::a, ConvBlockType::b })
+      {
+        const vector<int> a_bits = coded_bits (block_type, 0);
+        const vector<int> b_bits = coded_bits (block_type, 1);
+
+        vector<int> signs (a_bits.size());
+        for (size_t i = 0; i < signs.size(); i++)
+          signs[i] = b_bits[i] - a_bits[i];
+        bit_signs.push_back (signs);
+      }
+  }
+  /* compute one score per segment: > 0 for B segments, < 0 for A segments, NAN if the segment has no data */
+  bool
+  run (const WavData& wav_data, const vector<double>& segment_durations, vector<double>& scores)
+  {
+    size_t        offset;
+    ConvBlockType block_type;
+    if (!find_block_offset (wav_data, offset, block_type))
+      return false;
+
+    /* segment boundaries in samples; ignore frames close to a boundary, as the decoded stream
+     * may be shifted a little bit (for instance by the aac encoder delay)
+     */
+    const size_t guard = wav_data.sample_rate() / 10;
+    vector<size_t> segment_start;
+    double t = 0;
+    for (auto d : segment_durations)
+      {
+        segment_start.push_back (t * wav_data.sample_rate());
+        t += d;
+      }
+    segment_start.push_back (t * wav_data.sample_rate());
+
+    vector<double> sum (segment_durations.size());
+    vector<double> sum2 (segment_durations.size());
+
+    const size_t n_frames   = wav_data.n_frames();
+    const int    n_channels = wav_data.n_channels();
+    const double min_db     = -96;
+
+    FFTAnalyzer fft_analyzer (n_channels);
+    vector<vector<complex<float>>> fft_out;
+
+    /* pos is the position relative to the start of the first block pair, the input starts at offset */
+    const size_t block_size = frames_per_block * Params::frame_size;
+    size_t       seg = 0;
+    for (size_t block = 0; block * block_size < offset + n_frames; block++)
+      {
+        const int ab = (block & 1) ^ (block_type == ConvBlockType::b);
+        for (int f = 0; f < frames_per_block; f++)
+          {
+            const size_t pos = block * block_size + f * Params::frame_size;
+            if (frame_entries[f].empty() || pos < offset || pos + Params::frame_size > offset + n_frames)
+              continue;
+
+            const size_t start = pos - offset;
+            while (seg < segment_durations.size() && segment_start[seg + 1] < start + Params::frame_size + guard)
+              seg++;
+            if (seg == segment_durations.size())
+              break;
+            if (start < segment_start[seg] + guard)
+              continue;
+
+            fft_analyzer.run_fft (wav_data.samples(), start, fft_out);
+
+            double value = 0;
+            for (const auto& entry : frame_entries[f])
+              {
+                const int sign = bit_signs[ab][entry.bit];
+                if (sign)
+                  {
+                    for (int ch = 0; ch < n_channels; ch++)
+                      {
+                        value += sign * (db_from_complex (fft_out[ch][entry.up], min_db) -
+                                         db_from_complex (fft_out[ch][entry.down], min_db));
+                      }
+                  }
+              }
+            sum[seg]  += value;
+            sum2[seg] += value * value;
+          }
+      }
+    /* normalize: score is the sum divided by its expected deviation (for independent frames) */
+    scores.clear();
+    for (size_t s = 0; s < sum.size(); s++)
+      scores.push_back (sum2[s] > 0 ? sum[s] / sqrt (sum2[s]) : NAN);
+    return true;
+  }
+};
+
 static int
 decode_and_report (const WavData& wav_data, const vector<int>& orig_bits)
 {
@@ -654,6 +842,49 @@ decode_and_report (const WavData& wav_data, const vector<int>& orig_bits)
   return 0;
 }
 
+/* select watermark channels and resample to the watermark sample rate */
+static bool
+prepare_input (WavData& wav_data)
+{
+  if (Params::test_truncate)
+    {
+      const size_t  want_n_samples = wav_data.sample_rate() * wav_data.n_channels() * Params::test_truncate;
+      vector<float> short_samples  = wav_data.samples();
+
+      if (want_n_samples < short_samples.size())
+        {
+          short_samples.resize (want_n_samples);
+          wav_data.set_samples (short_samples);
+        }
+    }
+  WatermarkChannels wm_channels (wav_data.n_channels());
+  if (!wm_channels.check())
+    return false;
+  if (!wm_channels.all())
+    {
+      /* only analyze the watermark channels (or their downmix) */
+      vector<float> wm_samples;
+      wm_channels.select (wav_data.samples(), wm_samples);
+      wav_data = WavData (wm_samples, wm_channels.n_wm_channels(), wav_data.sample_rate(), wav_data.bit_depth());
+    }
+  if (wav_data.sample_rate() != Params::mark_sample_rate)
+    wav_data = resample (wav_data, Params::mark_sample_rate);
+  return true;
+}
+
+/* load input file (or hls stream), select watermark channels and resample to the watermark sample rate */
+static bool
+load_input (const string& infile, WavData& wav_data)
+{
+  Error err = hls_is_input (infile) ? hls_load_input (infile, wav_data) : wav_data.load (infile);
+  if (err)
+    {
+      error ("audiowmark: error loading %s: %s\n", infile.c_str(), err.message());
+      return false;
+    }
+  return prepare_input (wav_data);
+}
+
 int
 get_watermark (const string& infile, const string& orig_pattern)
 {
@@ -666,30 +897,92 @@ get_watermark (const string& infile, const string& orig_pattern)
     }
 
   WavData wav_data;
-  Error err = wav_data.load (infile);
-  if (err)
+  if (!load_input (infile, wav_data))
+    return 1;
+
+  return decode_and_report (wav_data, orig_bitvec);
+}
+
+/* same as above, for audio that has already been decoded */
+int
+get_watermark (WavData wav_data, const string& orig_pattern)
+{
+  vector<int> orig_bitvec;
+  if (!orig_pattern.empty())
     {
-      error ("audiowmark: error loading %s: %s\n", infile.c_str(), err.message());
+      orig_bitvec = parse_payload (orig_pattern);
+      if (orig_bitvec.empty())
+        return 1;
+    }
+
+  if (!prepare_input (wav_data))
+    return 1;
+
+  return decode_and_report (wav_data, orig_bitvec);
+}
+
+/* decode message from a stream of A/B variant segments with the given durations (in seconds) */
+int
+get_ab_watermark (const string& infile, const vector<double>& segment_durations, const string& orig_pattern)
+{
+  vector<int> orig_bitvec;
+  if (!orig_pattern.empty())
+    {
+      orig_bitvec = parse_payload (orig_pattern);
+      if (orig_bitvec.empty())
+        return 1;
+    }
+
+  WavData wav_data;
+  if (!load_input (infile, wav_data))
+    return 1;
+
+  ABDecoder ab_decoder;
+  vector<double> scores;
+  if (!ab_decoder.run (wav_data, segment_durations, scores))
+    {
+      error ("audiowmark: no watermark sync found in %s\n", infile.c_str());
       return 1;
     }
 
-  if (Params::test_truncate)
+  /* segment i carries message bit i % payload_size, combine all segments for each bit */
+  vector<double> bit_scores (Params::payload_size);
+  vector<int>    bit_segments (Params::payload_size);
+  double time = 0;
+  for (size_t i = 0; i < scores.size(); i++)
     {
-      const size_t  want_n_samples = wav_data.sample_rate() * wav_data.n_channels() * Params::test_truncate;
-      vector<float> short_samples  = wav_data.samples();
+      const int seconds = time;
+      time += segment_durations[i];
+      if (std::isnan (scores[i]))
+        continue;
+
+      printf ("segment %3zd %2d:%02d %c %.3f\n", i, seconds / 60, seconds % 60, scores[i] > 0 ? 'B' : 'A', fabs (scores[i]));
+      bit_scores[i % Params::payload_size]   += scores[i];
+      bit_segments[i % Params::payload_size] += 1;
+    }
 
-      if (want_n_samples < short_samples.size())
+  vector<int> bit_vec;
+  double      min_score = -1;
+  for (size_t b = 0; b < Params::payload_size; b++)
+    {
+      if (!bit_segments[b])
         {
-          short_samples.resize (want_n_samples);
-          wav_data.set_samples (short_samples);
+          error ("audiowmark: input too short: no segment found for message bit %zd\n", b);
+          return 1;
         }
+      const double score = fabs (bit_scores[b]) / sqrt (bit_segments[b]);
+      if (min_score < 0 || score < min_score)
+        min_score = score;
+      bit_vec.push_back (bit_scores[b] > 0);
     }
-  if (wav_data.sample_rate() == Params::mark_sample_rate)
-    {
-      return decode_and_report (wav_data, orig_bitvec);
-    }
-  else
+  printf ("pattern   ab %s %.3f\n", bit_vec_to_str (bit_vec).c_str(), min_score);
+
+  if (!orig_bitvec.empty())
     {
-      return decode_and_report (resample (wav_data, Params::mark_sample_rate), orig_bitvec);
+      const int match_count = bit_vec == orig_bitvec;
+      printf ("match_count %d 1\n", match_count);
+      if (!match_count)
+        return 1;
     }
+  return 0;
 }
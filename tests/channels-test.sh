@@ -0,0 +1,19 @@
+#!/bin/bash
+
+source test-common.sh
+
+IN_WAV=channels-test.wav
+OUT_WAV=channels-test-out.wav
+
+audiowmark test-gen-noise $IN_WAV 200 44100
+
+# watermark only one channel
+audiowmark_add --channels 1 $IN_WAV $OUT_WAV $TEST_MSG
+audiowmark_cmp --channels 1 --expect-matches 5 $OUT_WAV $TEST_MSG
+
+# watermark generated from mid signal
+audiowmark_add --mid $IN_WAV $OUT_WAV $TEST_MSG
+audiowmark_cmp --mid --expect-matches 5 $OUT_WAV $TEST_MSG
+
+rm $IN_WAV $OUT_WAV
+exit 0
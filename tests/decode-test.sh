@@ -0,0 +1,46 @@
+#!/bin/bash
+
+source test-common.sh
+
+if [ "x$Q" == "x1" ] && [ -z "$V" ]; then
+  FFMPEG_Q="-v quiet"
+fi
+
+set -e
+
+IN_WAV=decode-test-input.wav
+OUT_WAV=decode-test-output.wav
+IN_FLAC=decode-test-output.flac
+IN_MP3=decode-test-output.mp3
+IN_AAC=decode-test-output.m4a
+IN_OPUS=decode-test-output.opus
+OUT_AAC_WAV=decode-test-aac-output.wav
+
+# generate watermarked input: longer than 60 seconds, so that files are decoded in parallel
+audiowmark test-gen-noise $IN_WAV 200 44100
+audiowmark_add $IN_WAV $OUT_WAV $TEST_MSG
+ffmpeg $FFMPEG_Q -y -i $OUT_WAV $IN_FLAC
+ffmpeg $FFMPEG_Q -y -i $OUT_WAV -c:a libmp3lame -ab 128k $IN_MP3
+ffmpeg $FFMPEG_Q -y -i $OUT_WAV -c:a aac -ab 192k $IN_AAC
+ffmpeg $FFMPEG_Q -y -i $OUT_WAV -c:a libopus -ab 128k $IN_OPUS
+
+# parallel decoding must give the same samples as serial decoding
+for f in $IN_FLAC $IN_MP3
+do
+  ../src/testload $f 3 > /dev/null || die "parallel decoding of $f differs from serial decoding"
+done
+
+# decoding mp3 at a reduced sample rate must not affect detection
+audiowmark_cmp --mp3-reduced-rate --expect-matches 5 $IN_MP3 $TEST_MSG
+
+# formats that libsndfile and mpg123 can't read are decoded using the ffmpeg libs
+audiowmark_cmp --expect-matches 5 $IN_AAC $TEST_MSG
+audiowmark_cmp --expect-matches 5 $IN_OPUS $TEST_MSG
+
+# ffmpeg decoded input can also be watermarked
+audiowmark_add $IN_AAC $OUT_AAC_WAV $TEST_MSG
+audiowmark_cmp --expect-matches 5 $OUT_AAC_WAV $TEST_MSG
+
+rm $IN_WAV $OUT_WAV $IN_FLAC $IN_MP3 $IN_AAC $IN_OPUS $OUT_AAC_WAV
+
+exit 0
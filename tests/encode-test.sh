@@ -0,0 +1,35 @@
+#!/bin/bash
+
+source test-common.sh
+
+if [ "x$Q" == "x1" ] && [ -z "$V" ]; then
+  FFMPEG_Q="-v quiet"
+fi
+
+set -e
+
+IN_WAV=encode-test-input.wav
+
+# input length is not a multiple of the codec frame sizes
+audiowmark test-gen-noise $IN_WAV 200 44100
+IN_FRAMES=$(ffprobe -v error -select_streams a -show_entries stream=duration_ts -of csv=p=0 $IN_WAV)
+
+for ext in m4a mp3
+do
+  OUT=encode-test-output.$ext
+  OUT_WAV=encode-test-output-$ext.wav
+
+  # watermark and encode, decode again: the length must not change
+  audiowmark_add $IN_WAV $OUT $TEST_MSG
+  ffmpeg $FFMPEG_Q -y -i $OUT $OUT_WAV
+  OUT_FRAMES=$(ffprobe -v error -select_streams a -show_entries stream=duration_ts -of csv=p=0 $OUT_WAV)
+  [ "$OUT_FRAMES" == "$IN_FRAMES" ] || die "length of $OUT is $OUT_FRAMES frames, input length is $IN_FRAMES frames"
+
+  audiowmark_cmp --expect-matches 5 $OUT $TEST_MSG
+
+  rm $OUT $OUT_WAV
+done
+
+rm $IN_WAV
+
+exit 0
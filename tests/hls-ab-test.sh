@@ -0,0 +1,46 @@
+#!/bin/bash
+
+source test-common.sh
+
+if [ "x$Q" == "x1" ] && [ -z "$V" ]; then
+  FFMPEG_Q="-v quiet"
+fi
+
+set -e
+
+HLS_DIR=hls-ab-test-dir.$$
+mkdir -p $HLS_DIR
+
+AB_MSG=f0c3
+
+# generate input sample
+audiowmark test-gen-noise $HLS_DIR/test-input.wav 200 44100
+
+# convert to hls
+ffmpeg $FFMPEG_Q -i $HLS_DIR/test-input.wav \
+  -f hls \
+  -c:a:0 aac -ab 192k \
+  -master_pl_name replay.m3u8 \
+  -hls_list_size 0 -hls_time 5 $HLS_DIR/as%v/out.m3u8
+
+# prepare hls segments for watermarking
+audiowmark hls-prepare $HLS_DIR/as0 $HLS_DIR/as0prep out.m3u8 $HLS_DIR/test-input.wav
+
+# write A/B variants of each segment and a playlist for one message
+audiowmark hls-prepare-ab --short 16 $HLS_DIR/as0prep $HLS_DIR/as0ab out.m3u8
+audiowmark hls-ab-playlist --short 16 $HLS_DIR/as0ab/out.m3u8 $HLS_DIR/as0ab/viewer.m3u8 $AB_MSG
+
+# convert A/B hls stream back to wav
+ffmpeg $FFMPEG_Q -y -i $HLS_DIR/as0ab/viewer.m3u8 $HLS_DIR/test-output.wav
+
+# detect message from wav
+$AUDIOWMARK hls-ab-cmp --short 16 $HLS_DIR/as0ab/out.m3u8 $HLS_DIR/test-output.wav $AB_MSG > /dev/null || die "failed to detect A/B message"
+
+rm $HLS_DIR/as0*/*.ts $HLS_DIR/as0ab/[ab]/*.ts
+rm $HLS_DIR/as0*/*.m3u8
+rmdir $HLS_DIR/as0ab/[ab] $HLS_DIR/as0*
+rm $HLS_DIR/test-*.wav
+rm $HLS_DIR/replay.m3u8
+rmdir $HLS_DIR
+
+exit 0
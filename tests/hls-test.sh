@@ -24,6 +24,78 @@ ffmpeg $FFMPEG_Q -i $HLS_DIR/test-input.wav \
 # prepare hls segments for watermarking
 audiowmark hls-prepare $HLS_DIR/as0 $HLS_DIR/as0prep out.m3u8 $HLS_DIR/test-input.wav
 
+# incremental hls-prepare while the audio master grows; the audio master is a wav file that is
+# still being written (data size 0xFFFFFFFF), so the number of frames depends on the file size
+ffmpeg $FFMPEG_Q -y -i $HLS_DIR/test-input.wav -flags +bitexact -map_metadata -1 $HLS_DIR/test-master.wav
+[ "$(dd if=$HLS_DIR/test-master.wav bs=1 skip=36 count=4 status=none)" == "data" ] || die "unexpected wav header layout"
+
+grow_master()
+{
+  head -c $((44 + $1 * 44100 * 4)) $HLS_DIR/test-master.wav > $HLS_DIR/test-live.wav
+  printf '\xff\xff\xff\xff' | dd of=$HLS_DIR/test-live.wav bs=1 seek=40 conv=notrunc status=none
+}
+live_playlist()
+{
+  awk -v n=$1 '/^#EXT-X-ENDLIST/ { next } { print } /\.ts$/ && ++count == n { exit }' $HLS_DIR/as0/out.m3u8 > $HLS_DIR/as0/live.m3u8
+}
+prepare_live()
+{
+  audiowmark hls-prepare --incremental $HLS_DIR/as0 $HLS_DIR/as0live live.m3u8 $HLS_DIR/test-live.wav
+}
+
+grow_master 60
+live_playlist 5
+prepare_live
+[ "$(ls $HLS_DIR/as0live/*.ts | wc -l)" == "5" ] || die "incremental hls-prepare: first run should prepare 5 segments"
+mkdir -p $HLS_DIR/as0live1
+cp $HLS_DIR/as0live/*.ts $HLS_DIR/as0live1
+
+# the audio master doesn't contain the new segments yet: fail without changing anything
+live_playlist 10
+cp $HLS_DIR/as0live/live.m3u8.state $HLS_DIR/live-state
+$AUDIOWMARK -q --strict hls-prepare --incremental $HLS_DIR/as0 $HLS_DIR/as0live live.m3u8 $HLS_DIR/test-live.wav 2> /dev/null &&
+  die "incremental hls-prepare should fail if the audio master is too short"
+cmp -s $HLS_DIR/live-state $HLS_DIR/as0live/live.m3u8.state || die "incremental hls-prepare changed the state after an error"
+[ "$(ls $HLS_DIR/as0live/*.ts | wc -l)" == "5" ] || die "incremental hls-prepare wrote segments after an error"
+
+# second run: only the new segments are prepared
+grow_master 120
+prepare_live
+[ "$(ls $HLS_DIR/as0live/*.ts | wc -l)" == "10" ] || die "incremental hls-prepare: second run should prepare 5 more segments"
+for i in $(cd $HLS_DIR/as0live1; ls)
+do
+  cmp -s $HLS_DIR/as0live1/$i $HLS_DIR/as0live/$i || die "incremental hls-prepare: second run modified old segment $i"
+done
+
+# the stream is finished: the audio master ends with the last segment, so the context after the last
+# segments is incomplete; this is an error while the playlist may still grow, but once the playlist
+# contains #EXT-X-ENDLIST, the missing context is padded with silence, like hls-prepare does it
+grow_master 200
+live_playlist 1000000
+$AUDIOWMARK -q --strict hls-prepare --incremental $HLS_DIR/as0 $HLS_DIR/as0live live.m3u8 $HLS_DIR/test-live.wav 2> /dev/null &&
+  die "incremental hls-prepare should fail for the last segments if the playlist is not finished"
+cp $HLS_DIR/as0/out.m3u8 $HLS_DIR/as0/live.m3u8
+prepare_live
+[ "$(ls $HLS_DIR/as0live/*.ts | wc -l)" == "$(ls $HLS_DIR/as0/*.ts | wc -l)" ] ||
+  die "incremental hls-prepare: all segments of a finished playlist should be prepared"
+
+# the context of all segments must be the audio master (not silence), like for normal hls-prepare;
+# for the last segments, the padded context must be the same as for normal hls-prepare
+for i in $(cd $HLS_DIR/as0live; ls *.ts)
+do
+  ../src/testmpegts get $HLS_DIR/as0live/$i full.flac > $HLS_DIR/live-ctx.flac
+  ../src/testmpegts get $HLS_DIR/as0prep/$i full.flac | cmp -s - $HLS_DIR/live-ctx.flac ||
+    die "incremental hls-prepare: context of segment $i differs from hls-prepare context"
+done
+rm $HLS_DIR/as0*/live.m3u8* $HLS_DIR/live-state $HLS_DIR/live-ctx.flac
+
+# segments are prepared in parallel: the result must be identical to sequential processing
+audiowmark hls-prepare --test-sequential $HLS_DIR/as0 $HLS_DIR/as0seq out.m3u8 $HLS_DIR/test-input.wav
+for i in $(cd $HLS_DIR/as0prep; ls)
+do
+  cmp -s $HLS_DIR/as0prep/$i $HLS_DIR/as0seq/$i || die "parallel hls-prepare output $i differs from sequential output"
+done
+
 # watermark hls segments individually
 mkdir -p $HLS_DIR/as0m
 for i in $(cd $HLS_DIR/as0; ls out*.ts)
@@ -32,12 +104,79 @@ do
 done
 cp $HLS_DIR/as0/out.m3u8 $HLS_DIR/as0m/out.m3u8
 
+# hls-add-batch encodes all segments continuously, so the aac data differs from hls-add, but the
+# segments must be drop-in replacements: same packet timestamps and durations as hls-add segments
+mkdir -p $HLS_DIR/as0batch
+audiowmark hls-add-batch $HLS_DIR/as0batch $TEST_MSG $(cd $HLS_DIR/as0; ls out*.ts | sed "s|^|$HLS_DIR/as0prep/|")
+for i in $(cd $HLS_DIR/as0; ls out*.ts)
+do
+  ffprobe -v error -select_streams a -show_entries packet=pts,dts,duration -of csv=p=0 $HLS_DIR/as0m/$i > $HLS_DIR/packets-add.txt
+  ffprobe -v error -select_streams a -show_entries packet=pts,dts,duration -of csv=p=0 $HLS_DIR/as0batch/$i > $HLS_DIR/packets-batch.txt
+  [ -s $HLS_DIR/packets-add.txt ] || die "hls-add output $i has no audio packets"
+  cmp -s $HLS_DIR/packets-add.txt $HLS_DIR/packets-batch.txt || die "hls-add-batch output $i: packets differ from hls-add output"
+done
+rm $HLS_DIR/packets-add.txt $HLS_DIR/packets-batch.txt
+
+# the joined batch segments and a playlist that mixes batch and hls-add segments must decode
+# without gaps (to the same length as the hls-add segments), and contain the watermark
+cp $HLS_DIR/as0/out.m3u8 $HLS_DIR/as0batch/out.m3u8
+mkdir -p $HLS_DIR/as0mix
+MIX_DIR=as0batch
+for i in $(cd $HLS_DIR/as0; ls out*.ts)
+do
+  cp $HLS_DIR/$MIX_DIR/$i $HLS_DIR/as0mix/$i
+  [ $MIX_DIR == as0batch ] && MIX_DIR=as0m || MIX_DIR=as0batch
+done
+cp $HLS_DIR/as0/out.m3u8 $HLS_DIR/as0mix/out.m3u8
+ffmpeg $FFMPEG_Q -y -i $HLS_DIR/as0m/out.m3u8 $HLS_DIR/test-add.wav
+ADD_FRAMES=$(ffprobe -v error -select_streams a -show_entries stream=duration_ts -of csv=p=0 $HLS_DIR/test-add.wav)
+for dir in as0batch as0mix
+do
+  ffmpeg $FFMPEG_Q -y -i $HLS_DIR/$dir/out.m3u8 $HLS_DIR/test-$dir.wav
+  FRAMES=$(ffprobe -v error -select_streams a -show_entries stream=duration_ts -of csv=p=0 $HLS_DIR/test-$dir.wav)
+  [ "$FRAMES" == "$ADD_FRAMES" ] || die "hls-add-batch: $dir decodes to $FRAMES frames, expected $ADD_FRAMES"
+  audiowmark_cmp --expect-matches 5 $HLS_DIR/test-$dir.wav $TEST_MSG
+done
+
+# watermarking one segment with many messages must give the same output as one run per message
+TEST_MSG2=0123456789abcdef0123456789abcdef
+SEG=$(cd $HLS_DIR/as0; ls out*.ts | head -1)
+audiowmark hls-add $HLS_DIR/as0prep/$SEG $HLS_DIR/as0m/multi1-$SEG $TEST_MSG $HLS_DIR/as0m/multi2-$SEG $TEST_MSG2
+audiowmark hls-add $HLS_DIR/as0prep/$SEG $HLS_DIR/as0m/single2-$SEG $TEST_MSG2
+cmp -s $HLS_DIR/as0m/$SEG $HLS_DIR/as0m/multi1-$SEG || die "multi message hls-add output differs for message 1"
+cmp -s $HLS_DIR/as0m/single2-$SEG $HLS_DIR/as0m/multi2-$SEG || die "multi message hls-add output differs for message 2"
+rm $HLS_DIR/as0m/multi1-$SEG $HLS_DIR/as0m/multi2-$SEG $HLS_DIR/as0m/single2-$SEG
+
+# the input is 16 bit, so all context formats are lossless and must give the same watermarked segments
+for fmt in flac pcm16 float
+do
+  audiowmark hls-prepare --context-format $fmt $HLS_DIR/as0 $HLS_DIR/as0$fmt out.m3u8 $HLS_DIR/test-input.wav
+  for i in $(cd $HLS_DIR/as0; ls out*.ts)
+  do
+    audiowmark hls-add $HLS_DIR/as0$fmt/$i $HLS_DIR/as0$fmt/wm-$i $TEST_MSG
+    cmp -s $HLS_DIR/as0m/$i $HLS_DIR/as0$fmt/wm-$i || die "hls-add output $i differs for context format $fmt"
+  done
+done
+
 # convert watermarked hls back to wav
 ffmpeg $FFMPEG_Q -y -i $HLS_DIR/as0m/out.m3u8 $HLS_DIR/test-output.wav
 
 # detect watermark from wav
 audiowmark_cmp --expect-matches 5 $HLS_DIR/test-output.wav $TEST_MSG
 
+# detect watermark directly from playlist / directory of segments
+audiowmark_cmp --expect-matches 5 $HLS_DIR/as0m/out.m3u8 $TEST_MSG
+audiowmark_cmp --expect-matches 5 $HLS_DIR/as0m $TEST_MSG
+
+# the segments are decoded in parallel, with each decoder primed with the last packets of the previous
+# segment: this must give the same samples as decoding all segments as one stream; this is only exact
+# without PNS (perceptual noise substitution), because the noise generator state of the decoder
+# depends on all previous frames
+mkdir -p $HLS_DIR/as0nopns
+ffmpeg $FFMPEG_Q -i $HLS_DIR/test-input.wav -f hls -c:a aac -aac_pns 0 -ab 192k \
+  -hls_list_size 0 -hls_time 10 $HLS_DIR/as0nopns/out.m3u8
+../src/testhls load-cmp $HLS_DIR/as0nopns/out.m3u8 > /dev/null || die "parallel hls decoding differs from decoding one stream"
+
 rm $HLS_DIR/as0*/*.ts
 rm $HLS_DIR/as0*/out.m3u8
 rmdir $HLS_DIR/as0*
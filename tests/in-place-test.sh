@@ -0,0 +1,30 @@
+#!/bin/bash
+
+source test-common.sh
+
+IN_WAV=in-place-test.wav
+OUT_RAW=in-place-test-out.raw
+
+audiowmark test-gen-noise $IN_WAV 200 44100
+
+# in-place output must match the output of the streaming code
+audiowmark_add --output-format raw --raw-rate 44100 $IN_WAV $OUT_RAW $TEST_MSG
+audiowmark_add --in-place $IN_WAV $TEST_MSG
+tail -c +45 $IN_WAV | cmp -s - $OUT_RAW || die "in-place watermarking output differs from streaming output"
+[ -e $IN_WAV.journal ] && die "journal not removed after in-place watermarking"
+
+audiowmark_cmp --expect-matches 5 $IN_WAV $TEST_MSG
+
+# interrupted runs (simulated crash in the middle of a block) must resume to the same output:
+# first crash after the first checkpoint (8s blocks, 32s checkpoints), second crash while resuming
+audiowmark test-gen-noise $IN_WAV 200 44100
+$AUDIOWMARK -q --strict add --in-place --test-in-place-crash 6 $IN_WAV $TEST_MSG && die "in-place crash test did not crash"
+[ -e $IN_WAV.journal ] || die "no journal after interrupted in-place watermarking"
+tail -c +45 $IN_WAV | cmp -s - $OUT_RAW && die "interrupted in-place watermarking completed"
+$AUDIOWMARK -q --strict add --in-place --test-in-place-crash 5 $IN_WAV $TEST_MSG && die "in-place crash test did not crash"
+audiowmark_add --in-place $IN_WAV $TEST_MSG
+tail -c +45 $IN_WAV | cmp -s - $OUT_RAW || die "resumed in-place watermarking output differs from streaming output"
+[ -e $IN_WAV.journal ] && die "journal not removed after resumed in-place watermarking"
+
+rm $IN_WAV $OUT_RAW
+exit 0
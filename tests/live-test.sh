@@ -0,0 +1,26 @@
+#!/bin/bash
+
+source test-common.sh
+
+IN_WAV=live-test.wav
+OUT_WAV=live-test-out.wav
+IN_RAW=live-test.raw
+OUT_RAW=live-test-out.raw
+
+# 48 kHz, no resampling: watermark needs 2 frames, limiter lookahead uses the rest of the budget
+audiowmark test-gen-noise $IN_WAV 200 48000
+audiowmark_add --max-latency 50 $IN_WAV $OUT_WAV $TEST_MSG
+audiowmark_cmp --expect-matches 5 $OUT_WAV $TEST_MSG
+
+# raw stream from stdin to stdout
+tail -c +45 $IN_WAV > $IN_RAW
+cat $IN_RAW | audiowmark_add --live --format raw --raw-rate 48000 - - $TEST_MSG > $OUT_RAW || die "live watermarking raw stream failed"
+[ "$(stat -c %s $IN_RAW)" == "$(stat -c %s $OUT_RAW)" ] || die "live raw stream output length mismatch"
+
+# 44.1 kHz, with resampling
+audiowmark test-gen-noise $IN_WAV 200 44100
+audiowmark_add --live $IN_WAV $OUT_WAV $TEST_MSG
+audiowmark_cmp --expect-matches 5 $OUT_WAV $TEST_MSG
+
+rm $IN_WAV $OUT_WAV $IN_RAW $OUT_RAW
+exit 0
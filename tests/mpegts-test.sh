@@ -0,0 +1,28 @@
+#!/bin/bash
+
+source test-common.sh
+
+TS_DIR=mpegts-test-dir.$$
+mkdir -p $TS_DIR
+cd $TS_DIR
+
+# append entries with sizes around the packet boundaries, one after another
+: > in.ts
+for size in 0 1 163 164 165 339 340 341 1000 100000 1048576
+do
+  seq 1000000 | head -c $size > data$size
+  ../../src/testmpegts append in.ts out.ts data$size > /dev/null || die "failed to append data$size"
+  ../../src/testmpegts get out.ts data$size | cmp -s - data$size || die "failed to get data$size"
+  mv out.ts in.ts
+  rm data$size
+done
+
+# the output must stay byte-identical to the output of previous versions
+MD5=$(md5sum < in.ts | cut -d' ' -f1)
+[ "$MD5" == "730c0f42d5b22b441cd6e9434d7d8f6a" ] || die "mpegts output changed (md5 $MD5)"
+
+rm in.ts
+cd ..
+rmdir $TS_DIR
+
+exit 0
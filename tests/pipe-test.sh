@@ -4,11 +4,19 @@ source test-common.sh
 
 IN_WAV=pipe-test.wav
 OUT_WAV=pipe-test-out.wav
+IN_RAW=pipe-test.raw
 
 audiowmark test-gen-noise $IN_WAV 200 44100
 cat $IN_WAV | audiowmark_add - - $TEST_MSG > $OUT_WAV || die "watermark from pipe failed"
 audiowmark_cmp --expect-matches 5 $OUT_WAV $TEST_MSG
 cat $OUT_WAV | audiowmark_cmp --expect-matches 5 - $TEST_MSG || die "watermark detection from pipe failed"
 
-rm $IN_WAV $OUT_WAV
+# raw input has no length information: wav header for streaming (pipe) or fixed on close (file)
+audiowmark_add --output-format raw --raw-rate 44100 $IN_WAV $IN_RAW $TEST_MSG
+cat $IN_RAW | audiowmark_add --input-format raw --raw-rate 44100 - - $TEST_MSG | cat > $OUT_WAV || die "watermark wav stream failed"
+audiowmark_cmp --expect-matches 5 $OUT_WAV $TEST_MSG
+cat $IN_RAW | audiowmark_add --input-format raw --raw-rate 44100 - - $TEST_MSG > $OUT_WAV || die "watermark wav stream to file failed"
+audiowmark_cmp --expect-matches 5 $OUT_WAV $TEST_MSG
+
+rm $IN_WAV $OUT_WAV $IN_RAW
 exit 0
@@ -0,0 +1,29 @@
+#!/bin/bash
+
+source test-common.sh
+
+IN_WAV=raw-format-test.wav
+OUT_WAV=raw-format-test-out.wav
+OUT_RAW=raw-format-test-out.raw
+
+audiowmark test-gen-noise $IN_WAV 200 44100
+
+for FORMAT in "8 unsigned little" "16 signed big" "24 unsigned little" "32 signed big" "32 float little" "32 float big"
+do
+  set -- $FORMAT
+  RAW_OPTS="--raw-rate 44100 --raw-bits $1 --raw-encoding $2 --raw-endian $3"
+
+  # get/cmp don't support raw input, so convert back to wav using add
+  audiowmark_add --output-format raw $RAW_OPTS $IN_WAV $OUT_RAW $TEST_MSG
+  audiowmark_add --input-format raw $RAW_OPTS $OUT_RAW $OUT_WAV $TEST_MSG
+  audiowmark_cmp --expect-matches 5 $OUT_WAV $TEST_MSG
+done
+
+# float wav output
+audiowmark_add --output-float $IN_WAV $OUT_WAV $TEST_MSG
+audiowmark_cmp --expect-matches 5 $OUT_WAV $TEST_MSG
+audiowmark_add --output-float $IN_WAV - $TEST_MSG > $OUT_WAV || die "float wav output to stdout failed"
+audiowmark_cmp --expect-matches 5 $OUT_WAV $TEST_MSG
+
+rm $IN_WAV $OUT_WAV $OUT_RAW
+exit 0
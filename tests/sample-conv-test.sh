@@ -0,0 +1,8 @@
+#!/bin/bash
+
+source test-common.sh
+
+# SIMD sample conversion must produce the same results as the scalar code
+../src/testsampleconv > /dev/null || die "sample conversion results differ between implementations"
+
+exit 0
@@ -0,0 +1,47 @@
+#!/bin/bash
+
+source test-common.sh
+
+IN_WAV=shm-test.wav
+OUT_RAW=shm-test-out.raw
+REF_RAW=shm-test-ref.raw
+SHM_IN=audiowmark-shm-test-in-$$
+SHM_OUT=audiowmark-shm-test-out-$$
+
+audiowmark test-gen-noise $IN_WAV 200 44100
+audiowmark_add --output-format raw --raw-rate 44100 --raw-bits 32 --raw-encoding float $IN_WAV $REF_RAW $TEST_MSG
+
+# a ring that is still used by its producer must not be replaced
+../src/testshm write $IN_WAV $SHM_IN &
+STALE_PID=$!
+for i in $(seq 50); do [ -e /dev/shm/$SHM_IN ] && break; sleep 0.1; done
+sleep 0.5
+../src/testshm write $IN_WAV $SHM_IN 2>/dev/null && die "ring in use was replaced"
+kill -9 $STALE_PID
+wait $STALE_PID 2>/dev/null
+[ -e /dev/shm/$SHM_IN ] || die "ring of killed producer not found"
+
+# producer -> shm ring -> audiowmark -> shm ring -> consumer
+../src/testshm write $IN_WAV $SHM_IN &
+PRODUCER_PID=$!
+# the producer replaces the ring of the killed producer, wait for this (producer_pid at offset 28)
+# before starting the consumer, which would otherwise attach to the old ring
+for i in $(seq 50); do
+  [ "$(od -A n -t u4 -j 28 -N 4 /dev/shm/$SHM_IN 2>/dev/null | tr -d ' ')" = "$PRODUCER_PID" ] && break
+  sleep 0.1
+done
+audiowmark_add --format shm $SHM_IN $SHM_OUT $TEST_MSG &
+ADD_PID=$!
+../src/testshm read $SHM_OUT $OUT_RAW || die "reading shm output failed"
+wait $PRODUCER_PID || die "writing shm input failed"
+wait $ADD_PID || die "watermarking shm stream failed"
+
+# shm streaming output must match the output of the raw stream code
+cmp -s $OUT_RAW $REF_RAW || die "shm output differs from raw stream output"
+
+# the consumer removes the rings
+[ -e /dev/shm/$SHM_IN ] && die "input ring not removed"
+[ -e /dev/shm/$SHM_OUT ] && die "output ring not removed"
+
+rm $IN_WAV $OUT_RAW $REF_RAW
+exit 0
@@ -0,0 +1,32 @@
+#!/bin/bash
+
+source test-common.sh
+
+if [ "x$Q" == "x1" ] && [ -z "$V" ]; then
+  FFMPEG_Q="-v quiet"
+fi
+
+set -e
+
+IN_WAV=video-test-input.wav
+IN_VIDEO=video-test-input.mp4
+OUT_VIDEO=video-test-output.mp4
+
+# generate input video: small test pattern video with noise audio
+audiowmark test-gen-noise $IN_WAV 200 44100
+ffmpeg $FFMPEG_Q -y -f lavfi -i testsrc=size=160x120:rate=10 -i $IN_WAV \
+  -map 0:v -map 1:a -c:v mpeg4 -c:a aac -ab 192k -shortest $IN_VIDEO
+
+# watermark audio stream (video stream is copied)
+audiowmark video-add $IN_VIDEO $OUT_VIDEO $TEST_MSG
+
+# output must still contain the video stream
+VIDEO_STREAMS=$(ffprobe -v error -select_streams v -show_entries stream=index -of csv=p=0 $OUT_VIDEO | wc -l)
+[ "$VIDEO_STREAMS" == "1" ] || die "video stream missing in output ($VIDEO_STREAMS video streams)"
+
+# detect watermark from video
+$AUDIOWMARK --strict video-cmp --expect-matches 5 $OUT_VIDEO $TEST_MSG > /dev/null || die "failed to detect watermark in $OUT_VIDEO"
+
+rm $IN_WAV $IN_VIDEO $OUT_VIDEO
+
+exit 0